@@ -2,10 +2,12 @@
 
   File        bmp.c
 
-  Resume      Library for the treat of 24 bit BMP images
+  Resume      Library for the treat of BMP images
 
-  Description This library only supports 24 bit uncompressed pixel bitmap
-            format files.
+  Description This library supports uncompressed BMP files of 8 (palette),
+            24 and 32 bit (BGRA) pixels, bottom-up or top-down. RLE8 and
+            RLE4 files are loaded expanded to 8 bit, and indexed images can
+            be saved run length encoded.
 
   See also    bmp.h
 
@@ -37,12 +39,29 @@ SOFTWARE.
 #include <limits.h>
 #include <string.h>
 #include <unistd.h>
-#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/uio.h>
 #include <math.h>
 #include <errno.h>
+#include <pthread.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define BMP_LINUX_URING // io_uring of Linux 5.6 or later, without liburing
+#endif
+#endif
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BMP_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include "bmp.h"
 
@@ -58,6 +77,60 @@ SOFTWARE.
 
 #define SIZE_GAUSSIAN_KERNEL 20
 
+#define BLUR_BOXES 3 // box blurs used by fast_blur
+
+#define RESIZE_BITS 14 // precision of the resize weights, they sum 1 << 14
+
+#define CHAIN_BLOCK 1024 // pixels that go through a whole chain at once
+
+#define ROTATE_TILE 64 // side of the tiles rotate goes through, in pixels
+#define ROTATE_BLOCK 8 // side of the blocks transposed by the kernels
+
+#define FLIP_CHUNK 256 // pixels swapped at once by mirror
+
+#define BI_RGB 0 // biCompression of the uncompressed images
+#define BI_RLE8 1 // run length encoded 8 bit indices
+#define BI_RLE4 2 // run length encoded 4 bit indices
+#define BI_BITFIELDS 3 // uncompressed with channel masks, 32 bit BGRA only
+
+#define RLE_HASH_BITS 10 // slots of the colour table of save_image_rle, log2
+#define RLE_CHUNK (1 << 22) // bytes of coded rows save_image_rle writes at once
+
+#define SAVE_IOV 512 // buffers of a writev of save_image, below IOV_MAX
+#define SAVE_BUFFER (1 << 20) // bytes of flipped rows save_image writes at once
+
+#define QUEUE_CHUNK (1 << 16) // bytes of the first read of a BMPQUEUE load
+#define QUEUE_IO_MAX (1 << 30) // bytes of a read or write of a BMPQUEUE
+
+#define IO_OPEN 0 // steps of a request of BMP_IO_URING
+#define IO_READ 1
+#define IO_WRITE 2
+#define IO_CLOSE 3
+
+#define PALETTE_SIZE 256 // colours of the palette of an 8 bit image
+
+#define HSV_BLOCK 256 // pixels converted to HSV at once
+#define HSV_RECIP_BITS 22 // precision of hsv_recip
+
+#define DOT_BITS 22 // fixed point of the exact sepia and luma kernels
+
+#define PLOT_LEFT 48 // margins around the plot area of a histogram chart
+#define PLOT_RIGHT 16
+#define PLOT_TOP 16
+#define PLOT_BOTTOM 32
+
+#define PARALLEL_GRAIN 16384 // fewest pixels worth handing to another thread
+
+#define PARALLEL_CHUNKS 4 // bands per thread, they balance uneven bands
+
+#define BMP_BUFFER_ALIGN 64 // alignment of the pixel buffer (cache line)
+
+#define POOL_WASTE 2 // a kept buffer serves requests down to 1/POOL_WASTE
+
+#ifndef BMP_ROW_ALIGN
+#define BMP_ROW_ALIGN 1 // alignment of every row, 1 keeps the rows packed
+#endif
+
 static const char *error_map_bmp[NUM_ERROR_MSGS_BMP] =
   {
     "Success",
@@ -67,6 +140,50 @@ static const char *error_map_bmp[NUM_ERROR_MSGS_BMP] =
     "Unknown error"
   };
 
+// (1 << HSV_RECIP_BITS)/k, turns the divisions of the HSV conversion into
+// products
+static const int hsv_recip[256] =
+  {
+    0, 4194304, 2097152, 1398101, 1048576, 838860, 699050, 599186,
+    524288, 466033, 419430, 381300, 349525, 322638, 299593, 279620,
+    262144, 246723, 233016, 220752, 209715, 199728, 190650, 182361,
+    174762, 167772, 161319, 155344, 149796, 144631, 139810, 135300,
+    131072, 127100, 123361, 119837, 116508, 113359, 110376, 107546,
+    104857, 102300, 99864, 97541, 95325, 93206, 91180, 89240,
+    87381, 85598, 83886, 82241, 80659, 79137, 77672, 76260,
+    74898, 73584, 72315, 71089, 69905, 68759, 67650, 66576,
+    65536, 64527, 63550, 62601, 61680, 60787, 59918, 59074,
+    58254, 57456, 56679, 55924, 55188, 54471, 53773, 53092,
+    52428, 51781, 51150, 50533, 49932, 49344, 48770, 48210,
+    47662, 47127, 46603, 46091, 45590, 45100, 44620, 44150,
+    43690, 43240, 42799, 42366, 41943, 41527, 41120, 40721,
+    40329, 39945, 39568, 39199, 38836, 38479, 38130, 37786,
+    37449, 37117, 36792, 36472, 36157, 35848, 35544, 35246,
+    34952, 34663, 34379, 34100, 33825, 33554, 33288, 33026,
+    32768, 32513, 32263, 32017, 31775, 31536, 31300, 31068,
+    30840, 30615, 30393, 30174, 29959, 29746, 29537, 29330,
+    29127, 28926, 28728, 28532, 28339, 28149, 27962, 27776,
+    27594, 27413, 27235, 27060, 26886, 26715, 26546, 26379,
+    26214, 26051, 25890, 25731, 25575, 25420, 25266, 25115,
+    24966, 24818, 24672, 24528, 24385, 24244, 24105, 23967,
+    23831, 23696, 23563, 23431, 23301, 23172, 23045, 22919,
+    22795, 22671, 22550, 22429, 22310, 22192, 22075, 21959,
+    21845, 21732, 21620, 21509, 21399, 21290, 21183, 21076,
+    20971, 20867, 20763, 20661, 20560, 20460, 20360, 20262,
+    20164, 20068, 19972, 19878, 19784, 19691, 19599, 19508,
+    19418, 19328, 19239, 19152, 19065, 18978, 18893, 18808,
+    18724, 18641, 18558, 18477, 18396, 18315, 18236, 18157,
+    18078, 18001, 17924, 17848, 17772, 17697, 17623, 17549,
+    17476, 17403, 17331, 17260, 17189, 17119, 17050, 16980,
+    16912, 16844, 16777, 16710, 16644, 16578, 16513, 16448
+  };
+
+// position of v, p, q and t in the r, g, b channels of every hue sector
+static const BYTE hsv_sector[6][3] =
+  {
+    {0, 3, 1}, {2, 0, 1}, {1, 0, 3}, {1, 2, 0}, {3, 1, 0}, {0, 1, 2}
+  };
+
 /*---------------------------------------------------------------------------*/
 /* Type declarations                                                         */
 /*---------------------------------------------------------------------------*/
@@ -76,36 +193,667 @@ static const char *error_map_bmp[NUM_ERROR_MSGS_BMP] =
 /* Structure declarations                                                    */
 /*---------------------------------------------------------------------------*/
 
+typedef void (*span_fn)(RGBTRIPLE *span, size_t n, const void *arg);
+
+typedef void (*to_hsv_fn)(const RGBTRIPLE *src, WORD *h, WORD *s, BYTE *v
+    , size_t n);
+
+typedef void (*to_rgb_fn)(const WORD *h, const WORD *s, const BYTE *v
+    , RGBTRIPLE *dst, size_t n);
+
+//The same conversions from and to three planes, plane[0] b, [1] g and [2] r
+typedef void (*planes_hsv_fn)(const BYTE *const *plane, WORD *h, WORD *s
+    , BYTE *v, size_t n);
+
+typedef void (*planes_rgb_fn)(const WORD *h, const WORD *s, const BYTE *v
+    , BYTE *const *plane, size_t n);
+
+//Changes n pixels already converted to HSV
+typedef void (*hsv_fn)(WORD *h, WORD *s, BYTE *v, size_t n, const void *arg);
+
+//Copies n pixels to three planes (split) and back (merge)
+typedef void (*split_fn)(const RGBTRIPLE *src, BYTE *const *plane, size_t n);
+
+typedef void (*merge_fn)(const BYTE *const *plane, RGBTRIPLE *dst, size_t n);
+
+//sum[x] += k*src[x] for the n samples of a row, in doubles or bytes
+typedef void (*taps_fn)(double *sum, const double *src, double k, size_t n);
+
+typedef void (*taps8_fn)(double *sum, const BYTE *src, double k, size_t n);
+
+//dst[x] = sum[x]/weight, clamped to [0, 255] and truncated
+typedef void (*norm_fn)(const double *sum, BYTE *dst, double weight
+    , size_t n);
+
+//dst[k][m] = src[m][k], for a block of ROTATE_BLOCK x ROTATE_BLOCK pixels
+typedef void (*transpose_fn)(const RGBTRIPLE *const *src
+    , RGBTRIPLE *const *dst);
+
+//Swaps a[i] and b[-1-i], the first n pixels after a with the last n before b
+typedef void (*flip_fn)(RGBTRIPLE *a, RGBTRIPLE *b, size_t n);
+
+//Copies the colours of n 32 bit pixels to 24 bit ones (pack) and back
+//(unpack), which keeps the alpha already in dst
+typedef void (*pack_fn)(const RGBQUAD *src, RGBTRIPLE *dst, size_t n);
+
+typedef void (*unpack_fn)(const RGBTRIPLE *src, RGBQUAD *dst, size_t n);
+
+struct bitone_args{
+  RGBTRIPLE dark;
+  RGBTRIPLE light;
+  int threshold;
+};
+
+struct span_kernels{
+  span_fn zero;
+  span_fn sepia;
+  span_fn bitone;
+  span_fn grayscale;
+  span_fn invert;
+  to_hsv_fn to_hsv;
+  to_rgb_fn to_rgb;
+  transpose_fn transpose;
+  flip_fn flip;
+  pack_fn pack;
+  unpack_fn unpack;
+  transpose_fn transpose32; // of 32 bit pixels
+  flip_fn flip32;
+  transpose_fn transpose8; // of bytes, palette indices and planes
+  flip_fn flip8;
+  split_fn split;
+  merge_fn merge;
+  planes_hsv_fn to_hsv_planes;
+  planes_rgb_fn to_rgb_planes;
+  taps_fn taps; // of the Gaussian blur
+  taps8_fn taps8;
+  norm_fn norm;
+};
+
+struct channel_lut{
+  int src[3]; // input channel (0 b, 1 g, 2 r) of each output channel
+  BYTE lut[3][256]; // table of each output channel
+};
+
+struct chain_stage{
+  span_fn fn;
+  union{
+    int i;
+    char c;
+    double d;
+    struct bitone_args bitone;
+    struct channel_lut lut;
+  }arg;
+};
+
+struct chain_plan{
+  int n;
+  struct chain_stage stages[BMP_CHAIN_MAX];
+};
+
+struct probe_job{
+  char **paths;
+  BMPPROBE *probes;
+  size_t n;
+  size_t next; // next path to probe, shared by all the threads
+};
+
+typedef void (*band_fn)(void *arg, size_t begin, size_t end);
+
+struct pool_job{
+  band_fn fn;
+  void *arg;
+  size_t n; // items (rows, pixels or bytes) to split in bands
+  size_t band; // items of every band, but the last one
+  size_t bands;
+  size_t next; // next band to run, shared by all the threads
+  int threads; // threads allowed to take part
+};
+
+struct span_job{
+  BMPFILE *image;
+  span_fn fn;
+  const void *arg;
+  int size; // bytes per pixel, 3 or 4
+};
+
+struct hsv_job{//HSV filters of a planar image
+  BMPFILE *image;
+  hsv_fn fn;
+  const void *arg;
+};
+
+struct histo_job{
+  BMPFILE *image;
+  BMPHISTO *histo;
+  int channels; // BMP_HISTO_* to be counted
+};
+
+struct copy_job{//rotate and mirror
+  RGBTRIPLE **src;
+  RGBTRIPLE **dst;
+  int height; // of src
+  int width;
+  int size; // bytes per pixel
+  char motion;
+  transpose_fn transpose;
+  flip_fn flip;
+};
+
+struct resample_job{
+  RGBTRIPLE **src;
+  RGBTRIPLE **dst;
+  int new_height;
+  int new_width;
+  int old_height;
+  int old_width;
+  int size; // bytes per pixel, 1, 3 or 4
+  const double *lanc; // the 4 Lanczos terms of every output column
+};
+
+struct convert_job{
+  RGBTRIPLE **src;
+  RGBTRIPLE **dst;
+  int width;
+  int from; // bytes per pixel of src
+  int to; // of dst
+  const RGBQUAD *palette; // of src, if it has 8 bits
+};
+
+struct resize_axis{
+  int taps; // weights of every output position
+  int *first; // first source position of every output position
+  short *weight; // taps weights of every output position
+};
+
+struct resize_job{
+  RGBTRIPLE **src;
+  RGBTRIPLE **dst;
+  int width; // of dst
+  int size; // bytes per pixel
+  const struct resize_axis *axis;
+  int error; // errno of a band that could not allocate its buffers
+};
+
+struct blur_job{
+  RGBTRIPLE **src;
+  RGBTRIPLE **dst;
+  int height;
+  int width;
+  int size; // bytes per pixel
+  const double *kernel;
+  const double *prefix; // prefix sums of kernel
+  int s_kernel;
+  int error; // errno of a band that could not allocate its buffers
+};
+
+struct rle_palette{//Colours of an image saved by save_image_rle
+  RGBQUAD colors[PALETTE_SIZE];
+  int n;
+  DWORD key[1 << RLE_HASH_BITS]; // colour | 1 << 24 of every slot, 0 if free
+  BYTE index[1 << RLE_HASH_BITS]; // in colors of the colour of every slot
+};
+
+struct rle_job{
+  BMPFILE *image;
+  const struct rle_palette *map; // NULL if the image has 8 bits
+  int first; // row of the first one of the job
+  int rle4;
+  size_t row_max; // bytes reserved for every coded row
+  BYTE *out;
+  size_t *length; // bytes of every coded row
+  int error; // errno of a band that could not allocate its buffers
+};
+
+struct save_job{//save_image_mmap and save_image_to_memory
+  BMPFILE *image;
+  BYTE *dst; // first row in the buffer of the file
+  size_t file_row; // bytes of a row and its padding
+};
+
+struct box_job{
+  RGBTRIPLE **src;
+  RGBTRIPLE **dst;
+  int height;
+  int width;
+  int size; // bytes per pixel
+  int boxes[BLUR_BOXES]; // radii of the boxes
+  int error; // errno of a band that could not allocate its buffers
+};
+
+struct colour_dot{//A row of a colour matrix, r*coef[0] + g*coef[1] + b*coef[2]
+  double coef[3]; // BMP_PRECISION_EXACT gives the truncation of these doubles
+  int fixed[3]; // coef << DOT_BITS, truncated
+  DWORD limit; // fraction of a fixed sum, << (32 - DOT_BITS), that may be short
+  WORD quick[3]; // coef in 1/65536, of BMP_PRECISION_FAST
+  WORD table[3][256]; // (v*quick) >> 8, the products in 1/256 of a level
+};
+
+struct pool_block{//Header of every bitmap, BMP_BUFFER_ALIGN bytes before it
+  BMPPOOL *pool; // where the block goes back when freed, NULL to free it
+  size_t size; // bytes of the block after the header
+  struct pool_block *next; // in the list of kept blocks of pool
+};
+
+struct io_request{//A load or a save of a BMPQUEUE
+  struct io_request *next; // in the pending or the done list of the queue
+  int op; // BMP_IO_LOAD or BMP_IO_SAVE
+  int step; // IO_* of BMP_IO_URING
+  int fd; // -1 if the file is not open
+  char *path;
+  BYTE *data; // file read or to be written
+  size_t size; // bytes of data, reserved to read or to be written
+  size_t offset; // bytes of data read or written so far
+  void *tag;
+  BMPFILE image; // loaded
+  int error;
+};
+
+#ifdef BMP_LINUX_URING
+struct io_ring{//The rings of an io_uring, shared with the kernel
+  int fd;
+  unsigned entries; // of the submission ring
+  unsigned queued; // entries written and not submitted yet
+  unsigned closing; // closes of loaded files, nobody waits for them
+  BYTE *sq_map;
+  size_t sq_size;
+  BYTE *cq_map; // sq_map if both rings are in one mapping
+  size_t cq_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  struct io_uring_cqe *cqes;
+  unsigned cq_mask;
+};
+#endif
 
 /*---------------------------------------------------------------------------*/
 /* Variable declarations                                                     */
 /*---------------------------------------------------------------------------*/
 
+static struct span_kernels kernels; // kernels of the selected SIMD level
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+static int simd_supported = BMP_SIMD_NONE; // best level of the CPU
+static int simd_current = BMP_SIMD_NONE;
+static int precision_mode = BMP_PRECISION_EXACT;
+
+static struct colour_dot sepia_dot[3] = // r, g and b rows, filled by dot_init
+  {{{0.393, 0.769, 0.189}}, {{0.349, 0.686, 0.168}}, {{0.272, 0.534, 0.131}}};
+static struct colour_dot luma_dot = {{0.2126, 0.7152, 0.0722}};
+
+static const RGBTRIPLE plot_colour[4] = // of the r, g, b and luma lines
+  {{0x20, 0x20, 0xD0}, {0x20, 0xA0, 0x20}, {0xD0, 0x40, 0x20}
+  , {0x40, 0x40, 0x40}};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER; // held by a job
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static struct pool_job *pool_job = NULL; // job being run, if any
+static unsigned long pool_generation = 0; // jobs published so far
+static int pool_started = 0; // worker threads created
+static int pool_running = 0; // workers inside pool_job
+static int pool_threads = 0; // threads of a job, 0 until first used
 
 /*---------------------------------------------------------------------------*/
 /* Macro declarations                                                        */
 /*---------------------------------------------------------------------------*/
 
+#ifdef BMP_X86_SIMD
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+//Pixel j of a row of pixels of size bytes
+#define PIXEL(row, j, size) \
+  ((RGBTRIPLE *)((BYTE *)(row) + (size_t)(j)*(size)))
 
 /*---------------------------------------------------------------------------*/
 /* Static function prototypes                                                */
 /*---------------------------------------------------------------------------*/
 
-void RGBtoHSV(float r, float g, float b, float* h, float* s, float* v);
+RGBTRIPLE **generate_bitmap(int new_height, int new_width, int *error);
 
-void HSVtoRGB(float h, float s, float v, float *r, float *g, float *b);
+static RGBTRIPLE **alloc_bitmap(BMPPOOL *pool, int height, int width
+          , size_t slack, int *error);
 
-RGBTRIPLE **generate_bitmap(int new_height, int new_width, int *error);
+static RGBTRIPLE **alloc_rows(BMPPOOL *pool, int height, size_t row_size
+          , size_t slack, int *error);
+
+static struct pool_block *bitmap_block(RGBTRIPLE **bitmap);
+
+static struct pool_block *pool_take(BMPPOOL *pool, size_t size);
+
+static int pool_give(BMPPOOL *pool, struct pool_block *block);
+
+static size_t row_stride(size_t row_size);
+
+static DWORD row_padding(size_t row_size);
+
+static int pixel_size(const BMPFILE *image);
+
+static size_t row_bytes(const BMPFILE *image);
+
+static size_t bitmap_head(int height);
+
+static void set_bitmap(BMPFILE *image, RGBTRIPLE **bitmap, int height
+          , int width);
+
+static RGBTRIPLE **alloc_layer(BMPPOOL *pool, int height, int width, int size
+          , int *error);
+
+static int alloc_planes(BMPPOOL *pool, BYTE **planes[3], int height
+          , int width, int *error);
+
+static void free_planes(BYTE **planes[3]);
+
+static void free_layers(RGBTRIPLE **layers[3], int n);
+
+static int image_layers(BMPFILE *image, RGBTRIPLE **layers[3], int *size);
+
+static int set_layers(BMPFILE *image, RGBTRIPLE **layers[3], int n
+          , int height, int width, int *error);
+
+static void merge_planes(BMPFILE *image);
+
+static void packed_layout(BMPFILE *image);
+
+static void release_bitmap(BMPFILE *image);
+
+static void set_size(BMPFILE *image, int height, int width);
+
+static int check_rect(BMPFILE *image, int x, int y, int width, int height
+          , int *error);
+
+static void unlink_view(BMPFILE *view);
+
+static void detach_views(BMPFILE *image);
+
+static int check_extra(const BITMAPFILEHEADER *fh, const BITMAPINFOHEADER *ih
+          , const BYTE *extra, size_t n);
+
+static size_t palette_offset(const BITMAPINFOHEADER *ih);
+
+static int palette_colors(const BITMAPINFOHEADER *ih);
+
+static RGBQUAD *read_palette(const BITMAPINFOHEADER *ih, const BYTE *extra
+          , int *error);
+
+static int compressed(const BITMAPINFOHEADER *ih);
+
+static int load_rle(BMPFILE *image, FILE *fd, int *error);
+
+static int expand_rle(BMPFILE *image, const BYTE *data, size_t n, int *error);
+
+static int borrow_rows(BMPFILE *image, const BYTE *pixels, size_t file_row
+          , int *error);
+
+static int copy_rows(BMPFILE *image, const BYTE *pixels, size_t file_row
+          , int *error);
+
+static size_t file_size(BMPFILE *image, const struct iovec *iov, int n);
+
+static void fill_file(BMPFILE *image, const struct iovec *iov, int n
+          , BYTE *dst);
+
+static int decode_rle(const BYTE *data, size_t n, RGBTRIPLE **bitmap
+          , int height, int width, int rle4);
+
+static void rle_skip(RGBTRIPLE **bitmap, int width, int *x, int *y, int to_x
+          , int to_y);
+
+static int rle_palette(BMPFILE *image, int colors, struct rle_palette *map);
+
+static void rle_rows(void *arg, size_t begin, size_t end);
+
+static size_t encode_rle(const BYTE *row, int n, BYTE *out, int rle4);
+
+static int header_vector(BMPFILE *image, BITMAPINFOHEADER *ih
+          , struct iovec *iov);
+
+static int write_vector(int fd, struct iovec *iov, int n, int *error);
+
+static int write_reversed(int fd, BMPFILE *image, int *error);
+
+static void save_rows(void *arg, size_t begin, size_t end);
+
+static struct io_request *new_request(BMPQUEUE *queue, int op, char *path
+          , void *tag, int *error);
+
+static void start_request(BMPQUEUE *queue, struct io_request *req);
+
+static void finish_request(BMPQUEUE *queue, struct io_request *req);
+
+static void run_request(struct io_request *req);
+
+static void *queue_worker(void *arg);
+
+static int ring_setup(BMPQUEUE *queue, unsigned entries, int *error);
+
+static void ring_start(BMPQUEUE *queue, struct io_request *req);
+
+static int ring_wait(BMPQUEUE *queue, int *error);
+
+static void ring_close(BMPQUEUE *queue);
+
+static int grey_palette(const BMPFILE *image);
+
+static int mixing_size(BMPFILE *image, int *error);
+
+static void convert_rows(void *arg, size_t begin, size_t end);
+
+static void for_each_span(BMPFILE *image, span_fn fn, const void *arg);
+
+static void for_each_hsv(BMPFILE *image, span_fn fn, hsv_fn hsv
+          , const void *arg);
+
+static void hsv_span(RGBTRIPLE *span, size_t n, hsv_fn fn, const void *arg);
+
+static void run_span(const struct span_job *job, BYTE *span, size_t n);
+
+static void zero_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void sepia_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void saturation_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void brightness_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void chroma_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void saturation_hsv(WORD *h, WORD *s, BYTE *v, size_t n
+          , const void *arg);
+
+static void brightness_hsv(WORD *h, WORD *s, BYTE *v, size_t n
+          , const void *arg);
+
+static void chroma_hsv(WORD *h, WORD *s, BYTE *v, size_t n, const void *arg);
+
+static void bitone_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void grayscale_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void invert_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void to_hsv_span(const RGBTRIPLE *src, WORD *h, WORD *s, BYTE *v
+          , size_t n);
+
+static void to_rgb_span(const WORD *h, const WORD *s, const BYTE *v
+          , RGBTRIPLE *dst, size_t n);
+
+static void to_hsv_planes(const BYTE *const *plane, WORD *h, WORD *s, BYTE *v
+          , size_t n);
+
+static void to_rgb_planes(const WORD *h, const WORD *s, const BYTE *v
+          , BYTE *const *plane, size_t n);
+
+static void split_span(const RGBTRIPLE *src, BYTE *const *plane, size_t n);
+
+static void merge_span(const BYTE *const *plane, RGBTRIPLE *dst, size_t n);
+
+static void taps_span(double *sum, const double *src, double k, size_t n);
+
+static void taps8_span(double *sum, const BYTE *src, double k, size_t n);
+
+static void norm_span(const double *sum, BYTE *dst, double weight, size_t n);
+
+static void transpose_block(const RGBTRIPLE *const *src
+          , RGBTRIPLE *const *dst);
+
+static void flip_span(RGBTRIPLE *a, RGBTRIPLE *b, size_t n);
+
+static void swap_span(void *a, void *b, size_t n);
+
+static void transpose_block8(const RGBTRIPLE *const *src
+          , RGBTRIPLE *const *dst);
+
+static void transpose_block32(const RGBTRIPLE *const *src
+          , RGBTRIPLE *const *dst);
+
+static void flip_span8(RGBTRIPLE *a, RGBTRIPLE *b, size_t n);
+
+static void flip_span32(RGBTRIPLE *a, RGBTRIPLE *b, size_t n);
+
+static void pack_quads(const RGBQUAD *src, RGBTRIPLE *dst, size_t n);
+
+static void unpack_quads(const RGBTRIPLE *src, RGBQUAD *dst, size_t n);
+
+static void lut_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static void chain_span(RGBTRIPLE *span, size_t n, const void *arg);
+
+static int fold_lut(struct channel_lut *lut, const BMPOP *op);
+
+static int percent_factor(int percent);
+
+static void simd_init(void);
+
+static void dot_init(struct colour_dot *dot);
 
-RGBTRIPLE **rotate_bitmap(RGBTRIPLE **bitmap, int height, int width, char motion
+static void simd_select(int level);
+
+static const struct span_kernels *simd_kernels(void);
+
+RGBTRIPLE **rotate_bitmap(BMPPOOL *pool, RGBTRIPLE **bitmap, int height
+          , int width, int size, char motion, int *error);
+
+static void flip_bitmap(RGBTRIPLE **bitmap, int height, int width, int size
+          , char motion);
+
+static void flip_image(BMPFILE *image, char motion);
+
+static void orient(BMPFILE *image, char motion);
+
+static void reverse_row(const BYTE *src, BYTE *dst, int width, int size);
+
+static void copy_kernels(struct copy_job *job);
+
+void free_bitmap(RGBTRIPLE **bitmap);
+
+static void parse_headers(const BYTE *headers, BITMAPFILEHEADER *fh
+          , BITMAPINFOHEADER *ih);
+
+static int check_file(const BITMAPFILEHEADER *fh);
+
+static int check_header(const BITMAPINFOHEADER *ih);
+
+static void *probe_worker(void *arg);
+
+static int online_threads(void);
+
+static void parallel_for(size_t n, size_t grain, band_fn fn, void *arg);
+
+static void run_bands(struct pool_job *job);
+
+static void *pool_worker(void *arg);
+
+static size_t row_grain(int width);
+
+static void span_pixels(void *arg, size_t begin, size_t end);
+
+static void span_rows(void *arg, size_t begin, size_t end);
+
+static void span_planes(void *arg, size_t begin, size_t end);
+
+static void hsv_planes(void *arg, size_t begin, size_t end);
+
+static void split_rows(void *arg, size_t begin, size_t end);
+
+static void merge_rows(void *arg, size_t begin, size_t end);
+
+static void histo_rows(void *arg, size_t begin, size_t end);
+
+static void flip_rows(void *arg, size_t begin, size_t end);
+
+static void rotate_rows(void *arg, size_t begin, size_t end);
+
+static void rotate_block(const struct copy_job *job, int i, int j);
+
+static void rotate_pixels(const struct copy_job *job, int i0, int i1, int j0
+          , int j1);
+
+static void resample_rows(void *arg, size_t begin, size_t end);
+
+static double resize_filter(int filter, double x);
+
+static int resize_weights(int old_size, int new_size, int filter
+          , struct resize_axis *axis);
+
+static RGBTRIPLE **resize_bitmap(BMPPOOL *pool, RGBTRIPLE **bitmap
+          , int old_height, int old_width, int new_height, int new_width
+          , int size, const struct resize_axis *cols
+          , const struct resize_axis *rows, int *error);
+
+static void resize_rows(void *arg, size_t begin, size_t end);
+
+static void resize_columns(void *arg, size_t begin, size_t end);
+
+static void blur_rows(void *arg, size_t begin, size_t end);
+
+static void box_rows(void *arg, size_t begin, size_t end);
+
+static void box_columns(void *arg, size_t begin, size_t end);
+
+static void box_pass(const BYTE *src, BYTE *dst, int n, int channels
+          , DWORD *acc, int r);
+
+static int stream_error(BMPSTREAM *stream, int *error);
+
+static void stream_sizes(BMPSTREAM *stream, int height);
+
+static unsigned int *histo_channel(const BMPHISTO *histo, int c);
+
+static void plot_points(const unsigned int *counts, unsigned int max, int *x
+          , int *y);
+
+static unsigned int plot_max(const BMPHISTO *histo, int channels);
+
+static void plot_line(RGBTRIPLE *canvas, int x0, int y0, int x1, int y1
+          , RGBTRIPLE colour);
+
+static void plot_canvas(const BMPHISTO *histo, int channels
+          , RGBTRIPLE *canvas);
+
+static int plot_svg(const BMPHISTO *histo, int channels, char *path
           , int *error);
 
-void free_bitmap(RGBTRIPLE **bitmap, int height);
+static int plot_bmp(const RGBTRIPLE *canvas, char *path, int *error);
+
+static int plot_png(const RGBTRIPLE *canvas, char *path, int *error);
+
+static void png_chunk(FILE *fd, const char *type, const BYTE *data, size_t n
+          , const DWORD *crc_table);
 
-void call_gnuplot(char *csv_template, char *path, int *error);
+static void put_be32(BYTE *p, DWORD v);
 
-RGBTRIPLE **resample_bitmap(RGBTRIPLE **bitmap, int new_height, int new_width
-          , int old_height, int old_width, int *error);
+RGBTRIPLE **resample_bitmap(BMPPOOL *pool, RGBTRIPLE **bitmap, int new_height
+          , int new_width, int old_height, int old_width, int size
+          , int *error);
 
 double sinc(double var);
 
@@ -121,9 +869,6 @@ int max(int a, int b);
 
 int min(int a, int b);
 
-double d_max(int n_args, double  a, double b, ...);
-
-double d_min(int n_args, double  a, double b, ...);
 
 /*---------------------------------------------------------------------------*/
 /* Function definitions                                                      */
@@ -141,50 +886,112 @@ const char *get_error_msg_bmp(int error){
 }
 
 int is_BMP(char *path, int *error){
-  char *abs_path = NULL;
-  char buffer[PATH_MAX] = "\0";
+  BMPPROBE probe;
 
-  abs_path = realpath(path, buffer);
-  if(errno){
-    *error = errno;
+  probe_BMP(path, &probe);
+  if(probe.error > 0){
+    *error = probe.error;
+    return -1;
+  }
+  return probe.is_bmp;
+}
+
+int probe_BMP(char *path, BMPPROBE *probe){
+  //The headers and the channel masks that may follow them
+  size_t size = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+  BYTE headers[sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)
+      + 3*sizeof(DWORD)];
+
+  memset(probe, 0, sizeof(BMPPROBE));
+
+  int fd;
+  if((fd = open(path, O_RDONLY)) < 0){
+    probe->error = errno;
     errno = 0;
     return -1;
   }
 
   struct stat info;
-  if(lstat(abs_path, &info)){
-    *error = errno;
+  if(fstat(fd, &info)){
+    probe->error = errno;
     errno = 0;
+    close(fd);
     return -1;
   }
-  if(S_ISREG(info.st_mode)){
-    WORD bufferBM = 0x0000;
-    DWORD bufferSize = 0;
-    FILE *fd;
+  probe->file_size = info.st_size;
 
-    if((fd = fopen(abs_path, "r")) == NULL){
-      *error = errno;
-			errno = 0;
-  		return -1;
-  	}
-    if(fread(&bufferBM, sizeof(WORD), 1, fd) != 1){
-      fclose(fd);
-      *error = errno;
-			errno = 0;
-      return -1;
-    }
-    if(fread(&bufferSize, sizeof(DWORD), 1, fd) != 1){
-      fclose(fd);
-      *error = errno;
-			errno = 0;
-      return -1;
-    }
-    fclose(fd);
+  if(!S_ISREG(info.st_mode)){
+    probe->error = CANNOT_LOAD;
+    close(fd);
+    return -1;
+  }
 
-    if((bufferBM == 0x4D42) &&(bufferSize == info.st_size)){
-      return 1;
+  ssize_t got = pread(fd, headers, sizeof(headers), 0);
+  if(got < 0){
+    probe->error = errno;
+    errno = 0;
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  memset(headers + got, 0, sizeof(headers) - got);
+  parse_headers(headers, &probe->fh, &probe->ih);
+
+  probe->is_bmp = (got >= sizeof(WORD) + sizeof(DWORD))
+      &&(probe->fh.bfType == 0x4D42)&&(probe->fh.bfSize == info.st_size);
+
+  if((!probe->is_bmp)||(got < size)){
+    probe->error = CANNOT_LOAD;
+    return -1;
+  }
+  if((probe->error = check_file(&probe->fh))
+      ||(probe->error = check_header(&probe->ih))){
+    return -1;
+  }
+  if((probe->error = check_extra(&probe->fh, &probe->ih, headers + size
+      , got - size))){
+    return -1;
+  }
+  return 0;
+}
+
+int probe_BMP_batch(char **paths, size_t n, BMPPROBE *probes, int threads
+        , int *error){
+  struct probe_job job = {paths, probes, n, 0};
+
+  if(threads <= 0){
+    threads = BMP_PROBE_THREADS;
+  }
+  if(threads > n){
+    threads = n;
+  }
+  if(threads <= 1){
+    probe_worker(&job);
+    return 0;
+  }
+
+  pthread_t *pool = malloc(threads * sizeof(pthread_t));
+  if(pool == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+
+  int i, ret, started = 0;
+  for(i=0; i<threads; i++){
+    if((ret = pthread_create(&pool[i], NULL, probe_worker, &job))){
+      break;
     }
+    started++;
+  }
+  if(started == 0){//The calling thread does the job alone
+    probe_worker(&job);
+  }
+  for(i=0; i<started; i++){
+    pthread_join(pool[i], NULL);
   }
+  free(pool);
   return 0;
 }
 
@@ -193,7 +1000,7 @@ int load_image(BMPFILE *image, char *path, int *error){
   char buffer[PATH_MAX] = "\0";
 
   abs_path = realpath(path, buffer);
-  if(errno){
+  if(abs_path == NULL){
     *error = errno;
     errno = 0;
     return -1;
@@ -208,8 +1015,21 @@ int load_image(BMPFILE *image, char *path, int *error){
 
   image->alignment = NULL;
   image->bitmap = NULL;
-
-  if(fread(&image->fh.bfType, sizeof(WORD), 1, fd) != 1){
+  image->pixels = NULL;
+  image->palette = NULL;
+  memset(image->planes, 0, sizeof(image->planes));
+  image->orientation = 0;
+  image->stride = 0;
+  image->map = NULL;
+  image->map_size = 0;
+  image->stats = NULL;
+  image->parent = NULL;
+  image->views = NULL;
+  image->next_view = NULL;
+  image->pool = NULL;
+
+  BYTE headers[sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)];
+  if(fread(headers, sizeof(headers), 1, fd) != 1){
     if(errno){
       *error = errno;
       errno = 0;
@@ -219,1249 +1039,7198 @@ int load_image(BMPFILE *image, char *path, int *error){
     fclose(fd);
     return -1;
   }
+  parse_headers(headers, &image->fh, &image->ih);
 
-  if(fread(&image->fh.bfSize, sizeof(DWORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
+  int ret;
+  if((ret = check_file(&image->fh))||(ret = check_header(&image->ih))){
+    *error = ret;
     fclose(fd);
     return -1;
   }
-
-  if(fread(&image->fh.bfReserved1, sizeof(WORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
-    fclose(fd);
-    return -1;
+  if(image->ih.biHeight < 0){//Top-down, the rows are flipped lazily
+    image->ih.biHeight = -image->ih.biHeight;
+    image->orientation = BMP_FLIP_V;
   }
 
-  if(fread(&image->fh.bfReserved2, sizeof(WORD), 1, fd) != 1){
-    if(errno){
+  image->aligment_size = image->fh.bfOffBits - ftell(fd);
+
+  if(image->aligment_size == 0){
+    image->alignment = NULL;
+  }else{
+    if((image->alignment = malloc(image->aligment_size)) == NULL){
       *error = errno;
       errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
+      fclose(fd);
+      return -1;
+    }
+    if(fread(image->alignment, image->aligment_size, 1, fd) != 1){
+      if(errno){
+        *error = errno;
+        errno = 0;
+      }else{
+        *error = CANNOT_LOAD;
+      }
+      free(image->alignment);
+      image->alignment = NULL;
+      fclose(fd);
+      return -1;
     }
+  }
+
+  if((ret = check_extra(&image->fh, &image->ih, image->alignment
+      , image->aligment_size))){
+    *error = ret;
+    free(image->alignment);
+    image->alignment = NULL;
     fclose(fd);
     return -1;
   }
-
-  if(fread(&image->fh.bfOffBits, sizeof(DWORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
+  if((image->ih.biBitCount <= 8)
+      &&((image->palette = read_palette(&image->ih, image->alignment, error))
+      == NULL)){
+    free(image->alignment);
+    image->alignment = NULL;
     fclose(fd);
     return -1;
   }
-
-  if(fread(&image->ih.biSize, sizeof(DWORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
+  if(compressed(&image->ih)){//Expanded straight into the pixel buffer
+    if((ret = load_rle(image, fd, error))){
+      free(image->palette);
+      image->palette = NULL;
+      free(image->alignment);
+      image->alignment = NULL;
     }
     fclose(fd);
-    return -1;
+    return ret;
   }
 
-  if(fread(&image->ih.biWidth, sizeof(LONG), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
+  int height = image->ih.biHeight;
+  size_t row_size = row_bytes(image);
+  image->padding = row_padding(row_size);
+  size_t file_row = row_size + image->padding;
+  size_t stride = row_stride(row_size);
+  size_t slack = (file_row > stride) ? height*(file_row - stride) : 0;
+  size_t to_read = height ? (height - 1)*file_row + row_size : 0;
+
+  //Nothing is allocated for rows a regular file does not hold
+  struct stat info;
+  if(fstat(fileno(fd), &info)){
+    *error = errno;
+    errno = 0;
+    ret = -1;
+  }else if(S_ISREG(info.st_mode)&&((info.st_size < image->fh.bfOffBits)
+      ||(to_read > (size_t)info.st_size - image->fh.bfOffBits))){
+    *error = CANNOT_LOAD;
+    ret = -1;
+  }
+  if(ret){
+    free(image->palette);
+    image->palette = NULL;
+    free(image->alignment);
+    image->alignment = NULL;
     fclose(fd);
     return -1;
   }
 
-  if(fread(&image->ih.biHeight, sizeof(LONG), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
+  RGBTRIPLE **bitmap = alloc_rows(image->pool, height, row_size, slack
+      , error);
+  if(bitmap == NULL){
+    free(image->palette);
+    image->palette = NULL;
+    free(image->alignment);
+    image->alignment = NULL;
     fclose(fd);
     return -1;
   }
+  BYTE *pixels = (BYTE *)bitmap + bitmap_head(height);
 
-  if(fread(&image->ih.biPlanes, sizeof(WORD), 1, fd) != 1){
+  //The whole pixel array is read at once, the last padding may be missing
+  if(fread(pixels, 1, height*file_row, fd) < to_read){
     if(errno){
       *error = errno;
       errno = 0;
     }else{
       *error = CANNOT_LOAD;
     }
+    free_bitmap(bitmap);
+    free(image->palette);
+    image->palette = NULL;
+    free(image->alignment);
+    image->alignment = NULL;
     fclose(fd);
     return -1;
   }
 
-  if(fread(&image->ih.biBitCount, sizeof(WORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
+  //Move every row from its place in the file to its place in the buffer
+  int i;
+  if(file_row > stride){
+    for(i=1; i<height; i++){
+      memmove(pixels + i*stride, pixels + i*file_row, row_size);
     }
-    fclose(fd);
+  }else if(file_row < stride){
+    for(i=height-1; i>0; i--){
+      memmove(pixels + i*stride, pixels + i*file_row, row_size);
+    }
+  }
+
+  image->bitmap = bitmap;
+  image->pixels = (RGBTRIPLE *)pixels;
+  image->stride = stride;
+
+  fclose(fd);
+  return 0;
+}
+
+int load_image_mmap(BMPFILE *image, char *path, int mode, int *error){
+  if((mode != BMP_MAP_READ)&&(mode != BMP_MAP_PRIVATE)){
+    *error = UNKNOWN;
     return -1;
   }
 
-  if(image->ih.biBitCount != 24){//Not 24bit image
-    *error = NOT_SPT_FMT;
-    fclose(fd);
+  int fd;
+  if((fd = open(path, O_RDONLY)) < 0){
+    *error = errno;
+    errno = 0;
     return -1;
   }
 
-  if(fread(&image->ih.biCompression, sizeof(DWORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
-    fclose(fd);
+  struct stat info;
+  if(fstat(fd, &info)){
+    *error = errno;
+    errno = 0;
+    close(fd);
+    return -1;
+  }
+  if(info.st_size < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)){
+    *error = CANNOT_LOAD;
+    close(fd);
     return -1;
   }
 
-  if(image->ih.biCompression){//Compressed image
-    *error = NOT_SPT_FMT;
-    fclose(fd);
+  int prot = PROT_READ;
+  int flags = MAP_SHARED;
+  if(mode == BMP_MAP_PRIVATE){
+    prot |= PROT_WRITE;
+    flags = MAP_PRIVATE;
+  }
+
+  BYTE *map = mmap(NULL, info.st_size, prot, flags, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED){
+    *error = errno;
+    errno = 0;
     return -1;
   }
 
-  if(fread(&image->ih.biSizeImage, sizeof(DWORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
-    fclose(fd);
+  if(load_image_from_memory(image, map, info.st_size, BMP_MEMORY_BORROW
+      , error)){
+    munmap(map, info.st_size);
     return -1;
   }
+  image->map = map;
+  image->map_size = info.st_size;
+  return 0;
+}
 
-  if(fread(&image->ih.biXPelsPerMeter, sizeof(LONG), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
-    fclose(fd);
+int load_image_from_memory(BMPFILE *image, const void *data, size_t size
+        , int mode, int *error){
+  size_t headers = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+  const BYTE *file = data;
+
+  if((mode != BMP_MEMORY_COPY)&&(mode != BMP_MEMORY_BORROW)){
+    *error = UNKNOWN;
     return -1;
   }
+  if(size < headers){
+    *error = CANNOT_LOAD;
+    return -1;
+  }
+  parse_headers(file, &image->fh, &image->ih);
+
+  //Codes cannot be borrowed, they are expanded in a new bitmap
+  int ret;
+  if((ret = check_file(&image->fh))||(ret = check_header(&image->ih))
+      ||(ret = (compressed(&image->ih)&&(mode == BMP_MEMORY_BORROW))
+      ? NOT_SPT_FMT : 0)){
+    *error = ret;
+    return -1;
+  }
+  image->orientation = 0;
+  if(image->ih.biHeight < 0){//Top-down, the rows are flipped lazily
+    image->ih.biHeight = -image->ih.biHeight;
+    image->orientation = BMP_FLIP_V;
+  }
 
-  if(fread(&image->ih.biYPelsPerMeter, sizeof(LONG), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
-    fclose(fd);
+  int height = image->ih.biHeight;
+  size_t row_size = row_bytes(image);
+  image->padding = row_padding(row_size);
+  size_t file_row = row_size + image->padding;
+  size_t to_read = height ? (height - 1)*file_row + row_size : 0;
+  if(compressed(&image->ih)){
+    to_read = 0;
+  }
+
+  if((image->fh.bfOffBits < headers)
+      ||(image->fh.bfOffBits > size)||(to_read > size - image->fh.bfOffBits)){
+    *error = CANNOT_LOAD;
+    return -1;
+  }
+  if((ret = check_extra(&image->fh, &image->ih, file + headers
+      , image->fh.bfOffBits - headers))){
+    *error = ret;
     return -1;
   }
 
-  if(fread(&image->ih.biClrUsed, sizeof(DWORD), 1, fd) != 1){
-    if(errno){
-      *error = errno;
-      errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
-    }
-    fclose(fd);
+  image->palette = NULL;
+  memset(image->planes, 0, sizeof(image->planes));
+  if((image->ih.biBitCount <= 8)
+      &&((image->palette = read_palette(&image->ih, file + headers, error))
+      == NULL)){
     return -1;
   }
 
-  if(fread(&image->ih.biClrImportant, sizeof(DWORD), 1, fd) != 1){
-    if(errno){
+  image->aligment_size = image->fh.bfOffBits - headers;
+  image->alignment = NULL;
+  if(image->aligment_size){
+    if((image->alignment = malloc(image->aligment_size)) == NULL){
       *error = errno;
       errno = 0;
-    }else{
-      *error = CANNOT_LOAD;
+      free(image->palette);
+      image->palette = NULL;
+      return -1;
     }
-    fclose(fd);
-    return -1;
+    memcpy(image->alignment, file + headers, image->aligment_size);
   }
 
-  image->aligment_size = image->fh.bfOffBits - ftell(fd);
-
-  if(image->aligment_size == 0){
-    image->alignment = NULL;
-  }else{
-    image->alignment = malloc(image->aligment_size);
-    if(fread(image->alignment, image->aligment_size, 1, fd) != 1){
-      if(errno){
-        *error = errno;
-        errno = 0;
-      }else{
-        *error = CANNOT_LOAD;
-      }
-      fclose(fd);
-      return -1;
+  image->map = NULL;
+  image->map_size = 0;
+  image->stats = NULL;
+  image->parent = NULL;
+  image->views = NULL;
+  image->next_view = NULL;
+  image->pool = NULL;
+
+  const BYTE *pixels = file + image->fh.bfOffBits;
+  if(compressed(&image->ih)){
+    size_t n = size - image->fh.bfOffBits;
+    if((image->ih.biSizeImage > 0)&&(image->ih.biSizeImage < n)){
+      n = image->ih.biSizeImage;
     }
+    ret = expand_rle(image, pixels, n, error);
+  }else if(mode == BMP_MEMORY_BORROW){
+    ret = borrow_rows(image, pixels, file_row, error);
+  }else{
+    ret = copy_rows(image, pixels, file_row, error);
   }
-
-  image->padding = (4 - (image->ih.biWidth * sizeof(RGBTRIPLE)) % 4) % 4;
-
-  image->bitmap = malloc(sizeof(RGBTRIPLE*)*image->ih.biHeight);
-  int i;
-  for(i=0; i<image->ih.biHeight; i++){
-    image->bitmap[i] = malloc(sizeof(RGBTRIPLE)*image->ih.biWidth);
-    fread(image->bitmap[i], sizeof(RGBTRIPLE), image->ih.biWidth, fd);
-    fseek(fd, image->padding, SEEK_CUR);
+  if(ret){
+    free(image->alignment);
+    image->alignment = NULL;
+    free(image->palette);
+    image->palette = NULL;
+    return -1;
   }
-
-  fclose(fd);
   return 0;
 }
 
 void clean_image(BMPFILE *image){
   if(image->alignment != NULL){
     free(image->alignment);
+    image->alignment = NULL;
   }
+  free(image->palette);
+  image->palette = NULL;
+  free_planes(image->planes);
 
-  int  i;
-
-  if(image->bitmap != NULL){
-    for(i=0; i<image->ih.biHeight; i++){
-      if(image->bitmap[i]!= NULL){
-        free(image->bitmap[i]);
-      }
-    }
-    free(image->bitmap);
-  }
+  invalidate_stats(image);
+  release_bitmap(image);
 }
 
 int save_image(BMPFILE *image, char *path, int *error){
-  FILE *fd;
-  if((fd = fopen(path, "w")) == NULL){
+  int fd;
+  if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0){
     *error = errno;
     errno = 0;
     return -1;
-	}
+  }
+
+  if(image->planes[0] != NULL){//The bitmap is brought up to date
+    merge_planes(image);
+  }
 
-  fwrite(&image->fh, sizeof(BITMAPFILEHEADER), 1, fd);
-  fwrite(&image->ih, sizeof(BITMAPINFOHEADER), 1, fd);
-  fwrite(image->alignment, image->aligment_size, 1, fd );
+  //A vertical flip is written for free as a top-down image
+  BITMAPINFOHEADER ih = image->ih;
+  if(image->orientation & BMP_FLIP_V){
+    ih.biHeight = -ih.biHeight;
+  }
 
-  int i, k;
-  for(i=0; i<image->ih.biHeight; ++i){
-    fwrite(image->bitmap[i], sizeof(RGBTRIPLE), image->ih.biWidth, fd);
-    for(k = 0; k < image->padding; k++){
-      fputc(0, fd);
+  static const BYTE zeros[4] = {0};
+  struct iovec iov[SAVE_IOV];
+  int n = header_vector(image, &ih, iov);
+  size_t row_size = row_bytes(image);
+  int ret = 0;
+
+  if(image->orientation & BMP_FLIP_H){//Every row is reversed on its way out
+    ret = write_vector(fd, iov, n, error)||write_reversed(fd, image, error);
+  }else if((image->padding == 0)&&(image->stride == row_size)){
+    //The headers and the whole pixel array in a single call
+    iov[n].iov_base = image->pixels;
+    iov[n].iov_len = row_size*image->ih.biHeight;
+    ret = write_vector(fd, iov, n + 1, error);
+  }else{//The rows and their padding in batches, the first after the headers
+    int i;
+    for(i=0; (i<image->ih.biHeight)&&(ret == 0); ++i){
+      iov[n].iov_base = image->bitmap[i];
+      iov[n++].iov_len = row_size;
+      if(image->padding){
+        iov[n].iov_base = (void *)zeros;
+        iov[n++].iov_len = image->padding;
+      }
+      if(n > SAVE_IOV - 2){
+        ret = write_vector(fd, iov, n, error);
+        n = 0;
+      }
+    }
+    if(ret == 0){
+      ret = write_vector(fd, iov, n, error);
     }
   }
-  fclose(fd);
-  return 0;
-}
 
-void zero(BMPFILE *image, int mask){
-  int i,j;
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      image->bitmap[i][j].b &=  mask      & 0xFF;
-      image->bitmap[i][j].g &= (mask>>8)  & 0xFF;
-      image->bitmap[i][j].r &= (mask>>16) & 0xFF;
-    }
+  if(close(fd)&&(ret == 0)){
+    *error = errno;
+    errno = 0;
+    ret = -1;
   }
+  return ret;
 }
 
-void sepia(BMPFILE *image){
-  int i,j,r,g,b;
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      r = image->bitmap[i][j].r*0.393 + image->bitmap[i][j].g*0.769
-          + image->bitmap[i][j].b*0.189;
-      g = image->bitmap[i][j].r*0.349 + image->bitmap[i][j].g*0.686
-          + image->bitmap[i][j].b*0.168;
-      b = image->bitmap[i][j].r*0.272 + image->bitmap[i][j].g*0.534
-          + image->bitmap[i][j].b*0.131;
+int save_image_mmap(BMPFILE *image, char *path, int *error){
+  int fd;
+  if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
 
-      (r>255) ? (image->bitmap[i][j].r = 255) : (image->bitmap[i][j].r = r);
-      (g>255) ? (image->bitmap[i][j].g = 255) : (image->bitmap[i][j].g = g);
-      (b>255) ? (image->bitmap[i][j].b = 255) : (image->bitmap[i][j].b = b);
-    }
+  if(image->planes[0] != NULL){//The bitmap is brought up to date
+    merge_planes(image);
   }
-}
 
-void saturation(BMPFILE *image, int sat_p){
-  double contrast_d = ((double)sat_p)/100.0;
+  BITMAPINFOHEADER ih = image->ih;
+  if(image->orientation & BMP_FLIP_V){
+    ih.biHeight = -ih.biHeight;
+  }
 
-  int i,j;
-  float r,g,b,h,s,v;
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      r = ((double)image->bitmap[i][j].r)/255.0;
-      g = ((double)image->bitmap[i][j].g)/255.0;
-      b = ((double)image->bitmap[i][j].b)/255.0;
+  struct iovec iov[SAVE_IOV];
+  int n = header_vector(image, &ih, iov);
+  size_t size = file_size(image, iov, n);
 
-      RGBtoHSV(r, g, b, &h, &s, &v);
-      if((s *= contrast_d)>1.0){
-        s = 1.0;
-      }
-      HSVtoRGB(h, s, v, &r, &g, &b);
+  //The blocks are reserved first, a full disk is an error and not a SIGBUS
+  int ret = posix_fallocate(fd, 0, size);
+  if(ret){
+    *error = ret;
+    close(fd);
+    return -1;
+  }
+  BYTE *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED){
+    *error = errno;
+    errno = 0;
+    close(fd);
+    return -1;
+  }
 
-      image->bitmap[i][j].r = (BYTE)(r*255.0);
-      image->bitmap[i][j].g = (BYTE)(g*255.0);
-      image->bitmap[i][j].b = (BYTE)(b*255.0);
-    }
+  fill_file(image, iov, n, map);
+  munmap(map, size);
+  if(close(fd)){
+    *error = errno;
+    errno = 0;
+    return -1;
   }
+  return 0;
 }
 
-void brightness(BMPFILE *image, int bright){
-  double bright_d = ((double)bright)/100.0;
+int save_image_to_memory(BMPFILE *image, void **data, size_t *capacity
+        , size_t *length, int mode, int *error){
+  if((mode != BMP_MEMORY_FIXED)&&(mode != BMP_MEMORY_GROW)){
+    *error = UNKNOWN;
+    return -1;
+  }
 
-  int i,j;
-  float r,g,b,h,s,v;
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      r = ((double)image->bitmap[i][j].r)/255.0;
-      g = ((double)image->bitmap[i][j].g)/255.0;
-      b = ((double)image->bitmap[i][j].b)/255.0;
+  if(image->planes[0] != NULL){//The bitmap is brought up to date
+    merge_planes(image);
+  }
 
-      RGBtoHSV(r, g, b, &h, &s, &v);
-      if((v *= bright_d)>1.0){
-        v = 1.0;
-      }
-      HSVtoRGB(h, s, v, &r, &g, &b);
+  BITMAPINFOHEADER ih = image->ih;
+  if(image->orientation & BMP_FLIP_V){
+    ih.biHeight = -ih.biHeight;
+  }
 
-      image->bitmap[i][j].r = (BYTE)(r*255.0);
-      image->bitmap[i][j].g = (BYTE)(g*255.0);
-      image->bitmap[i][j].b = (BYTE)(b*255.0);
+  struct iovec iov[SAVE_IOV];
+  int n = header_vector(image, &ih, iov);
+  *length = file_size(image, iov, n);
+  if((*data == NULL)||(*capacity < *length)){
+    if(mode == BMP_MEMORY_FIXED){//The caller may try again with length
+      *error = CANNOT_WRITE;
+      return -1;
+    }
+    void *grown = realloc(*data, *length);
+    if(grown == NULL){
+      *error = errno;
+      errno = 0;
+      return -1;
     }
+    *data = grown;
+    *capacity = *length;
   }
+
+  fill_file(image, iov, n, *data);
+  return 0;
 }
 
-void chroma(BMPFILE *image, int angle){
-  int i,j;
-  float r,g,b,h,s,v;
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      r = ((double)image->bitmap[i][j].r)/255.0;
-      g = ((double)image->bitmap[i][j].g)/255.0;
-      b = ((double)image->bitmap[i][j].b)/255.0;
+int save_image_rle(BMPFILE *image, char *path, int compression, int *error){
+  if((compression != BMP_RLE8)&&(compression != BMP_RLE4)){
+    *error = UNKNOWN;
+    return -1;
+  }
 
-      RGBtoHSV(r, g, b, &h, &s, &v);
+  if(image->planes[0] != NULL){//The bitmap is brought up to date
+    merge_planes(image);
+  }
 
-      h+=angle;
+  //The colours are known before anything is written
+  int rle4 = (compression == BMP_RLE4);
+  struct rle_palette map;
+  int ret;
+  if((ret = rle_palette(image, rle4 ? 16 : PALETTE_SIZE, &map))){
+    *error = ret;
+    return -1;
+  }
 
-      int loops = ((int)h)/360;
-      h = h - ((double)loops)*360.0;
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+  size_t row_max = 2*(size_t)width + 2; // bound of a coded row
+  int chunk = max(1, min(height, RLE_CHUNK/row_max));
+  struct rle_job job = {image, (image->palette != NULL) ? NULL : &map, 0
+      , rle4, row_max, NULL, NULL, 0};
 
-      HSVtoRGB(h, s, v, &r, &g, &b);
+  job.out = malloc(chunk*row_max);
+  job.length = malloc(chunk*sizeof(size_t));
+  if((job.out == NULL)||(job.length == NULL)){
+    *error = errno;
+    errno = 0;
+    free(job.out);
+    free(job.length);
+    return -1;
+  }
 
-      image->bitmap[i][j].r = (BYTE)(r*255.0);
-      image->bitmap[i][j].g = (BYTE)(g*255.0);
-      image->bitmap[i][j].b = (BYTE)(b*255.0);
-    }
+  FILE *fd;
+  if((fd = fopen(path, "w")) == NULL){
+    *error = errno;
+    errno = 0;
+    free(job.out);
+    free(job.length);
+    return -1;
   }
-}
 
-void bitone(BMPFILE *image, RGBTRIPLE dark, RGBTRIPLE light, int threshold){
-  int i,j;
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      if((image->bitmap[i][j].r + image->bitmap[i][j].g + image->bitmap[i][j].b)
-          < threshold){
-        image->bitmap[i][j] = dark;
-      }else{
-        image->bitmap[i][j] = light;
-      }
+  BITMAPINFOHEADER ih = image->ih;
+  ih.biSize = sizeof(BITMAPINFOHEADER);
+  ih.biBitCount = rle4 ? 4 : 8;
+  ih.biCompression = compression;
+  ih.biSizeImage = 0;
+  ih.biClrUsed = map.n;
+  ih.biClrImportant = 0;
+  BITMAPFILEHEADER fh = {0x4D42, 0, 0, 0, sizeof(BITMAPFILEHEADER)
+      + sizeof(BITMAPINFOHEADER) + map.n*sizeof(RGBQUAD)};
+
+  //The headers are written again once the size of the pixels is known
+  fwrite(&fh, sizeof(BITMAPFILEHEADER), 1, fd);
+  fwrite(&ih, sizeof(BITMAPINFOHEADER), 1, fd);
+  fwrite(map.colors, sizeof(RGBQUAD), map.n, fd);
+
+  //Bands of rows coded in parallel, written in order
+  static const BYTE end[2] = {0, 1};
+  int i;
+  for(job.first=0; (job.first<height)&&(job.error == 0); job.first+=chunk){
+    int rows = min(chunk, height - job.first);
+    parallel_for(rows, row_grain(width), rle_rows, &job);
+    for(i=0; (i<rows)&&(job.error == 0); i++){
+      fwrite(job.out + i*row_max, 1, job.length[i], fd);
+      ih.biSizeImage += job.length[i];
     }
   }
-}
+  fwrite(end, 1, sizeof(end), fd);
+  ih.biSizeImage += sizeof(end);
+  fh.bfSize = fh.bfOffBits + ih.biSizeImage;
 
-void grayscale(BMPFILE *image, char rgby){
-  int i,j;
-  BYTE result;
+  free(job.out);
+  free(job.length);
+  if(job.error){
+    fclose(fd);
+    *error = job.error;
+    return -1;
+  }
 
-  switch (rgby){
-    case 'r':
-    for(i=0; i<image->ih.biHeight; i++){
-        for(j=0; j<image->ih.biWidth; j++){
-           result = image->bitmap[i][j].r;
-           image->bitmap[i][j].b = result;
-           image->bitmap[i][j].g = result;
-        }
-    }
-    break;
-
-    case 'g':
-    for(i=0; i<image->ih.biHeight; i++){
-        for(j=0; j<image->ih.biWidth; j++){
-          result = image->bitmap[i][j].g;
-          image->bitmap[i][j].r = result;
-          image->bitmap[i][j].g = result;
-        }
+  if(fseek(fd, 0, SEEK_SET) == 0){
+    fwrite(&fh, sizeof(BITMAPFILEHEADER), 1, fd);
+    fwrite(&ih, sizeof(BITMAPINFOHEADER), 1, fd);
+  }
+  if(ferror(fd)|fclose(fd)){
+    if(errno){
+      *error = errno;
+      errno = 0;
+    }else{
+      *error = CANNOT_WRITE;
     }
-    break;
+    return -1;
+  }
+  return 0;
+}
 
-    case 'b':
-    for(i=0; i<image->ih.biHeight; i++){
-        for(j=0; j<image->ih.biWidth; j++){
-          result = image->bitmap[i][j].b;
-          image->bitmap[i][j].r = result;
-          image->bitmap[i][j].g = result;
-        }
-    }
-    break;
+int convert_image(BMPFILE *image, int bits, int *error){
+  if((bits != 8)&&(bits != 24)&&(bits != 32)){
+    *error = UNKNOWN;
+    return -1;
+  }
+  if(bits == image->ih.biBitCount){
+    return 0;
+  }
+  packed_layout(image);
+  if(detach_view(image, error)){
+    return -1;
+  }
+  detach_views(image);
 
-    case 'y':
-    for(i=0; i<image->ih.biHeight; i++){
-        for(j=0; j<image->ih.biWidth; j++){
-          result = image->bitmap[i][j].r*0.2126 + image->bitmap[i][j].g*0.7152
-              + image->bitmap[i][j].b*0.0722;
-          image->bitmap[i][j].r = result;
-          image->bitmap[i][j].g = result;
-          image->bitmap[i][j].b = result;
-        }
-    }
-    break;
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+  int size = bits/8;
+
+  //The rest of a longer info header is kept, followed by the new palette
+  size_t offset = palette_offset(&image->ih);
+  size_t colors = (bits == 8) ? PALETTE_SIZE*sizeof(RGBQUAD) : 0;
+  BYTE *alignment = NULL;
+  RGBQUAD *palette = NULL;
+
+  RGBTRIPLE **bitmap = alloc_rows(image->pool, height, (size_t)width*size, 0
+      , error);
+  if(bitmap == NULL){
+    return -1;
+  }
+  if(((offset + colors > 0)&&((alignment = calloc(1, offset + colors))
+      == NULL))||((bits == 8)&&((palette = malloc(colors)) == NULL))){
+    *error = errno;
+    errno = 0;
+    free(alignment);
+    free_bitmap(bitmap);
+    return -1;
   }
-}
 
-void invert(BMPFILE *image){
-  int i,j;
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      image->bitmap[i][j].r = 255 - image->bitmap[i][j].r;
-      image->bitmap[i][j].g = 255 - image->bitmap[i][j].g;
-      image->bitmap[i][j].b = 255 - image->bitmap[i][j].b;
+  struct convert_job job = {image->bitmap, bitmap, width, pixel_size(image)
+      , size, image->palette};
+  parallel_for(height, row_grain(width), convert_rows, &job);
+
+  if(palette != NULL){
+    int i;
+    for(i=0; i<PALETTE_SIZE; i++){
+      RGBQUAD grey = {i, i, i, 0};
+      palette[i] = grey;
     }
+    memcpy(alignment + offset, palette, colors);
+  }
+  size_t kept = (offset < image->aligment_size) ? offset
+      : image->aligment_size;
+  if((image->alignment != NULL)&&(kept > 0)){//alignment is NULL if empty
+    memcpy(alignment, image->alignment, kept);
   }
+  free(image->alignment);
+  image->alignment = alignment;
+  image->aligment_size = offset + colors;
+  free(image->palette);
+  image->palette = palette;
+
+  DWORD old_offset = image->fh.bfOffBits;
+  image->fh.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)
+      + offset + colors;
+  image->fh.bfSize = image->fh.bfSize + image->fh.bfOffBits - old_offset;
+  image->ih.biBitCount = bits;
+  image->ih.biCompression = BI_RGB;
+  image->ih.biClrUsed = 0;
+  image->ih.biClrImportant = 0;
+
+  set_bitmap(image, bitmap, height, width);
+  return 0;
 }
 
-void blackandwhite(BMPFILE *image){
-  unsigned int histo[256] = {0};
-
-  int i,j,y;
-  for(i=0; i<image->ih.biHeight; i++){
-    for (j=0; j<image->ih.biWidth; j++){
-      y = image->bitmap[i][j].r*0.2126 + image->bitmap[i][j].g*0.7152
-          + image->bitmap[i][j].b*0.0722;
-      histo[y]++;
-    }
+int set_layout(BMPFILE *image, int layout, int *error){
+  if(layout == BMP_LAYOUT_PACKED){
+    packed_layout(image);
+    return 0;
   }
-  int total = image->ih.biWidth * image->ih.biHeight;
-  //Otsu's Method
-  double sum = 0;
-  for(int i=0 ; i<256 ; i++){
-    sum += i * histo[i];
+  if(layout != BMP_LAYOUT_PLANAR){
+    *error = UNKNOWN;
+    return -1;
+  }
+  if(image->planes[0] != NULL){
+    return 0;
+  }
+  if(image->ih.biBitCount != 24){
+    *error = NOT_SPT_FMT;
+    return -1;
+  }
+  if((image->parent != NULL)||(image->views != NULL)){//They share the bitmap
+    *error = UNKNOWN;
+    return -1;
   }
 
-  double var_max = 0;
+  if(alloc_planes(image->pool, image->planes, image->ih.biHeight
+      , image->ih.biWidth, error)){
+    return -1;
+  }
+  parallel_for(image->ih.biHeight, row_grain(image->ih.biWidth), split_rows
+      , image);
+  return 0;
+}
 
-  double sumB = 0;
-  int wB = 0;
-  int wF = 0;
-  int threshold = 0;
+int open_stream(BMPSTREAM *stream, char *path, int *error){
+  memset(stream, 0, sizeof(BMPSTREAM));
 
-  for(i=0; i<256; ++i){
-    wB += histo[i];
-    wF = total - wB;
-    if(wB == 0 || wF == 0){
-      continue;
-    }
+  if((stream->fd = fopen(path, "r")) == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+  if((stream->buffer = malloc(BMP_STREAM_BUFFER)) != NULL){
+    setvbuf(stream->fd, stream->buffer, _IOFBF, BMP_STREAM_BUFFER);
+  }
 
-    sumB += i*histo[i];
+  BYTE headers[sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)];
+  if(fread(headers, sizeof(headers), 1, stream->fd) != 1){
+    stream_error(stream, error);
+    close_stream(stream, error);
+    return -1;
+  }
+  parse_headers(headers, &stream->fh, &stream->ih);
+
+  int ret;
+  if((ret = check_file(&stream->fh))||(ret = check_header(&stream->ih))
+      ||(ret = (compressed(&stream->ih)||(stream->ih.biHeight < 0))
+      ? NOT_SPT_FMT : 0)){
+    close_stream(stream, error);
+    *error = ret;
+    return -1;
+  }
 
-    double mB = sumB/wB;
-    double mF = (sum - sumB)/wF;
+  //Masks and palette, between the headers and the pixels
+  size_t n = (stream->fh.bfOffBits > sizeof(headers))
+      ? stream->fh.bfOffBits - sizeof(headers) : 0;
+  BYTE *extra = malloc(n + 1);
+  if(extra == NULL){
+    stream_error(stream, error);
+    close_stream(stream, error);
+    return -1;
+  }
+  if((n > 0)&&(fread(extra, n, 1, stream->fd) != 1)){
+    stream_error(stream, error);
+    free(extra);
+    close_stream(stream, error);
+    return -1;
+  }
+  if((ret = check_extra(&stream->fh, &stream->ih, extra, n))){
+    free(extra);
+    close_stream(stream, error);
+    *error = ret;
+    return -1;
+  }
 
-    double between = (double)wB * (double)wF * (mB - mF) * (mB - mF);
+  int size = stream->ih.biBitCount/8;
+  if(size == 1){
+    stream->palette = read_palette(&stream->ih, extra, error);
+  }
+  free(extra);
+  if((size == 1)&&(stream->palette == NULL)){
+    close_stream(stream, error);
+    return -1;
+  }
 
-    if(between>var_max){
-      threshold = i;
-      var_max = between;
-    }
+  //Rows of other sizes are read here and converted to 24 bit
+  if((size != sizeof(RGBTRIPLE))
+      &&((stream->raw = malloc((size_t)stream->ih.biWidth*size + 1)) == NULL)){
+    stream_error(stream, error);
+    close_stream(stream, error);
+    return -1;
   }
 
-  RGBTRIPLE light = {0xFF,0xFF,0xFF};
-  RGBTRIPLE dark = {0x00,0x00,0x00};
-  bitone(image, dark, light, threshold*3);
-}
+  if(fseek(stream->fd, stream->fh.bfOffBits, SEEK_SET)){
+    stream_error(stream, error);
+    close_stream(stream, error);
+    return -1;
+  }
 
-void mirror(BMPFILE *image, char hv, int *error){
-  BMPFILE aux;
+  stream->padding = row_padding((size_t)stream->ih.biWidth*size);
+  return 0;
+}
 
-  if(bmpdup(image, &aux, error)){
-    return;
+int read_rows(BMPSTREAM *stream, RGBTRIPLE *rows, int n, int *error){
+  if((stream->writer)||(n < 0)){
+    *error = UNKNOWN;
+    return -1;
+  }
+  if(n > stream->ih.biHeight - stream->row){
+    n = stream->ih.biHeight - stream->row;
   }
 
-  int i,j;
-  if(hv == 'v'){
-    int w = image->ih.biWidth;
-
-    for(i=0; i<image->ih.biHeight; i++){
-      for(j=0; j<image->ih.biWidth; j++){
-        memcpy(&image->bitmap[i][j], &aux.bitmap[i][w-j-1], sizeof(RGBTRIPLE));
-      }
+  int width = stream->ih.biWidth;
+  int size = stream->ih.biBitCount/8;
+  BYTE padding[4];
+  int i, j;
+  for(i=0; i<n; i++){
+    RGBTRIPLE *row = rows + (size_t)i*width;
+    BYTE *raw = (stream->raw != NULL) ? stream->raw : (BYTE *)row;
+    if(fread(raw, size, width, stream->fd) != width){
+      return stream_error(stream, error);
     }
-  }else if(hv == 'h'){
-    int h = image->ih.biHeight;
-
-    for(i=0; i<image->ih.biHeight; i++){
-      for(j=0; j<image->ih.biWidth; j++){
-        memcpy(&image->bitmap[i][j], &aux.bitmap[h-1-i][j], sizeof(RGBTRIPLE));
+    if(size == 1){//Rows are given in 24 bit
+      for(j=0; j<width; j++){
+        const RGBQUAD *colour = &stream->palette[raw[j]];
+        row[j].b = colour->b;
+        row[j].g = colour->g;
+        row[j].r = colour->r;
       }
+    }else if(size == 4){
+      simd_kernels()->pack((const RGBQUAD *)raw, row, width);
+    }
+    //The padding of the last row may be missing
+    if((stream->row + i + 1 < stream->ih.biHeight)&&(stream->padding)
+        &&(fread(padding, stream->padding, 1, stream->fd) != 1)){
+      return stream_error(stream, error);
     }
-  }else{
-    *error = UNKNOWN;
   }
-
-  clean_image(&aux);
+  stream->row += n;
+  return n;
 }
 
-int rotate(BMPFILE *image, char motion, int *error){
-  int new_width;
-  int new_height;
-  int new_XPelsPerMeter = image->ih.biYPelsPerMeter;
-  int new_YPelsPerMeter = image->ih.biXPelsPerMeter;
-
-  RGBTRIPLE **new_im;
-
-  new_width = image->ih.biHeight;
-  new_height = image->ih.biWidth;
+int create_stream(BMPSTREAM *stream, char *path, int width, int height
+        , int *error){
+  memset(stream, 0, sizeof(BMPSTREAM));
 
-  new_im = rotate_bitmap(image->bitmap, image->ih.biHeight, image->ih.biWidth
-                      , motion, error);
-  if(new_im == NULL){
+  if((width < 0)||(height < 0)){
+    *error = UNKNOWN;
     return -1;
   }
 
-  free_bitmap(image->bitmap, image->ih.biHeight);
-
-  image->ih.biWidth = new_width;
-  image->ih.biHeight = new_height;
-  image->ih.biXPelsPerMeter = new_XPelsPerMeter;
-  image->ih.biYPelsPerMeter = new_YPelsPerMeter;
-
-  image->padding = (4 - (image->ih.biWidth * sizeof(RGBTRIPLE)) % 4) % 4;
+  if((stream->fd = fopen(path, "w")) == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+  if((stream->buffer = malloc(BMP_STREAM_BUFFER)) != NULL){
+    setvbuf(stream->fd, stream->buffer, _IOFBF, BMP_STREAM_BUFFER);
+  }
+  stream->writer = 1;
+  stream->padding = (4 - (width * sizeof(RGBTRIPLE)) % 4) % 4;
+
+  stream->fh.bfType = 0x4D42;
+  stream->fh.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+  stream->ih.biSize = sizeof(BITMAPINFOHEADER);
+  stream->ih.biWidth = width;
+  stream->ih.biHeight = height;
+  stream->ih.biPlanes = 1;
+  stream->ih.biBitCount = 24;
+  stream_sizes(stream, height);
+
+  if((fwrite(&stream->fh, sizeof(BITMAPFILEHEADER), 1, stream->fd) != 1)
+      ||(fwrite(&stream->ih, sizeof(BITMAPINFOHEADER), 1, stream->fd) != 1)){
+    stream_error(stream, error);
+    fclose(stream->fd);
+    stream->fd = NULL;
+    free(stream->buffer);
+    stream->buffer = NULL;
+    remove(path);
+    return -1;
+  }
+  return 0;
+}
 
-  int old_biSizeImage = image->ih.biSizeImage;
-  image->ih.biSizeImage = image->ih.biHeight*(image->ih.biWidth*3
-        +image->padding);
+int write_rows(BMPSTREAM *stream, RGBTRIPLE *rows, int n, int *error){
+  static const BYTE zeros[4] = {0};
 
-  image->fh.bfSize = image->fh.bfSize + image->ih.biSizeImage - old_biSizeImage;
+  if((!stream->writer)||(n < 0)
+      ||((stream->ih.biHeight)&&(n > stream->ih.biHeight - stream->row))){
+    *error = UNKNOWN;
+    return -1;
+  }
 
-  image->bitmap = new_im;
+  int i;
+  for(i=0; i<n; i++){
+    RGBTRIPLE *row = rows + (size_t)i*stream->ih.biWidth;
+    if((fwrite(row, sizeof(RGBTRIPLE), stream->ih.biWidth, stream->fd)
+          != stream->ih.biWidth)
+        ||(fwrite(zeros, 1, stream->padding, stream->fd) != stream->padding)){
+      return stream_error(stream, error);
+    }
+  }
+  stream->row += n;
   return 0;
 }
 
-int generate_histogram(BMPFILE *image, char *path, int *error){
-  unsigned int histo_r[256];
-  unsigned int histo_g[256];
-  unsigned int histo_b[256];
-  memset(histo_r, 0, sizeof(int)*255);//clean the arrays
-  memset(histo_g, 0, sizeof(int)*255);
-  memset(histo_b, 0, sizeof(int)*255);
+int close_stream(BMPSTREAM *stream, int *error){
+  int ret = 0;
 
-  int r,g,b;
-  r = 0; g = 0; b = 0;
+  if(stream->fd == NULL){
+    return 0;
+  }
 
-  int i,j;
-  for(i=0; i<image->ih.biHeight; i++){
-    for (j=0; j<image->ih.biWidth; j++){
-      r = image->bitmap[i][j].r;
-      g = image->bitmap[i][j].g;
-      b = image->bitmap[i][j].b;
+  if(stream->writer){//The headers are completed with the rows written
+    stream->ih.biHeight = stream->row;
+    stream_sizes(stream, stream->row);
 
-      histo_r[r]++;
-      histo_g[g]++;
-      histo_b[b]++;
+    if(fseek(stream->fd, 0, SEEK_SET)
+        ||(fwrite(&stream->fh, sizeof(BITMAPFILEHEADER), 1, stream->fd) != 1)
+        ||(fwrite(&stream->ih, sizeof(BITMAPINFOHEADER), 1, stream->fd) != 1)
+        ||(fflush(stream->fd))){
+      ret = stream_error(stream, error);
     }
   }
 
-  FILE *fd;
-  int temp;
-  char template[]="histogram_XXXXXX.csv";
-  temp = mkstemps(template, 4);
+  if(fclose(stream->fd) && (ret == 0)){
+    ret = stream_error(stream, error);
+  }
+  stream->fd = NULL;
+  free(stream->buffer);
+  stream->buffer = NULL;
+  free(stream->palette);
+  stream->palette = NULL;
+  free(stream->raw);
+  stream->raw = NULL;
+  return ret;
+}
 
-  if((fd = fdopen(temp, "w")) == NULL){
-    *error = errno;
-    errno = 0;
+int wrap_rows(BMPFILE *view, RGBTRIPLE *rows, int width, int n, int *error){
+  if((width < 0)||(n < 0)){
+    *error = UNKNOWN;
     return -1;
   }
 
-  fprintf(fd, "Intensity\t");
-  fprintf(fd, "Red\t");
-  fprintf(fd, "Green\t");
-  fprintf(fd, "Blue\n");
+  //Only the row pointers, in a block that free_bitmap can release
+  memset(view, 0, sizeof(BMPFILE));
+  if((view->bitmap = alloc_rows(NULL, n, 0, 0, error)) == NULL){
+    return -1;
+  }
 
-  for(i=0; i<256; i++){
-    fprintf(fd, "%d",i);
-    fprintf(fd, "\t");
-    fprintf(fd, "%u", histo_r[i]);
-    fprintf(fd, "\t");
-    fprintf(fd, "%u", histo_g[i]);
-    fprintf(fd, "\t");
-    fprintf(fd, "%u", histo_b[i]);
-    fprintf(fd, "\n");
+  view->fh.bfType = 0x4D42;
+  view->fh.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+  view->ih.biSize = sizeof(BITMAPINFOHEADER);
+  view->ih.biWidth = width;
+  view->ih.biHeight = n;
+  view->ih.biPlanes = 1;
+  view->ih.biBitCount = 24;
+  view->padding = (4 - (width * sizeof(RGBTRIPLE)) % 4) % 4;
+  view->ih.biSizeImage = n * (width * 3 + view->padding);
+  view->fh.bfSize = view->fh.bfOffBits + view->ih.biSizeImage;
+
+  view->pixels = rows;
+  view->stride = width * sizeof(RGBTRIPLE);
+  int i;
+  for(i=0; i<n; i++){
+    view->bitmap[i] = rows + (size_t)i*width;
   }
-  fclose(fd);
+  return 0;
+}
+
+int create_pool(BMPPOOL *pool, size_t limit, int *error){
+  memset(pool, 0, sizeof(BMPPOOL));
+  int ret = pthread_mutex_init(&pool->lock, NULL);
+  if(ret){
+    *error = ret;
+    return -1;
+  }
+  pool->limit = limit;
+  return 0;
+}
 
-  call_gnuplot(template, path, error);
+void clean_pool(BMPPOOL *pool){
+  while(pool->blocks != NULL){
+    struct pool_block *next = pool->blocks->next;
+    free(pool->blocks);
+    pool->blocks = next;
+  }
+  pool->kept = 0;
+  pthread_mutex_destroy(&pool->lock);
+}
 
-  remove(template);
+void use_pool(BMPFILE *image, BMPPOOL *pool){
+  int c;
 
-  return 0;
+  //The row pointers of a view or of a mapping are not a pool block
+  image->pool = pool;
+  if((image->parent == NULL)&&(image->map == NULL)&&(image->bitmap != NULL)){
+    bitmap_block(image->bitmap)->pool = pool;
+  }
+  for(c=0; c<3; c++){
+    if(image->planes[c] != NULL){
+      bitmap_block((RGBTRIPLE **)image->planes[c])->pool = pool;
+    }
+  }
 }
 
-int bmpdup(BMPFILE *source, BMPFILE *dest, int *error){
-  dest->fh = source->fh;
-  dest->ih = source->ih;
-  dest->aligment_size = source->aligment_size;
-  if(source->alignment){
-    dest->alignment = malloc(source->aligment_size);
-    if(errno){
-      *error = errno;
-      errno = 0;
+int create_queue(BMPQUEUE *queue, int depth, int backend, int *error){
+  int ret;
+
+  memset(queue, 0, sizeof(BMPQUEUE));
+  if((backend < BMP_IO_AUTO)||(backend > BMP_IO_THREADS)){
+    *error = UNKNOWN;
+    return -1;
+  }
+  queue->depth = (depth <= 0) ? BMP_QUEUE_DEPTH : min(depth, BMP_QUEUE_MAX);
+  if((ret = pthread_mutex_init(&queue->lock, NULL))){
+    *error = ret;
+    return -1;
+  }
+  pthread_cond_init(&queue->work, NULL);
+  pthread_cond_init(&queue->ready, NULL);
+
+  //A request has one entry in flight at most, the close of a load another
+  if(backend != BMP_IO_THREADS){
+    int ring_error = 0;
+    if(ring_setup(queue, 2*queue->depth, &ring_error) == 0){
+      queue->backend = BMP_IO_URING;
+      return 0;
+    }
+    if(backend == BMP_IO_URING){
+      *error = ring_error;
+      clean_queue(queue);
       return -1;
     }
-    memcpy(dest->alignment, source->alignment, source->aligment_size);
-  }else{
-    dest->alignment = NULL;
   }
-  dest->padding = source->padding;
-  dest->bitmap = NULL;
-  dest->bitmap = malloc(sizeof(RGBTRIPLE *)*source->ih.biHeight);
-  if(errno){
-    if(dest->bitmap != NULL){
-      free(dest->bitmap);
-    }
+
+  queue->backend = BMP_IO_THREADS;
+  int threads = min(queue->depth, BMP_QUEUE_THREADS);
+  if((queue->threads = malloc(threads*sizeof(pthread_t))) == NULL){
     *error = errno;
     errno = 0;
+    clean_queue(queue);
     return -1;
   }
-  int i,j,a;
-  for(a=0; a<source->ih.biHeight; a++){
-    dest->bitmap[a] = NULL;
-    dest->bitmap[a] = malloc(sizeof(RGBTRIPLE)*source->ih.biWidth);
-    if(errno){
-      for(i=0; i<a; i++){
-        if(dest->bitmap[i] != NULL){
-          free(dest->bitmap[i]);
-        }
-      }
-      if(dest->bitmap != NULL){
-        free(dest->bitmap);
-      }
-      *error = errno;
-      errno = 0;
-      return -1;
-    }
+  ret = 0;
+  while((queue->n_threads < threads)&&!(ret = pthread_create(
+      &queue->threads[queue->n_threads], NULL, queue_worker, queue))){
+    queue->n_threads++;
   }
-
-  for(i = 0; i<source->ih.biHeight; i++){
-    for(j = 0; j<source->ih.biWidth; j++){
-      dest->bitmap[i][j].r = source->bitmap[i][j].r;
-  	  dest->bitmap[i][j].b = source->bitmap[i][j].b;
-      dest->bitmap[i][j].g = source->bitmap[i][j].g;
-    }
+  if(queue->n_threads == 0){
+    *error = ret;
+    clean_queue(queue);
+    return -1;
   }
   return 0;
 }
 
-int reduce(BMPFILE *image, int factor, int *error){
-  int new_width = image->ih.biWidth/factor;
-  int new_height = image->ih.biHeight/factor;
-  int new_XPelsPerMeter = image->ih.biXPelsPerMeter/factor;
-  int new_YPelsPerMeter = image->ih.biYPelsPerMeter/factor;
+int queue_load(BMPQUEUE *queue, char *path, void *tag, int *error){
+  struct io_request *req = new_request(queue, BMP_IO_LOAD, path, tag, error);
 
-  RGBTRIPLE **new_im;
+  if(req == NULL){
+    return -1;
+  }
+  start_request(queue, req);
+  return 0;
+}
 
-  new_im = resample_bitmap(image->bitmap, new_height, new_width,
-                  image->ih.biHeight, image->ih.biWidth, error);
+int queue_save(BMPQUEUE *queue, BMPFILE *image, char *path, void *tag
+        , int *error){
+  struct io_request *req = new_request(queue, BMP_IO_SAVE, path, tag, error);
+  size_t capacity = 0;
 
-  if(new_im == NULL){
+  if(req == NULL){
+    return -1;
+  }
+  if(save_image_to_memory(image, (void **)&req->data, &capacity, &req->size
+      , BMP_MEMORY_GROW, error)){
+    free(req->data);
+    free(req->path);
+    free(req);
     return -1;
   }
+  start_request(queue, req);
+  return 0;
+}
 
-  free_bitmap(image->bitmap, image->ih.biHeight);
+int wait_queue(BMPQUEUE *queue, BMPDONE *done, int *error){
+  pthread_mutex_lock(&queue->lock);
+  while(queue->done == NULL){
+    if(queue->outstanding == 0){
+      pthread_mutex_unlock(&queue->lock);
+      return 0;
+    }
+    if(queue->ring == NULL){
+      pthread_cond_wait(&queue->ready, &queue->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if(ring_wait(queue, error)){
+      return -1;
+    }
+    pthread_mutex_lock(&queue->lock);
+  }
+  struct io_request *req = queue->done;
+  if((queue->done = req->next) == NULL){
+    queue->done_last = NULL;
+  }
+  queue->outstanding--;
+  pthread_mutex_unlock(&queue->lock);
 
-  image->ih.biWidth = new_width;
-  image->ih.biHeight = new_height;
-  image->ih.biXPelsPerMeter = new_XPelsPerMeter;
-  image->ih.biYPelsPerMeter = new_YPelsPerMeter;
+  memset(done, 0, sizeof(BMPDONE));
+  if((req->op == BMP_IO_LOAD)&&(req->error == 0)){
+    done->image = req->image;
+  }
+  done->tag = req->tag;
+  done->op = req->op;
+  done->error = req->error;
+  free(req->path);
+  free(req);
+  return 1;
+}
 
-  image->padding = (4 - (image->ih.biWidth * sizeof(RGBTRIPLE)) % 4) % 4;
+void clean_queue(BMPQUEUE *queue){
+  BMPDONE done;
+  int error = 0;
+  int i;
 
-  int old_biSizeImage = image->ih.biSizeImage;
-  image->ih.biSizeImage = image->ih.biHeight * (image->ih.biWidth * 3
-      + image->padding);
+  while(wait_queue(queue, &done, &error) == 1){
+    if((done.op == BMP_IO_LOAD)&&(done.error == 0)){
+      clean_image(&done.image);
+    }
+  }
+  pthread_mutex_lock(&queue->lock);
+  queue->stop = 1;
+  pthread_cond_broadcast(&queue->work);
+  pthread_mutex_unlock(&queue->lock);
+  for(i=0; i<queue->n_threads; i++){
+    pthread_join(queue->threads[i], NULL);
+  }
+  free(queue->threads);
+  queue->threads = NULL;
+  queue->n_threads = 0;
+  if(queue->ring != NULL){
+    ring_close(queue);
+  }
+  pthread_cond_destroy(&queue->work);
+  pthread_cond_destroy(&queue->ready);
+  pthread_mutex_destroy(&queue->lock);
+}
 
-  image->fh.bfSize = image->fh.bfSize + image->ih.biSizeImage
-      - old_biSizeImage;
+void chain_clear(BMPCHAIN *chain){
+  chain->n = 0;
+}
 
-  image->bitmap = new_im;
+int chain_add(BMPCHAIN *chain, int op, int param, int *error){
+  if((chain->n >= BMP_CHAIN_MAX)||(op < BMP_OP_ZERO)||(op > BMP_OP_INVERT)
+      ||(op == BMP_OP_BITONE)){
+    *error = UNKNOWN;
+    return -1;
+  }
+  BMPOP *new_op = &chain->ops[chain->n++];
+  memset(new_op, 0, sizeof(BMPOP));
+  new_op->op = op;
+  new_op->param = param;
   return 0;
 }
 
-int enlarge(BMPFILE *image, int factor, int *error){
-  int new_width = image->ih.biWidth*factor;
-  int new_height = image->ih.biHeight*factor;
-  int new_XPelsPerMeter = image->ih.biXPelsPerMeter*factor;
-  int new_YPelsPerMeter = image->ih.biYPelsPerMeter*factor;
+int chain_add_bitone(BMPCHAIN *chain, RGBTRIPLE dark, RGBTRIPLE light
+        , int threshold, int *error){
+  if(chain->n >= BMP_CHAIN_MAX){
+    *error = UNKNOWN;
+    return -1;
+  }
+  BMPOP *new_op = &chain->ops[chain->n++];
+  new_op->op = BMP_OP_BITONE;
+  new_op->param = threshold;
+  new_op->dark = dark;
+  new_op->light = light;
+  return 0;
+}
 
-  RGBTRIPLE **new_im = NULL;
+int apply_chain(BMPFILE *image, BMPCHAIN *chain, int *error){
+  if((chain->n < 0)||(chain->n > BMP_CHAIN_MAX)){
+    *error = UNKNOWN;
+    return -1;
+  }
+
+  struct chain_plan *plan = malloc(sizeof(struct chain_plan));
+  if(plan == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
 
-  new_im = resample_bitmap(image->bitmap, new_height, new_width,
-                  image->ih.biHeight, image->ih.biWidth, error);
+  const struct span_kernels *k = simd_kernels();
+  struct chain_stage *stage = NULL;
+  int i, c;
 
-  if(new_im == NULL){
+  plan->n = 0;
+  for(i=0; i<chain->n; i++){
+    const BMPOP *op = &chain->ops[i];
+
+    //Per channel operations are accumulated in the previous table
+    if((stage != NULL)&&(stage->fn == lut_span)
+        &&(fold_lut(&stage->arg.lut, op) == 0)){
+      continue;
+    }
+
+    stage = &plan->stages[plan->n];
+    stage->fn = lut_span;
+    for(c=0; c<3; c++){
+      int v;
+      stage->arg.lut.src[c] = c;
+      for(v=0; v<256; v++){
+        stage->arg.lut.lut[c][v] = v;
+      }
+    }
+    if(fold_lut(&stage->arg.lut, op) == 0){
+      plan->n++;
+      continue;
+    }
+
+    switch(op->op){
+      case BMP_OP_SEPIA:
+      stage->fn = k->sepia;
+      break;
+
+      case BMP_OP_SATURATION:
+      stage->fn = saturation_span;
+      stage->arg.i = op->param;
+      break;
+
+      case BMP_OP_BRIGHTNESS:
+      stage->fn = brightness_span;
+      stage->arg.i = op->param;
+      break;
+
+      case BMP_OP_CHROMA:
+      stage->fn = chroma_span;
+      stage->arg.i = op->param;
+      break;
+
+      case BMP_OP_BITONE:
+      stage->fn = k->bitone;
+      stage->arg.bitone.dark = op->dark;
+      stage->arg.bitone.light = op->light;
+      stage->arg.bitone.threshold = op->param;
+      break;
+
+      case BMP_OP_GRAYSCALE:
+      stage->fn = k->grayscale;
+      stage->arg.c = op->param;
+      break;
+
+      default:
+      free(plan);
+      *error = UNKNOWN;
+      return -1;
+    }
+    plan->n++;
+  }
+
+  if(plan->n == 1){//Nothing to fuse
+    for_each_span(image, plan->stages[0].fn, &plan->stages[0].arg);
+  }else if(plan->n > 1){
+    for_each_span(image, chain_span, plan);
+  }
+
+  free(plan);
+  return 0;
+}
+
+int bmp_simd_level(void){
+  simd_kernels();
+  return simd_current;
+}
+
+int bmp_set_simd(int level){
+  simd_kernels();
+  level = max(BMP_SIMD_NONE, min(level, simd_supported));
+  simd_select(level);
+  return level;
+}
+
+int bmp_precision(void){
+  return precision_mode;
+}
+
+int bmp_set_precision(int mode){
+  if((mode == BMP_PRECISION_EXACT)||(mode == BMP_PRECISION_FAST)){
+    precision_mode = mode;
+  }
+  return precision_mode;
+}
+
+int bmp_threads(void){
+  int threads;
+
+  pthread_mutex_lock(&pool_lock);
+  if(pool_threads == 0){
+    pool_threads = online_threads();
+  }
+  threads = pool_threads;
+  pthread_mutex_unlock(&pool_lock);
+  return threads;
+}
+
+int bmp_set_threads(int threads){
+  if(threads <= 0){
+    threads = online_threads();
+  }
+  threads = min(threads, BMP_MAX_THREADS);
+
+  pthread_mutex_lock(&pool_lock);
+  pool_threads = threads;
+  pthread_mutex_unlock(&pool_lock);
+  return threads;
+}
+
+void zero(BMPFILE *image, int mask){
+  for_each_span(image, simd_kernels()->zero, &mask);
+}
+
+void sepia(BMPFILE *image){
+  for_each_span(image, simd_kernels()->sepia, NULL);
+}
+
+void rgb_to_hsv_row(const RGBTRIPLE *src, WORD *h, WORD *s, BYTE *v
+          , size_t n){
+  simd_kernels()->to_hsv(src, h, s, v, n);
+}
+
+void hsv_to_rgb_row(const WORD *h, const WORD *s, const BYTE *v
+          , RGBTRIPLE *dst, size_t n){
+  simd_kernels()->to_rgb(h, s, v, dst, n);
+}
+
+void saturation(BMPFILE *image, int sat_p){
+  for_each_hsv(image, saturation_span, saturation_hsv, &sat_p);
+}
+
+void brightness(BMPFILE *image, int bright){
+  for_each_hsv(image, brightness_span, brightness_hsv, &bright);
+}
+
+void chroma(BMPFILE *image, int angle){
+  for_each_hsv(image, chroma_span, chroma_hsv, &angle);
+}
+
+void bitone(BMPFILE *image, RGBTRIPLE dark, RGBTRIPLE light, int threshold){
+  struct bitone_args args = {dark, light, threshold};
+  for_each_span(image, simd_kernels()->bitone, &args);
+}
+
+void grayscale(BMPFILE *image, char rgby){
+  for_each_span(image, simd_kernels()->grayscale, &rgby);
+}
+
+void invert(BMPFILE *image){
+  for_each_span(image, simd_kernels()->invert, NULL);
+}
+
+void blackandwhite(BMPFILE *image){
+  BMPHISTO luma;
+  const unsigned int *histo = luma.y;
+
+  //The thresholding drops the cache, so it is only filled by others
+  if(image->stats != NULL){
+    histo = image->stats->histo.y;
+  }else{
+    histogram(image, &luma, BMP_HISTO_Y);
+  }
+
+  int i;
+  int total = image->ih.biWidth * image->ih.biHeight;
+  //Otsu's Method
+  double sum = 0;
+  for(int i=0 ; i<256 ; i++){
+    sum += i * histo[i];
+  }
+
+  double var_max = 0;
+
+  double sumB = 0;
+  int wB = 0;
+  int wF = 0;
+  int threshold = 0;
+
+  for(i=0; i<256; ++i){
+    wB += histo[i];
+    wF = total - wB;
+    if(wB == 0 || wF == 0){
+      continue;
+    }
+
+    sumB += i*histo[i];
+
+    double mB = sumB/wB;
+    double mF = (sum - sumB)/wF;
+
+    double between = (double)wB * (double)wF * (mB - mF) * (mB - mF);
+
+    if(between>var_max){
+      threshold = i;
+      var_max = between;
+    }
+  }
+
+  RGBTRIPLE light = {0xFF,0xFF,0xFF};
+  RGBTRIPLE dark = {0x00,0x00,0x00};
+  bitone(image, dark, light, threshold*3);
+}
+
+void mirror(BMPFILE *image, char hv, int *error){
+  if((hv != 'v')&&(hv != 'h')){
+    *error = UNKNOWN;
+    return;
+  }
+
+  orient(image, hv);
+}
+
+int rotate(BMPFILE *image, char motion, int *error){
+  int new_width;
+  int new_height;
+  int new_XPelsPerMeter = image->ih.biYPelsPerMeter;
+  int new_YPelsPerMeter = image->ih.biXPelsPerMeter;
+
+  RGBTRIPLE **layers[3];
+  RGBTRIPLE **new_im[3] = {NULL, NULL, NULL};
+  int size = pixel_size(image);
+  int c, n;
+
+  if(motion == 'u'){//Half a turn keeps the size, both flips
+    orient(image, motion);
+    return 0;
+  }
+  if((motion != 'l')&&(motion != 'r')){
+    *error = UNKNOWN;
+    return -1;
+  }
+
+  new_width = image->ih.biHeight;
+  new_height = image->ih.biWidth;
+
+  n = image_layers(image, layers, &size);
+  for(c=0; c<n; c++){
+    new_im[c] = rotate_bitmap(image->pool, layers[c], image->ih.biHeight
+        , image->ih.biWidth, size, motion, error);
+    if(new_im[c] == NULL){
+      free_layers(new_im, n);
+      return -1;
+    }
+  }
+
+  if(set_layers(image, new_im, n, new_height, new_width, error)){
+    return -1;
+  }
+
+  image->ih.biXPelsPerMeter = new_XPelsPerMeter;
+  image->ih.biYPelsPerMeter = new_YPelsPerMeter;
+
+  //A quarter turn after a flip is the same turn before the flip of the other
+  //axis, so the pending flips swap their axes
+  int flips = image->orientation;
+  image->orientation = ((flips & BMP_FLIP_H) ? BMP_FLIP_V : 0)
+      | ((flips & BMP_FLIP_V) ? BMP_FLIP_H : 0);
+  return 0;
+}
+
+int resolve_orientation(BMPFILE *image, int *error){
+  int flips = image->orientation;
+  if(flips == 0){
+    return 0;
+  }
+
+  if((image->map != NULL)&&(image->planes[0] == NULL)){
+    //The mapping may be read-only, the rows are copied out of it in their
+    //new order
+    int height = image->ih.biHeight;
+    int width = image->ih.biWidth;
+    size_t row_size = row_bytes(image);
+    RGBTRIPLE **bitmap = alloc_rows(image->pool, height, row_size, 0, error);
+    if(bitmap == NULL){
+      return -1;
+    }
+    int i;
+    for(i=0; i<height; i++){
+      memcpy(bitmap[i], image->bitmap[(flips & BMP_FLIP_V) ? height-1-i : i]
+          , row_size);
+    }
+    set_bitmap(image, bitmap, height, width);
+    flips &= ~BMP_FLIP_V;
+  }
+
+  image->orientation = 0;
+  if(flips){
+    flip_image(image, (flips == BMP_FLIP_V) ? 'h'
+        : ((flips == BMP_FLIP_H) ? 'v' : 'u'));
+  }
+  return 0;
+}
+
+RGBTRIPLE *image_pixel(BMPFILE *image, int x, int y){
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+
+  if((x < 0)||(y < 0)||(x >= width)||(y >= height)){
+    return NULL;
+  }
+
+  //Rows are bottom-up, y counts from the top
+  int row = (image->orientation & BMP_FLIP_V) ? y : height - 1 - y;
+  int col = (image->orientation & BMP_FLIP_H) ? width - 1 - x : x;
+  return PIXEL(image->bitmap[row], col, pixel_size(image));
+}
+
+void histogram(BMPFILE *image, BMPHISTO *histo, int channels){
+  struct histo_job job = {image, histo, channels};
+  int c;
+
+  memset(histo, 0, sizeof(BMPHISTO));
+  simd_kernels();//The luma tables
+  if(image->stats != NULL){
+    for(c=0; c<4; c++){
+      if(channels & (1 << c)){
+        memcpy(histo_channel(histo, c), histo_channel(&image->stats->histo, c)
+            , 256*sizeof(unsigned int));
+      }
+    }
+    return;
+  }
+  parallel_for(image->ih.biHeight, row_grain(image->ih.biWidth), histo_rows
+      , &job);
+}
+
+int plot_histogram(const BMPHISTO *histo, int channels, char *path
+        , int format, int *error){
+  if(format == BMP_PLOT_SVG){
+    return plot_svg(histo, channels, path, error);
+  }
+  if((format != BMP_PLOT_BMP)&&(format != BMP_PLOT_PNG)){
+    *error = UNKNOWN;
+    return -1;
+  }
+
+  RGBTRIPLE *canvas = malloc(BMP_PLOT_WIDTH*BMP_PLOT_HEIGHT*sizeof(RGBTRIPLE));
+  if(canvas == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+  plot_canvas(histo, channels, canvas);
+
+  int ret;
+  if(format == BMP_PLOT_BMP){
+    ret = plot_bmp(canvas, path, error);
+  }else{
+    ret = plot_png(canvas, path, error);
+  }
+  free(canvas);
+  return ret;
+}
+
+int generate_histogram(BMPFILE *image, char *path, int *error){
+  char file[PATH_MAX];
+
+  if(snprintf(file, PATH_MAX, "%s.png", path) >= PATH_MAX){
+    *error = ENAMETOOLONG;
+    return -1;
+  }
+
+  int channels = BMP_HISTO_R | BMP_HISTO_G | BMP_HISTO_B;
+  const BMPSTATS *stats = image_stats(image, error);
+  if(stats == NULL){
+    return -1;
+  }
+  return plot_histogram(&stats->histo, channels, file, BMP_PLOT_PNG, error);
+}
+
+const BMPSTATS *image_stats(BMPFILE *image, int *error){
+  if(image->stats != NULL){
+    return image->stats;
+  }
+
+  BMPSTATS *stats = malloc(sizeof(BMPSTATS));
+  if(stats == NULL){
+    *error = errno;
+    errno = 0;
+    return NULL;
+  }
+
+  //Everything else comes from the histograms
+  histogram(image, &stats->histo, BMP_HISTO_ALL);
+
+  int c, i;
+  for(c=0; c<4; c++){
+    const unsigned int *counts = histo_channel(&stats->histo, c);
+    double n = 0, sum = 0, sum_sq = 0;
+    stats->min[c] = 0;
+    stats->max[c] = 0;
+    for(i=0; i<256; i++){
+      if(counts[i]){
+        if(n == 0){
+          stats->min[c] = i;
+        }
+        stats->max[c] = i;
+        n += counts[i];
+        sum += (double)i*counts[i];
+        sum_sq += (double)i*i*counts[i];
+      }
+    }
+    stats->mean[c] = n ? sum/n : 0;
+    stats->variance[c] = n ? sum_sq/n - stats->mean[c]*stats->mean[c] : 0;
+  }
+
+  image->stats = stats;
+  return stats;
+}
+
+void invalidate_stats(BMPFILE *image){
+  BMPFILE *owner = (image->parent != NULL) ? image->parent : image;
+  BMPFILE *view;
+
+  //An image and its views show the same pixels
+  free(owner->stats);
+  owner->stats = NULL;
+  for(view=owner->views; view!=NULL; view=view->next_view){
+    free(view->stats);
+    view->stats = NULL;
+  }
+}
+
+int bmpdup(BMPFILE *source, BMPFILE *dest, int *error){
+  dest->fh = source->fh;
+  dest->ih = source->ih;
+  dest->aligment_size = source->aligment_size;
+  if(source->alignment){
+    if((dest->alignment = malloc(source->aligment_size)) == NULL){
+      *error = errno;
+      errno = 0;
+      return -1;
+    }
+    memcpy(dest->alignment, source->alignment, source->aligment_size);
+  }else{
+    dest->alignment = NULL;
+  }
+  dest->padding = source->padding;
+  dest->orientation = source->orientation;
+  dest->map = NULL;
+  dest->map_size = 0;
+  dest->stats = NULL;
+  dest->parent = NULL;
+  dest->views = NULL;
+  dest->next_view = NULL;
+  dest->pool = source->pool;
+
+  dest->palette = NULL;
+  if(source->palette != NULL){
+    if((dest->palette = malloc(PALETTE_SIZE*sizeof(RGBQUAD))) == NULL){
+      *error = errno;
+      errno = 0;
+      free(dest->alignment);
+      dest->alignment = NULL;
+      return -1;
+    }
+    memcpy(dest->palette, source->palette, PALETTE_SIZE*sizeof(RGBQUAD));
+  }
+
+  size_t row_size = row_bytes(source);
+  dest->bitmap = alloc_rows(dest->pool, source->ih.biHeight, row_size, 0
+      , error);
+  if(dest->bitmap == NULL){
+    free(dest->palette);
+    dest->palette = NULL;
+    if(dest->alignment != NULL){
+      free(dest->alignment);
+      dest->alignment = NULL;
+    }
     return -1;
   }
+  dest->pixels = (RGBTRIPLE *)((BYTE *)dest->bitmap
+      + bitmap_head(source->ih.biHeight));
+  dest->stride = row_stride(row_size);
+
+  memset(dest->planes, 0, sizeof(dest->planes));
+  if(source->planes[0] != NULL){//The copy keeps the layout
+    if(alloc_planes(dest->pool, dest->planes, source->ih.biHeight
+        , source->ih.biWidth, error)){
+      release_bitmap(dest); // back to dest->pool, as it came
+      free(dest->palette);
+      dest->palette = NULL;
+      free(dest->alignment);
+      dest->alignment = NULL;
+      return -1;
+    }
+    int c, i;
+    for(c=0; c<3; c++){
+      for(i=0; i<source->ih.biHeight; i++){
+        memcpy(dest->planes[c][i], source->planes[c][i], source->ih.biWidth);
+      }
+    }
+  }else if((source->stride == dest->stride)&&(source->ih.biHeight > 0)){
+    //The tail of the last row may be past the end of a cropped bitmap
+    memcpy(dest->pixels, source->pixels
+        , (source->ih.biHeight - 1)*dest->stride + row_size);
+  }else{
+    int i;
+    for(i = 0; i<source->ih.biHeight; i++){
+      memcpy(dest->bitmap[i], source->bitmap[i], row_size);
+    }
+  }
+  return 0;
+}
+
+int reduce(BMPFILE *image, int factor, int *error){
+  int new_width = image->ih.biWidth/factor;
+  int new_height = image->ih.biHeight/factor;
+  int new_XPelsPerMeter = image->ih.biXPelsPerMeter/factor;
+  int new_YPelsPerMeter = image->ih.biYPelsPerMeter/factor;
+
+  packed_layout(image);
+  int size = mixing_size(image, error);
+  if(size < 0){
+    return -1;
+  }
+
+  RGBTRIPLE **new_im;
+
+  new_im = resample_bitmap(image->pool, image->bitmap, new_height, new_width,
+                  image->ih.biHeight, image->ih.biWidth, size, error);
+
+  if(new_im == NULL){
+    return -1;
+  }
+
+  set_bitmap(image, new_im, new_height, new_width);
+
+  image->ih.biXPelsPerMeter = new_XPelsPerMeter;
+  image->ih.biYPelsPerMeter = new_YPelsPerMeter;
+  return 0;
+}
+
+int enlarge(BMPFILE *image, int factor, int *error){
+  int new_width = image->ih.biWidth*factor;
+  int new_height = image->ih.biHeight*factor;
+  int new_XPelsPerMeter = image->ih.biXPelsPerMeter*factor;
+  int new_YPelsPerMeter = image->ih.biYPelsPerMeter*factor;
+
+  packed_layout(image);
+  int size = mixing_size(image, error);
+  if(size < 0){
+    return -1;
+  }
+
+  RGBTRIPLE **new_im = NULL;
+
+  new_im = resample_bitmap(image->pool, image->bitmap, new_height, new_width,
+                  image->ih.biHeight, image->ih.biWidth, size, error);
+
+  if(new_im == NULL){
+    return -1;
+  }
+
+  set_bitmap(image, new_im, new_height, new_width);
+
+  image->ih.biXPelsPerMeter = new_XPelsPerMeter;
+  image->ih.biYPelsPerMeter = new_YPelsPerMeter;
+  return 0;
+}
+
+int resize(BMPFILE *image, int new_width, int new_height, int filter
+          , int *error){
+  int old_width = image->ih.biWidth;
+  int old_height = image->ih.biHeight;
+
+  if((new_width < 1)||(new_height < 1)||(old_width < 1)||(old_height < 1)
+      ||(filter < BMP_FILTER_AREA)||(filter > BMP_FILTER_LANCZOS3)){
+    *error = UNKNOWN;
+    return -1;
+  }
+
+  int size = mixing_size(image, error);
+  if(size < 0){
+    return -1;
+  }
+
+  if((new_width == old_width)&&(new_height == old_height)){
+    return 0;
+  }
+
+  struct resize_axis cols = {0, NULL, NULL};
+  struct resize_axis rows = {0, NULL, NULL};
+  RGBTRIPLE **layers[3];
+  RGBTRIPLE **new_bitmap[3] = {NULL, NULL, NULL};
+  int ret = -1;
+  int c, n;
+
+  if(resize_weights(old_width, new_width, filter, &cols)
+      ||resize_weights(old_height, new_height, filter, &rows)){
+    *error = errno;
+    errno = 0;
+    goto end;
+  }
+
+  n = image_layers(image, layers, &size);
+  for(c=0; c<n; c++){
+    new_bitmap[c] = resize_bitmap(image->pool, layers[c], old_height
+        , old_width, new_height, new_width, size, &cols, &rows, error);
+    if(new_bitmap[c] == NULL){
+      free_layers(new_bitmap, n);
+      goto end;
+    }
+  }
+
+  if(set_layers(image, new_bitmap, n, new_height, new_width, error)){
+    goto end;
+  }
+  image->ih.biXPelsPerMeter
+      = (long long)image->ih.biXPelsPerMeter*new_width/old_width;
+  image->ih.biYPelsPerMeter
+      = (long long)image->ih.biYPelsPerMeter*new_height/old_height;
+  ret = 0;
+
+end:
+  free(cols.first);
+  free(cols.weight);
+  free(rows.first);
+  free(rows.weight);
+  return ret;
+}
+
+int crop(BMPFILE *image, unsigned char x_1, unsigned char y_1
+        , unsigned char x_2, unsigned char y_2, int *error){
+
+  if((x_1>=x_2)||(y_1>=y_2)||(x_2>100)||(y_2>100)){
+    *error = UNKNOWN;
+    return -1;
+  }
+
+  int x1 = (image->ih.biWidth*x_1)/100;
+  int x2 = (image->ih.biWidth*x_2)/100;
+  int y1 = (image->ih.biHeight*y_1)/100;
+  int y2 = (image->ih.biHeight*y_2)/100;
+
+  return crop_rect(image, x1, y1, x2-x1, y2-y1, error);
+}
+
+int crop_rect(BMPFILE *image, int x, int y, int width, int height, int *error){
+  if(check_rect(image, x, y, width, height, error)){
+    return -1;
+  }
+
+  //The window is taken where the pending flips leave it
+  if(image->orientation & BMP_FLIP_H){
+    x = image->ih.biWidth - x - width;
+  }
+  if(image->orientation & BMP_FLIP_V){
+    y = image->ih.biHeight - y - height;
+  }
+
+  //Rows are bottom-up, y counts from the top
+  int bottom = image->ih.biHeight - y - height;
+  int i, c;
+  invalidate_stats(image);
+  for(i=0; i<height; i++){
+    image->bitmap[i] = PIXEL(image->bitmap[bottom+i], x, pixel_size(image));
+  }
+  for(c=0; (c<3)&&(image->planes[c] != NULL); c++){
+    for(i=0; i<height; i++){
+      image->planes[c][i] = image->planes[c][bottom+i] + x;
+    }
+  }
+  image->pixels = image->bitmap[0];
+  set_size(image, height, width);
+  return 0;
+}
+
+int view_image(BMPFILE *view, BMPFILE *image, int x, int y, int width
+        , int height, int *error){
+  if(check_rect(image, x, y, width, height, error)
+      ||resolve_orientation(image, error)){
+    return -1;
+  }
+
+  packed_layout(image);
+  memset(view, 0, sizeof(BMPFILE));
+  if((view->bitmap = malloc((height + 1) * sizeof(RGBTRIPLE *))) == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+
+  //Plain headers, the bytes between them and the pixels are not kept but
+  //for the palette, which the view gets a copy of
+  view->fh = image->fh;
+  view->ih = image->ih;
+  view->ih.biSize = sizeof(BITMAPINFOHEADER);
+  view->ih.biCompression = BI_RGB;
+  view->fh.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+  if(image->palette != NULL){
+    size_t colors = palette_colors(&image->ih)*sizeof(RGBQUAD);
+    view->palette = malloc(PALETTE_SIZE*sizeof(RGBQUAD));
+    view->alignment = calloc(1, colors);
+    if((view->palette == NULL)||(view->alignment == NULL)){
+      *error = errno;
+      errno = 0;
+      free(view->palette);
+      free(view->alignment);
+      free(view->bitmap);
+      memset(view, 0, sizeof(BMPFILE));
+      return -1;
+    }
+    memcpy(view->palette, image->palette, PALETTE_SIZE*sizeof(RGBQUAD));
+    view->aligment_size = colors;
+    view->fh.bfOffBits += colors;
+  }
+  view->fh.bfSize = view->fh.bfOffBits;
+  view->ih.biSizeImage = 0;
+  set_size(view, height, width);
+
+  int bottom = image->ih.biHeight - y - height;
+  int i;
+  for(i=0; i<height; i++){
+    view->bitmap[i] = PIXEL(image->bitmap[bottom+i], x, pixel_size(image));
+  }
+  view->pixels = view->bitmap[0];
+  view->stride = image->stride;
+
+  BMPFILE *owner = (image->parent != NULL) ? image->parent : image;
+  view->pool = owner->pool;
+  view->parent = owner;
+  view->next_view = owner->views;
+  owner->views = view;
+  return 0;
+}
+
+int detach_view(BMPFILE *view, int *error){
+  if(view->parent == NULL){
+    return 0;
+  }
+
+  int height = view->ih.biHeight;
+  size_t row_size = row_bytes(view);
+  RGBTRIPLE **bitmap = alloc_rows(view->pool, height, row_size, 0, error);
+  if(bitmap == NULL){
+    return -1;
+  }
+
+  int i;
+  for(i=0; i<height; i++){
+    memcpy(bitmap[i], view->bitmap[i], row_size);
+  }
+  unlink_view(view);
+  free(view->bitmap);
+  view->bitmap = bitmap;
+  view->pixels = (RGBTRIPLE *)((BYTE *)bitmap + bitmap_head(height));
+  view->stride = row_stride(row_size);
+  return 0;
+}
+
+int blur(BMPFILE *image, int s_kernel, int radius, int *error){
+  if(radius<2){
+    *error = UNKNOWN;
+    return -1;
+  }
+  int k;
+
+  if(s_kernel == 0){
+    s_kernel = 4*radius;
+  }
+  if(s_kernel < 1){
+    *error = UNKNOWN;
+    return -1;
+  }
+
+  int size = mixing_size(image, error);
+  if(size < 0){
+    return -1;
+  }
+
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+  int kern_len = s_kernel/2;
+
+  //The 2D kernel G(x)*G(y) is separable: 1D kernel and its prefix sums,
+  //used to renormalize the taps that fall inside the image near the edges
+  double *kernel = malloc((2*s_kernel + 1) * sizeof(double));
+  if(kernel == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+  double *prefix = kernel + s_kernel;
+
+  prefix[0] = 0;
+  for(k=0; k<s_kernel; k++){
+    kernel[k] = _G((double)(k-kern_len), radius);
+    prefix[k+1] = prefix[k] + kernel[k];
+  }
+
+  RGBTRIPLE **layers[3];
+  RGBTRIPLE **new_bitmap[3] = {NULL, NULL, NULL};
+  int c, n = image_layers(image, layers, &size);
+  for(c=0; c<n; c++){
+    new_bitmap[c] = alloc_layer(image->pool, height, width, size, error);
+    if(new_bitmap[c] == NULL){
+      free_layers(new_bitmap, n);
+      free(kernel);
+      return -1;
+    }
+  }
+
+  struct blur_job job = {NULL, NULL, height, width, size, kernel, prefix
+      , s_kernel, 0};
+  for(c=0; (c<n)&&(job.error == 0); c++){
+    job.src = layers[c];
+    job.dst = new_bitmap[c];
+    parallel_for(height, row_grain(width), blur_rows, &job);
+  }
+
+  free(kernel);
+
+  if(job.error){
+    free_layers(new_bitmap, n);
+    *error = job.error;
+    return -1;
+  }
+
+  return set_layers(image, new_bitmap, n, height, width, error);
+}
+
+int fast_blur(BMPFILE *image, int radius, int *error){
+  if(radius<2){
+    *error = UNKNOWN;
+    return -1;
+  }
+
+  int size = mixing_size(image, error);
+  if(size < 0){
+    return -1;
+  }
+
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+  RGBTRIPLE **layers[3];
+  RGBTRIPLE **new_bitmap[3] = {NULL, NULL, NULL};
+  int c, layer_n = image_layers(image, layers, &size);
+  struct box_job job = {NULL, NULL, height, width, size, {0}, 0};
+  int n;
+
+  //Sizes of the boxes whose succession approaches a Gaussian of sigma radius
+  double ideal = sqrt(12.0*radius*radius/BLUR_BOXES + 1);
+  int wl = (int)ideal;
+  if(wl % 2 == 0){
+    wl--;
+  }
+  int m = round((12.0*radius*radius - BLUR_BOXES*wl*wl - 4*BLUR_BOXES*wl
+      - 3*BLUR_BOXES)/(-4.0*wl - 4));
+  for(n=0; n<BLUR_BOXES; n++){
+    job.boxes[n] = ((n < m) ? wl : wl + 2)/2;
+  }
+
+  for(c=0; c<layer_n; c++){
+    new_bitmap[c] = alloc_layer(image->pool, height, width, size, error);
+    if(new_bitmap[c] == NULL){
+      free_layers(new_bitmap, layer_n);
+      return -1;
+    }
+  }
+
+  //Horizontal boxes in place by bands of rows, then the vertical ones by
+  //bands of columns, ping-pong between the bitmap and new_bitmap
+  invalidate_stats(image);
+  for(c=0; (c<layer_n)&&(job.error == 0); c++){
+    job.src = layers[c];
+    job.dst = new_bitmap[c];
+    parallel_for(height, row_grain(width), box_rows, &job);
+    if(job.error == 0){
+      parallel_for((size_t)width*size
+          , max(64, size*PARALLEL_GRAIN/(height + 1)), box_columns, &job);
+    }
+  }
+
+  if(job.error){
+    free_layers(new_bitmap, layer_n);
+    *error = job.error;
+    return -1;
+  }
+
+  if(BLUR_BOXES % 2){//The last vertical pass wrote into new_bitmap
+    return set_layers(image, new_bitmap, layer_n, height, width, error);
+  }
+  free_layers(new_bitmap, layer_n);
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Static function definitions                                               */
+/*---------------------------------------------------------------------------*/
+
+RGBTRIPLE **generate_bitmap(int new_height, int new_width, int *error){
+  RGBTRIPLE **new_bitmap = alloc_bitmap(NULL, new_height, new_width, 0, error);
+  if(new_bitmap == NULL){
+    return NULL;
+  }
+  memset((BYTE *)new_bitmap + bitmap_head(new_height), 0
+      , new_height*row_stride(new_width*sizeof(RGBTRIPLE)));
+  return new_bitmap;
+}
+
+static size_t row_stride(size_t row_size){
+  return (row_size + BMP_ROW_ALIGN - 1)/BMP_ROW_ALIGN*BMP_ROW_ALIGN;
+}
+
+static size_t bitmap_head(int height){
+  size_t head = height * sizeof(RGBTRIPLE *);
+  return (head + BMP_BUFFER_ALIGN - 1)/BMP_BUFFER_ALIGN*BMP_BUFFER_ALIGN;
+}
+
+static RGBTRIPLE **alloc_bitmap(BMPPOOL *pool, int height, int width
+        , size_t slack, int *error){
+  if(width < 0){
+    *error = UNKNOWN;
+    return NULL;
+  }
+  return alloc_rows(pool, height, width*sizeof(RGBTRIPLE), slack, error);
+}
+
+//Rows of row_size bytes, whatever the size of their pixels, taken from pool
+//if it keeps a big enough block
+static RGBTRIPLE **alloc_rows(BMPPOOL *pool, int height, size_t row_size
+        , size_t slack, int *error){
+  if(height < 0){
+    *error = UNKNOWN;
+    return NULL;
+  }
+
+  //One block: its header, the row pointers and the aligned pixel buffer
+  size_t head = bitmap_head(height);
+  size_t stride = row_stride(row_size);
+  size_t size = head + height*stride + slack;
+  struct pool_block *block = pool_take(pool, size);
+  if(block == NULL){
+    void *memory = NULL;
+    int ret = posix_memalign(&memory, BMP_BUFFER_ALIGN
+        , BMP_BUFFER_ALIGN + size);
+    if(ret){
+      *error = ret;
+      return NULL;
+    }
+    block = memory;
+    block->size = size;
+  }
+  block->pool = pool;
+
+  RGBTRIPLE **new_bitmap = (RGBTRIPLE **)((BYTE *)block + BMP_BUFFER_ALIGN);
+  BYTE *pixels = (BYTE *)new_bitmap + head;
+  int i;
+  for(i=0; i<height; i++){
+    new_bitmap[i] = (RGBTRIPLE *)(pixels + i*stride);
+  }
+  return new_bitmap;
+}
+
+static struct pool_block *bitmap_block(RGBTRIPLE **bitmap){
+  return (struct pool_block *)((BYTE *)bitmap - BMP_BUFFER_ALIGN);
+}
+
+//The smallest kept block of at least size bytes, NULL if none is close enough
+static struct pool_block *pool_take(BMPPOOL *pool, size_t size){
+  if(pool == NULL){
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  struct pool_block **best = NULL;
+  struct pool_block **link;
+  for(link=&pool->blocks; *link!=NULL; link=&(*link)->next){
+    size_t have = (*link)->size;
+    if((have >= size)&&(have/POOL_WASTE <= size)
+        &&((best == NULL)||(have < (*best)->size))){
+      best = link;
+    }
+  }
+  struct pool_block *block = NULL;
+  if(best != NULL){
+    block = *best;
+    *best = block->next;
+    pool->kept -= block->size;
+    pool->hits++;
+  }else{
+    pool->misses++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return block;
+}
+
+//Keeps the block, making room by freeing the oldest ones. Returns -1 if it
+//is bigger than the whole pool
+static int pool_give(BMPPOOL *pool, struct pool_block *block){
+  if(block->size > pool->limit){
+    return -1;
+  }
+
+  struct pool_block *evicted = NULL;
+  pthread_mutex_lock(&pool->lock);
+  while(pool->kept + block->size > pool->limit){
+    struct pool_block **last = &pool->blocks;
+    while((*last)->next != NULL){
+      last = &(*last)->next;
+    }
+    pool->kept -= (*last)->size;
+    (*last)->next = evicted;
+    evicted = *last;
+    *last = NULL;
+  }
+  block->next = pool->blocks;
+  pool->blocks = block;
+  pool->kept += block->size;
+  pthread_mutex_unlock(&pool->lock);
+
+  while(evicted != NULL){//Freed out of the lock
+    struct pool_block *next = evicted->next;
+    free(evicted);
+    evicted = next;
+  }
+  return 0;
+}
+
+void free_bitmap(RGBTRIPLE **bitmap){
+  if(bitmap == NULL){
+    return;
+  }
+  struct pool_block *block = bitmap_block(bitmap);
+  if((block->pool == NULL)||pool_give(block->pool, block)){
+    free(block);
+  }
+}
+
+static void release_bitmap(BMPFILE *image){
+  detach_views(image);
+  if(image->parent != NULL){//A view, only the row pointers were allocated
+    unlink_view(image);
+    free(image->bitmap);
+  }else if(image->map != NULL){//Only the row pointers were allocated
+    free(image->bitmap);
+    if(image->map_size){//Not if the buffer is the caller's
+      munmap(image->map, image->map_size);
+    }
+    image->map = NULL;
+    image->map_size = 0;
+  }else if(image->bitmap != NULL){
+    free_bitmap(image->bitmap);
+  }
+  image->bitmap = NULL;
+  image->pixels = NULL;
+}
+
+static void set_bitmap(BMPFILE *image, RGBTRIPLE **bitmap, int height
+        , int width){
+  invalidate_stats(image);
+
+  if(((image->parent != NULL)||(image->views != NULL))
+      &&(height == image->ih.biHeight)&&(width == image->ih.biWidth)){
+    //The pixels are shared, the result is written where they are
+    int i;
+    for(i=0; i<height; i++){
+      memcpy(image->bitmap[i], bitmap[i], (size_t)width*pixel_size(image));
+    }
+    free_bitmap(bitmap);
+    return;
+  }
+
+  release_bitmap(image);
+
+  image->bitmap = bitmap;
+  image->pixels = (RGBTRIPLE *)((BYTE *)bitmap + bitmap_head(height));
+  image->stride = row_stride((size_t)width*pixel_size(image));
+  set_size(image, height, width);
+}
+
+//Rows of a bitmap of size byte pixels, those of a plane start aligned
+static RGBTRIPLE **alloc_layer(BMPPOOL *pool, int height, int width, int size
+        , int *error){
+  size_t row_size = (size_t)width*size;
+  if(size == 1){
+    row_size = (row_size + BMP_BUFFER_ALIGN - 1)/BMP_BUFFER_ALIGN
+        *BMP_BUFFER_ALIGN;
+  }
+  return alloc_rows(pool, height, row_size, 0, error);
+}
+
+static int alloc_planes(BMPPOOL *pool, BYTE **planes[3], int height
+        , int width, int *error){
+  int c;
+
+  memset(planes, 0, 3*sizeof(BYTE **));
+  for(c=0; c<3; c++){
+    planes[c] = (BYTE **)alloc_layer(pool, height, width, 1, error);
+    if(planes[c] == NULL){
+      free_planes(planes);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void free_planes(BYTE **planes[3]){
+  int c;
+  for(c=0; c<3; c++){
+    free_bitmap((RGBTRIPLE **)planes[c]);
+    planes[c] = NULL;
+  }
+}
+
+static void free_layers(RGBTRIPLE **layers[3], int n){
+  int c;
+  for(c=0; c<n; c++){
+    free_bitmap(layers[c]);
+    layers[c] = NULL;
+  }
+}
+
+//What a filter goes through: the bitmap, or the three planes as bitmaps of
+//1 byte pixels, then size becomes 1. Returns how many
+static int image_layers(BMPFILE *image, RGBTRIPLE **layers[3], int *size){
+  int c;
+
+  if(image->planes[0] == NULL){
+    layers[0] = image->bitmap;
+    return 1;
+  }
+  for(c=0; c<3; c++){
+    layers[c] = (RGBTRIPLE **)image->planes[c];
+  }
+  *size = 1;
+  return 3;
+}
+
+//Replaces the layers of the image by the n new ones, of height x width
+static int set_layers(BMPFILE *image, RGBTRIPLE **layers[3], int n
+        , int height, int width, int *error){
+  int c;
+
+  if(n == 1){
+    set_bitmap(image, layers[0], height, width);
+    return 0;
+  }
+
+  //The bitmap of a planar image only follows the size
+  if((height != image->ih.biHeight)||(width != image->ih.biWidth)){
+    RGBTRIPLE **bitmap = alloc_bitmap(image->pool, height, width, 0, error);
+    if(bitmap == NULL){
+      free_layers(layers, n);
+      return -1;
+    }
+    set_bitmap(image, bitmap, height, width);
+  }
+  free_planes(image->planes);
+  for(c=0; c<3; c++){
+    image->planes[c] = (BYTE **)layers[c];
+  }
+  invalidate_stats(image);
+  return 0;
+}
+
+static void merge_planes(BMPFILE *image){
+  parallel_for(image->ih.biHeight, row_grain(image->ih.biWidth), merge_rows
+      , image);
+}
+
+static void packed_layout(BMPFILE *image){
+  if(image->planes[0] != NULL){
+    merge_planes(image);
+    free_planes(image->planes);
+  }
+}
+
+static void set_size(BMPFILE *image, int height, int width){
+  image->ih.biWidth = width;
+  image->ih.biHeight = height;
+
+  size_t row_size = row_bytes(image);
+  image->padding = row_padding(row_size);
+
+  int old_biSizeImage = image->ih.biSizeImage;
+  image->ih.biSizeImage = image->ih.biHeight * (row_size + image->padding);
+
+  image->fh.bfSize = image->fh.bfSize + image->ih.biSizeImage
+      - old_biSizeImage;
+}
+
+static int check_rect(BMPFILE *image, int x, int y, int width, int height
+        , int *error){
+  if((x < 0)||(y < 0)||(width <= 0)||(height <= 0)
+      ||(x > image->ih.biWidth - width)||(y > image->ih.biHeight - height)){
+    *error = UNKNOWN;
+    return -1;
+  }
+  return 0;
+}
+
+static void unlink_view(BMPFILE *view){
+  BMPFILE **link = &view->parent->views;
+  while(*link != view){
+    link = &(*link)->next_view;
+  }
+  *link = view->next_view;
+  view->parent = NULL;
+  view->next_view = NULL;
+}
+
+static void detach_views(BMPFILE *image){
+  int error;
+
+  while(image->views != NULL){
+    BMPFILE *view = image->views;
+    if(detach_view(view, &error)){//Without memory the view is left empty
+      unlink_view(view);
+      free(view->bitmap);
+      view->bitmap = NULL;
+      view->pixels = NULL;
+      set_size(view, 0, 0);
+    }
+  }
+}
+
+static void for_each_span(BMPFILE *image, span_fn fn, const void *arg){
+  struct span_job job = {image, fn, arg, pixel_size(image)};
+  size_t width = image->ih.biWidth;
+
+  invalidate_stats(image);
+
+  if(image->palette != NULL){//8 bit, only the colours of the palette change
+    RGBTRIPLE colours[PALETTE_SIZE];
+    pack_quads(image->palette, colours, PALETTE_SIZE);
+    fn(colours, PALETTE_SIZE, arg);
+    unpack_quads(colours, image->palette, PALETTE_SIZE);
+    return;
+  }
+
+  if(image->planes[0] != NULL){//Blocks of pixels are interleaved for fn
+    parallel_for(image->ih.biHeight, row_grain(width), span_planes, &job);
+  }else if(image->stride == width*job.size){//Packed rows, bands of pixels
+    parallel_for(width*image->ih.biHeight, PARALLEL_GRAIN, span_pixels, &job);
+  }else{
+    parallel_for(image->ih.biHeight, row_grain(width), span_rows, &job);
+  }
+}
+
+//Planar images skip the interleaving, hsv goes straight through the planes
+static void for_each_hsv(BMPFILE *image, span_fn fn, hsv_fn hsv
+        , const void *arg){
+  struct hsv_job job = {image, hsv, arg};
+
+  if(image->planes[0] == NULL){
+    for_each_span(image, fn, arg);
+    return;
+  }
+  invalidate_stats(image);
+  parallel_for(image->ih.biHeight, row_grain(image->ih.biWidth), hsv_planes
+      , &job);
+}
+
+static void hsv_span(RGBTRIPLE *span, size_t n, hsv_fn fn, const void *arg){
+  const struct span_kernels *k = simd_kernels();
+  WORD h[HSV_BLOCK], s[HSV_BLOCK];
+  BYTE v[HSV_BLOCK];
+  size_t i, m;
+
+  for(i=0; i<n; i+=m){
+    m = (n - i < HSV_BLOCK) ? n - i : HSV_BLOCK;
+    k->to_hsv(span + i, h, s, v, m);
+    fn(h, s, v, m, arg);
+    k->to_rgb(h, s, v, span + i, m);
+  }
+}
+
+static void run_span(const struct span_job *job, BYTE *span, size_t n){
+  const struct span_kernels *k;
+  RGBTRIPLE block[CHAIN_BLOCK];
+  size_t i, m;
+
+  if(job->size == sizeof(RGBTRIPLE)){
+    job->fn((RGBTRIPLE *)span, n, job->arg);
+    return;
+  }
+
+  //32 bit pixels go through the filter by blocks of 24 bit copies
+  k = simd_kernels();
+  for(i=0; i<n; i+=m){
+    RGBQUAD *quads = (RGBQUAD *)span + i;
+    m = (n - i < CHAIN_BLOCK) ? n - i : CHAIN_BLOCK;
+    k->pack(quads, block, m);
+    job->fn(block, m, job->arg);
+    k->unpack(block, quads, m);
+  }
+}
+
+static void zero_span(RGBTRIPLE *span, size_t n, const void *arg){
+  int mask = *(const int *)arg;
+  size_t i;
+  for(i=0; i<n; i++){
+    span[i].b &=  mask      & 0xFF;
+    span[i].g &= (mask>>8)  & 0xFF;
+    span[i].r &= (mask>>16) & 0xFF;
+  }
+}
+
+//Whether the fixed point sum s, a bit short of the exact one, is so close
+//below a whole number that the exact one may reach it
+static inline int dot_near(const struct colour_dot *dot, int s){
+  return ((DWORD)s << (32 - DOT_BITS)) >= dot->limit;
+}
+
+//The doubles of a row of a matrix truncated, in integers. Only near whole
+//numbers the doubles have to tell their rounding
+static inline int dot_exact(const struct colour_dot *dot, int r, int g, int b){
+  int s = r*dot->fixed[0] + g*dot->fixed[1] + b*dot->fixed[2];
+
+  if(dot_near(dot, s)){
+    return r*dot->coef[0] + g*dot->coef[1] + b*dot->coef[2];
+  }
+  return s >> DOT_BITS;
+}
+
+//Rounded and saturated to a level, as the saturating 16 bit SIMD lanes do
+static inline int dot_fast(const struct colour_dot *dot, int r, int g, int b){
+  int s = dot->table[0][r] + dot->table[1][g] + dot->table[2][b] + 128;
+  return ((s > 0xFFFF) ? 0xFFFF : s) >> 8;
+}
+
+static inline int luma_of(int r, int g, int b, int fast){
+  return fast ? dot_fast(&luma_dot, r, g, b) : dot_exact(&luma_dot, r, g, b);
+}
+
+static void sepia_span(RGBTRIPLE *span, size_t n, const void *arg){
+  int r,g,b;
+  size_t i;
+
+  if(precision_mode == BMP_PRECISION_FAST){
+    for(i=0; i<n; i++){
+      r = dot_fast(&sepia_dot[0], span[i].r, span[i].g, span[i].b);
+      g = dot_fast(&sepia_dot[1], span[i].r, span[i].g, span[i].b);
+      b = dot_fast(&sepia_dot[2], span[i].r, span[i].g, span[i].b);
+
+      span[i].r = r;
+      span[i].g = g;
+      span[i].b = b;
+    }
+    return;
+  }
+  for(i=0; i<n; i++){
+    r = dot_exact(&sepia_dot[0], span[i].r, span[i].g, span[i].b);
+    g = dot_exact(&sepia_dot[1], span[i].r, span[i].g, span[i].b);
+    b = dot_exact(&sepia_dot[2], span[i].r, span[i].g, span[i].b);
+
+    span[i].r = (r>255) ? 255 : r;
+    span[i].g = (g>255) ? 255 : g;
+    span[i].b = (b>255) ? 255 : b;
+  }
+}
+
+static void saturation_span(RGBTRIPLE *span, size_t n, const void *arg){
+  hsv_span(span, n, saturation_hsv, arg);
+}
+
+static void brightness_span(RGBTRIPLE *span, size_t n, const void *arg){
+  hsv_span(span, n, brightness_hsv, arg);
+}
+
+static void chroma_span(RGBTRIPLE *span, size_t n, const void *arg){
+  hsv_span(span, n, chroma_hsv, arg);
+}
+
+static void saturation_hsv(WORD *h, WORD *s, BYTE *v, size_t n
+        , const void *arg){
+  long long factor = percent_factor(*(const int *)arg);
+  size_t j;
+
+  for(j=0; j<n; j++){
+    long long sat = (s[j]*factor + (1 << 15)) >> 16;
+    s[j] = (sat > BMP_SAT_MAX) ? BMP_SAT_MAX : sat;
+  }
+}
+
+static void brightness_hsv(WORD *h, WORD *s, BYTE *v, size_t n
+        , const void *arg){
+  long long factor = percent_factor(*(const int *)arg);
+  size_t j;
+
+  for(j=0; j<n; j++){
+    long long val = (v[j]*factor + (1 << 15)) >> 16;
+    v[j] = (val > 255) ? 255 : val;
+  }
+}
+
+static void chroma_hsv(WORD *h, WORD *s, BYTE *v, size_t n, const void *arg){
+  int angle = ((*(const int *)arg)%360 + 360)%360;
+  int shift = (angle*BMP_HUE_SECTOR + 30)/60;
+  size_t j;
+
+  for(j=0; j<n; j++){
+    int hue = h[j] + shift;
+    h[j] = (hue >= BMP_HUE_MAX) ? hue - BMP_HUE_MAX : hue;
+  }
+}
+
+static void bitone_span(RGBTRIPLE *span, size_t n, const void *arg){
+  const struct bitone_args *args = arg;
+  size_t i;
+  for(i=0; i<n; i++){
+    if((span[i].r + span[i].g + span[i].b) < args->threshold){
+      span[i] = args->dark;
+    }else{
+      span[i] = args->light;
+    }
+  }
+}
+
+static void grayscale_span(RGBTRIPLE *span, size_t n, const void *arg){
+  int fast = (precision_mode == BMP_PRECISION_FAST);
+  BYTE result;
+  size_t i;
+
+  switch (*(const char *)arg){
+    case 'r':
+    for(i=0; i<n; i++){
+      result = span[i].r;
+      span[i].b = result;
+      span[i].g = result;
+    }
+    break;
+
+    case 'g':
+    for(i=0; i<n; i++){
+      result = span[i].g;
+      span[i].r = result;
+      span[i].g = result;
+    }
+    break;
+
+    case 'b':
+    for(i=0; i<n; i++){
+      result = span[i].b;
+      span[i].r = result;
+      span[i].g = result;
+    }
+    break;
+
+    case 'y':
+    for(i=0; i<n; i++){
+      result = luma_of(span[i].r, span[i].g, span[i].b, fast);
+      span[i].r = result;
+      span[i].g = result;
+      span[i].b = result;
+    }
+    break;
+  }
+}
+
+static inline void hsv_pixel(int r, int g, int b, WORD *h, WORD *s
+        , BYTE *v){
+  int max = (r > g) ? r : g;
+  int min = (r < g) ? r : g;
+  max = (b > max) ? b : max;
+  min = (b < min) ? b : min;
+  int delta = max - min;
+
+  //Masks instead of branches, the maximum channel is hard to predict
+  int rm = -(max == r);
+  int gm = -(max == g) & ~rm;
+  int bm = ~(rm | gm);
+  int diff = (rm & (g - b)) | (gm & (b - r)) | (bm & (r - g));
+  int hue = ((gm & 2*BMP_HUE_SECTOR) | (bm & 4*BMP_HUE_SECTOR))
+      + ((diff*hsv_recip[delta] + (1 << (HSV_RECIP_BITS - 11)))
+      >> (HSV_RECIP_BITS - 10));
+
+  *h = hue + ((hue >> 31) & BMP_HUE_MAX);
+  *s = (delta*hsv_recip[max] + (1 << (HSV_RECIP_BITS - 13)))
+      >> (HSV_RECIP_BITS - 12);
+  *v = max;
+}
+
+static inline void rgb_pixel(int h, int s, int v, BYTE *r, BYTE *g
+        , BYTE *b){
+  const int one = BMP_SAT_MAX*BMP_HUE_SECTOR;
+  int sector = (h/BMP_HUE_SECTOR)%6;
+  int f = h%BMP_HUE_SECTOR;
+  int sat = (s > BMP_SAT_MAX) ? BMP_SAT_MAX : s;
+  int vpqt[4];
+
+  vpqt[0] = v;
+  vpqt[1] = (v*(BMP_SAT_MAX - sat) + BMP_SAT_MAX/2)/BMP_SAT_MAX;
+  vpqt[2] = (v*(one - sat*f) + one/2)/one;
+  vpqt[3] = (v*(one - sat*(BMP_HUE_SECTOR - f)) + one/2)/one;
+
+  *r = vpqt[hsv_sector[sector][0]];
+  *g = vpqt[hsv_sector[sector][1]];
+  *b = vpqt[hsv_sector[sector][2]];
+}
+
+static void to_hsv_span(const RGBTRIPLE *src, WORD *h, WORD *s, BYTE *v
+          , size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    hsv_pixel(src[i].r, src[i].g, src[i].b, h + i, s + i, v + i);
+  }
+}
+
+static void to_rgb_span(const WORD *h, const WORD *s, const BYTE *v
+          , RGBTRIPLE *dst, size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    rgb_pixel(h[i], s[i], v[i], &dst[i].r, &dst[i].g, &dst[i].b);
+  }
+}
+
+static void to_hsv_planes(const BYTE *const *plane, WORD *h, WORD *s, BYTE *v
+          , size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    hsv_pixel(plane[2][i], plane[1][i], plane[0][i], h + i, s + i, v + i);
+  }
+}
+
+static void to_rgb_planes(const WORD *h, const WORD *s, const BYTE *v
+          , BYTE *const *plane, size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    rgb_pixel(h[i], s[i], v[i], plane[2] + i, plane[1] + i, plane[0] + i);
+  }
+}
+
+static void split_span(const RGBTRIPLE *src, BYTE *const *plane, size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    plane[0][i] = src[i].b;
+    plane[1][i] = src[i].g;
+    plane[2][i] = src[i].r;
+  }
+}
+
+static void merge_span(const BYTE *const *plane, RGBTRIPLE *dst, size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    dst[i].b = plane[0][i];
+    dst[i].g = plane[1][i];
+    dst[i].r = plane[2][i];
+  }
+}
+
+static void taps_span(double *sum, const double *src, double k, size_t n){
+  size_t x;
+  for(x=0; x<n; x++){
+    sum[x] += k * src[x];
+  }
+}
+
+static void taps8_span(double *sum, const BYTE *src, double k, size_t n){
+  size_t x;
+  for(x=0; x<n; x++){
+    sum[x] += k * (double)src[x];
+  }
+}
+
+static void norm_span(const double *sum, BYTE *dst, double weight, size_t n){
+  size_t x;
+  for(x=0; x<n; x++){
+    double pixel = sum[x]/weight;
+    pixel = (pixel > 255 ? 255 : (pixel < 0 ? 0 : pixel));
+    dst[x] = pixel;
+  }
+}
+
+static void invert_span(RGBTRIPLE *span, size_t n, const void *arg){
+  size_t i;
+  for(i=0; i<n; i++){
+    span[i].r = 255 - span[i].r;
+    span[i].g = 255 - span[i].g;
+    span[i].b = 255 - span[i].b;
+  }
+}
+
+static void transpose_block(const RGBTRIPLE *const *src
+        , RGBTRIPLE *const *dst){
+  int k, m;
+  for(k=0; k<ROTATE_BLOCK; k++){
+    for(m=0; m<ROTATE_BLOCK; m++){
+      dst[k][m] = src[m][k];
+    }
+  }
+}
+
+static void flip_span(RGBTRIPLE *a, RGBTRIPLE *b, size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    RGBTRIPLE tmp = a[i];
+    a[i] = *(b - 1 - i);
+    *(b - 1 - i) = tmp;
+  }
+}
+
+//Swaps the n bytes after a and after b
+static void swap_span(void *a, void *b, size_t n){
+  BYTE tmp[FLIP_CHUNK*sizeof(RGBTRIPLE)];
+  BYTE *p = a, *q = b;
+  size_t i, k;
+
+  for(i=0; i<n; i+=k){
+    k = (n - i < sizeof(tmp)) ? n - i : sizeof(tmp);
+    memcpy(tmp, p + i, k);
+    memcpy(p + i, q + i, k);
+    memcpy(q + i, tmp, k);
+  }
+}
+
+static void transpose_block8(const RGBTRIPLE *const *src
+        , RGBTRIPLE *const *dst){
+  int k, m;
+  for(k=0; k<ROTATE_BLOCK; k++){
+    for(m=0; m<ROTATE_BLOCK; m++){
+      ((BYTE *)dst[k])[m] = ((const BYTE *)src[m])[k];
+    }
+  }
+}
+
+static void transpose_block32(const RGBTRIPLE *const *src
+        , RGBTRIPLE *const *dst){
+  int k, m;
+  for(k=0; k<ROTATE_BLOCK; k++){
+    for(m=0; m<ROTATE_BLOCK; m++){
+      ((RGBQUAD *)dst[k])[m] = ((const RGBQUAD *)src[m])[k];
+    }
+  }
+}
+
+static void flip_span8(RGBTRIPLE *a, RGBTRIPLE *b, size_t n){
+  BYTE *p = (BYTE *)a;
+  BYTE *q = (BYTE *)b;
+  size_t i;
+  for(i=0; i<n; i++){
+    BYTE tmp = p[i];
+    p[i] = *(q - 1 - i);
+    *(q - 1 - i) = tmp;
+  }
+}
+
+static void flip_span32(RGBTRIPLE *a, RGBTRIPLE *b, size_t n){
+  RGBQUAD *p = (RGBQUAD *)a;
+  RGBQUAD *q = (RGBQUAD *)b;
+  size_t i;
+  for(i=0; i<n; i++){
+    RGBQUAD tmp = p[i];
+    p[i] = *(q - 1 - i);
+    *(q - 1 - i) = tmp;
+  }
+}
+
+static void pack_quads(const RGBQUAD *src, RGBTRIPLE *dst, size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    dst[i].b = src[i].b;
+    dst[i].g = src[i].g;
+    dst[i].r = src[i].r;
+  }
+}
+
+static void unpack_quads(const RGBTRIPLE *src, RGBQUAD *dst, size_t n){
+  size_t i;
+  for(i=0; i<n; i++){
+    dst[i].b = src[i].b;
+    dst[i].g = src[i].g;
+    dst[i].r = src[i].r;
+  }
+}
+
+RGBTRIPLE **rotate_bitmap(BMPPOOL *pool, RGBTRIPLE **bitmap, int height
+        , int width, int size, char motion, int *error){
+  int new_width = height;
+  int new_height = width;
+
+  //Every pixel is written, there is no need to clear it
+  RGBTRIPLE **new_bitmap = alloc_rows(pool, new_height
+      , (size_t)new_width*size, 0, error);
+  if(new_bitmap == NULL){
+    return NULL;
+  }
+
+  struct copy_job job = {bitmap, new_bitmap, height, width, size, motion};
+  copy_kernels(&job);
+  parallel_for((new_height + ROTATE_TILE - 1)/ROTATE_TILE
+      , row_grain(new_width)/ROTATE_TILE + 1, rotate_rows, &job);
+  return new_bitmap;
+}
+
+static void flip_bitmap(RGBTRIPLE **bitmap, int height, int width, int size
+        , char motion){
+  struct copy_job job = {bitmap, bitmap, height, width, size, motion};
+  copy_kernels(&job);
+
+  //'v' reverses every row, 'h' and 'u' go through pairs of opposite rows
+  size_t n = (motion == 'v') ? (size_t)height : (size_t)(height + 1)/2;
+  parallel_for(n, row_grain(width), flip_rows, &job);
+}
+
+//mirror and half turns, in place
+static void flip_image(BMPFILE *image, char motion){
+  RGBTRIPLE **layers[3];
+  int size = pixel_size(image);
+  int c, n = image_layers(image, layers, &size);
+
+  invalidate_stats(image);
+  for(c=0; c<n; c++){
+    flip_bitmap(layers[c], image->ih.biHeight, image->ih.biWidth, size
+        , motion);
+  }
+}
+
+//Flips 'h', 'v' or both ('u') the image as shown. Only the pixels shared
+//with views are swapped, the rest of the images change their orientation
+static void orient(BMPFILE *image, char motion){
+  if((image->parent != NULL)||(image->views != NULL)){
+    flip_image(image, motion);
+    return;
+  }
+  //'h' reflects across the horizontal axis, so the rows change their order
+  image->orientation ^= (motion == 'h') ? BMP_FLIP_V
+      : ((motion == 'v') ? BMP_FLIP_H : BMP_FLIP_H | BMP_FLIP_V);
+}
+
+static void reverse_row(const BYTE *src, BYTE *dst, int width, int size){
+  int j;
+  for(j=0; j<width; j++){
+    memcpy(dst + (size_t)j*size, src + (size_t)(width - 1 - j)*size, size);
+  }
+}
+
+static void copy_kernels(struct copy_job *job){
+  const struct span_kernels *k = simd_kernels();
+
+  if(job->size == 1){
+    job->transpose = k->transpose8;
+    job->flip = k->flip8;
+  }else if(job->size == 4){
+    job->transpose = k->transpose32;
+    job->flip = k->flip32;
+  }else{
+    job->transpose = k->transpose;
+    job->flip = k->flip;
+  }
+}
+
+static void parse_headers(const BYTE *headers, BITMAPFILEHEADER *fh
+        , BITMAPINFOHEADER *ih){
+  memcpy(fh, headers, sizeof(BITMAPFILEHEADER));
+  memcpy(ih, headers + sizeof(BITMAPFILEHEADER), sizeof(BITMAPINFOHEADER));
+}
+
+//The file header of every loader: "BM", the pixels after the headers and a
+//bfSize, if it is set (streams over 4 GiB leave it 0), not before them
+static int check_file(const BITMAPFILEHEADER *fh){
+  DWORD headers = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
+
+  if((fh->bfType != 0x4D42)||(fh->bfOffBits < headers)
+      ||(fh->bfSize && (fh->bfSize < fh->bfOffBits))){
+    return CANNOT_LOAD;
+  }
+  return 0;
+}
+
+static int check_header(const BITMAPINFOHEADER *ih){
+  if((ih->biBitCount != 8)&&(ih->biBitCount != 24)
+      &&(ih->biBitCount != 32)&&((ih->biBitCount != 4)
+      ||(ih->biCompression != BI_RLE4))){
+    return NOT_SPT_FMT;
+  }
+  switch(ih->biCompression){
+    case BI_RGB:
+      if(ih->biBitCount == 4){
+        return NOT_SPT_FMT;
+      }
+      break;
+    case BI_BITFIELDS:
+      if(ih->biBitCount != 32){
+        return NOT_SPT_FMT;
+      }
+      break;
+    case BI_RLE8:
+      if(ih->biBitCount != 8){
+        return NOT_SPT_FMT;
+      }
+      break;
+    case BI_RLE4:
+      if(ih->biBitCount != 4){
+        return NOT_SPT_FMT;
+      }
+      break;
+    default://Other compressions
+      return NOT_SPT_FMT;
+  }
+  if((ih->biSize < sizeof(BITMAPINFOHEADER))
+      ||((ih->biBitCount <= 8)&&(ih->biClrUsed > (1u << ih->biBitCount)))){
+    return NOT_SPT_FMT;
+  }
+  if((ih->biWidth < 0)||(ih->biHeight < -INT32_MAX)){
+    return NOT_SPT_FMT;
+  }
+  if((ih->biHeight < 0)&&compressed(ih)){//RLE images are always bottom-up
+    return NOT_SPT_FMT;
+  }
+
+  //The rows, a byte a pixel once RLE4 is expanded, and their pointers must
+  //fit in a size_t
+  size_t size = (ih->biBitCount < 8) ? 1 : ih->biBitCount/8;
+  size_t height = (ih->biHeight < 0) ? -ih->biHeight : ih->biHeight;
+  if((size_t)ih->biWidth > (SIZE_MAX - BMP_ROW_ALIGN)/size){
+    return NOT_SPT_FMT;
+  }
+  size_t stride = row_stride(ih->biWidth*size);
+  if(height && (stride > (SIZE_MAX - bitmap_head(height))/height)){
+    return NOT_SPT_FMT;
+  }
+  return 0;
+}
+
+//The n bytes of extra follow the 54 of the headers: the rest of a longer
+//info header, the masks of BI_BITFIELDS and the palette
+static int check_extra(const BITMAPFILEHEADER *fh, const BITMAPINFOHEADER *ih
+        , const BYTE *extra, size_t n){
+  static const DWORD masks[3] = {0x00FF0000, 0x0000FF00, 0x000000FF};
+
+  if(ih->biCompression == BI_BITFIELDS){//Only the BGRA order is supported
+    if(n < sizeof(masks)){
+      return CANNOT_LOAD;
+    }
+    if(memcmp(extra, masks, sizeof(masks))){
+      return NOT_SPT_FMT;
+    }
+  }
+  if(ih->biBitCount <= 8){
+    size_t end = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)
+        + palette_offset(ih) + palette_colors(ih)*sizeof(RGBQUAD);
+    if(fh->bfOffBits < end){
+      return CANNOT_LOAD;
+    }
+  }
+  return 0;
+}
+
+static size_t palette_offset(const BITMAPINFOHEADER *ih){
+  return ih->biSize - sizeof(BITMAPINFOHEADER);
+}
+
+static int palette_colors(const BITMAPINFOHEADER *ih){
+  return ih->biClrUsed ? (int)ih->biClrUsed : 1 << ih->biBitCount;
+}
+
+//Always 256 entries, the ones past biClrUsed are black
+static RGBQUAD *read_palette(const BITMAPINFOHEADER *ih, const BYTE *extra
+        , int *error){
+  RGBQUAD *palette = calloc(PALETTE_SIZE, sizeof(RGBQUAD));
+  if(palette == NULL){
+    *error = errno;
+    errno = 0;
+    return NULL;
+  }
+  memcpy(palette, extra + palette_offset(ih)
+      , palette_colors(ih)*sizeof(RGBQUAD));
+  return palette;
+}
+
+static int compressed(const BITMAPINFOHEADER *ih){
+  return (ih->biCompression == BI_RLE8)||(ih->biCompression == BI_RLE4);
+}
+
+//Reads the codes that follow the palette and expands them
+static int load_rle(BMPFILE *image, FILE *fd, int *error){
+  struct stat info;
+  long start = ftell(fd);
+  if((start < 0)||fstat(fileno(fd), &info)){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+
+  size_t n = (info.st_size > start) ? info.st_size - start : 0;
+  if((image->ih.biSizeImage > 0)&&(image->ih.biSizeImage < n)){
+    n = image->ih.biSizeImage;
+  }
+  BYTE *data = malloc(n + 1);
+  if(data == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+  if(fread(data, 1, n, fd) < n){
+    if(errno){
+      *error = errno;
+      errno = 0;
+    }else{
+      *error = CANNOT_LOAD;
+    }
+    free(data);
+    return -1;
+  }
+
+  int ret = expand_rle(image, data, n, error);
+  free(data);
+  return ret;
+}
+
+//Decodes the n bytes of codes of data in a new bitmap, after which the image
+//is an uncompressed 8 bit one
+static int expand_rle(BMPFILE *image, const BYTE *data, size_t n, int *error){
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+  if(image->palette == NULL){//The indices would mean nothing
+    *error = NOT_SPT_FMT;
+    return -1;
+  }
+  RGBTRIPLE **bitmap = alloc_rows(image->pool, height, width, 0, error);
+  if(bitmap == NULL){
+    return -1;
+  }
+
+  int ret = decode_rle(data, n, bitmap, height, width
+      , image->ih.biCompression == BI_RLE4);
+  if(ret){
+    free_bitmap(bitmap);
+    *error = ret;
+    return -1;
+  }
+
+  //The palette keeps its size, the pixel array follows it as before
+  image->ih.biClrUsed = palette_colors(&image->ih);
+  image->ih.biBitCount = 8;
+  image->ih.biCompression = BI_RGB;
+  image->padding = row_padding(width);
+  image->ih.biSizeImage = height*(width + image->padding);
+  image->fh.bfSize = image->fh.bfOffBits + image->ih.biSizeImage;
+  image->bitmap = bitmap;
+  image->pixels = (RGBTRIPLE *)((BYTE *)bitmap + bitmap_head(height));
+  image->stride = row_stride(width);
+  return 0;
+}
+
+//Only the row pointers are allocated, the rows stay in the buffer of the file
+static int borrow_rows(BMPFILE *image, const BYTE *pixels, size_t file_row
+        , int *error){
+  int height = image->ih.biHeight;
+  if((image->bitmap = malloc(height * sizeof(RGBTRIPLE *) + 1)) == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+
+  int i;
+  for(i=0; i<height; i++){
+    image->bitmap[i] = (RGBTRIPLE *)(pixels + i*file_row);
+  }
+  image->pixels = (RGBTRIPLE *)pixels;
+  image->stride = file_row;
+  image->map = (void *)pixels;
+  return 0;
+}
+
+//The rows of the buffer of the file in a new bitmap
+static int copy_rows(BMPFILE *image, const BYTE *pixels, size_t file_row
+        , int *error){
+  int height = image->ih.biHeight;
+  size_t row_size = file_row - image->padding;
+  RGBTRIPLE **bitmap = alloc_rows(image->pool, height, row_size, 0, error);
+  if(bitmap == NULL){
+    return -1;
+  }
+
+  int i;
+  for(i=0; i<height; i++){
+    memcpy(bitmap[i], pixels + i*file_row, row_size);
+  }
+  image->bitmap = bitmap;
+  image->pixels = (RGBTRIPLE *)((BYTE *)bitmap + bitmap_head(height));
+  image->stride = row_stride(row_size);
+  return 0;
+}
+
+//Expands the n bytes of RLE8 or RLE4 codes in the rows of bitmap, bottom-up.
+//Runs past the end of a row are cut and the pixels skipped by the codes are
+//set to 0
+static int decode_rle(const BYTE *data, size_t n, RGBTRIPLE **bitmap
+        , int height, int width, int rle4){
+  size_t p = 0;
+  int x = 0, y = 0;
+  int k;
+
+  while(y < height){
+    if(p + 2 > n){//The codes end before the bitmap
+      return CANNOT_LOAD;
+    }
+    int count = data[p];
+    int code = data[p+1];
+    BYTE *row = (BYTE *)bitmap[y] + x;
+    p += 2;
+
+    if(count > 0){//count pixels of one index, or two alternating ones
+      int run = min(count, width - x);
+      if(rle4){
+        for(k=0; k<run; k++){
+          row[k] = (k & 1) ? (code & 0x0F) : (code >> 4);
+        }
+      }else{
+        memset(row, code, run);
+      }
+      x += run;
+    }else if(code == 0){//End of line
+      rle_skip(bitmap, width, &x, &y, 0, y + 1);
+    }else if(code == 1){//End of bitmap
+      rle_skip(bitmap, width, &x, &y, 0, height);
+    }else if(code == 2){//Delta, the next two bytes move the position
+      if(p + 2 > n){
+        return CANNOT_LOAD;
+      }
+      int to_y = y + data[p+1];
+      int to_x = (to_y < height) ? min(x + data[p], width) : 0;
+      rle_skip(bitmap, width, &x, &y, to_x, min(to_y, height));
+      p += 2;
+    }else{//Absolute mode, code indices padded to a whole word
+      size_t bytes = rle4 ? (code + 1)/2 : code;
+      if(p + bytes > n){
+        return CANNOT_LOAD;
+      }
+      int run = min(code, width - x);
+      if(rle4){
+        for(k=0; k<run; k++){
+          row[k] = (k & 1) ? (data[p + k/2] & 0x0F) : (data[p + k/2] >> 4);
+        }
+      }else{
+        memcpy(row, data + p, run);
+      }
+      x += run;
+      p += (bytes + 1) & ~(size_t)1;
+    }
+  }
+  return 0;
+}
+
+//Sets to 0 the pixels from (x, y) to (to_x, to_y), which becomes the
+//position
+static void rle_skip(RGBTRIPLE **bitmap, int width, int *x, int *y, int to_x
+        , int to_y){
+  while(*y < to_y){
+    memset((BYTE *)bitmap[*y] + *x, 0, width - *x);
+    (*y)++;
+    *x = 0;
+  }
+  if(to_x > *x){
+    memset((BYTE *)bitmap[*y] + *x, 0, to_x - *x);
+    *x = to_x;
+  }
+}
+
+static inline DWORD rle_key(const BYTE *pixel){
+  return pixel[0] | pixel[1] << 8 | pixel[2] << 16 | 1 << 24;
+}
+
+//Slot of key in the colour table, or the free one where it would go
+static inline int rle_slot(const struct rle_palette *map, DWORD key){
+  int slot = (DWORD)(key*2654435761u) >> (32 - RLE_HASH_BITS);
+  while((map->key[slot] != 0)&&(map->key[slot] != key)){
+    slot = (slot + 1) & ((1 << RLE_HASH_BITS) - 1);
+  }
+  return slot;
+}
+
+//The palette save_image_rle writes, at most colors of them: the one of an
+//8 bit image or the colours of the pixels of a 24 or 32 bit one
+static int rle_palette(BMPFILE *image, int colors, struct rle_palette *map){
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+  int i, j;
+
+  memset(map, 0, sizeof(struct rle_palette));
+  if(image->palette != NULL){
+    BYTE used = 0;
+    for(i=0; (i<height)&&(colors < PALETTE_SIZE); i++){
+      const BYTE *row = (const BYTE *)image->bitmap[i];
+      for(j=0; j<width; j++){
+        used |= row[j];
+      }
+    }
+    if(used >= colors){//Some index does not fit in 4 bits
+      return NOT_SPT_FMT;
+    }
+    map->n = min(palette_colors(&image->ih), colors);
+    memcpy(map->colors, image->palette, map->n*sizeof(RGBQUAD));
+    return 0;
+  }
+
+  int size = pixel_size(image);
+  DWORD last = 0;
+  for(i=0; i<height; i++){
+    const BYTE *row = (const BYTE *)image->bitmap[i];
+    for(j=0; j<width; j++){
+      DWORD key = rle_key(row + (size_t)j*size);
+      if(key == last){
+        continue;
+      }
+      int slot = rle_slot(map, key);
+      if(map->key[slot] == 0){//A new colour
+        if(map->n == colors){
+          return NOT_SPT_FMT;
+        }
+        RGBQUAD colour = {row[j*size], row[j*size + 1], row[j*size + 2], 0};
+        map->key[slot] = key;
+        map->index[slot] = map->n;
+        map->colors[map->n++] = colour;
+      }
+      last = key;
+    }
+  }
+  if(map->n == 0){//An empty image
+    map->n = 1;
+  }
+  return 0;
+}
+
+//Codes the n indices of row followed by an end of line in out, which has
+//room for 2*n + 2 bytes, the most it can take. Returns the bytes written
+static size_t encode_rle(const BYTE *row, int n, BYTE *out, int rle4){
+  BYTE *p = out;
+  int i = 0, k;
+
+  while(i < n){
+    int run = 1;
+    while((i + run < n)&&(run < 255)&&(row[i + run] == row[i])){
+      run++;
+    }
+    if(run >= 2){
+      *p++ = run;
+      *p++ = rle4 ? (row[i] << 4 | row[i]) : row[i];
+      i += run;
+      continue;
+    }
+
+    //Different indices, up to where two equal ones start a run
+    int len = 1;
+    while((i + len < n)&&(len < 255)
+        &&((i + len + 1 == n)||(row[i + len] != row[i + len + 1]))){
+      len++;
+    }
+    if(len < 3){//The absolute mode needs 3 indices at least
+      for(k=0; k<len; k++){
+        *p++ = 1;
+        *p++ = rle4 ? row[i + k] << 4 : row[i + k];
+      }
+    }else{
+      size_t bytes = rle4 ? (len + 1)/2 : len;
+      *p++ = 0;
+      *p++ = len;
+      if(rle4){
+        for(k=0; k<len; k+=2){
+          *p++ = row[i + k] << 4 | ((k + 1 < len) ? row[i + k + 1] : 0);
+        }
+      }else{
+        memcpy(p, row + i, len);
+        p += len;
+      }
+      if(bytes & 1){
+        *p++ = 0;
+      }
+    }
+    i += len;
+  }
+  *p++ = 0;
+  *p++ = 0;
+  return p - out;
+}
+
+//Whether the indices of an 8 bit image are its grey levels, so that filters
+//can mix them as one channel
+static int grey_palette(const BMPFILE *image){
+  int colors = palette_colors(&image->ih);
+  int i;
+
+  for(i=0; i<colors; i++){
+    const RGBQUAD *c = &image->palette[i];
+    if((c->r != i)||(c->g != i)||(c->b != i)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//Bytes per pixel a filter that mixes neighbours works with, any 8 bit image
+//whose indices are not grey levels is converted to 24 bit first
+static int mixing_size(BMPFILE *image, int *error){
+  if(resolve_orientation(image, error)){//Neighbours are where they are shown
+    return -1;
+  }
+  if((image->palette != NULL)&&(!grey_palette(image))){
+    if(convert_image(image, 24, error)){
+      return -1;
+    }
+  }
+  return pixel_size(image);
+}
+
+static int pixel_size(const BMPFILE *image){
+  return image->ih.biBitCount/8;
+}
+
+//Bytes of the pixels of a row, without padding. Computed in size_t, as the
+//width of a loaded image can reach INT32_MAX; check_header keeps the whole
+//pixel array below SIZE_MAX
+static size_t row_bytes(const BMPFILE *image){
+  return (size_t)image->ih.biWidth*pixel_size(image);
+}
+
+static DWORD row_padding(size_t row_size){
+  return (4 - row_size % 4) % 4;
+}
+
+static int stream_error(BMPSTREAM *stream, int *error){
+  if(errno){
+    *error = errno;
+    errno = 0;
+  }else{
+    *error = stream->writer ? CANNOT_WRITE : CANNOT_LOAD;
+  }
+  return -1;
+}
+
+//biSizeImage and bfSize of height rows, 0 if the file does not fit in their
+//32 bits (a biSizeImage of 0 is valid for uncompressed images)
+static void stream_sizes(BMPSTREAM *stream, int height){
+  uint64_t image = (uint64_t)height*((uint64_t)stream->ih.biWidth*3
+      + stream->padding);
+  uint64_t file = stream->fh.bfOffBits + image;
+
+  stream->ih.biSizeImage = (file <= UINT32_MAX) ? (DWORD)image : 0;
+  stream->fh.bfSize = (file <= UINT32_MAX) ? (DWORD)file : 0;
+}
+
+static inline void box_line(const BYTE *src, BYTE *dst, int n, int channels
+        , DWORD *acc, int r){
+  int i, c;
+  int count = min(r, n-1) + 1;
+  int box = 2*r + 1;
+
+  //Away from the ends the window is a whole box, divide it multiplying by
+  //ceil(2^40/box), exact while the sums stay below 256*box < 2^24
+  unsigned long long magic = 0;
+  if(box < 65536){
+    magic = ((1ULL << 40) + box - 1)/box;
+  }
+
+  for(c=0; c<channels; c++){
+    acc[c] = 0;
+  }
+  for(i=0; i<count; i++){
+    for(c=0; c<channels; c++){
+      acc[c] += src[i*channels + c];
+    }
+  }
+
+  //Running sum of the window [i-r, i+r] clipped to the line
+  for(i=0; i<n; i++){
+    if((count == box)&&magic){
+      for(c=0; c<channels; c++){
+        dst[i*channels + c] = ((acc[c] + count/2)*magic) >> 40;
+      }
+    }else{
+      for(c=0; c<channels; c++){
+        dst[i*channels + c] = (acc[c] + count/2)/count;
+      }
+    }
+    if(i+r+1 < n){
+      for(c=0; c<channels; c++){
+        acc[c] += src[(i+r+1)*channels + c];
+      }
+      count++;
+    }
+    if(i-r >= 0){
+      for(c=0; c<channels; c++){
+        acc[c] -= src[(i-r)*channels + c];
+      }
+      count--;
+    }
+  }
+}
+
+static void box_pass(const BYTE *src, BYTE *dst, int n, int channels
+        , DWORD *acc, int r){
+  switch(channels){
+    case 1:
+      box_line(src, dst, n, 1, acc, r);
+      break;
+    case 3:
+      box_line(src, dst, n, 3, acc, r);
+      break;
+    default:
+      box_line(src, dst, n, channels, acc, r);
+  }
+}
+
+static void *probe_worker(void *arg){
+  struct probe_job *job = arg;
+  size_t i;
+
+  while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n){
+    probe_BMP(job->paths[i], &job->probes[i]);
+  }
+  return NULL;
+}
+
+static int online_threads(void){
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return (cpus < 1) ? 1 : (int)min(cpus, BMP_MAX_THREADS);
+}
+
+static void parallel_for(size_t n, size_t grain, band_fn fn, void *arg){
+  int threads = bmp_threads();
+  struct pool_job job;
+
+  if(grain < 1){
+    grain = 1;
+  }
+  //Small jobs, and jobs started from a band or while another one runs, are
+  //done by the calling thread
+  if((threads < 2)||(n <= grain)||pthread_mutex_trylock(&pool_busy)){
+    if(n > 0){
+      fn(arg, 0, n);
+    }
+    return;
+  }
+
+  job.fn = fn;
+  job.arg = arg;
+  job.n = n;
+  job.band = (n + (size_t)threads*PARALLEL_CHUNKS - 1)
+      /((size_t)threads*PARALLEL_CHUNKS);
+  job.band = (job.band < grain) ? grain : job.band;
+  job.bands = (n + job.band - 1)/job.band;
+  job.next = 0;
+  job.threads = threads;
+
+  pthread_mutex_lock(&pool_lock);
+  while(pool_started < threads - 1){
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, pool_worker
+        , (void *)(intptr_t)(pool_started + 1))){
+      break;//The threads already running do the work
+    }
+    pthread_detach(thread);
+    pool_started++;
+  }
+  pool_job = &job;
+  pool_generation++;
+  pthread_cond_broadcast(&pool_wake);
+  pthread_mutex_unlock(&pool_lock);
+
+  run_bands(&job);
+
+  pthread_mutex_lock(&pool_lock);
+  while(pool_running > 0){
+    pthread_cond_wait(&pool_done, &pool_lock);
+  }
+  pool_job = NULL;
+  pthread_mutex_unlock(&pool_lock);
+  pthread_mutex_unlock(&pool_busy);
+}
+
+static void run_bands(struct pool_job *job){
+  size_t i;
+
+  while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+      < job->bands){
+    size_t begin = i*job->band;
+    size_t end = (job->n - begin < job->band) ? job->n : begin + job->band;
+    job->fn(job->arg, begin, end);
+  }
+}
+
+static void *pool_worker(void *arg){
+  int index = (intptr_t)arg; // the calling thread is the 0
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&pool_lock);
+  for(;;){
+    while(pool_generation == seen){
+      pthread_cond_wait(&pool_wake, &pool_lock);
+    }
+    seen = pool_generation;
+
+    struct pool_job *job = pool_job;
+    if((job == NULL)||(index >= job->threads)){
+      continue;
+    }
+    pool_running++;
+    pthread_mutex_unlock(&pool_lock);
+
+    run_bands(job);
+
+    pthread_mutex_lock(&pool_lock);
+    if(--pool_running == 0){
+      pthread_cond_signal(&pool_done);
+    }
+  }
+  return NULL;
+}
+
+static size_t row_grain(int width){
+  return PARALLEL_GRAIN/((size_t)width + 1) + 1;
+}
+
+static void span_pixels(void *arg, size_t begin, size_t end){
+  const struct span_job *job = arg;
+  run_span(job, (BYTE *)job->image->pixels + begin*job->size, end - begin);
+}
+
+static void span_rows(void *arg, size_t begin, size_t end){
+  const struct span_job *job = arg;
+  size_t i;
+
+  for(i=begin; i<end; i++){
+    run_span(job, (BYTE *)job->image->bitmap[i], job->image->ih.biWidth);
+  }
+}
+
+//Rows of a planar image, plane[0] b, [1] g and [2] r
+static void span_planes(void *arg, size_t begin, size_t end){
+  const struct span_job *job = arg;
+  const struct span_kernels *k = simd_kernels();
+  RGBTRIPLE block[CHAIN_BLOCK];
+  size_t width = job->image->ih.biWidth;
+  size_t i, j, m;
+  BYTE *plane[3];
+  int c;
+
+  for(i=begin; i<end; i++){
+    for(j=0; j<width; j+=m){
+      m = (width - j < CHAIN_BLOCK) ? width - j : CHAIN_BLOCK;
+      for(c=0; c<3; c++){
+        plane[c] = job->image->planes[c][i] + j;
+      }
+      k->merge((const BYTE *const *)plane, block, m);
+      job->fn(block, m, job->arg);
+      k->split(block, plane, m);
+    }
+  }
+}
+
+static void hsv_planes(void *arg, size_t begin, size_t end){
+  const struct hsv_job *job = arg;
+  const struct span_kernels *k = simd_kernels();
+  WORD h[HSV_BLOCK], s[HSV_BLOCK];
+  BYTE v[HSV_BLOCK];
+  size_t width = job->image->ih.biWidth;
+  size_t i, j, m;
+  BYTE *plane[3];
+  int c;
+
+  for(i=begin; i<end; i++){
+    for(j=0; j<width; j+=m){
+      m = (width - j < HSV_BLOCK) ? width - j : HSV_BLOCK;
+      for(c=0; c<3; c++){
+        plane[c] = job->image->planes[c][i] + j;
+      }
+      k->to_hsv_planes((const BYTE *const *)plane, h, s, v, m);
+      job->fn(h, s, v, m, job->arg);
+      k->to_rgb_planes(h, s, v, plane, m);
+    }
+  }
+}
+
+static void split_rows(void *arg, size_t begin, size_t end){
+  BMPFILE *image = arg;
+  const struct span_kernels *k = simd_kernels();
+  BYTE *plane[3];
+  size_t i;
+  int c;
+
+  for(i=begin; i<end; i++){
+    for(c=0; c<3; c++){
+      plane[c] = image->planes[c][i];
+    }
+    k->split(image->bitmap[i], plane, image->ih.biWidth);
+  }
+}
+
+static void merge_rows(void *arg, size_t begin, size_t end){
+  BMPFILE *image = arg;
+  const struct span_kernels *k = simd_kernels();
+  const BYTE *plane[3];
+  size_t i;
+  int c;
+
+  for(i=begin; i<end; i++){
+    for(c=0; c<3; c++){
+      plane[c] = image->planes[c][i];
+    }
+    k->merge(plane, image->bitmap[i], image->ih.biWidth);
+  }
+}
+
+//Inlined with a constant pixel size, as resize_span
+static inline void histo_span(const BYTE *row, int w, int size, int luma
+        , unsigned int count[4][2][256]){
+  int j, y;
+
+  for(j=0; j<w; j++){
+    const BYTE *p = row + j*size;
+    count[0][j & 1][p[2]]++;
+    count[1][j & 1][p[1]]++;
+    count[2][j & 1][p[0]]++;
+  }
+  if(luma){
+    int fast = (precision_mode == BMP_PRECISION_FAST);
+    for(j=0; j<w; j++){
+      const BYTE *p = row + j*size;
+      y = luma_of(p[2], p[1], p[0], fast);
+      count[3][j & 1][y]++;
+    }
+  }
+}
+
+static inline void histo_planes(BYTE **const *planes, size_t i, int w
+        , int luma, unsigned int count[4][2][256]){
+  const BYTE *b = planes[0][i], *g = planes[1][i], *r = planes[2][i];
+  int j, y;
+
+  for(j=0; j<w; j++){
+    count[0][j & 1][r[j]]++;
+    count[1][j & 1][g[j]]++;
+    count[2][j & 1][b[j]]++;
+  }
+  if(luma){
+    int fast = (precision_mode == BMP_PRECISION_FAST);
+    for(j=0; j<w; j++){
+      y = luma_of(r[j], g[j], b[j], fast);
+      count[3][j & 1][y]++;
+    }
+  }
+}
+
+static void histo_rows(void *arg, size_t begin, size_t end){
+  struct histo_job *job = arg;
+  //Two counters per value, for even and odd pixels, so that runs of a
+  //colour do not wait on the increment of a single counter
+  unsigned int count[4][2][256];
+  int w = job->image->ih.biWidth;
+  int size = pixel_size(job->image);
+  int luma = job->channels & BMP_HISTO_Y;
+  size_t i;
+  int j, c, y;
+
+  memset(count, 0, sizeof(count));
+  for(i=begin; i<end; i++){
+    const BYTE *row = (const BYTE *)job->image->bitmap[i];
+    if(job->image->planes[0] != NULL){
+      histo_planes(job->image->planes, i, w, luma, count);
+    }else if(size == 1){//Indices, turned into colours below
+      for(j=0; j<w; j++){
+        count[0][j & 1][row[j]]++;
+      }
+    }else if(size == sizeof(RGBQUAD)){
+      histo_span(row, w, sizeof(RGBQUAD), luma, count);
+    }else{
+      histo_span(row, w, sizeof(RGBTRIPLE), luma, count);
+    }
+  }
+
+  if(size == 1){//Every pixel counts for the channels of its colour
+    unsigned int index[256];
+    const RGBQUAD *palette = job->image->palette;
+    for(y=0; y<256; y++){
+      index[y] = count[0][0][y] + count[0][1][y];
+    }
+    memset(count, 0, sizeof(count));
+    for(y=0; y<256; y++){
+      const RGBQUAD *p = &palette[y];
+      count[0][0][p->r] += index[y];
+      count[1][0][p->g] += index[y];
+      count[2][0][p->b] += index[y];
+      count[3][0][luma_of(p->r, p->g, p->b
+          , precision_mode == BMP_PRECISION_FAST)] += index[y];
+    }
+  }
+
+  for(c=0; c<4; c++){
+    if(!(job->channels & (1 << c))){
+      continue;
+    }
+    unsigned int *histo = histo_channel(job->histo, c);
+    for(y=0; y<256; y++){
+      unsigned int n = count[c][0][y] + count[c][1][y];
+      if(n){
+        __atomic_fetch_add(&histo[y], n, __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+static void flip_rows(void *arg, size_t begin, size_t end){
+  const struct copy_job *job = arg;
+  int w = job->width;
+  int size = job->size;
+  size_t i;
+
+  for(i=begin; i<end; i++){
+    RGBTRIPLE *a = job->dst[i];
+    RGBTRIPLE *b = job->dst[job->height-1-i];
+    if((job->motion == 'v')||(a == b)){//Reversed within the row
+      if(job->motion != 'h'){
+        job->flip(a, PIXEL(a, w, size), w/2);
+      }
+    }else if(job->motion == 'h'){
+      swap_span(a, b, (size_t)w*size);
+    }else{//'u', each row takes the reverse of the opposite one
+      job->flip(a, PIXEL(b, w, size), w);
+    }
+  }
+}
+
+static void rotate_rows(void *arg, size_t begin, size_t end){
+  const struct copy_job *job = arg;
+  int new_height = job->width;
+  int new_width = job->height;
+  size_t t;
+  int i, j, j0;
+
+  //Output tiles keep the source rows they read in cache, whole blocks go to
+  //the transpose kernel and the ragged edges are copied pixel by pixel
+  for(t=begin; t<end; t++){
+    int i0 = t*ROTATE_TILE;
+    int i1 = (i0 + ROTATE_TILE < new_height) ? i0 + ROTATE_TILE : new_height;
+    int ib = i0 + (i1 - i0)/ROTATE_BLOCK*ROTATE_BLOCK;
+    for(j0=0; j0<new_width; j0+=ROTATE_TILE){
+      int j1 = (j0 + ROTATE_TILE < new_width) ? j0 + ROTATE_TILE : new_width;
+      int jb = j0 + (j1 - j0)/ROTATE_BLOCK*ROTATE_BLOCK;
+      for(i=i0; i<ib; i+=ROTATE_BLOCK){
+        for(j=j0; j<jb; j+=ROTATE_BLOCK){
+          rotate_block(job, i, j);
+        }
+        rotate_pixels(job, i, i + ROTATE_BLOCK, jb, j1);
+      }
+      rotate_pixels(job, ib, i1, j0, j1);
+    }
+  }
+}
+
+static void rotate_block(const struct copy_job *job, int i, int j){
+  const RGBTRIPLE *src[ROTATE_BLOCK];
+  RGBTRIPLE *dst[ROTATE_BLOCK];
+  int k;
+
+  //The block starting at dst[i][j] is the transpose of a source block, the
+  //direction of the turn only reverses the order of its rows or columns
+  for(k=0; k<ROTATE_BLOCK; k++){
+    if(job->motion == 'r'){
+      src[k] = PIXEL(job->src[j+k], job->width-i-ROTATE_BLOCK, job->size);
+      dst[k] = PIXEL(job->dst[i+ROTATE_BLOCK-1-k], j, job->size);
+    }else{
+      src[k] = PIXEL(job->src[job->height-1-j-k], i, job->size);
+      dst[k] = PIXEL(job->dst[i+k], j, job->size);
+    }
+  }
+  job->transpose(src, dst);
+}
+
+static void rotate_pixels(const struct copy_job *job, int i0, int i1, int j0
+        , int j1){
+  int size = job->size;
+  int i, j;
+
+  for(i=i0; i<i1; i++){
+    RGBTRIPLE *dst = job->dst[i];
+    for(j=j0; j<j1; j++){
+      if(job->motion == 'r'){
+        memcpy(PIXEL(dst, j, size), PIXEL(job->src[j], job->width-1-i, size)
+            , size);
+      }else{
+        memcpy(PIXEL(dst, j, size), PIXEL(job->src[job->height-1-j], i, size)
+            , size);
+      }
+    }
+  }
+}
+
+static void convert_rows(void *arg, size_t begin, size_t end){
+  const struct convert_job *job = arg;
+  const struct span_kernels *k = simd_kernels();
+  RGBTRIPLE block[CHAIN_BLOCK];
+  char luma = 'y';
+  size_t i;
+  int j, m, c;
+
+  for(i=begin; i<end; i++){
+    const BYTE *src = (const BYTE *)job->src[i];
+    BYTE *dst = (BYTE *)job->dst[i];
+
+    if(job->from == 1){//The colours of the palette
+      for(j=0; j<job->width; j++){
+        const RGBQUAD *colour = &job->palette[src[j]];
+        memcpy(dst + j*job->to, colour, sizeof(RGBTRIPLE));
+        if(job->to == sizeof(RGBQUAD)){
+          dst[j*job->to + 3] = 0xFF;
+        }
+      }
+    }else if(job->to == 1){//The luma of grayscale 'y' is the grey level
+      for(j=0; j<job->width; j+=m){
+        m = min(job->width - j, CHAIN_BLOCK);
+        if(job->from == sizeof(RGBQUAD)){
+          k->pack((const RGBQUAD *)src + j, block, m);
+        }else{
+          memcpy(block, (const RGBTRIPLE *)src + j, m*sizeof(RGBTRIPLE));
+        }
+        k->grayscale(block, m, &luma);
+        for(c=0; c<m; c++){
+          dst[j+c] = block[c].g;
+        }
+      }
+    }else if(job->to == sizeof(RGBTRIPLE)){
+      k->pack((const RGBQUAD *)src, (RGBTRIPLE *)dst, job->width);
+    }else{//Opaque alpha
+      for(j=0; j<job->width; j++){
+        memcpy(dst + 4*j, src + 3*j, sizeof(RGBTRIPLE));
+        dst[4*j + 3] = 0xFF;
+      }
+    }
+  }
+}
+
+//Row i of the result, inlined with a constant number of channels so that
+//the sums of the ones it does not have are left out
+static inline void resample_row(const struct resample_job *job, int i
+        , int channels){
+  RGBTRIPLE **bitmap = job->src;
+  int old_height = job->old_height;
+  int old_width = job->old_width;
+
+  double row_ratio = (double)old_height / (double)job->new_height;
+  double col_ratio = (double)old_width / (double)job->new_width;
+
+  int x,y,j,c;
+
+  double old_i = i*row_ratio;
+  int floor_i = (int)old_i;
+  double lanc_i[4];
+  for(x=0; x<4; x++){
+    lanc_i[x] = _L(old_i - (floor_i - 1 + x));
+  }
+  for(j=0; j<job->new_width; j++){
+    int floor_j = (int)(j*col_ratio);
+    const double *lanc_j = job->lanc + 4*j;
+
+    double s0 = 0.0;
+    double s1 = 0.0;
+    double s2 = 0.0;
+    double s3 = 0.0;
+    double weight = 0.0;
+
+    for(x=floor_i-2+1; x<=floor_i+2; x++){
+      for(y=floor_j-2+1; y<=floor_j+2; y++){
+        if((x<old_height)&&(y<old_width)&&(x>=0)&&(y>=0)){
+          double lanc_term = lanc_i[x - floor_i + 1]
+              * lanc_j[y - floor_j + 1];
+          const BYTE *pixel = (const BYTE *)bitmap[x] + y*channels;
+          s0 += pixel[0] * lanc_term;
+          if(channels > 1){
+            s1 += pixel[1] * lanc_term;
+            s2 += pixel[2] * lanc_term;
+          }
+          if(channels > 3){
+            s3 += pixel[3] * lanc_term;
+          }
+          weight += lanc_term;
+        }
+      }
+    }
+
+    double sum[4] = {s0, s1, s2, s3};
+    BYTE *dst = (BYTE *)job->dst[i] + j*channels;
+    for(c=0; c<channels; c++){
+      double value = sum[c] / weight;
+      if((value < 0.0)||(value > 255.0)){
+        value = (value > 255.0) ? 255.0 : 0;
+      }
+      dst[c] = value;
+    }
+  }
+}
+
+static void resample_rows(void *arg, size_t begin, size_t end){
+  const struct resample_job *job = arg;
+  size_t i;
+
+  for(i=begin; i<end; i++){
+    switch(job->size){
+      case 1:
+        resample_row(job, i, 1);
+        break;
+      case 4:
+        resample_row(job, i, 4);
+        break;
+      default:
+        resample_row(job, i, 3);
+    }
+  }
+}
+
+static double resize_filter(int filter, double x){
+  double a = (filter == BMP_FILTER_LANCZOS2) ? 2 : 3;
+
+  x = fabs(x);
+  switch(filter){
+    case BMP_FILTER_BILINEAR:
+    return (x < 1) ? 1 - x : 0;
+
+    case BMP_FILTER_BICUBIC:
+    if(x < 1){
+      return (1.5*x - 2.5)*x*x + 1;
+    }
+    return (x < 2) ? ((-0.5*x + 2.5)*x - 4)*x + 2 : 0;
+
+    default://Lanczos
+    if(x < 1e-8){
+      return 1;
+    }
+    return (x < a) ? a*sin(E_PI*x)*sin(E_PI*x/a)/(E_PI_SQ*x*x) : 0;
+  }
+}
+
+static int resize_weights(int old_size, int new_size, int filter
+          , struct resize_axis *axis){
+  static const double support[] = {0.5, 1, 2, 2, 3};
+  double scale = (double)old_size/new_size;
+  double stretch = (scale > 1) ? scale : 1; // the filter widens to reduce
+  double radius = support[filter]*stretch;
+  double *w;
+  int o, t;
+
+  axis->taps = min((int)ceil(2*radius) + 1, old_size);
+  axis->first = malloc(new_size * sizeof(int));
+  axis->weight = malloc((size_t)new_size * axis->taps * sizeof(short));
+  w = malloc(axis->taps * sizeof(double));
+  if((axis->first == NULL)||(axis->weight == NULL)||(w == NULL)){
+    free(w);
+    return -1;
+  }
+
+  for(o=0; o<new_size; o++){
+    double center = (o + 0.5)*scale; // in source pixels, edges at integers
+    int lo = max(0, (int)floor(center - radius));
+    int hi = min(old_size, (int)ceil(center + radius));
+    double sum = 0;
+
+    //Window of taps inside the source, holding every pixel that counts
+    lo = min(lo, old_size - axis->taps);
+    hi = min(hi, lo + axis->taps);
+    for(t=0; t<axis->taps; t++){
+      double k = lo + t + 0.5; // centre of the source pixel
+      if(lo + t >= hi){
+        w[t] = 0;
+      }else if(filter == BMP_FILTER_AREA){//Overlap of the pixel and [o, o+1)
+        double from = fmax(lo + t, o*scale);
+        double to = fmin(lo + t + 1, (o + 1)*scale);
+        w[t] = fmax(0, to - from);
+      }else{
+        w[t] = resize_filter(filter, (k - center)/stretch);
+      }
+      sum += w[t];
+    }
+
+    //Normalized fixed point weights, the rounding goes to the biggest one
+    short *q = axis->weight + (size_t)o*axis->taps;
+    int total = 0, big = 0;
+    for(t=0; t<axis->taps; t++){
+      q[t] = lround(w[t]/sum*(1 << RESIZE_BITS));
+      total += q[t];
+      big = (q[t] > q[big]) ? t : big;
+    }
+    q[big] += (1 << RESIZE_BITS) - total;
+    axis->first[o] = lo;
+  }
+
+  free(w);
+  return 0;
+}
+
+//Inlined with a constant number of channels so that their loops unroll
+static inline void resize_span(const BYTE *src, BYTE *dst, int width
+        , const struct resize_axis *axis, int channels){
+  int j, t, c;
+
+  for(j=0; j<width; j++){
+    const BYTE *in = src + channels*axis->first[j];
+    const short *w = axis->weight + (size_t)j*axis->taps;
+    int acc[4] = {1 << (RESIZE_BITS - 1), 1 << (RESIZE_BITS - 1)
+        , 1 << (RESIZE_BITS - 1), 1 << (RESIZE_BITS - 1)};
+    for(t=0; t<axis->taps; t++){
+      for(c=0; c<channels; c++){
+        acc[c] += w[t]*in[channels*t + c];
+      }
+    }
+    for(c=0; c<channels; c++){
+      acc[c] >>= RESIZE_BITS;
+      dst[channels*j + c] = (acc[c] < 0) ? 0 : ((acc[c] > 255) ? 255 : acc[c]);
+    }
+  }
+}
+
+//Horizontal pass into old_height x new_width, then the vertical one. Returns
+//bitmap itself if the size does not change
+static RGBTRIPLE **resize_bitmap(BMPPOOL *pool, RGBTRIPLE **bitmap
+        , int old_height, int old_width, int new_height, int new_width
+        , int size, const struct resize_axis *cols
+        , const struct resize_axis *rows, int *error){
+  RGBTRIPLE **tmp = bitmap;
+  RGBTRIPLE **new_bitmap;
+
+  if(new_width != old_width){
+    tmp = alloc_layer(pool, old_height, new_width, size, error);
+    if(tmp == NULL){
+      return NULL;
+    }
+    struct resize_job job = {bitmap, tmp, new_width, size, cols, 0};
+    parallel_for(old_height, row_grain(new_width), resize_rows, &job);
+    if(job.error){
+      *error = job.error;
+      free_bitmap(tmp);
+      return NULL;
+    }
+  }
+  if(new_height == old_height){
+    return tmp;
+  }
+
+  new_bitmap = alloc_layer(pool, new_height, new_width, size, error);
+  if(new_bitmap != NULL){
+    struct resize_job job = {tmp, new_bitmap, new_width, size, rows, 0};
+    parallel_for(new_height, row_grain(new_width), resize_columns, &job);
+    if(job.error){
+      *error = job.error;
+      free_bitmap(new_bitmap);
+      new_bitmap = NULL;
+    }
+  }
+  if(tmp != bitmap){
+    free_bitmap(tmp);
+  }
+  return new_bitmap;
+}
+
+static void resize_rows(void *arg, size_t begin, size_t end){
+  struct resize_job *job = arg;
+  size_t i;
+
+  for(i=begin; i<end; i++){
+    const BYTE *src = (const BYTE *)job->src[i];
+    BYTE *dst = (BYTE *)job->dst[i];
+    switch(job->size){
+      case 1:
+        resize_span(src, dst, job->width, job->axis, 1);
+        break;
+      case 4:
+        resize_span(src, dst, job->width, job->axis, 4);
+        break;
+      default:
+        resize_span(src, dst, job->width, job->axis, 3);
+    }
+  }
+}
+
+static void resize_columns(void *arg, size_t begin, size_t end){
+  struct resize_job *job = arg;
+  const struct resize_axis *axis = job->axis;
+  size_t row_size = (size_t)job->width * job->size;
+  size_t i, j;
+  int t;
+
+  int *acc = malloc(row_size * sizeof(int));
+  if(acc == NULL){
+    __atomic_store_n(&job->error, errno, __ATOMIC_RELAXED);
+    errno = 0;
+    return;
+  }
+
+  //Whole rows at a time, every source row is read sequentially
+  for(i=begin; i<end; i++){
+    const short *w = axis->weight + i*axis->taps;
+    BYTE *dst = (BYTE *)job->dst[i];
+    for(j=0; j<row_size; j++){
+      acc[j] = 1 << (RESIZE_BITS - 1);
+    }
+    for(t=0; t<axis->taps; t++){
+      const BYTE *in = (const BYTE *)job->src[axis->first[i] + t];
+      if(w[t] == 0){
+        continue;
+      }
+      for(j=0; j<row_size; j++){
+        acc[j] += w[t]*in[j];
+      }
+    }
+    for(j=0; j<row_size; j++){
+      int v = acc[j] >> RESIZE_BITS;
+      dst[j] = (v < 0) ? 0 : ((v > 255) ? 255 : v);
+    }
+  }
+
+  free(acc);
+}
+
+//Horizontal pass of a row over the result of the vertical one, inlined with
+//a constant number of channels
+//Pixels [j0, j1) of the row, whose taps may fall out of it
+static inline void blur_span(const double *column, BYTE *dst, int j0, int j1
+        , int width, const double *kernel, const double *prefix, int s_kernel
+        , int channels){
+  int kern_len = s_kernel/2;
+  int j, k, c;
+
+  for(j=j0; j<j1; j++){
+    int l_lo = max(0, kern_len - j);
+    int l_hi = min(s_kernel - 1, width - 1 - j + kern_len);
+    double pixel[4] = {0, 0, 0, 0};
+
+    const double *src = column + (j-kern_len)*channels;
+    for(k=l_lo; k<=l_hi; k++){
+      for(c=0; c<channels; c++){
+        pixel[c] += kernel[k] * src[k*channels + c];
+      }
+    }
+
+    double weight = prefix[l_hi+1] - prefix[l_lo];
+    for(c=0; c<channels; c++){
+      pixel[c] /= weight;
+      pixel[c] = (pixel[c] > 255 ? 255 : (pixel[c] < 0 ? 0 : pixel[c]));
+      dst[j*channels + c] = pixel[c];
+    }
+  }
+}
+
+//Pixels [j0, j1) of the row with every tap inside it. Kernel by kernel over
+//all of them the sums vectorize, in the same order as blur_span
+static inline void blur_inner(const double *column, double *sum, BYTE *dst
+        , int j0, int j1, const double *kernel, const double *prefix
+        , int s_kernel, int channels){
+  const struct span_kernels *k = simd_kernels();
+  const double *src = column + (size_t)(j0 - s_kernel/2)*channels;
+  size_t n = (size_t)(j1 - j0)*channels;
+  int t;
+
+  if(n == 0){
+    return;
+  }
+  memset(sum, 0, n*sizeof(double));
+  for(t=0; t<s_kernel; t++){
+    k->taps(sum, src + (size_t)t*channels, kernel[t], n);
+  }
+  k->norm(sum, dst + (size_t)j0*channels, prefix[s_kernel] - prefix[0], n);
+}
+
+//Edges, inner pixels and edges again, with a constant number of channels
+static inline void blur_line(const double *column, double *sum, BYTE *dst
+        , int width, const double *kernel, const double *prefix, int s_kernel
+        , int channels){
+  int j0 = min(s_kernel/2, width);
+  int j1 = max(j0, width - s_kernel + s_kernel/2 + 1);
+
+  blur_span(column, dst, 0, j0, width, kernel, prefix, s_kernel, channels);
+  blur_inner(column, sum, dst, j0, j1, kernel, prefix, s_kernel, channels);
+  blur_span(column, dst, j1, width, width, kernel, prefix, s_kernel
+      , channels);
+}
+
+static void blur_rows(void *arg, size_t begin, size_t end){
+  struct blur_job *job = arg;
+  const double *kernel = job->kernel;
+  const double *prefix = job->prefix;
+  int height = job->height;
+  int width = job->width;
+  int size = job->size;
+  int s_kernel = job->s_kernel;
+  int kern_len = s_kernel/2;
+  const struct span_kernels *kernels = simd_kernels();
+  int i, k;
+
+  //The vertical pass of a row, then the sums of the horizontal one
+  double *column = malloc(2 * (size_t)width * size * sizeof(double));
+  double *sum = column + (size_t)width * size;
+  if(column == NULL){
+    __atomic_store_n(&job->error, errno, __ATOMIC_RELAXED);
+    errno = 0;
+    return;
+  }
+
+  for(i=begin; i<end; i++){
+    //Vertical pass of the row i, normalized by the taps inside the image
+    int k_lo = max(0, kern_len - i);
+    int k_hi = min(s_kernel - 1, height - 1 - i + kern_len);
+    double weight = prefix[k_hi+1] - prefix[k_lo];
+
+    memset(column, 0, (size_t)width * size * sizeof(double));
+    for(k=k_lo; k<=k_hi; k++){
+      const BYTE *src = (const BYTE *)job->src[i-kern_len+k];
+      double gaussian_term = kernel[k]/weight;
+      kernels->taps8(column, src, gaussian_term, (size_t)width*size);
+    }
+
+    BYTE *dst = (BYTE *)job->dst[i];
+    switch(size){
+      case 1:
+        blur_line(column, sum, dst, width, kernel, prefix, s_kernel, 1);
+        break;
+      case 4:
+        blur_line(column, sum, dst, width, kernel, prefix, s_kernel, 4);
+        break;
+      default:
+        blur_line(column, sum, dst, width, kernel, prefix, s_kernel, 3);
+    }
+  }
+
+  free(column);
+}
+
+static void box_rows(void *arg, size_t begin, size_t end){
+  struct box_job *job = arg;
+  size_t line = (size_t)job->width * job->size;
+  DWORD acc[4];
+  size_t i;
+  int n;
+
+  BYTE *copy = malloc(line);
+  if(copy == NULL){
+    __atomic_store_n(&job->error, errno, __ATOMIC_RELAXED);
+    errno = 0;
+    return;
+  }
+
+  for(i=begin; i<end; i++){
+    BYTE *row = (BYTE *)job->src[i];
+    for(n=0; n<BLUR_BOXES; n++){
+      memcpy(copy, row, line);
+      box_pass(copy, row, job->width, job->size, acc, job->boxes[n]);
+    }
+  }
+
+  free(copy);
+}
+
+//The headers of the file of image, with ih, and the bytes up to the pixels.
+//Returns how many buffers of iov it filled
+static int header_vector(BMPFILE *image, BITMAPINFOHEADER *ih
+        , struct iovec *iov){
+  int n = 0;
+
+  iov[n].iov_base = &image->fh;
+  iov[n++].iov_len = sizeof(BITMAPFILEHEADER);
+  iov[n].iov_base = ih;
+  iov[n++].iov_len = sizeof(BITMAPINFOHEADER);
+  if(image->palette != NULL){//The palette may have changed since loaded
+    size_t offset = palette_offset(&image->ih);
+    size_t colors = palette_colors(&image->ih)*sizeof(RGBQUAD);
+    iov[n].iov_base = image->alignment;
+    iov[n++].iov_len = offset;
+    iov[n].iov_base = image->palette;
+    iov[n++].iov_len = colors;
+    iov[n].iov_base = image->alignment + offset + colors;
+    iov[n++].iov_len = image->aligment_size - offset - colors;
+  }else{
+    iov[n].iov_base = image->alignment;
+    iov[n++].iov_len = image->aligment_size;
+  }
+  return n;
+}
+
+//Writes the n buffers of iov, again from where it stopped if the system
+//writes only a part of them
+static int write_vector(int fd, struct iovec *iov, int n, int *error){
+  while(n > 0){
+    ssize_t done = writev(fd, iov, n);
+    if(done < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      *error = errno;
+      errno = 0;
+      return -1;
+    }
+    while((n > 0)&&((size_t)done >= iov->iov_len)){
+      done -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if(n > 0){
+      iov->iov_base = (BYTE *)iov->iov_base + done;
+      iov->iov_len -= done;
+    }
+  }
+  return 0;
+}
+
+//The rows of a horizontally flipped image, reversed and padded in a buffer
+//that is written every SAVE_BUFFER bytes
+static int write_reversed(int fd, BMPFILE *image, int *error){
+  int height = image->ih.biHeight;
+  int width = image->ih.biWidth;
+  int size = pixel_size(image);
+  size_t row_size = (size_t)width*size;
+  size_t file_row = row_size + image->padding;
+  if(file_row == 0){
+    return 0;
+  }
+  int rows = max(1, min(height, SAVE_BUFFER/file_row));
+
+  void *buffer = NULL;
+  int ret = posix_memalign(&buffer, BMP_BUFFER_ALIGN, rows*file_row + 1);
+  if(ret){
+    *error = ret;
+    return -1;
+  }
+  memset(buffer, 0, rows*file_row);
+
+  int i, j;
+  for(i=0; i<height; i+=rows){
+    int k = min(rows, height - i);
+    for(j=0; j<k; j++){
+      reverse_row((const BYTE *)image->bitmap[i+j]
+          , (BYTE *)buffer + j*file_row, width, size);
+    }
+    struct iovec iov = {buffer, k*file_row};
+    if((ret = write_vector(fd, &iov, 1, error))){
+      break;
+    }
+  }
+  free(buffer);
+  return ret;
+}
+
+//Bytes of the file of image whose headers are the n buffers of iov
+static size_t file_size(BMPFILE *image, const struct iovec *iov, int n){
+  size_t size = 0;
+  int i;
+
+  for(i=0; i<n; i++){
+    size += iov[i].iov_len;
+  }
+  return size + image->ih.biHeight*(row_bytes(image) + image->padding);
+}
+
+//Writes in dst the file of image whose headers are the n buffers of iov, the
+//rows in parallel
+static void fill_file(BMPFILE *image, const struct iovec *iov, int n
+        , BYTE *dst){
+  int i;
+
+  for(i=0; i<n; i++){
+    if(iov[i].iov_len){ // no alignment or palette is a NULL base
+      memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+      dst += iov[i].iov_len;
+    }
+  }
+  size_t file_row = row_bytes(image) + image->padding;
+  struct save_job job = {image, dst, file_row};
+  parallel_for(image->ih.biHeight, row_grain(image->ih.biWidth), save_rows
+      , &job);
+}
+
+//Rows [begin, end) of the image in the buffer of its file, with their
+//padding
+static void save_rows(void *arg, size_t begin, size_t end){
+  const struct save_job *job = arg;
+  BMPFILE *image = job->image;
+  int width = image->ih.biWidth;
+  int size = pixel_size(image);
+  size_t i;
+
+  for(i=begin; i<end; i++){
+    BYTE *dst = job->dst + i*job->file_row;
+    if(image->orientation & BMP_FLIP_H){
+      reverse_row((const BYTE *)image->bitmap[i], dst, width, size);
+    }else{
+      memcpy(dst, image->bitmap[i], (size_t)width*size);
+    }
+    memset(dst + (size_t)width*size, 0, image->padding);
+  }
+}
+
+//Codes the rows first + [begin, end) of the image, those of a 24 or 32 bit
+//one turned into indices of the palette first
+static void rle_rows(void *arg, size_t begin, size_t end){
+  struct rle_job *job = arg;
+  BMPFILE *image = job->image;
+  int width = image->ih.biWidth;
+  int size = pixel_size(image);
+  BYTE *index = NULL;
+  size_t i;
+  int j;
+
+  int flip_h = image->orientation & BMP_FLIP_H;
+  if(((job->map != NULL)||flip_h)&&((index = malloc(width + 1)) == NULL)){
+    __atomic_store_n(&job->error, errno, __ATOMIC_RELAXED);
+    errno = 0;
+    return;
+  }
+
+  //RLE images are bottom-up, the rows go out as shown
+  for(i=begin; i<end; i++){
+    int r = job->first + i;
+    if(image->orientation & BMP_FLIP_V){
+      r = image->ih.biHeight - 1 - r;
+    }
+    const BYTE *row = (const BYTE *)image->bitmap[r];
+    if(job->map == NULL){
+      if(flip_h){
+        reverse_row(row, index, width, 1);
+        row = index;
+      }
+    }else{
+      DWORD last = 0;
+      BYTE last_index = 0;
+      for(j=0; j<width; j++){
+        DWORD key = rle_key(row + (size_t)(flip_h ? width - 1 - j : j)*size);
+        if(key != last){
+          last = key;
+          last_index = job->map->index[rle_slot(job->map, key)];
+        }
+        index[j] = last_index;
+      }
+      row = index;
+    }
+    job->length[i] = encode_rle(row, width, job->out + i*job->row_max
+        , job->rle4);
+  }
+
+  free(index);
+}
+
+static struct io_request *new_request(BMPQUEUE *queue, int op, char *path
+        , void *tag, int *error){
+  pthread_mutex_lock(&queue->lock);
+  int full = (queue->outstanding >= queue->depth);
+  pthread_mutex_unlock(&queue->lock);
+  if(full){
+    *error = EAGAIN;
+    return NULL;
+  }
+
+  struct io_request *req = calloc(1, sizeof(struct io_request));
+  if((req == NULL)||((req->path = strdup(path)) == NULL)){
+    *error = errno;
+    errno = 0;
+    free(req);
+    return NULL;
+  }
+  req->op = op;
+  req->fd = -1;
+  req->tag = tag;
+  return req;
+}
+
+static void start_request(BMPQUEUE *queue, struct io_request *req){
+  pthread_mutex_lock(&queue->lock);
+  queue->outstanding++;
+  if(queue->ring == NULL){
+    if(queue->pending_last != NULL){
+      queue->pending_last->next = req;
+    }else{
+      queue->pending = req;
+    }
+    queue->pending_last = req;
+    pthread_cond_signal(&queue->work);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  if(queue->ring != NULL){
+    ring_start(queue, req);
+  }
+}
+
+static void finish_request(BMPQUEUE *queue, struct io_request *req){
+  free(req->data);
+  req->data = NULL;
+  req->next = NULL;
+  pthread_mutex_lock(&queue->lock);
+  if(queue->done_last != NULL){
+    queue->done_last->next = req;
+  }else{
+    queue->done = req;
+  }
+  queue->done_last = req;
+  pthread_cond_signal(&queue->ready);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+//The blocking request of BMP_IO_THREADS
+static void run_request(struct io_request *req){
+  if(req->op == BMP_IO_LOAD){
+    load_image(&req->image, req->path, &req->error);
+    return;
+  }
+
+  int fd = open(req->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd < 0){
+    req->error = errno;
+    errno = 0;
+    return;
+  }
+  struct iovec iov = {req->data, req->size};
+  if(write_vector(fd, &iov, 1, &req->error)){
+    close(fd);
+    return;
+  }
+  if(close(fd)){
+    req->error = errno;
+    errno = 0;
+  }
+}
+
+static void *queue_worker(void *arg){
+  BMPQUEUE *queue = arg;
+
+  pthread_mutex_lock(&queue->lock);
+  for(;;){
+    while((queue->pending == NULL)&&!queue->stop){
+      pthread_cond_wait(&queue->work, &queue->lock);
+    }
+    struct io_request *req = queue->pending;
+    if(req == NULL){
+      break;
+    }
+    if((queue->pending = req->next) == NULL){
+      queue->pending_last = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    run_request(req);
+    finish_request(queue, req);
+    pthread_mutex_lock(&queue->lock);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+#ifdef BMP_LINUX_URING
+
+static int ring_enter(struct io_ring *ring, unsigned wait, int *error){
+  for(;;){
+    long done = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait
+        , wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if(done >= 0){
+      ring->queued -= done;
+      return 0;
+    }
+    if(errno == EINTR){
+      continue;
+    }
+    //Too many completions not reaped yet, the caller reaps them
+    if((errno == EBUSY)||(errno == EAGAIN)){
+      errno = 0;
+      return 0;
+    }
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+}
+
+//Writes an entry in the submission ring, it goes to the kernel with the
+//next ring_enter
+static int ring_push(struct io_ring *ring, int opcode, int fd
+        , const void *addr, size_t len, size_t off, int flags, void *user
+        , int *error){
+  unsigned tail = *ring->sq_tail;
+
+  if((tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries)
+      &&ring_enter(ring, 0, error)){
+    return -1;
+  }
+  if(tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries){
+    *error = EBUSY;
+    return -1;
+  }
+
+  unsigned index = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)addr;
+  sqe->len = (len > QUEUE_IO_MAX) ? QUEUE_IO_MAX : len;
+  sqe->off = off;
+  sqe->open_flags = flags;
+  sqe->user_data = (uintptr_t)user;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+  return 0;
+}
+
+//Nobody waits for the close of a loaded file, its completion has no request
+static void ring_close_fd(struct io_ring *ring, int fd){
+  int error = 0;
+
+  if(ring_push(ring, IORING_OP_CLOSE, fd, NULL, 0, 0, 0, NULL, &error)){
+    close(fd);
+    return;
+  }
+  ring->closing++;
+}
+
+//Submits the operation of the step of req
+static int ring_issue(struct io_ring *ring, struct io_request *req
+        , int *error){
+  switch(req->step){
+    case IO_OPEN:
+      if(req->op == BMP_IO_LOAD){
+        return ring_push(ring, IORING_OP_OPENAT, AT_FDCWD, req->path, 0, 0
+            , O_RDONLY, req, error);
+      }
+      return ring_push(ring, IORING_OP_OPENAT, AT_FDCWD, req->path, 0666, 0
+          , O_WRONLY | O_CREAT | O_TRUNC, req, error);
+    case IO_READ:
+      return ring_push(ring, IORING_OP_READ, req->fd, req->data + req->offset
+          , req->size - req->offset, req->offset, 0, req, error);
+    case IO_WRITE:
+      return ring_push(ring, IORING_OP_WRITE, req->fd
+          , req->data + req->offset, req->size - req->offset, req->offset, 0
+          , req, error);
+    default:
+      return ring_push(ring, IORING_OP_CLOSE, req->fd, NULL, 0, 0, 0, req
+          , error);
+  }
+}
+
+//Moves req to its next step with the result res of the last one
+static void ring_step(BMPQUEUE *queue, struct io_request *req, int res){
+  struct io_ring *ring = queue->ring;
+  BITMAPFILEHEADER fh;
+  int error = 0;
+
+  if(res < 0){
+    error = -res;
+  }else switch(req->step){
+    case IO_OPEN:
+      req->fd = res;
+      if(req->op == BMP_IO_SAVE){
+        req->step = IO_WRITE;
+        break;
+      }
+      req->step = IO_READ;
+      req->size = QUEUE_CHUNK;
+      if((req->data = malloc(req->size)) == NULL){
+        error = errno;
+        errno = 0;
+      }
+      break;
+    case IO_READ:
+      //Reads may be short anywhere, only 0 or the size of the header tell
+      //the end of the file
+      memset(&fh, 0, sizeof(BITMAPFILEHEADER));
+      req->offset += res;
+      if(req->offset >= sizeof(BITMAPFILEHEADER)){
+        memcpy(&fh, req->data, sizeof(BITMAPFILEHEADER));
+      }
+      int known = (fh.bfType == 0x4D42)&&(fh.bfSize >= req->offset);
+      if((res == 0)||(known&&(fh.bfSize == req->offset))){
+        load_image_from_memory(&req->image, req->data, req->offset
+            , BMP_MEMORY_COPY, &req->error);
+        ring_close_fd(ring, req->fd);
+        finish_request(queue, req);
+        return;
+      }
+      if(req->offset == req->size){//Room for the rest of the file
+        size_t size = known ? fh.bfSize : 2*req->size;
+        BYTE *data = realloc(req->data, size);
+        if(data == NULL){
+          error = errno;
+          errno = 0;
+          break;
+        }
+        req->data = data;
+        req->size = size;
+      }
+      break;
+    case IO_WRITE:
+      req->offset += res;
+      if(res == 0){
+        error = EIO;
+      }else if(req->offset == req->size){
+        req->step = IO_CLOSE;
+      }
+      break;
+    default:
+      req->fd = -1;
+      finish_request(queue, req);
+      return;
+  }
+
+  if(!error&&!ring_issue(ring, req, &error)){
+    return;
+  }
+  req->error = error;
+  if((req->fd >= 0)&&(req->step != IO_CLOSE)){
+    ring_close_fd(ring, req->fd);
+  }
+  finish_request(queue, req);
+}
+
+static void ring_reap(BMPQUEUE *queue){
+  struct io_ring *ring = queue->ring;
+  unsigned head = *ring->cq_head;
+
+  while(head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    struct io_request *req = (struct io_request *)(uintptr_t)cqe->user_data;
+    int res = cqe->res;
+    __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+    if(req == NULL){
+      ring->closing--;
+    }else{
+      ring_step(queue, req, res);
+    }
+  }
+}
+
+static void ring_free(struct io_ring *ring){
+  if(ring->sqes != NULL){
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if((ring->cq_map != NULL)&&(ring->cq_map != ring->sq_map)){
+    munmap(ring->cq_map, ring->cq_size);
+  }
+  if(ring->sq_map != NULL){
+    munmap(ring->sq_map, ring->sq_size);
+  }
+  close(ring->fd);
+  free(ring);
+}
+
+static void *ring_map(struct io_ring *ring, size_t size, off_t offset){
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE
+      , MAP_SHARED | MAP_POPULATE, ring->fd, offset);
+  return (map == MAP_FAILED) ? NULL : map;
+}
+
+//The opens, reads, writes and closes must all be supported
+static int ring_probe(struct io_ring *ring){
+  static const int ops[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE
+      , IORING_OP_CLOSE};
+  size_t size = sizeof(struct io_uring_probe)
+      + 256*sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  int i, ok = (probe != NULL);
+
+  if(ok&&(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE
+      , probe, 256) < 0)){
+    ok = 0;
+  }
+  for(i=0; ok&&(i<sizeof(ops)/sizeof(ops[0])); i++){
+    ok = (ops[i] <= probe->last_op)
+        &&(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  errno = 0;
+  return ok;
+}
+
+static int ring_setup(BMPQUEUE *queue, unsigned entries, int *error){
+  struct io_uring_params params;
+  struct io_ring *ring = calloc(1, sizeof(struct io_ring));
+
+  if(ring == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CLAMP;
+  if((ring->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0){
+    *error = errno;
+    errno = 0;
+    free(ring);
+    return -1;
+  }
+
+  ring->sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  ring->cq_size = params.cq_off.cqes
+      + params.cq_entries*sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+  int single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if(single){
+    ring->sq_size = ring->cq_size = (ring->sq_size > ring->cq_size)
+        ? ring->sq_size : ring->cq_size;
+  }
+  if(((ring->sq_map = ring_map(ring, ring->sq_size, IORING_OFF_SQ_RING))
+      == NULL)||((ring->cq_map = single ? ring->sq_map : ring_map(ring
+      , ring->cq_size, IORING_OFF_CQ_RING)) == NULL)||((ring->sqes = ring_map(
+      ring, ring->sqes_size, IORING_OFF_SQES)) == NULL)){
+    *error = errno;
+    errno = 0;
+    ring_free(ring);
+    return -1;
+  }
+  if(!ring_probe(ring)){
+    *error = ENOSYS;
+    ring_free(ring);
+    return -1;
+  }
+
+  ring->entries = params.sq_entries;
+  ring->sq_head = (unsigned *)(ring->sq_map + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(ring->sq_map + params.sq_off.tail);
+  ring->sq_array = (unsigned *)(ring->sq_map + params.sq_off.array);
+  ring->sq_mask = *(unsigned *)(ring->sq_map + params.sq_off.ring_mask);
+  ring->cq_head = (unsigned *)(ring->cq_map + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(ring->cq_map + params.cq_off.tail);
+  ring->cqes = (struct io_uring_cqe *)(ring->cq_map + params.cq_off.cqes);
+  ring->cq_mask = *(unsigned *)(ring->cq_map + params.cq_off.ring_mask);
+  queue->ring = ring;
+  return 0;
+}
+
+static void ring_start(BMPQUEUE *queue, struct io_request *req){
+  int error = 0;
+
+  req->step = IO_OPEN;
+  if(ring_issue(queue->ring, req, &error)){
+    req->error = error;
+    finish_request(queue, req);
+  }
+}
+
+//Submits the entries written and handles the completions, waiting for one
+static int ring_wait(BMPQUEUE *queue, int *error){
+  if(ring_enter(queue->ring, 1, error)){
+    return -1;
+  }
+  ring_reap(queue);
+  return 0;
+}
+
+static void ring_close(BMPQUEUE *queue){
+  struct io_ring *ring = queue->ring;
+  int error = 0;
+
+  while((ring->closing > 0)&&!ring_enter(ring, 1, &error)){
+    ring_reap(queue);
+  }
+  ring_free(ring);
+  queue->ring = NULL;
+}
+
+#else
+
+static int ring_setup(BMPQUEUE *queue, unsigned entries, int *error){
+  *error = ENOSYS;
+  return -1;
+}
+
+//Without io_uring there is never a ring to use
+static void ring_start(BMPQUEUE *queue, struct io_request *req){
+}
+
+static int ring_wait(BMPQUEUE *queue, int *error){
+  *error = ENOSYS;
+  return -1;
+}
+
+static void ring_close(BMPQUEUE *queue){
+}
+
+#endif
+
+//Vertical boxes over the bytes [begin, end) of every row
+static void box_columns(void *arg, size_t begin, size_t end){
+  struct box_job *job = arg;
+  size_t row_size = end - begin;
+  int height = job->height;
+  int i, n;
+  size_t j;
+
+  DWORD *acc = malloc(row_size * sizeof(DWORD));
+  if(acc == NULL){
+    __atomic_store_n(&job->error, errno, __ATOMIC_RELAXED);
+    errno = 0;
+    return;
+  }
+
+  RGBTRIPLE **src = job->src;
+  RGBTRIPLE **dst = job->dst;
+  for(n=0; n<BLUR_BOXES; n++){
+    int r = job->boxes[n];
+    int count = min(r, height-1) + 1;
+
+    memset(acc, 0, row_size * sizeof(DWORD));
+    for(i=0; i<count; i++){
+      const BYTE *in = (const BYTE *)src[i] + begin;
+      for(j=0; j<row_size; j++){
+        acc[j] += in[j];
+      }
+    }
+
+    for(i=0; i<height; i++){
+      BYTE *out = (BYTE *)dst[i] + begin;
+      for(j=0; j<row_size; j++){
+        out[j] = (acc[j] + count/2)/count;
+      }
+      if(i+r+1 < height){//The window enters a new row
+        const BYTE *in = (const BYTE *)src[i+r+1] + begin;
+        for(j=0; j<row_size; j++){
+          acc[j] += in[j];
+        }
+        count++;
+      }
+      if(i-r >= 0){//And leaves an old one
+        const BYTE *in = (const BYTE *)src[i-r] + begin;
+        for(j=0; j<row_size; j++){
+          acc[j] -= in[j];
+        }
+        count--;
+      }
+    }
+
+    RGBTRIPLE **aux = src;
+    src = dst;
+    dst = aux;
+  }
+
+  free(acc);
+}
+
+static unsigned int *histo_channel(const BMPHISTO *histo, int c){
+  unsigned int *channels[4] = {(unsigned int *)histo->r
+      , (unsigned int *)histo->g, (unsigned int *)histo->b
+      , (unsigned int *)histo->y};
+  return channels[c];
+}
+
+static void plot_points(const unsigned int *counts, unsigned int max, int *x
+        , int *y){
+  int width = BMP_PLOT_WIDTH - PLOT_LEFT - PLOT_RIGHT;
+  int height = BMP_PLOT_HEIGHT - PLOT_TOP - PLOT_BOTTOM;
+  int i;
+
+  //Measured from the bottom left corner of the chart
+  for(i=0; i<256; i++){
+    x[i] = PLOT_LEFT + i*(width - 1)/255;
+    y[i] = PLOT_BOTTOM + (int)((unsigned long long)counts[i]*(height - 1)/max);
+  }
+}
+
+static unsigned int plot_max(const BMPHISTO *histo, int channels){
+  unsigned int max = 1;
+  int c, i;
+
+  for(c=0; c<4; c++){
+    if(channels & (1 << c)){
+      const unsigned int *counts = histo_channel(histo, c);
+      for(i=0; i<256; i++){
+        if(counts[i] > max){
+          max = counts[i];
+        }
+      }
+    }
+  }
+  return max;
+}
+
+static void plot_line(RGBTRIPLE *canvas, int x0, int y0, int x1, int y1
+        , RGBTRIPLE colour){
+  int dx = abs(x1 - x0);
+  int dy = -abs(y1 - y0);
+  int sx = (x0 < x1) ? 1 : -1;
+  int sy = (y0 < y1) ? 1 : -1;
+  int err = dx + dy;
+  int e2;
+
+  //Bresenham
+  for(;;){
+    canvas[y0*BMP_PLOT_WIDTH + x0] = colour;
+    if((x0 == x1)&&(y0 == y1)){
+      break;
+    }
+    e2 = 2*err;
+    if(e2 >= dy){
+      err += dy;
+      x0 += sx;
+    }
+    if(e2 <= dx){
+      err += dx;
+      y0 += sy;
+    }
+  }
+}
+
+static void plot_canvas(const BMPHISTO *histo, int channels
+        , RGBTRIPLE *canvas){
+  RGBTRIPLE white = {0xFF, 0xFF, 0xFF};
+  RGBTRIPLE grid = {0xE0, 0xE0, 0xE0};
+  RGBTRIPLE black = {0x00, 0x00, 0x00};
+  int left = PLOT_LEFT;
+  int right = BMP_PLOT_WIDTH - PLOT_RIGHT - 1;
+  int bottom = PLOT_BOTTOM;
+  int top = BMP_PLOT_HEIGHT - PLOT_TOP - 1;
+  int x[256], y[256];
+  int c, i;
+
+  //Rows bottom-up, as in a BMPFILE
+  for(i=0; i<BMP_PLOT_WIDTH*BMP_PLOT_HEIGHT; i++){
+    canvas[i] = white;
+  }
+  for(i=1; i<4; i++){
+    int gy = bottom + i*(top - bottom)/4;
+    int gx = left + 64*i*(right - left)/255;
+    plot_line(canvas, left, gy, right, gy, grid);
+    plot_line(canvas, gx, bottom, gx, top, grid);
+  }
+
+  unsigned int max = plot_max(histo, channels);
+  for(c=0; c<4; c++){
+    if(channels & (1 << c)){
+      plot_points(histo_channel(histo, c), max, x, y);
+      for(i=1; i<256; i++){
+        plot_line(canvas, x[i-1], y[i-1], x[i], y[i], plot_colour[c]);
+      }
+    }
+  }
+
+  plot_line(canvas, left, bottom, right, bottom, black);
+  plot_line(canvas, right, bottom, right, top, black);
+  plot_line(canvas, right, top, left, top, black);
+  plot_line(canvas, left, top, left, bottom, black);
+}
+
+static int plot_svg(const BMPHISTO *histo, int channels, char *path
+        , int *error){
+  static const char *names[4] = {"Red", "Green", "Blue", "Luma"};
+  int width = BMP_PLOT_WIDTH;
+  int height = BMP_PLOT_HEIGHT;
+  int left = PLOT_LEFT;
+  int right = width - PLOT_RIGHT - 1;
+  int top = PLOT_TOP;
+  int bottom = height - PLOT_BOTTOM - 1;
+  int x[256], y[256];
+  int c, i;
+  FILE *fd;
+
+  if((fd = fopen(path, "w")) == NULL){
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+
+  fprintf(fd, "<svg xmlns=\"http://www.w3.org/2000/svg\"");
+  fprintf(fd, " width=\"%d\" height=\"%d\">\n", width, height);
+  fprintf(fd, "<rect width=\"100%%\" height=\"100%%\" fill=\"#FFFFFF\"/>\n");
+  fprintf(fd, "<g font-family=\"sans-serif\" font-size=\"12\">\n");
+  for(i=0; i<5; i++){
+    int value = (i < 4) ? 64*i : 255;
+    int gx = left + value*(right - left)/255;
+    fprintf(fd, "<line x1=\"%d\" y1=\"%d\" x2=\"%d\" y2=\"%d\"", gx, top
+        , gx, bottom);
+    fprintf(fd, " stroke=\"#E0E0E0\"/>\n");
+    fprintf(fd, "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\">%d</text>\n"
+        , gx, bottom + 16, value);
+  }
+
+  unsigned int max = plot_max(histo, channels);
+  fprintf(fd, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">%u</text>\n"
+      , left - 4, top + 4, max);
+  fprintf(fd, "</g>\n");
+
+  for(c=0; c<4; c++){
+    if(!(channels & (1 << c))){
+      continue;
+    }
+    const RGBTRIPLE *colour = &plot_colour[c];
+    plot_points(histo_channel(histo, c), max, x, y);
+    fprintf(fd, "<polyline fill=\"none\" stroke=\"#%02X%02X%02X\" points=\""
+        , colour->r, colour->g, colour->b);
+    for(i=0; i<256; i++){//SVG rows go top-down
+      fprintf(fd, "%s%d,%d", i ? " " : "", x[i], height - 1 - y[i]);
+    }
+    fprintf(fd, "\"><title>%s</title></polyline>\n", names[c]);
+  }
+
+  fprintf(fd, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\"", left
+      , top, right - left, bottom - top);
+  fprintf(fd, " fill=\"none\" stroke=\"#000000\"/>\n");
+  fprintf(fd, "</svg>\n");
+
+  int failed = ferror(fd);
+  if((fclose(fd) != 0)||failed){
+    *error = CANNOT_WRITE;
+    errno = 0;
+    return -1;
+  }
+  return 0;
+}
+
+static int plot_bmp(const RGBTRIPLE *canvas, char *path, int *error){
+  BMPSTREAM stream;
+
+  if(create_stream(&stream, path, BMP_PLOT_WIDTH, BMP_PLOT_HEIGHT, error)){
+    return -1;
+  }
+  if(write_rows(&stream, (RGBTRIPLE *)canvas, BMP_PLOT_HEIGHT, error)){
+    int ignored;
+    close_stream(&stream, &ignored);
+    return -1;
+  }
+  return close_stream(&stream, error);
+}
+
+static int plot_png(const RGBTRIPLE *canvas, char *path, int *error){
+  static const BYTE signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A
+      , '\n'};
+  DWORD crc_table[256];
+  DWORD a = 1, b = 0; // Adler-32 of the raw rows
+  int i, j, k;
+
+  for(i=0; i<256; i++){
+    DWORD crc = i;
+    for(k=0; k<8; k++){
+      crc = (crc & 1) ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+    }
+    crc_table[i] = crc;
+  }
+
+  //zlib stream of stored deflate blocks: each raw row is a filter byte (none)
+  //and the r, g, b bytes of the row, top-down
+  size_t row = 1 + 3*BMP_PLOT_WIDTH;
+  size_t raw = row*BMP_PLOT_HEIGHT;
+  size_t blocks = (raw + 0xFFFF - 1)/0xFFFF;
+  size_t size = 2 + raw + 5*blocks + 4;
+  BYTE *data = malloc(size);
+  BYTE *rows = malloc(raw);
+  if((data == NULL)||(rows == NULL)){
+    free(data);
+    free(rows);
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+
+  BYTE *p = rows;
+  for(i=BMP_PLOT_HEIGHT-1; i>=0; i--){
+    const RGBTRIPLE *src = canvas + i*BMP_PLOT_WIDTH;
+    *p++ = 0;
+    for(j=0; j<BMP_PLOT_WIDTH; j++){
+      *p++ = src[j].r;
+      *p++ = src[j].g;
+      *p++ = src[j].b;
+    }
+  }
+
+  BYTE *q = data;
+  size_t done = 0;
+  *q++ = 0x78;
+  *q++ = 0x01;
+  while(done < raw){
+    size_t n = (raw - done < 0xFFFF) ? raw - done : 0xFFFF;
+    *q++ = (done + n == raw) ? 1 : 0;
+    *q++ = n & 0xFF;
+    *q++ = n >> 8;
+    *q++ = ~n & 0xFF;
+    *q++ = (~n >> 8) & 0xFF;
+    memcpy(q, rows + done, n);
+    q += n;
+    done += n;
+  }
+  for(done=0; done<raw; done++){
+    a = (a + rows[done]) % 65521;
+    b = (b + a) % 65521;
+  }
+  put_be32(q, (b << 16) | a);
+
+  BYTE header[13];
+  put_be32(header, BMP_PLOT_WIDTH);
+  put_be32(header + 4, BMP_PLOT_HEIGHT);
+  header[8] = 8; // bits per channel
+  header[9] = 2; // truecolour
+  header[10] = 0; // deflate
+  header[11] = 0; // adaptive filtering
+  header[12] = 0; // no interlace
+
+  FILE *fd;
+  if((fd = fopen(path, "w")) == NULL){
+    free(data);
+    free(rows);
+    *error = errno;
+    errno = 0;
+    return -1;
+  }
+  fwrite(signature, 1, sizeof(signature), fd);
+  png_chunk(fd, "IHDR", header, sizeof(header), crc_table);
+  png_chunk(fd, "IDAT", data, size, crc_table);
+  png_chunk(fd, "IEND", NULL, 0, crc_table);
+  free(data);
+  free(rows);
+
+  int failed = ferror(fd);
+  if((fclose(fd) != 0)||failed){
+    *error = CANNOT_WRITE;
+    errno = 0;
+    return -1;
+  }
+  return 0;
+}
+
+static void png_chunk(FILE *fd, const char *type, const BYTE *data, size_t n
+        , const DWORD *crc_table){
+  BYTE word[4];
+  DWORD crc = 0xFFFFFFFF;
+  size_t i;
+
+  for(i=0; i<4; i++){
+    crc = crc_table[(crc ^ (BYTE)type[i]) & 0xFF] ^ (crc >> 8);
+  }
+  for(i=0; i<n; i++){
+    crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  }
+
+  put_be32(word, n);
+  fwrite(word, 1, 4, fd);
+  fwrite(type, 1, 4, fd);
+  if(n){
+    fwrite(data, 1, n, fd);
+  }
+  put_be32(word, crc ^ 0xFFFFFFFF);
+  fwrite(word, 1, 4, fd);
+}
+
+static void put_be32(BYTE *p, DWORD v){
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+//The channels of pixels of size bytes are resampled alike, so an image gives
+//the same pixels at 8, 24 or 32 bit
+RGBTRIPLE **resample_bitmap(BMPPOOL *pool, RGBTRIPLE **bitmap, int new_height
+        , int new_width, int old_height, int old_width, int size
+        , int *error){
+
+  //Every pixel is written, there is no need to clear it
+  RGBTRIPLE **new_bitmap = alloc_rows(pool, new_height
+      , (size_t)new_width*size, 0, error);
+  if(new_bitmap == NULL){
+    return NULL;
+  }
+
+  //The Lanczos terms of a column are the same for every row
+  double *lanc = malloc((size_t)new_width * 4 * sizeof(double));
+  if(lanc == NULL){
+    free_bitmap(new_bitmap);
+    *error = errno;
+    errno = 0;
+    return NULL;
+  }
+
+  double col_ratio = (double)old_width / (double)new_width;
+  int j, y;
+  for(j=0; j<new_width; j++){
+    double old_j = j*col_ratio;
+    int floor_j = (int)old_j;
+    for(y=0; y<4; y++){
+      lanc[4*j + y] = _L(old_j - (floor_j - 1 + y));
+    }
+  }
+
+  struct resample_job job = {bitmap, new_bitmap, new_height, new_width
+      , old_height, old_width, size, lanc};
+  parallel_for(new_height, row_grain(new_width), resample_rows, &job);
+
+  free(lanc);
+  return new_bitmap;
+}
+
+double fast_sin(double var){
+  int loops = var/(E_TAU);
+  var = var - loops*E_TAU;
+
+  if(var>E_PI){
+    var = E_PI - var;
+  }else if((-var)>E_PI){
+    var = -E_PI - var;
+  }
+
+  if(var<0){
+    var = -var;
+    return -(16.0*var*(E_PI - var))/(5.0*E_PI_SQ - 4.0*var*(E_PI - var));
+  }else{
+    return (16.0*var*(E_PI - var))/(5.0*E_PI_SQ - 4.0*var*(E_PI - var));
+  }
+}
+
+double sinc(double var){
+  if(var == 0.0){
+    return 1.0;
+  }
+  return fast_sin(E_PI*var)/(E_PI*var);
+}
+
+double _L(double var){//Lanczos kernel window size = 2
+  if((var < 2)&&(var > -2)){
+    return sinc(var)*sinc(var/2.0);
+  }
+  return 0;
+}
+
+double _G(double x, double sigma){//Gaussian function
+  return (1/(2*E_PI*sigma*sigma))*fast_exp(-(x*x)/(2*sigma*sigma));
+}
+
+int max(int a, int b){
+  if(a > b){
+    return a;
+  }
+  return b;
+}
+
+int min(int a, int b){
+  if(a < b){
+    return a;
+  }
+  return b;
+}
+
+double fast_exp(double x){
+  volatile union{
+    float f;
+    unsigned int i;
+  }cvt;
+
+  float t = x * 1.442695041;
+  float fi = (float)((int)t);
+  float f = t - fi;
+  int i = (int)fi;
+  cvt.f = (0.3371894346 * f + 0.657636276) * f + 1.00172476;
+  cvt.i += (i << 23);
+  return (double)cvt.f;
+}
+
+#ifdef BMP_X86_SIMD
+
+/* Packed 24 bit pixels are handled by chunks of 16 pixels (48 bytes, three
+   128 bit vectors). The masks below gather the b, g and r bytes of a chunk
+   into three planes and scatter them back. AVX2 and AVX-512 run two and four
+   chunks side by side, one in each 128 bit lane, with the same masks. */
+
+static const BYTE deinterleave_mask[3][3][16] __attribute__((aligned(16))) =
+  {
+    {//b plane from vectors 0, 1 and 2
+      {0x00, 0x03, 0x06, 0x09, 0x0C, 0x0F, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x02, 0x05,
+       0x08, 0x0B, 0x0E, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x01, 0x04, 0x07, 0x0A, 0x0D}
+    },
+    {//g plane
+      {0x01, 0x04, 0x07, 0x0A, 0x0D, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x00, 0x03, 0x06,
+       0x09, 0x0C, 0x0F, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x02, 0x05, 0x08, 0x0B, 0x0E}
+    },
+    {//r plane
+      {0x02, 0x05, 0x08, 0x0B, 0x0E, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x01, 0x04, 0x07,
+       0x0A, 0x0D, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x00, 0x03, 0x06, 0x09, 0x0C, 0x0F}
+    }
+  };
+
+static const BYTE interleave_mask[3][3][16] __attribute__((aligned(16))) =
+  {
+    {//vector 0 from the b, g and r planes
+      {0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02, 0x80,
+       0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80, 0x05},
+      {0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80, 0x02,
+       0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80, 0x80},
+      {0x80, 0x80, 0x00, 0x80, 0x80, 0x01, 0x80, 0x80,
+       0x02, 0x80, 0x80, 0x03, 0x80, 0x80, 0x04, 0x80}
+    },
+    {//vector 1
+      {0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80, 0x80,
+       0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0A, 0x80},
+      {0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07, 0x80,
+       0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80, 0x0A},
+      {0x80, 0x05, 0x80, 0x80, 0x06, 0x80, 0x80, 0x07,
+       0x80, 0x80, 0x08, 0x80, 0x80, 0x09, 0x80, 0x80}
+    },
+    {//vector 2
+      {0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80, 0x80, 0x0D,
+       0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F, 0x80, 0x80},
+      {0x80, 0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80, 0x80,
+       0x0D, 0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F, 0x80},
+      {0x0A, 0x80, 0x80, 0x0B, 0x80, 0x80, 0x0C, 0x80,
+       0x80, 0x0D, 0x80, 0x80, 0x0E, 0x80, 0x80, 0x0F}
+    }
+  };
+
+/* Blocks are transposed with one 32 bit lane per pixel: the 8 pixels of a
+   block row are spread over two vectors, pixels 0-3 from its first 16 bytes
+   and 4-7 from its last 16, and packed back to 24 bytes when stored. */
+
+static const BYTE transpose_mask[3][16] __attribute__((aligned(16))) =
+  {
+    {0x00, 0x01, 0x02, 0x80, 0x03, 0x04, 0x05, 0x80,
+     0x06, 0x07, 0x08, 0x80, 0x09, 0x0A, 0x0B, 0x80},//pixels 0-3
+    {0x04, 0x05, 0x06, 0x80, 0x07, 0x08, 0x09, 0x80,
+     0x0A, 0x0B, 0x0C, 0x80, 0x0D, 0x0E, 0x0F, 0x80},//pixels 4-7
+    {0x00, 0x01, 0x02, 0x04, 0x05, 0x06, 0x08, 0x09,
+     0x0A, 0x0C, 0x0D, 0x0E, 0x80, 0x80, 0x80, 0x80} //packed
+  };
+
+static const BYTE reverse_mask[3][3][16] __attribute__((aligned(16))) =
+  {
+    {//vector 0 of the reversed chunk from vectors 0, 1 and 2
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x0E},
+      {0x0D, 0x0E, 0x0F, 0x0A, 0x0B, 0x0C, 0x07, 0x08,
+       0x09, 0x04, 0x05, 0x06, 0x01, 0x02, 0x03, 0x80}
+    },
+    {//vector 1
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x0F, 0x80},
+      {0x0F, 0x80, 0x0B, 0x0C, 0x0D, 0x08, 0x09, 0x0A,
+       0x05, 0x06, 0x07, 0x02, 0x03, 0x04, 0x80, 0x00},
+      {0x80, 0x00, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80}
+    },
+    {//vector 2
+      {0x80, 0x0C, 0x0D, 0x0E, 0x09, 0x0A, 0x0B, 0x06,
+       0x07, 0x08, 0x03, 0x04, 0x05, 0x00, 0x01, 0x02},
+      {0x01, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80},
+      {0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+       0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80}
+    }
+  };
+
+//The pixels of a chunk set in near go back to their values in orig and
+//through the scalar kernel, the exact kernels leave them the doubles
+static inline void patch_span(RGBTRIPLE *span, const RGBTRIPLE *orig
+        , int near, span_fn fn, const void *arg){
+  while(near){
+    int j = __builtin_ctz(near);
+    span[j] = orig[j];
+    fn(span + j, 1, arg);
+    near &= near - 1;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* SSE4.1, 16 pixels per iteration                                           */
+/*---------------------------------------------------------------------------*/
+
+#define MASK_SSE(m) _mm_load_si128((const __m128i *)(m))
+
+TARGET_SSE41 static inline void load_planes_sse41(const BYTE *p
+        , __m128i *b, __m128i *g, __m128i *r){
+  __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+  __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+  __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 32));
+  __m128i *plane[3] = {b, g, r};
+  int c;
+
+  for(c=0; c<3; c++){
+    *plane[c] = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v0, MASK_SSE(deinterleave_mask[c][0])),
+        _mm_shuffle_epi8(v1, MASK_SSE(deinterleave_mask[c][1]))),
+        _mm_shuffle_epi8(v2, MASK_SSE(deinterleave_mask[c][2])));
+  }
+}
+
+TARGET_SSE41 static inline void store_planes_sse41(BYTE *p, __m128i b
+        , __m128i g, __m128i r){
+  int v;
+
+  for(v=0; v<3; v++){
+    __m128i out = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(b, MASK_SSE(interleave_mask[v][0])),
+        _mm_shuffle_epi8(g, MASK_SSE(interleave_mask[v][1]))),
+        _mm_shuffle_epi8(r, MASK_SSE(interleave_mask[v][2])));
+    _mm_storeu_si128((__m128i *)(p + 16*v), out);
+  }
+}
+
+//dot_exact for 4 pixels as 32 bit integers, near gets the lanes of dot_near
+//that dot_exact asks the doubles
+TARGET_SSE41 static inline __m128i dot4_sse41(__m128i r, __m128i g
+        , __m128i b, const struct colour_dot *dot, __m128i *near){
+  __m128i s = _mm_add_epi32(_mm_add_epi32(
+      _mm_mullo_epi32(r, _mm_set1_epi32(dot->fixed[0])),
+      _mm_mullo_epi32(g, _mm_set1_epi32(dot->fixed[1]))),
+      _mm_mullo_epi32(b, _mm_set1_epi32(dot->fixed[2])));
+  __m128i frac = _mm_slli_epi32(s, 32 - DOT_BITS);
+  *near = _mm_cmpeq_epi32(_mm_max_epu32(frac, _mm_set1_epi32(dot->limit))
+      , frac);
+  return _mm_srli_epi32(s, DOT_BITS);
+}
+
+//The same for 16 pixels, saturated to a byte. The pixels near a whole number
+//are added to the bits of near
+TARGET_SSE41 static inline __m128i dot16_sse41(__m128i r, __m128i g
+        , __m128i b, const struct colour_dot *dot, int *near){
+  __m128i q[4], m[4];
+  int k;
+
+  for(k=0; k<4; k++){
+    q[k] = dot4_sse41(_mm_cvtepu8_epi32(r), _mm_cvtepu8_epi32(g)
+        , _mm_cvtepu8_epi32(b), dot, &m[k]);
+    r = _mm_srli_si128(r, 4);
+    g = _mm_srli_si128(g, 4);
+    b = _mm_srli_si128(b, 4);
+  }
+  *near |= _mm_movemask_epi8(_mm_packs_epi16(_mm_packs_epi32(m[0], m[1])
+      , _mm_packs_epi32(m[2], m[3])));
+  return _mm_packus_epi16(_mm_packs_epi32(q[0], q[1])
+      , _mm_packs_epi32(q[2], q[3]));
+}
+
+//dot_fast for 8 pixels, from 16 bit lanes that hold v << 8
+TARGET_SSE41 static inline __m128i quick8_sse41(__m128i r, __m128i g
+        , __m128i b, const struct colour_dot *dot){
+  __m128i s = _mm_adds_epu16(
+      _mm_mulhi_epu16(r, _mm_set1_epi16(dot->quick[0])),
+      _mm_mulhi_epu16(g, _mm_set1_epi16(dot->quick[1])));
+  s = _mm_adds_epu16(s, _mm_mulhi_epu16(b, _mm_set1_epi16(dot->quick[2])));
+  return _mm_srli_epi16(_mm_adds_epu16(s, _mm_set1_epi16(128)), 8);
+}
+
+TARGET_SSE41 static inline __m128i quick16_sse41(__m128i r, __m128i g
+        , __m128i b, const struct colour_dot *dot){
+  __m128i zero = _mm_setzero_si128();
+  return _mm_packus_epi16(quick8_sse41(_mm_unpacklo_epi8(zero, r)
+      , _mm_unpacklo_epi8(zero, g), _mm_unpacklo_epi8(zero, b), dot)
+      , quick8_sse41(_mm_unpackhi_epi8(zero, r), _mm_unpackhi_epi8(zero, g)
+      , _mm_unpackhi_epi8(zero, b), dot));
+}
+
+TARGET_SSE41 static void zero_span_sse41(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int mask = *(const int *)arg;
+  BYTE pattern[48];
+  size_t i;
+
+  for(i=0; i<48; i++){
+    pattern[i] = (mask >> (8*(i%3))) & 0xFF;
+  }
+  __m128i m0 = _mm_loadu_si128((const __m128i *)pattern);
+  __m128i m1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+  __m128i m2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
+
+  BYTE *p = (BYTE *)span;
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i *v = (__m128i *)p;
+    _mm_storeu_si128(v, _mm_and_si128(_mm_loadu_si128(v), m0));
+    _mm_storeu_si128(v + 1, _mm_and_si128(_mm_loadu_si128(v + 1), m1));
+    _mm_storeu_si128(v + 2, _mm_and_si128(_mm_loadu_si128(v + 2), m2));
+  }
+  zero_span(span + i, n - i, arg);
+}
+
+TARGET_SSE41 static void invert_span_sse41(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  __m128i ones = _mm_set1_epi8(-1);
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i *v = (__m128i *)p;
+    _mm_storeu_si128(v, _mm_xor_si128(_mm_loadu_si128(v), ones));
+    _mm_storeu_si128(v + 1, _mm_xor_si128(_mm_loadu_si128(v + 1), ones));
+    _mm_storeu_si128(v + 2, _mm_xor_si128(_mm_loadu_si128(v + 2), ones));
+  }
+  invert_span(span + i, n - i, arg);
+}
+
+TARGET_SSE41 static void sepia_span_sse41(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int fast = (precision_mode == BMP_PRECISION_FAST);
+  RGBTRIPLE orig[16];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r, nb, ng, nr;
+    int near = 0;
+    load_planes_sse41(p, &b, &g, &r);
+    if(fast){
+      nb = quick16_sse41(r, g, b, &sepia_dot[2]);
+      ng = quick16_sse41(r, g, b, &sepia_dot[1]);
+      nr = quick16_sse41(r, g, b, &sepia_dot[0]);
+    }else{
+      nb = dot16_sse41(r, g, b, &sepia_dot[2], &near);
+      ng = dot16_sse41(r, g, b, &sepia_dot[1], &near);
+      nr = dot16_sse41(r, g, b, &sepia_dot[0], &near);
+      if(near){
+        memcpy(orig, p, sizeof(orig));
+      }
+    }
+    store_planes_sse41(p, nb, ng, nr);
+    patch_span((RGBTRIPLE *)p, orig, near, sepia_span, arg);
+  }
+  sepia_span(span + i, n - i, arg);
+}
+
+TARGET_SSE41 static void grayscale_span_sse41(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int fast = (precision_mode == BMP_PRECISION_FAST);
+  char rgby = *(const char *)arg;
+  RGBTRIPLE orig[16];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  if(rgby == 'y'){
+    for(i=0; i+16<=n; i+=16, p+=48){
+      __m128i b, g, r, y;
+      int near = 0;
+      load_planes_sse41(p, &b, &g, &r);
+      if(fast){
+        y = quick16_sse41(r, g, b, &luma_dot);
+      }else if((y = dot16_sse41(r, g, b, &luma_dot, &near)), near){
+        memcpy(orig, p, sizeof(orig));
+      }
+      store_planes_sse41(p, y, y, y);
+      patch_span((RGBTRIPLE *)p, orig, near, grayscale_span, arg);
+    }
+    grayscale_span(span + i, n - i, arg);
+    return;
+  }
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r;
+    load_planes_sse41(p, &b, &g, &r);
+    switch(rgby){
+      case 'r':
+      store_planes_sse41(p, r, r, r);
+      break;
+
+      case 'g':
+      store_planes_sse41(p, b, g, g);
+      break;
+
+      case 'b':
+      store_planes_sse41(p, b, b, b);
+      break;
+    }
+  }
+  grayscale_span(span + i, n - i, arg);
+}
+
+TARGET_SSE41 static void bitone_span_sse41(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  const struct bitone_args *args = arg;
+  __m128i zero = _mm_setzero_si128();
+  __m128i thr = _mm_set1_epi16(max(0, min(args->threshold, 766)));
+  __m128i dark[3], light[3];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  dark[0] = _mm_set1_epi8(args->dark.b);
+  dark[1] = _mm_set1_epi8(args->dark.g);
+  dark[2] = _mm_set1_epi8(args->dark.r);
+  light[0] = _mm_set1_epi8(args->light.b);
+  light[1] = _mm_set1_epi8(args->light.g);
+  light[2] = _mm_set1_epi8(args->light.r);
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r;
+    load_planes_sse41(p, &b, &g, &r);
+
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(r, zero)
+        , _mm_unpacklo_epi8(g, zero)), _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(r, zero)
+        , _mm_unpackhi_epi8(g, zero)), _mm_unpackhi_epi8(b, zero));
+    __m128i m = _mm_packs_epi16(_mm_cmpgt_epi16(thr, lo)
+        , _mm_cmpgt_epi16(thr, hi));
+
+    store_planes_sse41(p, _mm_blendv_epi8(light[0], dark[0], m)
+        , _mm_blendv_epi8(light[1], dark[1], m)
+        , _mm_blendv_epi8(light[2], dark[2], m));
+  }
+  bitone_span(span + i, n - i, arg);
+}
+
+//hsv_recip[d] for 4 d >= 1, the float estimate is at most one too big
+TARGET_SSE41 static inline __m128i recip4_sse41(__m128i d){
+  __m128i one = _mm_set1_epi32(1 << HSV_RECIP_BITS);
+  __m128i q;
+
+  d = _mm_max_epi32(d, _mm_set1_epi32(1));
+  q = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(one), _mm_cvtepi32_ps(d)));
+  return _mm_add_epi32(q, _mm_cmpgt_epi32(_mm_mullo_epi32(q, d), one));
+}
+
+//to_hsv_span for 4 pixels as 32 bit integers
+TARGET_SSE41 static inline void hsv4_sse41(__m128i r, __m128i g, __m128i b
+        , __m128i *h, __m128i *s){
+  __m128i max = _mm_max_epi32(_mm_max_epi32(r, g), b);
+  __m128i delta = _mm_sub_epi32(max, _mm_min_epi32(_mm_min_epi32(r, g), b));
+  __m128i rm = _mm_cmpeq_epi32(max, r);
+  __m128i gm = _mm_andnot_si128(rm, _mm_cmpeq_epi32(max, g));
+  __m128i bm = _mm_andnot_si128(_mm_or_si128(rm, gm), _mm_set1_epi32(-1));
+  __m128i diff = _mm_sub_epi32(r, g);
+  __m128i hue;
+
+  diff = _mm_blendv_epi8(diff, _mm_sub_epi32(b, r), gm);
+  diff = _mm_blendv_epi8(diff, _mm_sub_epi32(g, b), rm);
+  hue = _mm_or_si128(_mm_and_si128(gm, _mm_set1_epi32(2*BMP_HUE_SECTOR))
+      , _mm_and_si128(bm, _mm_set1_epi32(4*BMP_HUE_SECTOR)));
+  hue = _mm_add_epi32(hue, _mm_srai_epi32(_mm_add_epi32(
+      _mm_mullo_epi32(diff, recip4_sse41(delta))
+      , _mm_set1_epi32(1 << (HSV_RECIP_BITS - 11))), HSV_RECIP_BITS - 10));
+  *h = _mm_add_epi32(hue, _mm_and_si128(_mm_srai_epi32(hue, 31)
+      , _mm_set1_epi32(BMP_HUE_MAX)));
+  *s = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(delta, recip4_sse41(max))
+      , _mm_set1_epi32(1 << (HSV_RECIP_BITS - 13))), HSV_RECIP_BITS - 12);
+}
+
+//to_rgb_span for 4 pixels as 32 bit integers
+TARGET_SSE41 static inline void rgb4_sse41(__m128i h, __m128i s, __m128i v
+        , __m128i *r, __m128i *g, __m128i *b){
+  const int one = BMP_SAT_MAX*BMP_HUE_SECTOR;
+  __m128i sector = _mm_srli_epi32(h, 10);
+  __m128i f = _mm_and_si128(h, _mm_set1_epi32(BMP_HUE_SECTOR - 1));
+  __m128i sf, p, q, t, is[6];
+  int k;
+
+  //sector%6, exact for the 64 sectors of a WORD hue
+  sector = _mm_sub_epi32(sector, _mm_mullo_epi32(_mm_srli_epi32(
+      _mm_mullo_epi32(sector, _mm_set1_epi32(43)), 8), _mm_set1_epi32(6)));
+  for(k=0; k<6; k++){
+    is[k] = _mm_cmpeq_epi32(sector, _mm_set1_epi32(k));
+  }
+  s = _mm_min_epi32(s, _mm_set1_epi32(BMP_SAT_MAX));
+
+  p = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(v
+      , _mm_sub_epi32(_mm_set1_epi32(BMP_SAT_MAX), s))
+      , _mm_set1_epi32(BMP_SAT_MAX/2)), 12);
+  sf = _mm_mullo_epi32(s, f);
+  q = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(v
+      , _mm_sub_epi32(_mm_set1_epi32(one), sf)), _mm_set1_epi32(one/2)), 22);
+  sf = _mm_mullo_epi32(s, _mm_sub_epi32(_mm_set1_epi32(BMP_HUE_SECTOR), f));
+  t = _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(v
+      , _mm_sub_epi32(_mm_set1_epi32(one), sf)), _mm_set1_epi32(one/2)), 22);
+
+  *r = _mm_blendv_epi8(_mm_blendv_epi8(_mm_blendv_epi8(p, q, is[1]), t, is[4])
+      , v, _mm_or_si128(is[0], is[5]));
+  *g = _mm_blendv_epi8(_mm_blendv_epi8(_mm_blendv_epi8(p, t, is[0]), q, is[3])
+      , v, _mm_or_si128(is[1], is[2]));
+  *b = _mm_blendv_epi8(_mm_blendv_epi8(_mm_blendv_epi8(p, t, is[2]), q, is[5])
+      , v, _mm_or_si128(is[3], is[4]));
+}
+
+//16 pixels of the planes b, g and r to HSV
+TARGET_SSE41 static inline void hsv16_sse41(__m128i b, __m128i g, __m128i r
+        , WORD *h, WORD *s, BYTE *v){
+  __m128i zero = _mm_setzero_si128();
+  __m128i hue[4], sat[4];
+  int k;
+
+  _mm_storeu_si128((__m128i *)v, _mm_max_epu8(_mm_max_epu8(r, g), b));
+
+  for(k=0; k<4; k++){
+    __m128i r16 = (k < 2) ? _mm_unpacklo_epi8(r, zero)
+        : _mm_unpackhi_epi8(r, zero);
+    __m128i g16 = (k < 2) ? _mm_unpacklo_epi8(g, zero)
+        : _mm_unpackhi_epi8(g, zero);
+    __m128i b16 = (k < 2) ? _mm_unpacklo_epi8(b, zero)
+        : _mm_unpackhi_epi8(b, zero);
+    if(k%2 == 0){
+      hsv4_sse41(_mm_unpacklo_epi16(r16, zero), _mm_unpacklo_epi16(g16, zero)
+          , _mm_unpacklo_epi16(b16, zero), &hue[k], &sat[k]);
+    }else{
+      hsv4_sse41(_mm_unpackhi_epi16(r16, zero), _mm_unpackhi_epi16(g16, zero)
+          , _mm_unpackhi_epi16(b16, zero), &hue[k], &sat[k]);
+    }
+  }
+  for(k=0; k<2; k++){
+    _mm_storeu_si128((__m128i *)(h + 8*k)
+        , _mm_packus_epi32(hue[2*k], hue[2*k + 1]));
+    _mm_storeu_si128((__m128i *)(s + 8*k)
+        , _mm_packus_epi32(sat[2*k], sat[2*k + 1]));
+  }
+}
+
+//16 pixels of HSV to the planes b, g and r
+TARGET_SSE41 static inline void rgb16_sse41(const WORD *h, const WORD *s
+        , const BYTE *v, __m128i *b16, __m128i *g16, __m128i *r16){
+  __m128i zero = _mm_setzero_si128();
+  __m128i val = _mm_loadu_si128((const __m128i *)v);
+  __m128i r[4], g[4], b[4];
+  int k;
+
+  for(k=0; k<4; k++){
+    __m128i h16 = _mm_loadu_si128((const __m128i *)(h + 8*(k/2)));
+    __m128i s16 = _mm_loadu_si128((const __m128i *)(s + 8*(k/2)));
+    __m128i v16 = (k < 2) ? _mm_unpacklo_epi8(val, zero)
+        : _mm_unpackhi_epi8(val, zero);
+    if(k%2 == 0){
+      rgb4_sse41(_mm_unpacklo_epi16(h16, zero), _mm_unpacklo_epi16(s16, zero)
+          , _mm_unpacklo_epi16(v16, zero), &r[k], &g[k], &b[k]);
+    }else{
+      rgb4_sse41(_mm_unpackhi_epi16(h16, zero), _mm_unpackhi_epi16(s16, zero)
+          , _mm_unpackhi_epi16(v16, zero), &r[k], &g[k], &b[k]);
+    }
+  }
+  *b16 = _mm_packus_epi16(_mm_packs_epi32(b[0], b[1])
+      , _mm_packs_epi32(b[2], b[3]));
+  *g16 = _mm_packus_epi16(_mm_packs_epi32(g[0], g[1])
+      , _mm_packs_epi32(g[2], g[3]));
+  *r16 = _mm_packus_epi16(_mm_packs_epi32(r[0], r[1])
+      , _mm_packs_epi32(r[2], r[3]));
+}
+
+TARGET_SSE41 static void to_hsv_span_sse41(const RGBTRIPLE *src, WORD *h
+        , WORD *s, BYTE *v, size_t n){
+  const BYTE *p = (const BYTE *)src;
+  size_t i;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r;
+    load_planes_sse41(p, &b, &g, &r);
+    hsv16_sse41(b, g, r, h + i, s + i, v + i);
+  }
+  to_hsv_span(src + i, h + i, s + i, v + i, n - i);
+}
+
+TARGET_SSE41 static void to_rgb_span_sse41(const WORD *h, const WORD *s
+        , const BYTE *v, RGBTRIPLE *dst, size_t n){
+  BYTE *p = (BYTE *)dst;
+  size_t i;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r;
+    rgb16_sse41(h + i, s + i, v + i, &b, &g, &r);
+    store_planes_sse41(p, b, g, r);
+  }
+  to_rgb_span(h + i, s + i, v + i, dst + i, n - i);
+}
+
+TARGET_SSE41 static void to_hsv_planes_sse41(const BYTE *const *plane
+        , WORD *h, WORD *s, BYTE *v, size_t n){
+  const BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+16<=n; i+=16){
+    hsv16_sse41(_mm_loadu_si128((const __m128i *)(plane[0] + i))
+        , _mm_loadu_si128((const __m128i *)(plane[1] + i))
+        , _mm_loadu_si128((const __m128i *)(plane[2] + i)), h + i, s + i
+        , v + i);
+  }
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
+  }
+  to_hsv_planes(rest, h + i, s + i, v + i, n - i);
+}
+
+TARGET_SSE41 static void to_rgb_planes_sse41(const WORD *h, const WORD *s
+        , const BYTE *v, BYTE *const *plane, size_t n){
+  BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+16<=n; i+=16){
+    __m128i b, g, r;
+    rgb16_sse41(h + i, s + i, v + i, &b, &g, &r);
+    _mm_storeu_si128((__m128i *)(plane[0] + i), b);
+    _mm_storeu_si128((__m128i *)(plane[1] + i), g);
+    _mm_storeu_si128((__m128i *)(plane[2] + i), r);
+  }
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
+  }
+  to_rgb_planes(h + i, s + i, v + i, rest, n - i);
+}
+
+TARGET_SSE41 static void split_span_sse41(const RGBTRIPLE *src
+        , BYTE *const *plane, size_t n){
+  const BYTE *p = (const BYTE *)src;
+  BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r;
+    load_planes_sse41(p, &b, &g, &r);
+    _mm_storeu_si128((__m128i *)(plane[0] + i), b);
+    _mm_storeu_si128((__m128i *)(plane[1] + i), g);
+    _mm_storeu_si128((__m128i *)(plane[2] + i), r);
+  }
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
+  }
+  split_span(src + i, rest, n - i);
+}
+
+TARGET_SSE41 static void merge_span_sse41(const BYTE *const *plane
+        , RGBTRIPLE *dst, size_t n){
+  BYTE *p = (BYTE *)dst;
+  const BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    store_planes_sse41(p, _mm_loadu_si128((const __m128i *)(plane[0] + i))
+        , _mm_loadu_si128((const __m128i *)(plane[1] + i))
+        , _mm_loadu_si128((const __m128i *)(plane[2] + i)));
+  }
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
+  }
+  merge_span(rest, dst + i, n - i);
+}
+
+//Transposes 4 rows of 4 pixels, one pixel per 32 bit lane
+TARGET_SSE41 static inline void transpose4_sse41(__m128i *v){
+  __m128i t0 = _mm_unpacklo_epi32(v[0], v[1]);
+  __m128i t1 = _mm_unpackhi_epi32(v[0], v[1]);
+  __m128i t2 = _mm_unpacklo_epi32(v[2], v[3]);
+  __m128i t3 = _mm_unpackhi_epi32(v[2], v[3]);
+  v[0] = _mm_unpacklo_epi64(t0, t2);
+  v[1] = _mm_unpackhi_epi64(t0, t2);
+  v[2] = _mm_unpacklo_epi64(t1, t3);
+  v[3] = _mm_unpackhi_epi64(t1, t3);
+}
+
+//Packs pixels 0-3 (lo) and 4-7 (hi), one per lane, into 24 bytes
+TARGET_SSE41 static inline void store8_sse41(BYTE *p, __m128i lo, __m128i hi){
+  lo = _mm_shuffle_epi8(lo, MASK_SSE(transpose_mask[2]));
+  hi = _mm_shuffle_epi8(hi, MASK_SSE(transpose_mask[2]));
+  _mm_storeu_si128((__m128i *)p, _mm_or_si128(lo, _mm_slli_si128(hi, 12)));
+  _mm_storel_epi64((__m128i *)(p + 16), _mm_srli_si128(hi, 4));
+}
+
+TARGET_SSE41 static void taps_span_sse41(double *sum, const double *src
+        , double k, size_t n){
+  __m128d kv = _mm_set1_pd(k);
+  size_t x;
+
+  for(x=0; x+2<=n; x+=2){
+    _mm_storeu_pd(sum + x, _mm_add_pd(_mm_loadu_pd(sum + x)
+        , _mm_mul_pd(kv, _mm_loadu_pd(src + x))));
+  }
+  taps_span(sum + x, src + x, k, n - x);
+}
+
+TARGET_SSE41 static void taps8_span_sse41(double *sum, const BYTE *src
+        , double k, size_t n){
+  __m128d kv = _mm_set1_pd(k);
+  size_t x;
+
+  for(x=0; x+4<=n; x+=4){
+    int four;
+    memcpy(&four, src + x, sizeof(four));
+    __m128i q = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(four));
+    _mm_storeu_pd(sum + x, _mm_add_pd(_mm_loadu_pd(sum + x)
+        , _mm_mul_pd(kv, _mm_cvtepi32_pd(q))));
+    _mm_storeu_pd(sum + x + 2, _mm_add_pd(_mm_loadu_pd(sum + x + 2)
+        , _mm_mul_pd(kv, _mm_cvtepi32_pd(_mm_srli_si128(q, 8)))));
+  }
+  taps8_span(sum + x, src + x, k, n - x);
+}
+
+TARGET_SSE41 static void norm_span_sse41(const double *sum, BYTE *dst
+        , double weight, size_t n){
+  __m128d w = _mm_set1_pd(weight);
+  __m128d lo = _mm_setzero_pd();
+  __m128d hi = _mm_set1_pd(255);
+  size_t x;
+
+  for(x=0; x+4<=n; x+=4){
+    __m128d a = _mm_div_pd(_mm_loadu_pd(sum + x), w);
+    __m128d b = _mm_div_pd(_mm_loadu_pd(sum + x + 2), w);
+    __m128i q = _mm_unpacklo_epi64(
+        _mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(a, lo), hi))
+        , _mm_cvttpd_epi32(_mm_min_pd(_mm_max_pd(b, lo), hi)));
+    q = _mm_packus_epi16(_mm_packus_epi32(q, q), q);
+    int four = _mm_cvtsi128_si32(q);
+    memcpy(dst + x, &four, sizeof(four));
+  }
+  norm_span(sum + x, dst + x, weight, n - x);
+}
+
+TARGET_SSE41 static void transpose_block8_sse41(const RGBTRIPLE *const *src
+        , RGBTRIPLE *const *dst){
+  __m128i a[ROTATE_BLOCK], t[4], u[4], v[4];
+  int k;
+
+  for(k=0; k<ROTATE_BLOCK; k++){
+    a[k] = _mm_loadl_epi64((const __m128i *)src[k]);
+  }
+  //Pairs of rows, then groups of 4 and 8: column k ends in 8 bytes of v
+  for(k=0; k<4; k++){
+    t[k] = _mm_unpacklo_epi8(a[2*k], a[2*k + 1]);
+  }
+  u[0] = _mm_unpacklo_epi16(t[0], t[1]);
+  u[1] = _mm_unpackhi_epi16(t[0], t[1]);
+  u[2] = _mm_unpacklo_epi16(t[2], t[3]);
+  u[3] = _mm_unpackhi_epi16(t[2], t[3]);
+  v[0] = _mm_unpacklo_epi32(u[0], u[2]);
+  v[1] = _mm_unpackhi_epi32(u[0], u[2]);
+  v[2] = _mm_unpacklo_epi32(u[1], u[3]);
+  v[3] = _mm_unpackhi_epi32(u[1], u[3]);
+  for(k=0; k<4; k++){
+    _mm_storel_epi64((__m128i *)dst[2*k], v[k]);
+    _mm_storel_epi64((__m128i *)dst[2*k + 1], _mm_srli_si128(v[k], 8));
+  }
+}
+
+TARGET_SSE41 static void flip_span8_sse41(RGBTRIPLE *a, RGBTRIPLE *b
+        , size_t n){
+  __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4
+      , 3, 2, 1, 0);
+  BYTE *p = (BYTE *)a;
+  BYTE *q = (BYTE *)b;
+  size_t i;
+
+  for(i=0; i+16<=n; i+=16, p+=16){
+    q -= 16;
+    __m128i x = _mm_loadu_si128((const __m128i *)p);
+    __m128i y = _mm_loadu_si128((const __m128i *)q);
+    _mm_storeu_si128((__m128i *)p, _mm_shuffle_epi8(y, reverse));
+    _mm_storeu_si128((__m128i *)q, _mm_shuffle_epi8(x, reverse));
+  }
+  flip_span8((RGBTRIPLE *)p, (RGBTRIPLE *)q, n - i);
+}
+
+TARGET_SSE41 static void transpose_block_sse41(const RGBTRIPLE *const *src
+        , RGBTRIPLE *const *dst){
+  __m128i lo[ROTATE_BLOCK]; // pixels 0-3 of each row
+  __m128i hi[ROTATE_BLOCK]; // pixels 4-7
+  int k;
+
+  for(k=0; k<ROTATE_BLOCK; k++){
+    const BYTE *p = (const BYTE *)src[k];
+    lo[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)p)
+        , MASK_SSE(transpose_mask[0]));
+    hi[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 8))
+        , MASK_SSE(transpose_mask[1]));
+  }
+  transpose4_sse41(lo);
+  transpose4_sse41(lo + 4);
+  transpose4_sse41(hi);
+  transpose4_sse41(hi + 4);
+  for(k=0; k<4; k++){
+    store8_sse41((BYTE *)dst[k], lo[k], lo[k+4]);
+    store8_sse41((BYTE *)dst[k+4], hi[k], hi[k+4]);
+  }
+}
+
+//Reverses the order of the 16 pixels of a chunk
+TARGET_SSE41 static inline void reverse16_sse41(__m128i *v){
+  __m128i out[3];
+  int o;
+
+  for(o=0; o<3; o++){
+    out[o] = _mm_or_si128(_mm_or_si128(
+        _mm_shuffle_epi8(v[0], MASK_SSE(reverse_mask[o][0])),
+        _mm_shuffle_epi8(v[1], MASK_SSE(reverse_mask[o][1]))),
+        _mm_shuffle_epi8(v[2], MASK_SSE(reverse_mask[o][2])));
+  }
+  v[0] = out[0];
+  v[1] = out[1];
+  v[2] = out[2];
+}
+
+TARGET_SSE41 static void flip_span_sse41(RGBTRIPLE *a, RGBTRIPLE *b
+        , size_t n){
+  BYTE *p = (BYTE *)a;
+  BYTE *q = (BYTE *)b;
+  __m128i x[3], y[3];
+  size_t i;
+  int v;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    q -= 48;
+    for(v=0; v<3; v++){
+      x[v] = _mm_loadu_si128((const __m128i *)(p + 16*v));
+      y[v] = _mm_loadu_si128((const __m128i *)(q + 16*v));
+    }
+    reverse16_sse41(x);
+    reverse16_sse41(y);
+    for(v=0; v<3; v++){
+      _mm_storeu_si128((__m128i *)(p + 16*v), y[v]);
+      _mm_storeu_si128((__m128i *)(q + 16*v), x[v]);
+    }
+  }
+  flip_span(a + i, b - i, n - i);
+}
+
+//32 bit pixels are already one per lane, the masks of the transposition
+//drop their alpha (pack) and make room for it (unpack)
+TARGET_SSE41 static void pack_quads_sse41(const RGBQUAD *src, RGBTRIPLE *dst
+        , size_t n){
+  BYTE *p = (BYTE *)dst;
+  __m128i v[4];
+  size_t i;
+  int k;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    for(k=0; k<4; k++){
+      v[k] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src+i+4*k))
+          , MASK_SSE(transpose_mask[2]));
+    }
+    _mm_storeu_si128((__m128i *)p
+        , _mm_or_si128(v[0], _mm_slli_si128(v[1], 12)));
+    _mm_storeu_si128((__m128i *)(p + 16)
+        , _mm_or_si128(_mm_srli_si128(v[1], 4), _mm_slli_si128(v[2], 8)));
+    _mm_storeu_si128((__m128i *)(p + 32)
+        , _mm_or_si128(_mm_srli_si128(v[2], 8), _mm_slli_si128(v[3], 4)));
+  }
+  pack_quads(src + i, dst + i, n - i);
+}
+
+TARGET_SSE41 static void unpack_quads_sse41(const RGBTRIPLE *src
+        , RGBQUAD *dst, size_t n){
+  const BYTE *p = (const BYTE *)src;
+  __m128i alpha = _mm_set1_epi32(0xFF000000);
+  __m128i v[4];
+  size_t i;
+  int k;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(p + 32));
+    v[0] = v0;
+    v[1] = _mm_alignr_epi8(v1, v0, 12);
+    v[2] = _mm_alignr_epi8(v2, v1, 8);
+    v[3] = _mm_srli_si128(v2, 4);
+    for(k=0; k<4; k++){
+      __m128i *q = (__m128i *)(dst + i + 4*k);
+      __m128i a = _mm_and_si128(_mm_loadu_si128(q), alpha);
+      _mm_storeu_si128(q, _mm_or_si128(a
+          , _mm_shuffle_epi8(v[k], MASK_SSE(transpose_mask[0]))));
+    }
+  }
+  unpack_quads(src + i, dst + i, n - i);
+}
 
-  free_bitmap(image->bitmap, image->ih.biHeight);
+TARGET_SSE41 static void transpose_block32_sse41(const RGBTRIPLE *const *src
+        , RGBTRIPLE *const *dst){
+  __m128i lo[ROTATE_BLOCK]; // pixels 0-3 of each row
+  __m128i hi[ROTATE_BLOCK]; // pixels 4-7
+  int k;
 
-  image->ih.biWidth = new_width;
-  image->ih.biHeight = new_height;
-  image->ih.biXPelsPerMeter = new_XPelsPerMeter;
-  image->ih.biYPelsPerMeter = new_YPelsPerMeter;
+  for(k=0; k<ROTATE_BLOCK; k++){
+    const __m128i *p = (const __m128i *)src[k];
+    lo[k] = _mm_loadu_si128(p);
+    hi[k] = _mm_loadu_si128(p + 1);
+  }
+  transpose4_sse41(lo);
+  transpose4_sse41(lo + 4);
+  transpose4_sse41(hi);
+  transpose4_sse41(hi + 4);
+  for(k=0; k<4; k++){
+    _mm_storeu_si128((__m128i *)dst[k], lo[k]);
+    _mm_storeu_si128((__m128i *)dst[k] + 1, lo[k+4]);
+    _mm_storeu_si128((__m128i *)dst[k+4], hi[k]);
+    _mm_storeu_si128((__m128i *)dst[k+4] + 1, hi[k+4]);
+  }
+}
 
-  image->padding = (4 - (image->ih.biWidth * sizeof(RGBTRIPLE)) % 4) % 4;
+TARGET_SSE41 static void flip_span32_sse41(RGBTRIPLE *a, RGBTRIPLE *b
+        , size_t n){
+  BYTE *p = (BYTE *)a;
+  BYTE *q = (BYTE *)b;
+  size_t i;
+
+  for(i=0; i+4<=n; i+=4, p+=16){
+    q -= 16;
+    __m128i x = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)p), 0x1B);
+    __m128i y = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)q), 0x1B);
+    _mm_storeu_si128((__m128i *)p, y);
+    _mm_storeu_si128((__m128i *)q, x);
+  }
+  flip_span32((RGBTRIPLE *)p, (RGBTRIPLE *)q, n - i);
+}
 
-  int old_biSizeImage = image->ih.biSizeImage;
-  image->ih.biSizeImage = image->ih.biHeight * (image->ih.biWidth * 3
-      + image->padding);
+/*---------------------------------------------------------------------------*/
+/* AVX2, 32 pixels per iteration                                             */
+/*---------------------------------------------------------------------------*/
 
-  image->fh.bfSize = image->fh.bfSize + image->ih.biSizeImage
-      - old_biSizeImage;
+#define MASK_AVX2(m) _mm256_broadcastsi128_si256(MASK_SSE(m))
 
-  image->bitmap = new_im;
-  return 0;
+TARGET_AVX2 static inline __m256i load2_avx2(const BYTE *p){
+  return _mm256_inserti128_si256(_mm256_castsi128_si256(
+      _mm_loadu_si128((const __m128i *)p))
+      , _mm_loadu_si128((const __m128i *)(p + 48)), 1);
 }
 
-int crop(BMPFILE *image, unsigned char x_1, unsigned char y_1
-        , unsigned char x_2, unsigned char y_2, int *error){
+TARGET_AVX2 static inline void store2_avx2(BYTE *p, __m256i v){
+  _mm_storeu_si128((__m128i *)p, _mm256_castsi256_si128(v));
+  _mm_storeu_si128((__m128i *)(p + 48), _mm256_extracti128_si256(v, 1));
+}
 
-  if((x_1>=x_2)||(y_1>=y_2)||(x_2>100)||(y_2>100)){
-    *error = UNKNOWN;
-    return -1;
+TARGET_AVX2 static inline void load_planes_avx2(const BYTE *p
+        , __m256i *b, __m256i *g, __m256i *r){
+  __m256i v0 = load2_avx2(p);
+  __m256i v1 = load2_avx2(p + 16);
+  __m256i v2 = load2_avx2(p + 32);
+  __m256i *plane[3] = {b, g, r};
+  int c;
+
+  for(c=0; c<3; c++){
+    *plane[c] = _mm256_or_si256(_mm256_or_si256(
+        _mm256_shuffle_epi8(v0, MASK_AVX2(deinterleave_mask[c][0])),
+        _mm256_shuffle_epi8(v1, MASK_AVX2(deinterleave_mask[c][1]))),
+        _mm256_shuffle_epi8(v2, MASK_AVX2(deinterleave_mask[c][2])));
   }
+}
 
-  int x1 = (image->ih.biWidth*x_1)/100;
-  int x2 = (image->ih.biWidth*x_2)/100;
-  int y1 = (image->ih.biHeight*y_1)/100;
-  int y2 = (image->ih.biHeight*y_2)/100;
-
-  uint new_width = x2-x1;
-  uint new_height = y2-y1;
-
-  RGBTRIPLE** new_bitmap = NULL;
-  if(!(new_bitmap = generate_bitmap(new_height, new_width, error))){
-    return -1;
-  }
+TARGET_AVX2 static inline void store_planes_avx2(BYTE *p, __m256i b
+        , __m256i g, __m256i r){
+  int v;
 
-  int i,j;
-  for(i=0; i<new_height; ++i){
-    for(j=0; j<new_width; ++j){
-      new_bitmap[i][j] = image->bitmap[i+x1][j+y1];
-    }
+  for(v=0; v<3; v++){
+    store2_avx2(p + 16*v, _mm256_or_si256(_mm256_or_si256(
+        _mm256_shuffle_epi8(b, MASK_AVX2(interleave_mask[v][0])),
+        _mm256_shuffle_epi8(g, MASK_AVX2(interleave_mask[v][1]))),
+        _mm256_shuffle_epi8(r, MASK_AVX2(interleave_mask[v][2]))));
   }
+}
 
-  free_bitmap(image->bitmap, image->ih.biHeight);
-
-  image->ih.biWidth = new_width;
-  image->ih.biHeight = new_height;
-  image->ih.biXPelsPerMeter
-      = image->ih.biXPelsPerMeter*(image->ih.biWidth/new_width);
-  image->ih.biYPelsPerMeter
-      = image->ih.biYPelsPerMeter*(image->ih.biHeight/new_height);
+//dot4_sse41 for 8 pixels, near gets one bit per pixel
+TARGET_AVX2 static inline __m256i dot8_avx2(__m128i r, __m128i g, __m128i b
+        , const struct colour_dot *dot, int *near){
+  __m256i s = _mm256_add_epi32(_mm256_add_epi32(
+      _mm256_mullo_epi32(_mm256_cvtepu8_epi32(r)
+        , _mm256_set1_epi32(dot->fixed[0])),
+      _mm256_mullo_epi32(_mm256_cvtepu8_epi32(g)
+        , _mm256_set1_epi32(dot->fixed[1]))),
+      _mm256_mullo_epi32(_mm256_cvtepu8_epi32(b)
+        , _mm256_set1_epi32(dot->fixed[2])));
+  __m256i frac = _mm256_slli_epi32(s, 32 - DOT_BITS);
+  __m256i m = _mm256_cmpeq_epi32(
+      _mm256_max_epu32(frac, _mm256_set1_epi32(dot->limit)), frac);
+  *near = _mm256_movemask_ps(_mm256_castsi256_ps(m));
+  return _mm256_srli_epi32(s, DOT_BITS);
+}
 
-  image->padding = (4 - (image->ih.biWidth * sizeof(RGBTRIPLE)) % 4) % 4;
+TARGET_AVX2 static inline __m128i dot16_avx2(__m128i r, __m128i g
+        , __m128i b, const struct colour_dot *dot, int *near){
+  int near_lo, near_hi;
+  __m256i lo = dot8_avx2(r, g, b, dot, &near_lo);
+  __m256i hi = dot8_avx2(_mm_srli_si128(r, 8), _mm_srli_si128(g, 8)
+      , _mm_srli_si128(b, 8), dot, &near_hi);
+  *near |= near_lo | (near_hi << 8);
+  return _mm_packus_epi16(
+      _mm_packs_epi32(_mm256_castsi256_si128(lo)
+        , _mm256_extracti128_si256(lo, 1)),
+      _mm_packs_epi32(_mm256_castsi256_si128(hi)
+        , _mm256_extracti128_si256(hi, 1)));
+}
 
-  int old_biSizeImage = image->ih.biSizeImage;
-  image->ih.biSizeImage = image->ih.biHeight * (image->ih.biWidth * 3
-      + image->padding);
+//quick16_sse41 in one vector of 16 bit lanes
+TARGET_AVX2 static inline __m128i quick16_avx2(__m128i r, __m128i g
+        , __m128i b, const struct colour_dot *dot){
+  __m256i s = _mm256_adds_epu16(
+      _mm256_mulhi_epu16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(r), 8)
+        , _mm256_set1_epi16(dot->quick[0])),
+      _mm256_mulhi_epu16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(g), 8)
+        , _mm256_set1_epi16(dot->quick[1])));
+  s = _mm256_adds_epu16(s
+      , _mm256_mulhi_epu16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(b), 8)
+        , _mm256_set1_epi16(dot->quick[2])));
+  s = _mm256_srli_epi16(_mm256_adds_epu16(s, _mm256_set1_epi16(128)), 8);
+  return _mm_packus_epi16(_mm256_castsi256_si128(s)
+      , _mm256_extracti128_si256(s, 1));
+}
 
-  image->fh.bfSize = image->fh.bfSize + image->ih.biSizeImage
-      - old_biSizeImage;
+TARGET_AVX2 static void zero_span_avx2(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int mask = *(const int *)arg;
+  BYTE pattern[96];
+  size_t i;
 
-  image->bitmap = new_bitmap;
-  return 0;
+  for(i=0; i<96; i++){
+    pattern[i] = (mask >> (8*(i%3))) & 0xFF;
+  }
+  __m256i m0 = _mm256_loadu_si256((const __m256i *)pattern);
+  __m256i m1 = _mm256_loadu_si256((const __m256i *)(pattern + 32));
+  __m256i m2 = _mm256_loadu_si256((const __m256i *)(pattern + 64));
+
+  BYTE *p = (BYTE *)span;
+  for(i=0; i+32<=n; i+=32, p+=96){
+    __m256i *v = (__m256i *)p;
+    _mm256_storeu_si256(v, _mm256_and_si256(_mm256_loadu_si256(v), m0));
+    _mm256_storeu_si256(v + 1
+        , _mm256_and_si256(_mm256_loadu_si256(v + 1), m1));
+    _mm256_storeu_si256(v + 2
+        , _mm256_and_si256(_mm256_loadu_si256(v + 2), m2));
+  }
+  zero_span_sse41(span + i, n - i, arg);
 }
 
-int blur(BMPFILE *image, int s_kernel, int radius, int *error){
-  if(radius<2){
-    *error = UNKNOWN;
-    return -1;
+TARGET_AVX2 static void invert_span_avx2(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  __m256i ones = _mm256_set1_epi8(-1);
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  for(i=0; i+32<=n; i+=32, p+=96){
+    __m256i *v = (__m256i *)p;
+    _mm256_storeu_si256(v, _mm256_xor_si256(_mm256_loadu_si256(v), ones));
+    _mm256_storeu_si256(v + 1
+        , _mm256_xor_si256(_mm256_loadu_si256(v + 1), ones));
+    _mm256_storeu_si256(v + 2
+        , _mm256_xor_si256(_mm256_loadu_si256(v + 2), ones));
   }
-  int i, j, k, l;
-  double weight;
+  invert_span_sse41(span + i, n - i, arg);
+}
 
-  if(s_kernel == 0){
-    s_kernel = 4*radius;
+TARGET_AVX2 static void sepia_span_avx2(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int fast = (precision_mode == BMP_PRECISION_FAST);
+  RGBTRIPLE orig[16];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r, nb, ng, nr;
+    int near = 0;
+    load_planes_sse41(p, &b, &g, &r);
+    if(fast){
+      nb = quick16_avx2(r, g, b, &sepia_dot[2]);
+      ng = quick16_avx2(r, g, b, &sepia_dot[1]);
+      nr = quick16_avx2(r, g, b, &sepia_dot[0]);
+    }else{
+      nb = dot16_avx2(r, g, b, &sepia_dot[2], &near);
+      ng = dot16_avx2(r, g, b, &sepia_dot[1], &near);
+      nr = dot16_avx2(r, g, b, &sepia_dot[0], &near);
+      if(near){
+        memcpy(orig, p, sizeof(orig));
+      }
+    }
+    store_planes_sse41(p, nb, ng, nr);
+    if(near){//The scalar kernel is SSE code, clean the upper halves first
+      _mm256_zeroupper();
+      patch_span((RGBTRIPLE *)p, orig, near, sepia_span, arg);
+    }
   }
+  sepia_span(span + i, n - i, arg);
+}
 
-  double **gaussian_kernel = calloc(s_kernel, sizeof(double *));
-  if(gaussian_kernel == NULL){
-    *error = errno;
-    return -1;
-  }
-  for(i=0; i<s_kernel; i++){
-    gaussian_kernel[i] = calloc(s_kernel, sizeof(double));
-    if(gaussian_kernel[i] == NULL){
-        for(;i>0; i--){
-          free(gaussian_kernel[i-1]);
-        }free(gaussian_kernel);
-        *error = errno;
-        return -1;
+TARGET_AVX2 static void grayscale_span_avx2(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int fast = (precision_mode == BMP_PRECISION_FAST);
+  char rgby = *(const char *)arg;
+  RGBTRIPLE orig[16];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  if(rgby == 'y'){
+    for(i=0; i+16<=n; i+=16, p+=48){
+      __m128i b, g, r, y;
+      int near = 0;
+      load_planes_sse41(p, &b, &g, &r);
+      if(fast){
+        y = quick16_avx2(r, g, b, &luma_dot);
+      }else if((y = dot16_avx2(r, g, b, &luma_dot, &near)), near){
+        memcpy(orig, p, sizeof(orig));
+      }
+      store_planes_sse41(p, y, y, y);
+      if(near){//The scalar kernel is SSE code, clean the upper halves first
+        _mm256_zeroupper();
+        patch_span((RGBTRIPLE *)p, orig, near, grayscale_span, arg);
+      }
     }
+    grayscale_span(span + i, n - i, arg);
+    return;
   }
 
-  //s_kernel = SIZE_GAUSSIAN_KERNEL;
-  //double gaussian_kernel[SIZE_GAUSSIAN_KERNEL][SIZE_GAUSSIAN_KERNEL];
+  for(i=0; i+32<=n; i+=32, p+=96){
+    __m256i b, g, r;
+    load_planes_avx2(p, &b, &g, &r);
+    switch(rgby){
+      case 'r':
+      store_planes_avx2(p, r, r, r);
+      break;
+
+      case 'g':
+      store_planes_avx2(p, b, g, g);
+      break;
 
-  double ii, jj;
-  for(i=0; i<s_kernel; i++){
-    for(j=0; j<s_kernel; j++){
-      ii = (double)(i-s_kernel/2);
-      jj = (double)(j-s_kernel/2);
-      gaussian_kernel[i][j] = _G(ii, radius)*_G(jj, radius);
+      case 'b':
+      store_planes_avx2(p, b, b, b);
+      break;
     }
   }
+  grayscale_span_sse41(span + i, n - i, arg);
+}
 
-  double norm = 1/gaussian_kernel[0][0];
-  double max_weight = 0;
-
-  for(i=0; i<s_kernel; i++){
-    for(j=0; j<s_kernel; j++){
-      gaussian_kernel[i][j] *= norm;
-      max_weight += gaussian_kernel[i][j];
-    }
+TARGET_AVX2 static void bitone_span_avx2(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  const struct bitone_args *args = arg;
+  __m256i zero = _mm256_setzero_si256();
+  __m256i thr = _mm256_set1_epi16(max(0, min(args->threshold, 766)));
+  __m256i dark[3], light[3];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  dark[0] = _mm256_set1_epi8(args->dark.b);
+  dark[1] = _mm256_set1_epi8(args->dark.g);
+  dark[2] = _mm256_set1_epi8(args->dark.r);
+  light[0] = _mm256_set1_epi8(args->light.b);
+  light[1] = _mm256_set1_epi8(args->light.g);
+  light[2] = _mm256_set1_epi8(args->light.r);
+
+  for(i=0; i+32<=n; i+=32, p+=96){
+    __m256i b, g, r;
+    load_planes_avx2(p, &b, &g, &r);
+
+    __m256i lo = _mm256_add_epi16(_mm256_add_epi16(
+        _mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(g, zero))
+        , _mm256_unpacklo_epi8(b, zero));
+    __m256i hi = _mm256_add_epi16(_mm256_add_epi16(
+        _mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(g, zero))
+        , _mm256_unpackhi_epi8(b, zero));
+    __m256i m = _mm256_packs_epi16(_mm256_cmpgt_epi16(thr, lo)
+        , _mm256_cmpgt_epi16(thr, hi));
+
+    store_planes_avx2(p, _mm256_blendv_epi8(light[0], dark[0], m)
+        , _mm256_blendv_epi8(light[1], dark[1], m)
+        , _mm256_blendv_epi8(light[2], dark[2], m));
   }
+  bitone_span_sse41(span + i, n - i, arg);
+}
 
-	int kern_len = s_kernel/2;
-	double pixel[3];
+//hsv_recip[d] for 8 d >= 1, the float estimate is at most one too big
+TARGET_AVX2 static inline __m256i recip8_avx2(__m256i d){
+  __m256i one = _mm256_set1_epi32(1 << HSV_RECIP_BITS);
+  __m256i q;
 
-  RGBTRIPLE **new_bitmap = generate_bitmap(image->ih.biHeight, image->ih.biWidth
-          , error);
-  if(new_bitmap == NULL){
-    return -1;
-  }
+  d = _mm256_max_epi32(d, _mm256_set1_epi32(1));
+  q = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(one)
+      , _mm256_cvtepi32_ps(d)));
+  return _mm256_add_epi32(q, _mm256_cmpgt_epi32(_mm256_mullo_epi32(q, d)
+      , one));
+}
 
-  for(i=0; i<image->ih.biHeight; i++){
-    for(j=0; j<image->ih.biWidth; j++){
-      memset(pixel, 0, 3*sizeof(double));
-			weight = max_weight;
-      for(k=0; k<s_kernel; k++){
-        for(l=0; l<s_kernel; l++){
-          int h = i-kern_len+k;
-          int w = j-kern_len+l;
-          double gaussian_term = gaussian_kernel[k][l];
-          if((h>=0)&&(w>=0)&&(h<image->ih.biHeight)&&(w<image->ih.biWidth)){
-            pixel[0] += gaussian_term * (double)image->bitmap[h][w].r;
-            pixel[1] += gaussian_term * (double)image->bitmap[h][w].g;
-            pixel[2] += gaussian_term * (double)image->bitmap[h][w].b;
-          }else{
-            weight -= gaussian_term;
-          }
-        }
-      }
-      pixel[0] /= weight;
-      pixel[1] /= weight;
-      pixel[2] /= weight;
-      pixel[0] = (pixel[0] > 255 ? 255 : (pixel[0] < 0 ? 0 : pixel[0]));
-      pixel[1] = (pixel[1] > 255 ? 255 : (pixel[1] < 0 ? 0 : pixel[1]));
-      pixel[2] = (pixel[2] > 255 ? 255 : (pixel[2] < 0 ? 0 : pixel[2]));
-      new_bitmap[i][j].r = pixel[0];
-      new_bitmap[i][j].g = pixel[1];
-      new_bitmap[i][j].b = pixel[2];
-		}
-	}
+//to_hsv_span for 8 pixels given as bytes
+TARGET_AVX2 static inline void hsv8_avx2(__m128i r8, __m128i g8, __m128i b8
+        , __m256i *h, __m256i *s){
+  __m256i r = _mm256_cvtepu8_epi32(r8);
+  __m256i g = _mm256_cvtepu8_epi32(g8);
+  __m256i b = _mm256_cvtepu8_epi32(b8);
+  __m256i max = _mm256_max_epi32(_mm256_max_epi32(r, g), b);
+  __m256i delta = _mm256_sub_epi32(max
+      , _mm256_min_epi32(_mm256_min_epi32(r, g), b));
+  __m256i rm = _mm256_cmpeq_epi32(max, r);
+  __m256i gm = _mm256_andnot_si256(rm, _mm256_cmpeq_epi32(max, g));
+  __m256i bm = _mm256_andnot_si256(_mm256_or_si256(rm, gm)
+      , _mm256_set1_epi32(-1));
+  __m256i diff = _mm256_sub_epi32(r, g);
+  __m256i hue;
+
+  diff = _mm256_blendv_epi8(diff, _mm256_sub_epi32(b, r), gm);
+  diff = _mm256_blendv_epi8(diff, _mm256_sub_epi32(g, b), rm);
+  hue = _mm256_or_si256(_mm256_and_si256(gm
+      , _mm256_set1_epi32(2*BMP_HUE_SECTOR))
+      , _mm256_and_si256(bm, _mm256_set1_epi32(4*BMP_HUE_SECTOR)));
+  hue = _mm256_add_epi32(hue, _mm256_srai_epi32(_mm256_add_epi32(
+      _mm256_mullo_epi32(diff, recip8_avx2(delta))
+      , _mm256_set1_epi32(1 << (HSV_RECIP_BITS - 11))), HSV_RECIP_BITS - 10));
+  *h = _mm256_add_epi32(hue, _mm256_and_si256(_mm256_srai_epi32(hue, 31)
+      , _mm256_set1_epi32(BMP_HUE_MAX)));
+  *s = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(delta
+      , recip8_avx2(max)), _mm256_set1_epi32(1 << (HSV_RECIP_BITS - 13)))
+      , HSV_RECIP_BITS - 12);
+}
 
-  for(i=0; i<s_kernel; i++){
-    free(gaussian_kernel[i]);
-  }free(gaussian_kernel);
+//to_rgb_span for 8 pixels as 32 bit integers
+TARGET_AVX2 static inline void rgb8_avx2(__m256i h, __m256i s, __m256i v
+        , __m256i *r, __m256i *g, __m256i *b){
+  const int one = BMP_SAT_MAX*BMP_HUE_SECTOR;
+  __m256i sector = _mm256_srli_epi32(h, 10);
+  __m256i f = _mm256_and_si256(h, _mm256_set1_epi32(BMP_HUE_SECTOR - 1));
+  __m256i sf, p, q, t, is[6];
+  int k;
+
+  //sector%6, exact for the 64 sectors of a WORD hue
+  sector = _mm256_sub_epi32(sector, _mm256_mullo_epi32(_mm256_srli_epi32(
+      _mm256_mullo_epi32(sector, _mm256_set1_epi32(43)), 8)
+      , _mm256_set1_epi32(6)));
+  for(k=0; k<6; k++){
+    is[k] = _mm256_cmpeq_epi32(sector, _mm256_set1_epi32(k));
+  }
+  s = _mm256_min_epi32(s, _mm256_set1_epi32(BMP_SAT_MAX));
+
+  p = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v
+      , _mm256_sub_epi32(_mm256_set1_epi32(BMP_SAT_MAX), s))
+      , _mm256_set1_epi32(BMP_SAT_MAX/2)), 12);
+  sf = _mm256_mullo_epi32(s, f);
+  q = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v
+      , _mm256_sub_epi32(_mm256_set1_epi32(one), sf))
+      , _mm256_set1_epi32(one/2)), 22);
+  sf = _mm256_mullo_epi32(s
+      , _mm256_sub_epi32(_mm256_set1_epi32(BMP_HUE_SECTOR), f));
+  t = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(v
+      , _mm256_sub_epi32(_mm256_set1_epi32(one), sf))
+      , _mm256_set1_epi32(one/2)), 22);
+
+  *r = _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(p, q, is[1])
+      , t, is[4]), v, _mm256_or_si256(is[0], is[5]));
+  *g = _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(p, t, is[0])
+      , q, is[3]), v, _mm256_or_si256(is[1], is[2]));
+  *b = _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(p, t, is[2])
+      , q, is[5]), v, _mm256_or_si256(is[3], is[4]));
+}
 
-  free_bitmap(image->bitmap, image->ih.biHeight);
-  image->bitmap = new_bitmap;
+//Packs 4 vectors of 8 integers into 32 bytes in order
+TARGET_AVX2 static inline __m256i pack32_avx2(const __m256i *x){
+  return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(
+      _mm256_packs_epi32(x[0], x[1]), _mm256_packs_epi32(x[2], x[3]))
+      , _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
 
-  return 0;
+//32 pixels of the planes b, g and r to HSV
+TARGET_AVX2 static inline void hsv32_avx2(__m256i b, __m256i g, __m256i r
+        , WORD *h, WORD *s, BYTE *v){
+  __m256i hue[4], sat[4];
+  int k;
+
+  _mm256_storeu_si256((__m256i *)v
+      , _mm256_max_epu8(_mm256_max_epu8(r, g), b));
+
+  for(k=0; k<2; k++){
+    __m128i r16 = k ? _mm256_extracti128_si256(r, 1)
+        : _mm256_castsi256_si128(r);
+    __m128i g16 = k ? _mm256_extracti128_si256(g, 1)
+        : _mm256_castsi256_si128(g);
+    __m128i b16 = k ? _mm256_extracti128_si256(b, 1)
+        : _mm256_castsi256_si128(b);
+    hsv8_avx2(r16, g16, b16, &hue[2*k], &sat[2*k]);
+    hsv8_avx2(_mm_srli_si128(r16, 8), _mm_srli_si128(g16, 8)
+        , _mm_srli_si128(b16, 8), &hue[2*k + 1], &sat[2*k + 1]);
+  }
+  for(k=0; k<2; k++){
+    _mm256_storeu_si256((__m256i *)(h + 16*k), _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(hue[2*k], hue[2*k + 1]), 0xD8));
+    _mm256_storeu_si256((__m256i *)(s + 16*k), _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(sat[2*k], sat[2*k + 1]), 0xD8));
+  }
 }
 
-/*---------------------------------------------------------------------------*/
-/* Static function definitions                                               */
-/*---------------------------------------------------------------------------*/
+//32 pixels of HSV to the planes b, g and r
+TARGET_AVX2 static inline void rgb32_avx2(const WORD *h, const WORD *s
+        , const BYTE *v, __m256i *b32, __m256i *g32, __m256i *r32){
+  __m256i r[4], g[4], b[4];
+  int k;
+
+  for(k=0; k<4; k++){
+    rgb8_avx2(_mm256_cvtepu16_epi32(
+        _mm_loadu_si128((const __m128i *)(h + 8*k)))
+        , _mm256_cvtepu16_epi32(
+        _mm_loadu_si128((const __m128i *)(s + 8*k)))
+        , _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((const __m128i *)(v + 8*k)))
+        , &r[k], &g[k], &b[k]);
+  }
+  *b32 = pack32_avx2(b);
+  *g32 = pack32_avx2(g);
+  *r32 = pack32_avx2(r);
+}
 
-void RGBtoHSV(float r, float g, float b, float* h, float* s, float* v){
-	float min, max, delta;
-	min = d_min(3, r, g, b);
-	max = d_max(3, r, g, b);
-  delta = max - min;
-  //V
-	*v = max;
-  //S
-	if(max != 0){
-		*s = delta / max;
-	}else{
-    *s = 0;
-		*h = -1;
-		return;
-	}
-  //H
-	if(r == max){
-		*h = (g - b)/delta;
-	}else if(g == max){
-		*h = 2 + (b - r)/delta;
-	}else{
-		*h = 4 + (r - g)/delta;
-  }
-  *h *= 60;
-	if(*h < 0){
-		*h += 360;
-  }
-}
-
-void HSVtoRGB(float h, float s, float v, float *r, float *g, float *b){
-	int i;
-	float f, p, q, t;
-	if(s == 0) {
-		*r = *g = *b = v;
-		return;
-	}
-	h /= 60;
-	i = h;
-	f = h - i;
-	p = v*(1 - s);
-	q = v*(1 - s*f);
-	t = v*(1 - s*(1 - f));
-	switch(i){
-    case 0:
-			*r = v;
-			*g = t;
-			*b = p;
-		  break;
-
-		case 1:
-			*r = q;
-			*g = v;
-			*b = p;
-      break;
+TARGET_AVX2 static void to_hsv_span_avx2(const RGBTRIPLE *src, WORD *h
+        , WORD *s, BYTE *v, size_t n){
+  const BYTE *p = (const BYTE *)src;
+  size_t i;
 
-		case 2:
-			*r = p;
-			*g = v;
-			*b = t;
-			break;
-
-		case 3:
-			*r = p;
-			*g = q;
-			*b = v;
-			break;
-
-		case 4:
-			*r = t;
-			*g = p;
-			*b = v;
-			break;
-
-		default:
-			*r = v;
-			*g = p;
-			*b = q;
-			break;
-	}
+  for(i=0; i+32<=n; i+=32, p+=96){
+    __m256i b, g, r;
+    load_planes_avx2(p, &b, &g, &r);
+    hsv32_avx2(b, g, r, h + i, s + i, v + i);
+  }
+  to_hsv_span(src + i, h + i, s + i, v + i, n - i);
 }
 
-RGBTRIPLE **generate_bitmap(int new_height, int new_width, int *error){
-  RGBTRIPLE **new_bitmap;
+TARGET_AVX2 static void to_rgb_span_avx2(const WORD *h, const WORD *s
+        , const BYTE *v, RGBTRIPLE *dst, size_t n){
+  BYTE *p = (BYTE *)dst;
+  size_t i;
 
-  if((new_bitmap = malloc(new_height * sizeof(RGBTRIPLE*))) == NULL){
-    *error = errno;
-    errno = 0;
-    return NULL;
+  for(i=0; i+32<=n; i+=32, p+=96){
+    __m256i b, g, r;
+    rgb32_avx2(h + i, s + i, v + i, &b, &g, &r);
+    store_planes_avx2(p, b, g, r);
   }
+  to_rgb_span(h + i, s + i, v + i, dst + i, n - i);
+}
 
-  int i,a;
-  for(i=0; i<new_height; i++){
-    new_bitmap[i] = NULL;
-    new_bitmap[i] = malloc(new_width * sizeof(RGBTRIPLE));
-    if(new_bitmap[i] == NULL){
-      for(a=0; a<i; a++){
-        if(new_bitmap[a] != NULL){
-          free(new_bitmap[a]);
-        }
-      }
-      if(new_bitmap != NULL){
-        free(new_bitmap);
-      }
-      *error = errno;
-      errno = 0;
-      return NULL;
-    }
-    memset(new_bitmap[i], 0, new_width * sizeof(RGBTRIPLE));
+TARGET_AVX2 static void to_hsv_planes_avx2(const BYTE *const *plane, WORD *h
+        , WORD *s, BYTE *v, size_t n){
+  const BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+32<=n; i+=32){
+    hsv32_avx2(_mm256_loadu_si256((const __m256i *)(plane[0] + i))
+        , _mm256_loadu_si256((const __m256i *)(plane[1] + i))
+        , _mm256_loadu_si256((const __m256i *)(plane[2] + i)), h + i, s + i
+        , v + i);
   }
-  return new_bitmap;
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
+  }
+  to_hsv_planes_sse41(rest, h + i, s + i, v + i, n - i);
 }
 
-void free_bitmap(RGBTRIPLE **bitmap, int height){
-  int i;
-  for(i=0; i<height; i++){
-    if(bitmap[i] != NULL){
-      free(bitmap[i]);
-    }
+TARGET_AVX2 static void to_rgb_planes_avx2(const WORD *h, const WORD *s
+        , const BYTE *v, BYTE *const *plane, size_t n){
+  BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+32<=n; i+=32){
+    __m256i b, g, r;
+    rgb32_avx2(h + i, s + i, v + i, &b, &g, &r);
+    _mm256_storeu_si256((__m256i *)(plane[0] + i), b);
+    _mm256_storeu_si256((__m256i *)(plane[1] + i), g);
+    _mm256_storeu_si256((__m256i *)(plane[2] + i), r);
   }
-  if(bitmap != NULL){
-    free(bitmap);
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
   }
+  to_rgb_planes_sse41(h + i, s + i, v + i, rest, n - i);
 }
 
-RGBTRIPLE **rotate_bitmap(RGBTRIPLE **bitmap, int height, int width, char motion
-        , int *error){
-  int new_width = height;
-  int new_height = width;
+TARGET_AVX2 static void split_span_avx2(const RGBTRIPLE *src
+        , BYTE *const *plane, size_t n){
+  const BYTE *p = (const BYTE *)src;
+  BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+32<=n; i+=32, p+=96){
+    __m256i b, g, r;
+    load_planes_avx2(p, &b, &g, &r);
+    _mm256_storeu_si256((__m256i *)(plane[0] + i), b);
+    _mm256_storeu_si256((__m256i *)(plane[1] + i), g);
+    _mm256_storeu_si256((__m256i *)(plane[2] + i), r);
+  }
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
+  }
+  split_span_sse41(src + i, rest, n - i);
+}
 
-  RGBTRIPLE **new_bitmap = generate_bitmap(new_height, new_width, error);
-  if(new_bitmap == NULL){
-    return NULL;
+TARGET_AVX2 static void merge_span_avx2(const BYTE *const *plane
+        , RGBTRIPLE *dst, size_t n){
+  BYTE *p = (BYTE *)dst;
+  const BYTE *rest[3];
+  size_t i;
+  int c;
+
+  for(i=0; i+32<=n; i+=32, p+=96){
+    store_planes_avx2(p, _mm256_loadu_si256((const __m256i *)(plane[0] + i))
+        , _mm256_loadu_si256((const __m256i *)(plane[1] + i))
+        , _mm256_loadu_si256((const __m256i *)(plane[2] + i)));
   }
+  for(c=0; c<3; c++){
+    rest[c] = plane[c] + i;
+  }
+  merge_span_sse41(rest, dst + i, n - i);
+}
 
-  int i,j;
-  for (i = 0; i < new_height; i++) {
-    for (j = 0; j < new_width; j++) {
-        if(motion == 'r')
-          new_bitmap[i][j] = bitmap[j][width-1-i];
-        else
-          new_bitmap[i][j] = bitmap[height-1-j][i];
-    }
+TARGET_AVX2 static void taps_span_avx2(double *sum, const double *src
+        , double k, size_t n){
+  __m256d kv = _mm256_set1_pd(k);
+  size_t x;
+
+  for(x=0; x+4<=n; x+=4){
+    _mm256_storeu_pd(sum + x, _mm256_add_pd(_mm256_loadu_pd(sum + x)
+        , _mm256_mul_pd(kv, _mm256_loadu_pd(src + x))));
   }
-  return new_bitmap;
+  taps_span(sum + x, src + x, k, n - x);
 }
 
-void call_gnuplot(char *csv_template, char *path, int *error){
-  int scpt;
-  char script[]="script_XXXXXX.gp";
-  scpt = mkstemps(script, 3);
+TARGET_AVX2 static void taps8_span_avx2(double *sum, const BYTE *src
+        , double k, size_t n){
+  __m256d kv = _mm256_set1_pd(k);
+  size_t x;
+
+  for(x=0; x+8<=n; x+=8){
+    __m128i q = _mm_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+    __m128i r = _mm_cvtepu8_epi32(_mm_srli_si128(
+        _mm_loadl_epi64((const __m128i *)(src + x)), 4));
+    _mm256_storeu_pd(sum + x, _mm256_add_pd(_mm256_loadu_pd(sum + x)
+        , _mm256_mul_pd(kv, _mm256_cvtepi32_pd(q))));
+    _mm256_storeu_pd(sum + x + 4, _mm256_add_pd(_mm256_loadu_pd(sum + x + 4)
+        , _mm256_mul_pd(kv, _mm256_cvtepi32_pd(r))));
+  }
+  taps8_span(sum + x, src + x, k, n - x);
+}
 
-  FILE *fd;
+TARGET_AVX2 static void norm_span_avx2(const double *sum, BYTE *dst
+        , double weight, size_t n){
+  __m256d w = _mm256_set1_pd(weight);
+  __m256d lo = _mm256_setzero_pd();
+  __m256d hi = _mm256_set1_pd(255);
+  size_t x;
+
+  for(x=0; x+8<=n; x+=8){
+    __m256d a = _mm256_div_pd(_mm256_loadu_pd(sum + x), w);
+    __m256d b = _mm256_div_pd(_mm256_loadu_pd(sum + x + 4), w);
+    __m128i q = _mm_packus_epi32(
+        _mm256_cvttpd_epi32(_mm256_min_pd(_mm256_max_pd(a, lo), hi))
+        , _mm256_cvttpd_epi32(_mm256_min_pd(_mm256_max_pd(b, lo), hi)));
+    _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(q, q));
+  }
+  norm_span(sum + x, dst + x, weight, n - x);
+}
 
-  if((fd = fdopen(scpt, "w")) == NULL){
-    *error = errno;
-    errno = 0;
-    return;
+TARGET_AVX2 static void transpose_block_avx2(const RGBTRIPLE *const *src
+        , RGBTRIPLE *const *dst){
+  __m256i mask = _mm256_inserti128_si256(_mm256_castsi128_si256(
+      MASK_SSE(transpose_mask[0])), MASK_SSE(transpose_mask[1]), 1);
+  __m256i r[ROTATE_BLOCK], t[ROTATE_BLOCK];
+  int k;
+
+  //Row k holds its pixels 0-3 in the low lane and 4-7 in the high one
+  for(k=0; k<ROTATE_BLOCK; k++){
+    const BYTE *p = (const BYTE *)src[k];
+    r[k] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(
+        _mm_loadu_si128((const __m128i *)p))
+        , _mm_loadu_si128((const __m128i *)(p + 8)), 1), mask);
+  }
+  for(k=0; k<ROTATE_BLOCK; k+=2){
+    t[k] = _mm256_unpacklo_epi32(r[k], r[k+1]);
+    t[k+1] = _mm256_unpackhi_epi32(r[k], r[k+1]);
+  }
+  for(k=0; k<ROTATE_BLOCK; k+=4){
+    r[k] = _mm256_unpacklo_epi64(t[k], t[k+2]);
+    r[k+1] = _mm256_unpackhi_epi64(t[k], t[k+2]);
+    r[k+2] = _mm256_unpacklo_epi64(t[k+1], t[k+3]);
+    r[k+3] = _mm256_unpackhi_epi64(t[k+1], t[k+3]);
+  }
+  //r[k] and r[k+4] hold column k (low lanes) and k+4 (high lanes) of rows
+  //0-3 and 4-7
+  for(k=0; k<4; k++){
+    __m256i c0 = _mm256_permute2x128_si256(r[k], r[k+4], 0x20);
+    __m256i c1 = _mm256_permute2x128_si256(r[k], r[k+4], 0x31);
+    store8_sse41((BYTE *)dst[k], _mm256_castsi256_si128(c0)
+        , _mm256_extracti128_si256(c0, 1));
+    store8_sse41((BYTE *)dst[k+4], _mm256_castsi256_si128(c1)
+        , _mm256_extracti128_si256(c1, 1));
   }
+}
 
-  fprintf(fd, "set xrange [0:255]\n");
-  fprintf(fd, "plot for [COL=2:4] inputfile using COL title columnheader with");
-  fprintf(fd, " lines\n");
-  fprintf(fd, "set terminal png\n");
-  fprintf(fd, "set output outputfile\n");
-  fprintf(fd, "replot\n");
+/*---------------------------------------------------------------------------*/
+/* AVX-512 (F and BW), 64 pixels per iteration                               */
+/*---------------------------------------------------------------------------*/
 
-  fclose(fd);
+#define MASK_AVX512(m) _mm512_broadcast_i32x4(MASK_SSE(m))
 
-  char f_argument[33] = "inputfile='";
-  strcat(f_argument, csv_template);
-  strcat(f_argument,"'");
-  char s_argument[PATH_MAX+20] = "outputfile='";
-  strcat(s_argument, path);
-  strcat(s_argument,".png'");
-
-  int status = 0;
-  pid_t fk = fork();
-  if(fk == 0){
-    execl("/usr/bin/gnuplot", "gnuplot", "-e", f_argument, "-e", s_argument
-            , script, NULL);
-  }else{
-    wait(&status);
-  }
-  if(status){
-    *error = UNKNOWN;
+TARGET_AVX512 static inline __m512i load4_avx512(const BYTE *p){
+  __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)p));
+  v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 48)), 1);
+  v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 96)), 2);
+  return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(p + 144))
+      , 3);
+}
+
+TARGET_AVX512 static inline void store4_avx512(BYTE *p, __m512i v){
+  _mm_storeu_si128((__m128i *)p, _mm512_castsi512_si128(v));
+  _mm_storeu_si128((__m128i *)(p + 48), _mm512_extracti32x4_epi32(v, 1));
+  _mm_storeu_si128((__m128i *)(p + 96), _mm512_extracti32x4_epi32(v, 2));
+  _mm_storeu_si128((__m128i *)(p + 144), _mm512_extracti32x4_epi32(v, 3));
+}
+
+TARGET_AVX512 static inline void load_planes_avx512(const BYTE *p
+        , __m512i *b, __m512i *g, __m512i *r){
+  __m512i v0 = load4_avx512(p);
+  __m512i v1 = load4_avx512(p + 16);
+  __m512i v2 = load4_avx512(p + 32);
+  __m512i *plane[3] = {b, g, r};
+  int c;
+
+  for(c=0; c<3; c++){
+    *plane[c] = _mm512_or_si512(_mm512_or_si512(
+        _mm512_shuffle_epi8(v0, MASK_AVX512(deinterleave_mask[c][0])),
+        _mm512_shuffle_epi8(v1, MASK_AVX512(deinterleave_mask[c][1]))),
+        _mm512_shuffle_epi8(v2, MASK_AVX512(deinterleave_mask[c][2])));
   }
-  remove(script);
+}
 
-  if(errno){
-    *error = errno;
-    errno = 0;
+TARGET_AVX512 static inline void store_planes_avx512(BYTE *p, __m512i b
+        , __m512i g, __m512i r){
+  int v;
+
+  for(v=0; v<3; v++){
+    store4_avx512(p + 16*v, _mm512_or_si512(_mm512_or_si512(
+        _mm512_shuffle_epi8(b, MASK_AVX512(interleave_mask[v][0])),
+        _mm512_shuffle_epi8(g, MASK_AVX512(interleave_mask[v][1]))),
+        _mm512_shuffle_epi8(r, MASK_AVX512(interleave_mask[v][2]))));
   }
 }
 
-RGBTRIPLE **resample_bitmap(RGBTRIPLE **bitmap, int new_height, int new_width
-        , int old_height, int old_width, int *error){
 
-  RGBTRIPLE **new_bitmap = generate_bitmap(new_height, new_width, error);
-  if(new_bitmap == NULL){
-    return NULL;
+//dot16_sse41 in one vector, the comparisons give the bits of near
+TARGET_AVX512 static inline __m128i dot16_avx512(__m128i r, __m128i g
+        , __m128i b, const struct colour_dot *dot, int *near){
+  __m512i s = _mm512_add_epi32(_mm512_add_epi32(
+      _mm512_mullo_epi32(_mm512_cvtepu8_epi32(r)
+        , _mm512_set1_epi32(dot->fixed[0])),
+      _mm512_mullo_epi32(_mm512_cvtepu8_epi32(g)
+        , _mm512_set1_epi32(dot->fixed[1]))),
+      _mm512_mullo_epi32(_mm512_cvtepu8_epi32(b)
+        , _mm512_set1_epi32(dot->fixed[2])));
+  *near |= _mm512_cmpge_epu32_mask(_mm512_slli_epi32(s, 32 - DOT_BITS)
+      , _mm512_set1_epi32(dot->limit));
+  return _mm512_cvtusepi32_epi8(_mm512_srli_epi32(s, DOT_BITS));
+}
+
+TARGET_AVX512 static void zero_span_avx512(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int mask = *(const int *)arg;
+  BYTE pattern[192];
+  size_t i;
+
+  for(i=0; i<192; i++){
+    pattern[i] = (mask >> (8*(i%3))) & 0xFF;
+  }
+  __m512i m0 = _mm512_loadu_si512(pattern);
+  __m512i m1 = _mm512_loadu_si512(pattern + 64);
+  __m512i m2 = _mm512_loadu_si512(pattern + 128);
+
+  BYTE *p = (BYTE *)span;
+  for(i=0; i+64<=n; i+=64, p+=192){
+    _mm512_storeu_si512(p, _mm512_and_si512(_mm512_loadu_si512(p), m0));
+    _mm512_storeu_si512(p + 64
+        , _mm512_and_si512(_mm512_loadu_si512(p + 64), m1));
+    _mm512_storeu_si512(p + 128
+        , _mm512_and_si512(_mm512_loadu_si512(p + 128), m2));
   }
+  zero_span_avx2(span + i, n - i, arg);
+}
 
-  double row_ratio = (double)old_height / (double)new_height;
-  double col_ratio = (double)old_width / (double)new_width;
+TARGET_AVX512 static void invert_span_avx512(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  __m512i ones = _mm512_set1_epi8(-1);
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  for(i=0; i+64<=n; i+=64, p+=192){
+    _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), ones));
+    _mm512_storeu_si512(p + 64
+        , _mm512_xor_si512(_mm512_loadu_si512(p + 64), ones));
+    _mm512_storeu_si512(p + 128
+        , _mm512_xor_si512(_mm512_loadu_si512(p + 128), ones));
+  }
+  invert_span_avx2(span + i, n - i, arg);
+}
 
-  int x,y,i,j;
-
-  for(i=0; i<new_height; i++){
-    double old_i = i*row_ratio;
-    double floor_i = (int)old_i;
-    for(j=0; j<new_width; j++){
-      double old_j = j*col_ratio;
-      double floor_j = (int)old_j;
-
-      double r = 0.0;
-      double g = 0.0;
-      double b = 0.0;
-      double weight = 0.0;
-
-      for(x=floor_i-2+1; x<=floor_i+2; x++){
-        for(y=floor_j-2+1; y<=floor_j+2; y++){
-          if((x<old_height)&&(y<old_width)&&(x>=0)&&(y>=0)){
-            double lanc_term = _L(old_i-x) * _L(old_j-y);
-            r += bitmap[x][y].r * lanc_term;
-            g += bitmap[x][y].g * lanc_term;
-            b += bitmap[x][y].b * lanc_term;
-            weight += lanc_term;
-          }
-        }
+TARGET_AVX512 static void sepia_span_avx512(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int fast = (precision_mode == BMP_PRECISION_FAST);
+  RGBTRIPLE orig[16];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  for(i=0; i+16<=n; i+=16, p+=48){
+    __m128i b, g, r, nb, ng, nr;
+    int near = 0;
+    load_planes_sse41(p, &b, &g, &r);
+    if(fast){
+      nb = quick16_avx2(r, g, b, &sepia_dot[2]);
+      ng = quick16_avx2(r, g, b, &sepia_dot[1]);
+      nr = quick16_avx2(r, g, b, &sepia_dot[0]);
+    }else{
+      nb = dot16_avx512(r, g, b, &sepia_dot[2], &near);
+      ng = dot16_avx512(r, g, b, &sepia_dot[1], &near);
+      nr = dot16_avx512(r, g, b, &sepia_dot[0], &near);
+      if(near){
+        memcpy(orig, p, sizeof(orig));
       }
-      r /= weight;
-      g /= weight;
-      b /= weight;
+    }
+    store_planes_sse41(p, nb, ng, nr);
+    if(near){//The scalar kernel is SSE code, clean the upper halves first
+      _mm256_zeroupper();
+      patch_span((RGBTRIPLE *)p, orig, near, sepia_span, arg);
+    }
+  }
+  sepia_span(span + i, n - i, arg);
+}
 
-      if((r < 0.0)||(r > 255.0)){
-        r = (r > 255.0) ? 255.0 : 0;
-      }
-      if((g < 0.0)||(g > 255.0)){
-        g = (g > 255.0) ? 255.0 : 0;
+TARGET_AVX512 static void grayscale_span_avx512(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  int fast = (precision_mode == BMP_PRECISION_FAST);
+  char rgby = *(const char *)arg;
+  RGBTRIPLE orig[16];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  if(rgby == 'y'){
+    for(i=0; i+16<=n; i+=16, p+=48){
+      __m128i b, g, r, y;
+      int near = 0;
+      load_planes_sse41(p, &b, &g, &r);
+      if(fast){
+        y = quick16_avx2(r, g, b, &luma_dot);
+      }else if((y = dot16_avx512(r, g, b, &luma_dot, &near)), near){
+        memcpy(orig, p, sizeof(orig));
       }
-      if((b < 0.0)||(b > 255.0)){
-        b = (b > 255.0) ? 255.0 : 0;
+      store_planes_sse41(p, y, y, y);
+      if(near){//The scalar kernel is SSE code, clean the upper halves first
+        _mm256_zeroupper();
+        patch_span((RGBTRIPLE *)p, orig, near, grayscale_span, arg);
       }
-
-      new_bitmap[i][j].r = r;
-      new_bitmap[i][j].g = g;
-      new_bitmap[i][j].b = b;
     }
+    grayscale_span(span + i, n - i, arg);
+    return;
   }
-  return new_bitmap;
-}
 
-double fast_sin(double var){
-  int loops = var/(E_TAU);
-  var = var - loops*E_TAU;
+  for(i=0; i+64<=n; i+=64, p+=192){
+    __m512i b, g, r;
+    load_planes_avx512(p, &b, &g, &r);
+    switch(rgby){
+      case 'r':
+      store_planes_avx512(p, r, r, r);
+      break;
 
-  if(var>E_PI){
-    var = E_PI - var;
-  }else if((-var)>E_PI){
-    var = -E_PI - var;
-  }
+      case 'g':
+      store_planes_avx512(p, b, g, g);
+      break;
 
-  if(var<0){
-    var = -var;
-    return -(16.0*var*(E_PI - var))/(5.0*E_PI_SQ - 4.0*var*(E_PI - var));
-  }else{
-    return (16.0*var*(E_PI - var))/(5.0*E_PI_SQ - 4.0*var*(E_PI - var));
+      case 'b':
+      store_planes_avx512(p, b, b, b);
+      break;
+    }
   }
+  grayscale_span_avx2(span + i, n - i, arg);
 }
 
-double sinc(double var){
-  if(var == 0.0){
-    return 1.0;
+TARGET_AVX512 static void bitone_span_avx512(RGBTRIPLE *span, size_t n
+        , const void *arg){
+  const struct bitone_args *args = arg;
+  __m512i zero = _mm512_setzero_si512();
+  __m512i thr = _mm512_set1_epi16(max(0, min(args->threshold, 766)));
+  __m512i dark[3], light[3];
+  BYTE *p = (BYTE *)span;
+  size_t i;
+
+  dark[0] = _mm512_set1_epi8(args->dark.b);
+  dark[1] = _mm512_set1_epi8(args->dark.g);
+  dark[2] = _mm512_set1_epi8(args->dark.r);
+  light[0] = _mm512_set1_epi8(args->light.b);
+  light[1] = _mm512_set1_epi8(args->light.g);
+  light[2] = _mm512_set1_epi8(args->light.r);
+
+  for(i=0; i+64<=n; i+=64, p+=192){
+    __m512i b, g, r;
+    load_planes_avx512(p, &b, &g, &r);
+
+    __m512i lo = _mm512_add_epi16(_mm512_add_epi16(
+        _mm512_unpacklo_epi8(r, zero), _mm512_unpacklo_epi8(g, zero))
+        , _mm512_unpacklo_epi8(b, zero));
+    __m512i hi = _mm512_add_epi16(_mm512_add_epi16(
+        _mm512_unpackhi_epi8(r, zero), _mm512_unpackhi_epi8(g, zero))
+        , _mm512_unpackhi_epi8(b, zero));
+    __m512i m = _mm512_packs_epi16(
+        _mm512_movm_epi16(_mm512_cmpgt_epi16_mask(thr, lo)),
+        _mm512_movm_epi16(_mm512_cmpgt_epi16_mask(thr, hi)));
+    __mmask64 k = _mm512_movepi8_mask(m);
+
+    store_planes_avx512(p, _mm512_mask_blend_epi8(k, light[0], dark[0])
+        , _mm512_mask_blend_epi8(k, light[1], dark[1])
+        , _mm512_mask_blend_epi8(k, light[2], dark[2]));
   }
-  return fast_sin(E_PI*var)/(E_PI*var);
+  bitone_span_avx2(span + i, n - i, arg);
 }
 
-double _L(double var){//Lanczos kernel window size = 2
-  if((var < 2)&&(var > -2)){
-    return sinc(var)*sinc(var/2.0);
-  }
-  return 0;
-}
+#endif
 
-double _G(double x, double sigma){//Gaussian function
-  return (1/(2*E_PI*sigma*sigma))*fast_exp(-(x*x)/(2*sigma*sigma));
-}
+static void lut_span(RGBTRIPLE *span, size_t n, const void *arg){
+  const struct channel_lut *lut = arg;
+  BYTE *p = (BYTE *)span;
+  size_t i;
 
-int max(int a, int b){
-  if(a > b){
-    return a;
+  for(i=0; i<n; i++, p+=3){
+    BYTE in[3] = {p[0], p[1], p[2]};
+    p[0] = lut->lut[0][in[lut->src[0]]];
+    p[1] = lut->lut[1][in[lut->src[1]]];
+    p[2] = lut->lut[2][in[lut->src[2]]];
   }
-  return b;
 }
 
-int min(int a, int b){
-  if(a < b){
-    return a;
+static void chain_span(RGBTRIPLE *span, size_t n, const void *arg){
+  const struct chain_plan *plan = arg;
+  size_t i;
+  int s;
+
+  //Every stage runs over a block while it is still in cache
+  for(i=0; i<n; i+=CHAIN_BLOCK){
+    size_t len = (n - i < CHAIN_BLOCK) ? n - i : CHAIN_BLOCK;
+    for(s=0; s<plan->n; s++){
+      plan->stages[s].fn(span + i, len, &plan->stages[s].arg);
+    }
   }
-  return b;
 }
 
-double d_max(int n_args, double  a, double b, ...){
-  n_args -= 2;
-  double maximum, aux;
+static int fold_lut(struct channel_lut *lut, const BMPOP *op){
+  int c, v;
 
-  if(a > b){
-    maximum = a;
-  }else{
-    maximum = b;
-  }
+  switch(op->op){
+    case BMP_OP_ZERO:
+    for(c=0; c<3; c++){
+      BYTE mask = (op->param >> (8*c)) & 0xFF;
+      for(v=0; v<256; v++){
+        lut->lut[c][v] &= mask;
+      }
+    }
+    return 0;
 
-  va_list numbers;
-  va_start (numbers, b);
+    case BMP_OP_INVERT:
+    for(c=0; c<3; c++){
+      for(v=0; v<256; v++){
+        lut->lut[c][v] = 255 - lut->lut[c][v];
+      }
+    }
+    return 0;
+
+    case BMP_OP_GRAYSCALE:
+    switch(op->param){//Channels copied as grayscale_span does
+      case 'r':
+      lut->src[0] = lut->src[1] = lut->src[2];
+      memcpy(lut->lut[0], lut->lut[2], 256);
+      memcpy(lut->lut[1], lut->lut[2], 256);
+      return 0;
+
+      case 'g':
+      lut->src[2] = lut->src[1];
+      memcpy(lut->lut[2], lut->lut[1], 256);
+      return 0;
+
+      case 'b':
+      lut->src[1] = lut->src[2] = lut->src[0];
+      memcpy(lut->lut[1], lut->lut[0], 256);
+      memcpy(lut->lut[2], lut->lut[0], 256);
+      return 0;
+
+      case 'y':
+      return -1;
 
-  int i;
-  for(i=0; i<n_args; i++){
-    aux = va_arg (numbers, double);
-    if(aux > maximum){
-      maximum = aux;
+      default://grayscale does nothing
+      return 0;
     }
   }
+  return -1;
+}
 
-  va_end (numbers);
-  return maximum;
+static int percent_factor(int percent){//percentage as 16.16 fixed point
+  if(percent < 0){
+    percent = 0;
+  }else if(percent > (1 << 20)){//saturates any channel anyway
+    percent = 1 << 20;
+  }
+  return (int)(((long long)percent << 16)/100);
 }
 
-double d_min(int n_args, double  a, double b, ...){
-  n_args -= 2;
-  double minimum, aux;
+static void simd_init(void){
+  int level = BMP_SIMD_NONE;
+  int c;
 
-  if(a < b){
-    minimum = a;
-  }else{
-    minimum = b;
+  for(c=0; c<3; c++){
+    dot_init(&sepia_dot[c]);
+  }
+  dot_init(&luma_dot);
+
+#ifdef BMP_X86_SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse4.1")){
+    level = BMP_SIMD_SSE41;
+  }
+  if(__builtin_cpu_supports("avx2")){
+    level = BMP_SIMD_AVX2;
   }
+  if(__builtin_cpu_supports("avx512f")&&__builtin_cpu_supports("avx512bw")){
+    level = BMP_SIMD_AVX512;
+  }
+#endif
+
+  simd_supported = level;
+  simd_select(level);
+}
 
-  va_list numbers;
-  va_start (numbers, b);
+static void dot_init(struct colour_dot *dot){
+  double short_by = 1;//What the truncated coefficients lose, and some margin
+  int c, v;
 
-  int i;
-  for(i=0; i<n_args; i++){
-    aux = va_arg (numbers, double);
-    if(aux < minimum){
-      minimum = aux;
+  for(c=0; c<3; c++){
+    dot->fixed[c] = dot->coef[c]*(1 << DOT_BITS);
+    short_by += 255*(dot->coef[c]*(1 << DOT_BITS) - dot->fixed[c]);
+    dot->quick[c] = lround(dot->coef[c]*65536);
+    for(v=0; v<256; v++){
+      dot->table[c][v] = (v*dot->quick[c]) >> 8;
     }
   }
-
-  va_end (numbers);
-  return minimum;
+  dot->limit = ((1 << DOT_BITS) - (DWORD)ceil(short_by)) << (32 - DOT_BITS);
 }
 
-double fast_exp(double x){
-  volatile union{
-    float f;
-    unsigned int i;
-  }cvt;
+static void simd_select(int level){
+  struct span_kernels k = {zero_span, sepia_span, bitone_span
+      , grayscale_span, invert_span, to_hsv_span, to_rgb_span
+      , transpose_block, flip_span, pack_quads, unpack_quads
+      , transpose_block32, flip_span32, transpose_block8, flip_span8
+      , split_span, merge_span, to_hsv_planes, to_rgb_planes
+      , taps_span, taps8_span, norm_span};
+
+#ifdef BMP_X86_SIMD
+  if(level >= BMP_SIMD_SSE41){
+    k = (struct span_kernels){zero_span_sse41, sepia_span_sse41
+        , bitone_span_sse41, grayscale_span_sse41, invert_span_sse41
+        , to_hsv_span_sse41, to_rgb_span_sse41, transpose_block_sse41
+        , flip_span_sse41, pack_quads_sse41, unpack_quads_sse41
+        , transpose_block32_sse41, flip_span32_sse41, transpose_block8_sse41
+        , flip_span8_sse41, split_span_sse41
+        , merge_span_sse41, to_hsv_planes_sse41, to_rgb_planes_sse41
+        , taps_span_sse41, taps8_span_sse41, norm_span_sse41};
+  }
+  if(level >= BMP_SIMD_AVX2){//Copies are bound by memory, SSE4.1 is kept
+    k = (struct span_kernels){zero_span_avx2, sepia_span_avx2
+        , bitone_span_avx2, grayscale_span_avx2, invert_span_avx2
+        , to_hsv_span_avx2, to_rgb_span_avx2, transpose_block_avx2
+        , flip_span_sse41, pack_quads_sse41, unpack_quads_sse41
+        , transpose_block32_sse41, flip_span32_sse41, transpose_block8_sse41
+        , flip_span8_sse41, split_span_avx2
+        , merge_span_avx2, to_hsv_planes_avx2, to_rgb_planes_avx2
+        , taps_span_avx2, taps8_span_avx2, norm_span_avx2};
+  }
+  if(level >= BMP_SIMD_AVX512){//No AVX-512 HSV kernels, AVX2 ones are used
+    k = (struct span_kernels){zero_span_avx512, sepia_span_avx512
+        , bitone_span_avx512, grayscale_span_avx512, invert_span_avx512
+        , to_hsv_span_avx2, to_rgb_span_avx2, transpose_block_avx2
+        , flip_span_sse41, pack_quads_sse41, unpack_quads_sse41
+        , transpose_block32_sse41, flip_span32_sse41, transpose_block8_sse41
+        , flip_span8_sse41, split_span_avx2
+        , merge_span_avx2, to_hsv_planes_avx2, to_rgb_planes_avx2
+        , taps_span_avx2, taps8_span_avx2, norm_span_avx2};
+  }
+#else
+  level = BMP_SIMD_NONE;
+#endif
 
-  float t = x * 1.442695041;
-  float fi = (float)((int)t);
-  float f = t - fi;
-  int i = (int)fi;
-  cvt.f = (0.3371894346 * f + 0.657636276) * f + 1.00172476;
-  cvt.i += (i << 23);
-  return (double)cvt.f;
+  kernels = k;
+  simd_current = level;
+}
+
+static const struct span_kernels *simd_kernels(void){
+  pthread_once(&simd_once, simd_init);
+  return &kernels;
 }
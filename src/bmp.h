@@ -2,10 +2,12 @@
 
   File        bmp.h
 
-  Resume      Library for the treat of 24 bit BMP images
+  Resume      Library for the treat of BMP images
 
-  Description This library only supports 24 bit uncompressed pixel bitmap
-            format files.
+  Description This library supports uncompressed BMP files of 8 (palette),
+            24 and 32 bit (BGRA) pixels, bottom-up or top-down. RLE8 and
+            RLE4 files are loaded expanded to 8 bit, and indexed images can
+            be saved run length encoded.
 
   See also    bmp.c
 
@@ -35,7 +37,9 @@ SOFTWARE.
 #ifndef BMP_H
 #define BMP_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
 /*---------------------------------------------------------------------------*/
 /* Constant declarations                                                     */
 /*---------------------------------------------------------------------------*/
@@ -46,6 +50,81 @@ SOFTWARE.
 #define NOT_SPT_FMT -3
 #define UNKNOWN -4
 
+#define BMP_MAP_READ 0 // shared read-only mapping of the file
+#define BMP_MAP_PRIVATE 1 // private copy-on-write mapping of the file
+
+#define BMP_MEMORY_COPY 0 // the rows are copied out of the caller's buffer
+#define BMP_MEMORY_BORROW 1 // the rows point into the caller's buffer
+#define BMP_MEMORY_FIXED 0 // the file is written in the caller's buffer
+#define BMP_MEMORY_GROW 1 // the buffer is reallocated if it is too small
+
+#define BMP_RLE8 1 // run length encoded 8 bit indices, as in biCompression
+#define BMP_RLE4 2 // run length encoded 4 bit indices
+
+#define BMP_PROBE_THREADS 8 // default number of threads of probe_BMP_batch
+
+#define BMP_MAX_THREADS 64 // maximum number of threads of the filters
+
+#define BMP_IO_AUTO 0 // backends of a BMPQUEUE: io_uring if the kernel has it
+#define BMP_IO_URING 1
+#define BMP_IO_THREADS 2 // blocking calls on a pool of threads
+
+#define BMP_IO_LOAD 0 // requests of a BMPQUEUE
+#define BMP_IO_SAVE 1
+
+#define BMP_QUEUE_DEPTH 64 // default number of requests of a BMPQUEUE
+#define BMP_QUEUE_MAX 4096 // maximum number of requests of a BMPQUEUE
+#define BMP_QUEUE_THREADS 16 // maximum number of threads of BMP_IO_THREADS
+
+#define BMP_STREAM_BUFFER (1 << 20) // stdio buffer of a BMPSTREAM
+
+#define BMP_SIMD_NONE 0 // portable C kernels
+#define BMP_SIMD_SSE41 1
+#define BMP_SIMD_AVX2 2
+#define BMP_SIMD_AVX512 3 // AVX-512 F and BW
+
+#define BMP_PRECISION_EXACT 0 // sepia and luma truncated as always
+#define BMP_PRECISION_FAST 1 // rounded in 16 bit fixed point
+
+#define BMP_HUE_SECTOR 1024 // hue units in 60 degrees
+#define BMP_HUE_MAX (6*BMP_HUE_SECTOR) // hue units in 360 degrees
+#define BMP_SAT_MAX 4096 // saturation of a pure colour
+
+#define BMP_FILTER_AREA 0 // mean of the covered pixels, best to reduce
+#define BMP_FILTER_BILINEAR 1
+#define BMP_FILTER_BICUBIC 2 // Keys cubic, a = -0.5
+#define BMP_FILTER_LANCZOS2 3
+#define BMP_FILTER_LANCZOS3 4
+
+#define BMP_LAYOUT_PACKED 0 // interleaved pixels, the rows of bitmap
+#define BMP_LAYOUT_PLANAR 1 // one plane per channel, the rows of planes
+
+#define BMP_FLIP_H 1 // pending flips of an image, bits of orientation:
+#define BMP_FLIP_V 2 // columns (H) or rows (V) in reverse order
+
+#define BMP_HISTO_R 1 // channels of a BMPHISTO
+#define BMP_HISTO_G 2
+#define BMP_HISTO_B 4
+#define BMP_HISTO_Y 8 // luma
+#define BMP_HISTO_ALL 15
+
+#define BMP_PLOT_SVG 0 // formats of the histogram charts
+#define BMP_PLOT_BMP 1
+#define BMP_PLOT_PNG 2 // uncompressed
+#define BMP_PLOT_WIDTH 640 // size of the histogram charts, in pixels
+#define BMP_PLOT_HEIGHT 480
+
+#define BMP_CHAIN_MAX 32 // maximum number of operations in a BMPCHAIN
+
+#define BMP_OP_ZERO 0 // param: mask, as in zero
+#define BMP_OP_SEPIA 1
+#define BMP_OP_SATURATION 2 // param: percentage
+#define BMP_OP_BRIGHTNESS 3 // param: percentage
+#define BMP_OP_CHROMA 4 // param: degrees
+#define BMP_OP_BITONE 5 // use chain_add_bitone
+#define BMP_OP_GRAYSCALE 6 // param: 'r', 'g', 'b' or 'y'
+#define BMP_OP_INVERT 7
+
 /*---------------------------------------------------------------------------*/
 /* Type declarations                                                         */
 /*---------------------------------------------------------------------------*/
@@ -96,13 +175,105 @@ typedef struct image{
   size_t aligment_size;
   BYTE *alignment; // characters between header and pixel map
   DWORD padding; // row padding within the pixel map
-  RGBTRIPLE **bitmap; // BITMAP multidimensional array
+  RGBTRIPLE **bitmap; // row view over pixels, bitmap[i] = pixels + i*stride
+  RGBTRIPLE *pixels; // contiguous pixel buffer owned by the image
+  RGBQUAD *palette; // 256 colours of an 8 bit image, NULL otherwise
+  BYTE **planes[3]; // rows of the b, g and r planes, NULL if packed
+  int orientation; // BMP_FLIP_* the bitmap is shown with, 0 if none
+  size_t stride; // bytes between the start of two consecutive rows
+  void *map; // mapping or buffer of the file the rows point into, if any
+  size_t map_size; // length of the mapping, 0 if the buffer is the caller's
+  struct stats *stats; // cache of image_stats, NULL until it is computed
+  struct image *parent; // image whose pixels a view shows, NULL if none
+  struct image *views; // views of this image, linked by next_view
+  struct image *next_view;
+  struct bitmap_pool *pool; // where its new bitmaps come from, NULL if none
 }BMPFILE;
 
 /*---------------------------------------------------------------------------*/
 /* Structure declarations                                                    */
 /*---------------------------------------------------------------------------*/
 
+typedef struct probe{
+  BITMAPFILEHEADER fh;
+  BITMAPINFOHEADER ih;
+  long long file_size; // size of the file in bytes
+  int is_bmp; // 1 if "BM" and bfSize matches the file size (as is_BMP)
+  int error; // 0 if load_image can load the file, the error code if not
+}BMPPROBE;
+
+typedef struct stream{
+  FILE *fd;
+  char *buffer; // stdio buffer of fd
+  BITMAPFILEHEADER fh;
+  BITMAPINFOHEADER ih;
+  DWORD padding; // row padding within the pixel map
+  int row; // rows read or written so far
+  int writer; // 1 if opened by create_stream, 0 if by open_stream
+  RGBQUAD *palette; // colours of an 8 bit image, NULL otherwise
+  BYTE *raw; // one row of an 8 or 32 bit image, NULL otherwise
+}BMPSTREAM;
+
+typedef struct bitmap_pool{
+  pthread_mutex_t lock;
+  struct pool_block *blocks; // bitmaps given back, the newest first
+  size_t limit; // bytes the pool keeps at most
+  size_t kept; // bytes of the bitmaps kept
+  unsigned long hits; // bitmaps served from the kept ones
+  unsigned long misses; // bitmaps that had to be allocated
+}BMPPOOL;
+
+typedef struct io_queue{
+  pthread_mutex_t lock;
+  pthread_cond_t work; // signalled when a request is pending
+  pthread_cond_t ready; // signalled when a request is done
+  struct io_request *pending; // not started yet, the oldest first
+  struct io_request *pending_last;
+  struct io_request *done; // completed and not waited for, the oldest first
+  struct io_request *done_last;
+  struct io_ring *ring; // of BMP_IO_URING, NULL otherwise
+  pthread_t *threads; // of BMP_IO_THREADS, NULL otherwise
+  int n_threads;
+  int stop; // tells the threads to finish
+  int backend; // BMP_IO_URING or BMP_IO_THREADS
+  int depth; // requests submitted and not waited for, at most
+  int outstanding; // requests submitted and not waited for
+}BMPQUEUE;
+
+typedef struct io_done{//A request that left a BMPQUEUE
+  BMPFILE image; // loaded by a BMP_IO_LOAD without error
+  void *tag; // given with the request
+  int op; // BMP_IO_LOAD or BMP_IO_SAVE
+  int error; // 0 or the error of load_image or save_image for the request
+}BMPDONE;
+
+typedef struct chain_op{
+  int op; // BMP_OP_*
+  int param; // parameter of the operation, if any
+  RGBTRIPLE dark; // colours and threshold of BMP_OP_BITONE
+  RGBTRIPLE light;
+}BMPOP;
+
+typedef struct chain{
+  int n; // operations queued
+  BMPOP ops[BMP_CHAIN_MAX];
+}BMPCHAIN;
+
+typedef struct histogram{
+  unsigned int r[256]; // pixels with each value of the channel
+  unsigned int g[256];
+  unsigned int b[256];
+  unsigned int y[256]; // luma, 0.2126 r + 0.7152 g + 0.0722 b
+}BMPHISTO;
+
+typedef struct stats{//index 0 r, 1 g, 2 b and 3 luma
+  BMPHISTO histo; // of all the channels
+  BYTE min[4];
+  BYTE max[4];
+  double mean[4];
+  double variance[4];
+}BMPSTATS;
+
 
 /*---------------------------------------------------------------------------*/
 /* Variable declarations                                                     */
@@ -133,6 +304,46 @@ typedef struct image{
 
 int is_BMP(char *path, int *error);
 
+/**probe_BMP*******************************************************************
+
+  Resume       Reads and validates the headers of the file at path
+
+  Description  Fills probe with the file and info headers of the file at path,
+            reading them with only one pread. is_bmp is set as is_BMP would
+            return it and error tells if load_image would accept the file:
+            0 on success, NOT_SPT_FMT for an unsupported format, CANNOT_LOAD
+            for a truncated or non BMP file or errno if it could not be read.
+
+  Parameters   -path: String with the path of the file.
+               -probe: Where the result is written.
+
+  Colat. Effe. Returns 0 if the file is a loadable BMP and -1 if not.
+
+  See also     is_BMP probe_BMP_batch
+
+******************************************************************************/
+
+int probe_BMP(char *path, BMPPROBE *probe);
+
+/**probe_BMP_batch*************************************************************
+
+  Resume       Probes a list of files using a pool of threads
+
+  Description  Calls probe_BMP for each of the n paths, writing the result of
+            paths[i] in probes[i]. The work is shared by threads threads, if
+            threads is 0 or less BMP_PROBE_THREADS are used.
+
+  Colat. Effe. Returns 0 when every path has been probed (whatever the result
+            of each probe is) or -1 if the threads could not be started, in
+            which case error is set appropiatelly.
+
+  See also     probe_BMP <pthread>
+
+******************************************************************************/
+
+int probe_BMP_batch(char **paths, size_t n, BMPPROBE *probes, int threads
+        , int *error);
+
 /**get_error_msg_bmp***********************************************************
 
   Resume       Returns the associated string to an error
@@ -150,12 +361,31 @@ const char *get_error_msg_bmp(int error);
 
   Description  Loads to memory the image in path. Writes in image pointer the
               direction of the image loaded.
+               8 bit (with palette), 24 bit and 32 bit (BI_RGB, or
+              BI_BITFIELDS with the usual BGRA masks) uncompressed images are
+              loaded as they are: the rows of bitmap hold RGBTRIPLE, RGBQUAD
+              or palette indices (BYTE) as ih.biBitCount tells, and the
+              colours of an 8 bit image are in palette. The point operations
+              (zero, sepia, saturation, brightness, chroma, bitone, grayscale,
+              invert and apply_chain) change the palette of an 8 bit image
+              and keep the alpha of a 32 bit one. Blurs and resizes mix the
+              channels of 32 bit and grey (identity palette) 8 bit images,
+              any other 8 bit image is converted to 24 bit for them.
+               RLE8 and RLE4 images are expanded while loaded into an
+              uncompressed 8 bit image with their palette, the pixels skipped
+              by the codes take the index 0.
+               The rows of a top-down image (negative biHeight) are kept in
+              the order of the file and its orientation is BMP_FLIP_V, with
+              a positive ih.biHeight. See resolve_orientation.
 
   Parameters   [pointer to an error variable]
 
   Colat. Effe. It is allocated in dinamic mem. so,
               it can and must be freed with clean_image function. Also if there
               is an error, the error var. will be set appropiatelly.
+              The whole bitmap lives in a single buffer (pixels), the rows of
+              bitmap are only pointers into it and must not be freed one by
+              one.
 
   See also     clean_image
 
@@ -163,11 +393,67 @@ const char *get_error_msg_bmp(int error);
 
 int load_image(BMPFILE *image, char *path, int *error);
 
+/**load_image_mmap**************************************************************
+
+  Resume       Maps the image in path into memory without copying it
+
+  Description  Maps the file in path and makes the rows of bitmap point
+            straight into the pixel array of the file, so nothing is read until
+            it is used. The rows keep the order of the file (bottom-up) and
+            stride is the padded size of a row in the file.
+               With mode BMP_MAP_READ the mapping is shared and read-only, any
+            function that modifies the bitmap in place must not be called on
+            it. With BMP_MAP_PRIVATE the pages are copy-on-write: the filters
+            work as usual and the file is never modified. Compressed (RLE)
+            images cannot be mapped, they return NOT_SPT_FMT.
+
+  Parameters   [image], [path], [BMP_MAP_READ or BMP_MAP_PRIVATE], [error]
+
+  Colat. Effe. The mapping is released by clean_image. If there is an error,
+            -1 is returned and the error var. is set appropiatelly.
+
+  See also     load_image clean_image <mmap>
+
+******************************************************************************/
+
+int load_image_mmap(BMPFILE *image, char *path, int mode, int *error);
+
+/**load_image_from_memory******************************************************
+
+  Resume       Loads the image from the size bytes of a BMP file in data
+
+  Description  Makes the same checks of the headers as load_image, probe_BMP
+            and open_stream: data must start by "BM" with the pixels after
+            the headers, else CANNOT_LOAD is returned. load_image_mmap maps
+            the file and calls it. With BMP_MEMORY_COPY the rows are
+            copied in a new bitmap and compressed (RLE) images are expanded.
+            With BMP_MEMORY_BORROW the rows of bitmap point straight into
+            data, as in a mapping, and compressed images return NOT_SPT_FMT.
+
+  Parameters   [image], [data], [size], [BMP_MEMORY_COPY or
+            BMP_MEMORY_BORROW], [error]
+
+  Colat. Effe. A borrowed data must outlive the image and the filters that
+            change the bitmap in place write into it, so it must be writable
+            for them. If there is an error, -1 is returned and the error var.
+            is set appropiatelly.
+
+  See also     load_image_mmap save_image_to_memory clean_image
+
+******************************************************************************/
+
+int load_image_from_memory(BMPFILE *image, const void *data, size_t size
+                           , int mode, int *error);
+
 /**clean_image*****************************************************************
 
   Resume       Clean from dinamic memory the image allocated by load_image
 
-  See also     load_image
+  Description  Frees the bitmap, or gives it back to the pool of the image
+            (use_pool) or, if the image was loaded by load_image_mmap, unmaps
+            the file.
+
+  See also     load_image load_image_mmap use_pool
 
 ******************************************************************************/
 
@@ -179,13 +465,475 @@ void clean_image(BMPFILE *image);
 
   Description  Save the image pointed by image to the path given
             by path. If there is an error, the error variable is set.
+               The pending flips of the image are applied on the way out,
+            without changing it: a vertical one by writing a top-down image
+            (negative biHeight) and a horizontal one row by row.
+               The headers and rows are written with writev: in a single call
+            if the rows are contiguous and unpadded, by batches of rows if
+            not, and through a buffer of reversed rows if flipped.
 
-  See also     load_image
+  See also     load_image save_image_mmap
 
 ******************************************************************************/
 
 int save_image(BMPFILE *image, char *path, int *error);
 
+/**save_image_mmap*************************************************************
+
+  Resume       Saves the image in path through a mapping of the file
+
+  Description  Writes the same file as save_image, but reserves its whole
+            size first (posix_fallocate), maps it and copies the rows into
+            the mapping in parallel, with the pending flips applied.
+
+  Colat. Effe. If there is an error, -1 is returned and the error var. is set
+            appropiatelly. The image is not changed.
+
+  See also     save_image load_image_mmap <posix_fallocate> <mmap>
+
+******************************************************************************/
+
+int save_image_mmap(BMPFILE *image, char *path, int *error);
+
+/**save_image_to_memory********************************************************
+
+  Resume       Writes the file save_image would write into a buffer
+
+  Description  *data is a buffer of *capacity bytes. With BMP_MEMORY_FIXED the
+            file is written in it, if it fits. With BMP_MEMORY_GROW *data is
+            NULL or allocated by malloc, and it is reallocated when it is too
+            small; *data and *capacity are updated then and the caller frees
+            it. *length is set to the bytes of the file. The rows are copied
+            in parallel.
+
+  Colat. Effe. If the file does not fit in a fixed buffer CANNOT_WRITE is
+            returned, *length tells the size it needs. If there is an error,
+            -1 is returned and the error var. is set appropiatelly.
+
+  See also     save_image load_image_from_memory
+
+******************************************************************************/
+
+int save_image_to_memory(BMPFILE *image, void **data, size_t *capacity
+                         , size_t *length, int mode, int *error);
+
+/**save_image_rle**************************************************************
+
+  Resume       Saves the image in path run length encoded
+
+  Description  Writes image as an indexed BMP compressed with compression,
+            BMP_RLE8 or BMP_RLE4. An 8 bit image keeps its palette and
+            indices. The palette of a 24 or 32 bit image (whose alpha is
+            dropped) is made of its colours in the order they are found,
+            bottom-up, so it suits images of few colours like the results of
+            bitone or blackandwhite. The rows are encoded by bands of rows in
+            parallel.
+
+  Colat. Effe. Returns NOT_SPT_FMT without creating the file if the image has
+            more colours than the compression allows (256 or 16), or an 8 bit
+            one has indices over 15 for BMP_RLE4. If there is an error, -1 is
+            returned and the error var. is set appropiatelly. The image is
+            not changed.
+
+  See also     save_image load_image
+
+******************************************************************************/
+
+int save_image_rle(BMPFILE *image, char *path, int compression, int *error);
+
+/**convert_image***************************************************************
+
+  Resume       Changes the pixel format of an image
+
+  Description  Converts the pixels of image to bits per pixel: 8 (the luma
+            of every pixel, as grayscale 'y', with a grey palette), 24 or 32
+            (with opaque alpha). An 8 bit image takes the colours of its
+            palette and a 32 bit one drops its alpha. The image is saved in
+            the new format, uncompressed.
+
+  Colat. Effe. A view or an image with views is detached from them first. If
+            there is an error, -1 is returned, the pixels and the format of
+            image are not changed and the error var. is set.
+
+  See also     load_image grayscale detach_view
+
+******************************************************************************/
+
+int convert_image(BMPFILE *image, int bits, int *error);
+
+/**set_layout******************************************************************
+
+  Resume       Changes the layout of the pixels of a 24 bit image in memory
+
+  Description  With BMP_LAYOUT_PLANAR the channels are split in three aligned
+            planes of bytes, planes[0] blue, planes[1] green and planes[2]
+            red, with the rows in the order of bitmap. blur, fast_blur,
+            resize, saturation, brightness, chroma, the point operations,
+            apply_chain, mirror, rotate, crop, histogram and save_image work on
+            the planes, the convolutions without shuffling channels in and
+            out, so a pipeline of them stays planar until it is saved. Any
+            other function turns the image back to BMP_LAYOUT_PACKED first.
+               While the image is planar the rows of bitmap keep their size
+            but not their pixels, until the layout is packed again.
+
+  Parameters   [image], [BMP_LAYOUT_PACKED or BMP_LAYOUT_PLANAR], [error]
+
+  Colat. Effe. The planes take as much memory as the bitmap, which is kept.
+            Only 24 bit images which are not views nor have views can be
+            planar. If there is an error, -1 is returned, the layout is not
+            changed and the error var. is set.
+
+  See also     convert_image view_image
+
+******************************************************************************/
+
+int set_layout(BMPFILE *image, int layout, int *error);
+
+/**open_stream*****************************************************************
+
+  Resume       Opens the image in path to be read by strips of rows
+
+  Description  Reads the headers of the image in path and leaves stream ready
+            for read_rows, without loading the bitmap. The headers can be
+            consulted in stream->fh and stream->ih. 8 and 32 bit images are
+            read as 24 bit rows, compressed (RLE) and top-down ones are not
+            supported.
+
+  Colat. Effe. The stream must be closed with close_stream. If there is an
+            error, -1 is returned and the error var. is set appropiatelly.
+
+  See also     read_rows close_stream
+
+******************************************************************************/
+
+int open_stream(BMPSTREAM *stream, char *path, int *error);
+
+/**read_rows*******************************************************************
+
+  Resume       Reads the next n rows of a stream opened by open_stream
+
+  Description  Copies up to n rows, in the order of the file (bottom-up),
+            into rows, which must have room for n*biWidth packed pixels.
+
+  Colat. Effe. Returns the number of rows read, 0 at the end of the image or
+            -1 if there is an error (or n is negative), in which case error is
+            set.
+
+  See also     open_stream wrap_rows
+
+******************************************************************************/
+
+int read_rows(BMPSTREAM *stream, RGBTRIPLE *rows, int n, int *error);
+
+/**create_stream***************************************************************
+
+  Resume       Creates the image in path to be written by strips of rows
+
+  Description  Writes the headers of a width x height 24 bit image and leaves
+            stream ready for write_rows. If height is 0, the number of rows is
+            not known in advance and it is fixed by close_stream. The fields of
+            stream->ih (e.g. the resolution) can be changed before closing.
+
+  Colat. Effe. The sizes of the headers are 32 bit: a file over 4 GiB is
+            written with biSizeImage and bfSize 0, which open_stream reads
+            but other programs may reject. If there is an error, -1 is
+            returned and the error var. is set appropiatelly.
+
+  See also     write_rows close_stream
+
+******************************************************************************/
+
+int create_stream(BMPSTREAM *stream, char *path, int width, int height
+        , int *error);
+
+/**write_rows******************************************************************
+
+  Resume       Appends n packed rows to a stream opened by create_stream
+
+  Description  Writes n rows of biWidth pixels (bottom-up, as in a BMPFILE)
+            adding the row padding of the file.
+
+  Colat. Effe. Returns 0 or -1 if there is an error or more rows than the
+            declared height are written, in which case error is set.
+
+  See also     create_stream close_stream
+
+******************************************************************************/
+
+int write_rows(BMPSTREAM *stream, RGBTRIPLE *rows, int n, int *error);
+
+/**close_stream****************************************************************
+
+  Resume       Closes a stream
+
+  Description  Closes a stream opened by open_stream or create_stream. For a
+            writer, the headers are written again with the final height,
+            biSizeImage and bfSize.
+
+  Colat. Effe. Returns 0 or -1 if the file could not be completed, in which
+            case error is set.
+
+******************************************************************************/
+
+int close_stream(BMPSTREAM *stream, int *error);
+
+/**wrap_rows*******************************************************************
+
+  Resume       Gives a BMPFILE view of n packed rows of a buffer
+
+  Description  Makes view a width x n image whose pixels are the ones in rows,
+            without copying them, so the row-local operations (zero, sepia,
+            saturation, brightness, chroma, bitone, grayscale, invert) can be
+            applied to each strip of a stream. Operations that look at the
+            whole image (blur, blackandwhite...) only see the strip.
+
+  Colat. Effe. Only the row pointers are allocated; view must be released with
+            clean_image, rows is never freed. If there is an error, -1 is
+            returned and the error var. is set.
+
+  See also     read_rows write_rows clean_image
+
+******************************************************************************/
+
+int wrap_rows(BMPFILE *view, RGBTRIPLE *rows, int width, int n, int *error);
+
+/**create_pool*****************************************************************
+
+  Resume       Prepares a pool that recycles the bitmaps of the operations
+
+  Description  The operations that write a new bitmap (blur, rotate, resize,
+            reduce, enlarge, convert_image, set_layout...) take it from the
+            pool of the image, if it keeps one big enough, and the bitmap
+            they replace goes back to it instead of being freed. Two stages
+            in a row ping-pong between the same two buffers. A kept bitmap
+            serves any request from half its size up. When the pool would
+            keep more than limit bytes, the oldest bitmaps are freed. hits and
+            misses count the bitmaps served from the pool and allocated.
+
+  Colat. Effe. If there is an error, -1 is returned and the error var. is
+            set. The pool may be shared by several threads.
+
+  See also     use_pool clean_pool
+
+******************************************************************************/
+
+int create_pool(BMPPOOL *pool, size_t limit, int *error);
+
+/**clean_pool******************************************************************
+
+  Resume       Frees the bitmaps kept by the pool
+
+  Colat. Effe. The images that use the pool must be cleaned, or moved to
+            another pool by use_pool, before.
+
+  See also     create_pool use_pool
+
+******************************************************************************/
+
+void clean_pool(BMPPOOL *pool);
+
+/**use_pool********************************************************************
+
+  Resume       Makes the operations on image recycle its bitmaps through pool
+
+  Description  The bitmaps the image owns already go back to pool when they
+            are replaced or the image is cleaned. A NULL pool frees them
+            again. Copies made by bmpdup and views get the same pool.
+
+  See also     create_pool clean_pool bmpdup view_image
+
+******************************************************************************/
+
+void use_pool(BMPFILE *image, BMPPOOL *pool);
+
+/**create_queue****************************************************************
+
+  Resume       Prepares a queue that loads and saves many images at once
+
+  Description  Up to depth requests (BMP_QUEUE_DEPTH if it is 0 or less, at
+            most BMP_QUEUE_MAX) of queue_load and queue_save are in flight at
+            the same time and wait_queue gives them back as they complete.
+            BMP_IO_URING submits the opens, reads, writes and closes of all of
+            them to an io_uring of the kernel, a few system calls for a whole
+            batch. BMP_IO_THREADS runs load_image and the writes on up to
+            BMP_QUEUE_THREADS threads. BMP_IO_AUTO takes io_uring and falls
+            back to the threads if the kernel (or a sandbox) does not allow
+            it; backend tells which one the queue got.
+
+  Colat. Effe. If there is an error, -1 is returned and the error var. is
+            set appropiatelly. The functions of a queue must be called from
+            one thread at a time.
+
+  See also     queue_load queue_save wait_queue clean_queue
+
+******************************************************************************/
+
+int create_queue(BMPQUEUE *queue, int depth, int backend, int *error);
+
+/**queue_load******************************************************************
+
+  Resume       Starts loading the image at path
+
+  Description  The image is read and parsed as load_image_from_memory does
+            and wait_queue gives it back with tag. The path is copied.
+
+  Colat. Effe. Returns -1 and sets the error var. to EAGAIN if depth requests
+            are outstanding, wait for one of them first.
+
+  See also     create_queue wait_queue load_image
+
+******************************************************************************/
+
+int queue_load(BMPQUEUE *queue, char *path, void *tag, int *error);
+
+/**queue_save******************************************************************
+
+  Resume       Starts saving the image at path
+
+  Description  The file save_image would write is made in memory, by
+            save_image_to_memory, before it returns, so the image can be
+            changed or cleaned right away. wait_queue tells when it is written
+            and if the write failed.
+
+  Colat. Effe. Returns -1 and sets the error var. to EAGAIN if depth requests
+            are outstanding, or to the error of save_image_to_memory.
+
+  See also     create_queue wait_queue save_image
+
+******************************************************************************/
+
+int queue_save(BMPQUEUE *queue, BMPFILE *image, char *path, void *tag
+        , int *error);
+
+/**wait_queue******************************************************************
+
+  Resume       Waits for a request of queue to complete
+
+  Description  Fills done with the oldest completed request, waiting for one
+            if none has completed yet. The images loaded must be cleaned by
+            the caller with clean_image.
+
+  Colat. Effe. Returns 1 when done is filled, 0 if no request is outstanding
+            and -1 if the kernel failed, in which case the error var. is set.
+
+  See also     queue_load queue_save clean_queue
+
+******************************************************************************/
+
+int wait_queue(BMPQUEUE *queue, BMPDONE *done, int *error);
+
+/**clean_queue*****************************************************************
+
+  Resume       Waits for the outstanding requests and frees the queue
+
+  Description  The images loaded and not waited for are cleaned.
+
+  See also     create_queue wait_queue
+
+******************************************************************************/
+
+void clean_queue(BMPQUEUE *queue);
+
+/**bmp_simd_level**************************************************************
+
+  Resume       Returns the instruction set used by the pixel kernels
+
+  Description  The first call detects the CPU (cpuid) and selects the fastest
+            kernels of zero, sepia, bitone, grayscale and invert it supports:
+            BMP_SIMD_NONE, BMP_SIMD_SSE41, BMP_SIMD_AVX2 or BMP_SIMD_AVX512.
+            Every level gives the same result.
+
+  See also     bmp_set_simd
+
+******************************************************************************/
+
+int bmp_simd_level(void);
+
+/**bmp_set_simd****************************************************************
+
+  Resume       Limits the instruction set used by the pixel kernels
+
+  Description  Selects the kernels of level, or of the best level supported
+            by the CPU if it is lower. Useful to compare or debug the kernels.
+
+  Colat. Effe. Returns the level selected. It must not be called while other
+            threads are running filters.
+
+  See also     bmp_simd_level
+
+******************************************************************************/
+
+int bmp_set_simd(int level);
+
+/**bmp_precision***************************************************************
+
+  Resume       Returns the precision of the colour matrices
+
+  Description  sepia, grayscale 'y', blackandwhite and the luma of the
+            histograms work in integer fixed point. With BMP_PRECISION_EXACT,
+            the default, they give the truncated result of the floating point
+            products that they used before, bit by bit. BMP_PRECISION_FAST
+            rounds 16 bit products to the nearest level instead, at most one
+            level away, and runs more pixels per instruction.
+
+  See also     bmp_set_precision
+
+******************************************************************************/
+
+int bmp_precision(void);
+
+/**bmp_set_precision***********************************************************
+
+  Resume       Selects the precision of the colour matrices
+
+  Description  mode is BMP_PRECISION_EXACT or BMP_PRECISION_FAST, any other
+            value keeps the current one. Every SIMD level gives the same
+            result in each mode.
+
+  Colat. Effe. Returns the mode selected. It must not be called while other
+            threads are running filters. The statistics cached before keep
+            the luma of the previous mode, see invalidate_stats.
+
+  See also     bmp_precision
+
+******************************************************************************/
+
+int bmp_set_precision(int mode);
+
+/**bmp_threads*****************************************************************
+
+  Resume       Returns the number of threads used by the filters
+
+  Description  Filters, histograms, rotations and resamplers split the image
+            in bands of rows (or of columns) that run on a persistent pool of
+            threads. By default it uses one thread per online CPU. Results do
+            not depend on the number of threads.
+
+  See also     bmp_set_threads
+
+******************************************************************************/
+
+int bmp_threads(void);
+
+/**bmp_set_threads*************************************************************
+
+  Resume       Sets the number of threads used by the filters
+
+  Description  threads <= 0 selects one thread per online CPU, 1 runs every
+            filter in the calling thread. At most BMP_MAX_THREADS. Every
+            thread holds at most one band and its scratch buffers at a time.
+            Calls made while another filter is using the pool, or from
+            inside a band, run in the calling thread.
+
+  Colat. Effe. Returns the number of threads selected. It must not be called
+            while other threads are running filters.
+
+  See also     bmp_threads
+
+******************************************************************************/
+
+int bmp_set_threads(int threads);
+
 /**zero************************************************************************
 
   Resume       Put one (or more) channel of the bitmap to zero
@@ -209,10 +957,52 @@ void zero(BMPFILE *image, int mask);
 
 void sepia(BMPFILE *image);
 
+/**rgb_to_hsv_row**************************************************************
+
+  Resume       Converts a row of pixels to planar HSV.
+
+  Description  Fixed point conversion without divisions. The hue is given in
+            units of 1/BMP_HUE_SECTOR of 60 degrees (0 to BMP_HUE_MAX - 1),
+            the saturation in units of 1/BMP_SAT_MAX and the value as the
+            largest channel. Hue and saturation are rounded to the nearest
+            unit and gray pixels get hue 0.
+
+  Parameters   [source row, hue, saturation and value planes, pixels]
+
+  See also     hsv_to_rgb_row
+
+******************************************************************************/
+
+void rgb_to_hsv_row(const RGBTRIPLE *src, WORD *h, WORD *s, BYTE *v
+          , size_t n);
+
+/**hsv_to_rgb_row**************************************************************
+
+  Resume       Converts a row of planar HSV pixels back to RGB.
+
+  Description  Inverse of rgb_to_hsv_row, rounding every channel to the
+            nearest value. Every pixel converted back and forth gives the
+            original pixel. Hues are taken modulo BMP_HUE_MAX and
+            saturations above BMP_SAT_MAX as BMP_SAT_MAX.
+
+  Parameters   [hue, saturation and value planes, destination row, pixels]
+
+  See also     rgb_to_hsv_row
+
+******************************************************************************/
+
+void hsv_to_rgb_row(const WORD *h, const WORD *s, const BYTE *v
+          , RGBTRIPLE *dst, size_t n);
+
 /**contrast********************************************************************
 
   Resume       Change the relative saturation of the image.
 
+  Description  Computed in fixed point HSV (see rgb_to_hsv_row). Channels
+            are rounded instead of truncated, so they can differ by up to 2
+            from the float conversion of previous versions. Negative
+            percentages are taken as 0.
+
   Parameters   [image_file, contrast (in percentage)]
 
 ******************************************************************************/
@@ -223,6 +1013,9 @@ void saturation(BMPFILE *image, int contrast_p);
 
   Resume       Change the relative brightness of the image.
 
+  Description  Computed in fixed point HSV like saturation, with the same
+            error bound. Negative percentages are taken as 0.
+
   Parameters   [image_file, brightness  (in percentage)]
 
 ******************************************************************************/
@@ -233,6 +1026,9 @@ void brightness(BMPFILE *image, int bright);
 
   Resume       Change the colour of the image.
 
+  Description  Rotates the hue in fixed point HSV like saturation, with the
+            same error bound. Negative angles rotate the other way.
+
   Parameters   [image_file, chroma  (in degrees)]
 
 ******************************************************************************/
@@ -287,13 +1083,74 @@ void blackandwhite(BMPFILE *image);
 
 void invert(BMPFILE *image);
 
+/**chain_clear*****************************************************************
+
+  Resume       Empties a chain of point operations
+
+  See also     chain_add apply_chain
+
+******************************************************************************/
+
+void chain_clear(BMPCHAIN *chain);
+
+/**chain_add*******************************************************************
+
+  Resume       Queues a point operation at the end of a chain
+
+  Description  op is one of BMP_OP_ZERO, BMP_OP_SEPIA, BMP_OP_SATURATION,
+            BMP_OP_BRIGHTNESS, BMP_OP_CHROMA, BMP_OP_GRAYSCALE or BMP_OP_INVERT
+            and param the argument the function of the same name takes (it is
+            ignored by sepia and invert). Bitone is queued by chain_add_bitone.
+
+  Colat. Effe. Returns -1 and sets error if the chain is full or op is
+            unknown.
+
+  See also     chain_add_bitone apply_chain
+
+******************************************************************************/
+
+int chain_add(BMPCHAIN *chain, int op, int param, int *error);
+
+/**chain_add_bitone************************************************************
+
+  Resume       Queues a bitone operation at the end of a chain
+
+  See also     bitone chain_add
+
+******************************************************************************/
+
+int chain_add_bitone(BMPCHAIN *chain, RGBTRIPLE dark, RGBTRIPLE light
+        , int threshold, int *error);
+
+/**apply_chain*****************************************************************
+
+  Resume       Applies a chain of point operations in a single pass
+
+  Description  The result is the same as calling the functions one after the
+            other, but the image is walked only once: the operations are
+            applied to blocks of pixels small enough to stay in cache. Runs of
+            operations that act on each channel on its own (zero, invert and
+            the 'r', 'g' and 'b' grayscales) are folded into one 256 entry
+            table per channel.
+
+  Colat. Effe. If there is an error, -1 is returned and error is set.
+
+  See also     chain_add
+
+******************************************************************************/
+
+int apply_chain(BMPFILE *image, BMPCHAIN *chain, int *error);
+
 /**mirror**********************************************************************
 
   Resume       Leflects the image
 
   Description  reflcts the image following the indications in hv. If hv value
           is 'h' it is reflected horizontally and if 'v' it is reflected
-          vertically.
+          vertically. No pixel is moved: the flip is added to the orientation
+          of the image, 'h' as BMP_FLIP_V and 'v' as BMP_FLIP_H (see
+          resolve_orientation). The pixels of a view, or of
+          an image with views, are shared and swapped in place instead.
 
   Colat. Effe. If it occurs an error, the error variable is set appropiatelly.
 
@@ -303,11 +1160,16 @@ void mirror(BMPFILE *image, char hv, int *error);
 
 /**rotate*********************************************************************
 
-  Resume       Rotates 90º to the left/right the image
+  Resume       Rotates 90º to the left/right the image, or 180º
 
   Description  Rotates 90º to the left/right the image following the indication
           in motion. If motion value is 'l' it is rotated to the left and if 'r'
-          it is rotated to the right.
+          it is rotated to the right. If it is 'u' it is turned upside down
+          (180º), which only flips the orientation of the image as mirror
+          does. Any other value is an error and -1 is returned.
+             A quarter turn goes through the image by tiles, so it needs one
+          new bitmap and no more, the pending flips of the image are kept
+          with their axes swapped.
 
   Colat. Effe. If it occurs an error, the error variable is set appropiatelly.
 
@@ -315,21 +1177,128 @@ void mirror(BMPFILE *image, char hv, int *error);
 
 int rotate(BMPFILE *image, char motion, int *error);
 
+/**resolve_orientation*********************************************************
+
+  Resume       Applies the pending flips of the image to its pixels
+
+  Description  The image shows its bitmap flipped as orientation tells
+            (BMP_FLIP_H, BMP_FLIP_V or both), which mirror, rotate and loading
+            top-down files change without moving pixels. This swaps the pixels
+            so that bitmap holds the image as shown and orientation is 0.
+            The point operations, histograms and conversions work on any
+            orientation, the filters that mix neighbours (blurs and resizes)
+            and view_image call it first. Call it before using the rows of
+            bitmap directly, or use image_pixel.
+
+  Colat. Effe. A mapped image gets its own bitmap. Returns -1 and sets the
+            error var. if it cannot be allocated.
+
+  See also     mirror rotate image_pixel
+
+******************************************************************************/
+
+int resolve_orientation(BMPFILE *image, int *error);
+
+/**image_pixel*****************************************************************
+
+  Resume       Pixel of the image as shown, whatever its orientation
+
+  Description  Returns the pixel at column x and row y, counted from the upper
+            left as in crop_rect, of a packed image: a RGBTRIPLE, a RGBQUAD or
+            a palette index as ih.biBitCount tells. NULL if it is outside the
+            image.
+
+  See also     resolve_orientation
+
+******************************************************************************/
+
+RGBTRIPLE *image_pixel(BMPFILE *image, int x, int y);
+
+/**histogram******************************************************************
+
+  Resume       Counts the pixels of each value of the channels of the image
+
+  Description  Fills histo with the counts of the channels in channels, any
+            combination of BMP_HISTO_R, BMP_HISTO_G, BMP_HISTO_B and
+            BMP_HISTO_Y (luma). The others are left at 0. Each band of the image
+            is counted apart and they are added at the end. If the statistics
+            of the image are cached, they are copied instead.
+
+  See also     plot_histogram image_stats blackandwhite
+
+******************************************************************************/
+
+void histogram(BMPFILE *image, BMPHISTO *histo, int channels);
+
+/**plot_histogram*************************************************************
+
+  Resume       Draws a chart of a histogram
+
+  Description  Draws the lines of the channels in channels of histo, scaled to
+            the highest count, in a BMP_PLOT_WIDTH x BMP_PLOT_HEIGHT chart and
+            saves it in path as BMP_PLOT_SVG, BMP_PLOT_BMP or BMP_PLOT_PNG.
+            Only the SVG chart has labels.
+
+  Colat. Effe. If it occurs an error, the function returns -1 and error is set
+            appropiatelly.
+
+  See also     histogram
+
+******************************************************************************/
+
+int plot_histogram(const BMPHISTO *histo, int channels, char *path
+        , int format, int *error);
+
 /**generate_histogram*********************************************************
 
   Resume       Generates the histogram of the image
 
-  Description  Generates the histogram of the tree channels and luminance of
-            image, and it is saved in path as a png file (.png is added). If it
-            occurs an error, the function returns -1 and error is set
-            appropiatelly. It is required to have  gnuplot installed.
+  Description  Generates the histogram of the tree channels of image, and it is
+            saved in path as a png file (.png is added). If it occurs an
+            error, the function returns -1 and error is set appropiatelly.
 
-  See also     man pages of gnuplot
+  See also     histogram plot_histogram
 
 ******************************************************************************/
 
 int generate_histogram(BMPFILE *image, char *path, int *error);
 
+/**image_stats****************************************************************
+
+  Resume       Statistics of the channels and luma of the image
+
+  Description  Returns the histograms, minimum, maximum, mean and variance of
+            the r, g, b and luma of image. They are computed in one pass the
+            first time and kept in image->stats until any function of this
+            library changes the pixels, so blackandwhite, histogram and
+            generate_histogram reuse them.
+
+  Colat. Effe. If the pixels are changed by other means, invalidate_stats must
+            be called. The cache is not shared safely between threads that use
+            the same image. If there is an error, NULL is returned and the
+            error var. is set.
+
+  See also     invalidate_stats histogram
+
+******************************************************************************/
+
+const BMPSTATS *image_stats(BMPFILE *image, int *error);
+
+/**invalidate_stats***********************************************************
+
+  Resume       Drops the cached statistics of the image
+
+  Description  Frees image->stats, so the next image_stats computes them
+            again, and those of the image it is a view of and of every other
+            view of it. The functions of this library call it when they change
+            the pixels.
+
+  See also     image_stats
+
+******************************************************************************/
+
+void invalidate_stats(BMPFILE *image);
+
 /**bmpdup*********************************************************************
 
   Resume       Copies the image source to dest
@@ -354,8 +1323,9 @@ int bmpdup(BMPFILE *source, BMPFILE *dest, int *error);
   Description  Decimates the bitmap of the image. Reduces the samples of the
             image by a factor. For it reduces the high frecuency components
             of the signal (low-pass filter), and keeps one of every M samples.
-            If it occurs an error, the function returns -1 and error is set
-            appropiatelly.
+            Grey 8 bit, 24 and 32 bit images are resampled alike, channel by
+            channel. If it occurs an error, the function returns -1 and error
+            is set appropiatelly.
 
   See also     https://en.wikipedia.org/wiki/Decimation_(signal_processing)
 
@@ -369,8 +1339,9 @@ int reduce(BMPFILE *image, int factor, int *error);
 
   Description  Upsamples the bitmap of the image. Increase the samples of the
             image by a factor. And then reduces the high frecuency components
-            of the signal (Interpolation). If there is an error, the function
-            returns -1 and error is set appropiatelly.
+            of the signal (Interpolation). Grey 8 bit, 24 and 32 bit images
+            are resampled alike, channel by channel. If there is an error, the
+            function returns -1 and error is set appropiatelly.
 
   See also     https://en.wikipedia.org/wiki/Upsampling
 
@@ -378,6 +1349,29 @@ int reduce(BMPFILE *image, int factor, int *error);
 
 int enlarge(BMPFILE *image, int factor, int *error);
 
+/**resize**********************************************************************
+
+  Resume       Resamples the image to any size
+
+  Description  Resizes the bitmap to new_width x new_height with a separable
+            filter: BMP_FILTER_AREA, BMP_FILTER_BILINEAR, BMP_FILTER_BICUBIC,
+            BMP_FILTER_LANCZOS2 or BMP_FILTER_LANCZOS3. The filter widens
+            with the factor when reducing, so every source pixel counts. The
+            fixed point weights of every output column and row are computed
+            once and applied in a horizontal and a vertical pass. If there is
+            an error, the function returns -1 and error is set appropiatelly.
+
+  Parameters   [BMP file, new width, new height, filter, error]
+
+  Colat. Effe. The resolution (pixels per meter) is scaled like the bitmap.
+
+  See also     reduce enlarge
+
+******************************************************************************/
+
+int resize(BMPFILE *image, int new_width, int new_height, int filter
+          , int *error);
+
 /**crop***********************************************************************
 
   Resume       Cut the image given two points **in percentage**.
@@ -388,27 +1382,120 @@ int enlarge(BMPFILE *image, int factor, int *error);
                If there is an error, the corresponding variable will be set
             properly and the function will return -1.
 
-  Colat. Effe. Return the new image in the pointer from the original image.
+  Colat. Effe. Return the new image in the pointer from the original image. As
+            crop_rect, no pixel is copied.
 
-  See also    d
+  See also    crop_rect view_image
 
 ******************************************************************************/
 
 int crop(BMPFILE *image, unsigned char x_1, unsigned char y_1
         , unsigned char x_2, unsigned char y_2, int *error);
 
+/**crop_rect******************************************************************
+
+  Resume       Cut the image to a rectangle given in pixels
+
+  Description  Keeps the width x height pixels whose upper left corner is the
+            pixel x (from the left) and y (from the top). Only the row pointers
+            are moved, the rest of the bitmap stays allocated until the image
+            is released.
+
+  Colat. Effe. If the rectangle is empty or not inside the image, -1 is
+            returned and error is set.
+
+  See also    crop view_image
+
+******************************************************************************/
+
+int crop_rect(BMPFILE *image, int x, int y, int width, int height, int *error);
+
+/**view_image*****************************************************************
+
+  Resume       Makes view a window of a rectangle of image, without copying it
+
+  Description  The rectangle is given as in crop_rect. view is a BMPFILE whose
+            rows point into the pixels of image, so every function can take it
+            as its target and the changes are seen in image. While its size
+            does not change, a view (or an image with views) keeps its pixels
+            where they are: blur, fast_blur or a square rotation write the
+            result back. Otherwise the view takes pixels of its own, as it does
+            with detach_view. A view of a view is a view of the same image.
+            The view of an 8 bit image has its own copy of the palette, the
+            point operations on it do not change the colours of image.
+               save_image writes a view straight from the pixels of image.
+
+  Colat. Effe. Only the row pointers are allocated; view must be released with
+            clean_image. Images with views and the views must stay where they
+            are in memory, they are linked. When image releases its pixels
+            (clean_image or a change of size), its views take a copy of them,
+            or are left empty if there is no memory for it. If there is an
+            error, -1 is returned and the error var. is set.
+
+  See also     crop_rect detach_view clean_image
+
+******************************************************************************/
+
+int view_image(BMPFILE *view, BMPFILE *image, int x, int y, int width
+        , int height, int *error);
+
+/**detach_view****************************************************************
+
+  Resume       Gives a view its own copy of its pixels
+
+  Description  Copies the pixels of view and unlinks it from its image, so
+            later changes of either are not seen by the other. Images that
+            are not views are left as they are.
+
+  Colat. Effe. If there is an error, -1 is returned, the error var. is set and
+            view is left as it was.
+
+  See also     view_image
+
+******************************************************************************/
+
+int detach_view(BMPFILE *view, int *error);
+
 /**blur***********************************************************************
 
   Resume       Given a radious, compute a Gaussian Blur with a certain quality
                (size of gaussian kernel). If quality is 0, it will be choosed
                automatically.
 
-  See also     https://en.wikipedia.org/wiki/Gaussian_blur
+  Description  The kernel is applied as a vertical and a horizontal 1D pass,
+            so the cost per pixel grows with quality and not with its square.
+            Near the edges only the taps inside the image are used and the
+            result is renormalized by their weight.
+
+  Colat. Effe. The doubles are added in another order than by the old 2D
+            kernel, so a channel may differ from its result by 1 level where
+            it falls next to the truncation.
+
+  See also     https://en.wikipedia.org/wiki/Gaussian_blur fast_blur
 
 ******************************************************************************/
 
 int blur(BMPFILE *image, int quality, int radii, int *error);
 
+/**fast_blur******************************************************************
+
+  Resume       Approximates a Gaussian Blur of the given radious in constant
+               time per pixel.
+
+  Description  Applies three successive box blurs (horizontal and vertical)
+            computed with running sums, whose sizes are chosen to approach a
+            Gaussian of sigma radious. The cost does not depend on the radious,
+            so it is the one to use for large radii. As in blur, the windows
+            are clipped and renormalized at the edges.
+
+  Colat. Effe. If there is an error, -1 is returned and error is set.
+
+  See also     blur http://blog.ivank.net/fastest-gaussian-blur.html
+
+******************************************************************************/
+
+int fast_blur(BMPFILE *image, int radii, int *error);
+
 /**Function*******************************************************************
 
   Resume       [obligatorio]
@@ -0,0 +1,1035 @@
+/**bmpbench*********************************************************************
+
+  File        bmpbench.c
+
+  Resume      Times every public operation of BMPlib on synthetic images
+
+  Description Usage: bmpbench [-s sizes] [-r repetitions] [-w warmups]
+            [-f filter] [-d dir] [-o json] [-t threads] [-l simd] [-b bits]
+            [-p] [-q] [-k megabytes] [-a backend]
+
+            Generates a noisy gradient image for each size class and times
+            each operation on it, repeated with a fresh copy of the image so
+            that every run sees the same pixels. Every class has a width that
+            is a multiple of 4 and an odd one, to exercise the row padding:
+              thumb   160x120 and 161x121
+              12mp    4000x3000 and 4003x3001
+              100mp   11544x8660 and 11547x8661
+            sizes is a comma separated list of classes (all by default) and
+            filter keeps the operations whose name contains it. The files of
+            the I/O operations are written in dir (/tmp by default). bits
+            converts the image to 8 (grey) or 32 bit pixels (24 by default).
+            -p runs the operations on planar images (BMP_LAYOUT_PLANAR), to
+            compare them with the packed ones, and set_layout times the
+            conversion from the layout of the image to the other one.
+            load_image_rle and save_image_rle work on a bitone copy of the
+            image, a mask of two colours, saved as RLE8. -q selects
+            BMP_PRECISION_FAST for sepia, grayscale and the luma. -k
+            recycles the bitmaps of the copies through a BMPPOOL that keeps
+            up to megabytes, its hits and misses are printed at the end.
+            The *_memory and load_image_borrow operations load and save the
+            file in a buffer, without going through the disk. queue_load and
+            queue_save move PROBE_FILES files at once through a BMPQUEUE of
+            the backend uring, threads or auto (the default).
+
+            For each operation and size the mean, standard deviation and
+            minimum of the runs are printed as ns/pixel and GB/s of the
+            pixels of the source image, and saved as JSON in the file json,
+            to compare builds.
+
+            Build: cc -O2 -Isrc tools/bmpbench.c src/bmp.c -lm -lpthread
+
+  See also    bmp.h
+
+  Autor       Raúl San Martín Aniceto
+
+  Copyright (c) 2017 Raúl San Martín Aniceto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "bmp.h"
+
+/*---------------------------------------------------------------------------*/
+/* Constant declarations                                                     */
+/*---------------------------------------------------------------------------*/
+
+#define STRIP_ROWS 64 // rows per call of read_rows and write_rows
+#define PROBE_FILES 16 // paths given to probe_BMP_batch and to the queue
+
+#define BENCH_COPY 1 // runs on a fresh copy of the image
+#define BENCH_FILE 2 // needs the image saved in a file
+#define BENCH_24 4 // needs 24 bit pixels
+#define BENCH_MASK 8 // needs the mask of the image saved as RLE8
+
+/*---------------------------------------------------------------------------*/
+/* Structure declarations                                                    */
+/*---------------------------------------------------------------------------*/
+
+struct size_class{
+  const char *name;
+  int width;
+  int height;
+};
+
+struct context{
+  BMPFILE *master; // generated image, never changed
+  RGBTRIPLE *pixels; // packed pixels of master
+  BMPFILE work; // copy of master of a BENCH_COPY operation
+  BMPFILE out; // image made by an operation, cleaned after it
+  int has_out;
+  char path[PATH_MAX]; // master saved as BMP
+  char out_path[PATH_MAX]; // scratch file
+  int layout; // BMP_LAYOUT_* of master before every run
+  BMPFILE mask; // bitone copy of master, for BENCH_MASK operations
+  int has_mask;
+  char mask_path[PATH_MAX]; // mask saved as RLE8
+  void *file; // master saved in memory
+  size_t file_size;
+  void *buffer; // scratch buffer of save_image_to_memory
+  size_t buffer_size;
+  BMPQUEUE *queue; // of queue_load and queue_save
+};
+
+struct bench{
+  const char *name;
+  int flags; // BENCH_*
+  int (*run)(struct context *ctx, int *error);
+};
+
+struct result{
+  double mean; // seconds
+  double stddev;
+  double min;
+  double max;
+};
+
+/*---------------------------------------------------------------------------*/
+/* Static function prototypes                                                */
+/*---------------------------------------------------------------------------*/
+
+static void usage(void);
+
+static double now(void);
+
+static int selected(const char *list, const char *name);
+
+static int make_mask(struct context *ctx, int *error);
+
+static RGBTRIPLE *generate(int width, int height);
+
+static int measure(const struct bench *bench, struct context *ctx, int runs
+          , int warmups, struct result *result, int *error);
+
+static int run_is_BMP(struct context *ctx, int *error);
+
+static int run_probe_BMP(struct context *ctx, int *error);
+
+static int run_probe_BMP_batch(struct context *ctx, int *error);
+
+static int run_load_image(struct context *ctx, int *error);
+
+static int run_load_image_mmap(struct context *ctx, int *error);
+
+static int run_save_image(struct context *ctx, int *error);
+
+static int run_save_image_mmap(struct context *ctx, int *error);
+
+static int run_load_image_memory(struct context *ctx, int *error);
+
+static int run_load_image_borrow(struct context *ctx, int *error);
+
+static int run_save_image_memory(struct context *ctx, int *error);
+
+static int run_queue_load(struct context *ctx, int *error);
+
+static int run_queue_save(struct context *ctx, int *error);
+
+static int drain_queue(BMPQUEUE *queue, int ret, int *error);
+
+static int run_load_image_rle(struct context *ctx, int *error);
+
+static int run_save_image_rle(struct context *ctx, int *error);
+
+static int run_read_rows(struct context *ctx, int *error);
+
+static int run_write_rows(struct context *ctx, int *error);
+
+static int run_wrap_rows(struct context *ctx, int *error);
+
+static int run_set_layout(struct context *ctx, int *error);
+
+static int run_zero(struct context *ctx, int *error);
+
+static int run_sepia(struct context *ctx, int *error);
+
+static int run_saturation(struct context *ctx, int *error);
+
+static int run_brightness(struct context *ctx, int *error);
+
+static int run_chroma(struct context *ctx, int *error);
+
+static int run_bitone(struct context *ctx, int *error);
+
+static int run_grayscale(struct context *ctx, int *error);
+
+static int run_blackandwhite(struct context *ctx, int *error);
+
+static int run_invert(struct context *ctx, int *error);
+
+static int run_apply_chain(struct context *ctx, int *error);
+
+static int run_mirror_h(struct context *ctx, int *error);
+
+static int run_mirror_v(struct context *ctx, int *error);
+
+static int run_rotate_l(struct context *ctx, int *error);
+
+static int run_rotate_r(struct context *ctx, int *error);
+
+static int run_rotate_u(struct context *ctx, int *error);
+
+static int run_resolve_orientation(struct context *ctx, int *error);
+
+static int run_histogram(struct context *ctx, int *error);
+
+static int run_plot_histogram(struct context *ctx, int *error);
+
+static int run_generate_histogram(struct context *ctx, int *error);
+
+static int run_image_stats(struct context *ctx, int *error);
+
+static int run_bmpdup(struct context *ctx, int *error);
+
+static int run_reduce(struct context *ctx, int *error);
+
+static int run_enlarge(struct context *ctx, int *error);
+
+static int run_resize_area(struct context *ctx, int *error);
+
+static int run_resize_bilinear(struct context *ctx, int *error);
+
+static int run_resize_bicubic(struct context *ctx, int *error);
+
+static int run_resize_lanczos3(struct context *ctx, int *error);
+
+static int run_crop(struct context *ctx, int *error);
+
+static int run_crop_rect(struct context *ctx, int *error);
+
+static int run_view_image(struct context *ctx, int *error);
+
+static int run_detach_view(struct context *ctx, int *error);
+
+static int run_blur(struct context *ctx, int *error);
+
+static int run_fast_blur(struct context *ctx, int *error);
+
+/*---------------------------------------------------------------------------*/
+/* Variable declarations                                                     */
+/*---------------------------------------------------------------------------*/
+
+static const struct size_class classes[] = {
+  {"thumb", 160, 120}, {"thumb", 161, 121},
+  {"12mp", 4000, 3000}, {"12mp", 4003, 3001},
+  {"100mp", 11544, 8660}, {"100mp", 11547, 8661}
+};
+
+static const struct bench benches[] = {
+  {"is_BMP", BENCH_FILE, run_is_BMP},
+  {"probe_BMP", BENCH_FILE, run_probe_BMP},
+  {"probe_BMP_batch", BENCH_FILE, run_probe_BMP_batch},
+  {"load_image", BENCH_FILE, run_load_image},
+  {"load_image_mmap", BENCH_FILE, run_load_image_mmap},
+  {"save_image", 0, run_save_image},
+  {"save_image_mmap", 0, run_save_image_mmap},
+  {"load_image_memory", 0, run_load_image_memory},
+  {"load_image_borrow", 0, run_load_image_borrow},
+  {"save_image_memory", 0, run_save_image_memory},
+  {"queue_load", BENCH_FILE, run_queue_load},
+  {"queue_save", 0, run_queue_save},
+  {"load_image_rle", BENCH_MASK, run_load_image_rle},
+  {"save_image_rle", BENCH_MASK, run_save_image_rle},
+  {"read_rows", BENCH_FILE, run_read_rows},
+  {"write_rows", 0, run_write_rows},
+  {"wrap_rows", 0, run_wrap_rows},
+  {"set_layout", BENCH_COPY | BENCH_24, run_set_layout},
+  {"zero", BENCH_COPY, run_zero},
+  {"sepia", BENCH_COPY, run_sepia},
+  {"saturation", BENCH_COPY, run_saturation},
+  {"brightness", BENCH_COPY, run_brightness},
+  {"chroma", BENCH_COPY, run_chroma},
+  {"bitone", BENCH_COPY, run_bitone},
+  {"grayscale", BENCH_COPY, run_grayscale},
+  {"blackandwhite", BENCH_COPY, run_blackandwhite},
+  {"invert", BENCH_COPY, run_invert},
+  {"apply_chain", BENCH_COPY, run_apply_chain},
+  {"mirror_h", BENCH_COPY, run_mirror_h},
+  {"mirror_v", BENCH_COPY, run_mirror_v},
+  {"rotate_l", BENCH_COPY, run_rotate_l},
+  {"rotate_r", BENCH_COPY, run_rotate_r},
+  {"rotate_u", BENCH_COPY, run_rotate_u},
+  {"resolve_orientation", BENCH_COPY, run_resolve_orientation},
+  {"histogram", 0, run_histogram},
+  {"plot_histogram", 0, run_plot_histogram},
+  {"generate_histogram", BENCH_COPY, run_generate_histogram},
+  {"image_stats", BENCH_COPY, run_image_stats},
+  {"bmpdup", 0, run_bmpdup},
+  {"reduce", BENCH_COPY, run_reduce},
+  {"enlarge", BENCH_COPY, run_enlarge},
+  {"resize_area", BENCH_COPY, run_resize_area},
+  {"resize_bilinear", BENCH_COPY, run_resize_bilinear},
+  {"resize_bicubic", BENCH_COPY, run_resize_bicubic},
+  {"resize_lanczos3", BENCH_COPY, run_resize_lanczos3},
+  {"crop", BENCH_COPY, run_crop},
+  {"crop_rect", BENCH_COPY, run_crop_rect},
+  {"view_image", 0, run_view_image},
+  {"detach_view", 0, run_detach_view},
+  {"blur", BENCH_COPY, run_blur},
+  {"fast_blur", BENCH_COPY, run_fast_blur}
+};
+
+/*---------------------------------------------------------------------------*/
+/* Function definitions                                                      */
+/*---------------------------------------------------------------------------*/
+
+int main(int argc, char **argv){
+  const char *sizes = "thumb,12mp,100mp";
+  const char *filter = "";
+  const char *dir = "/tmp";
+  char *json_path = NULL;
+  int runs = 5, warmups = 1, bits = 24, layout = BMP_LAYOUT_PACKED;
+  long keep = -1; // megabytes of the pool, -1 without it
+  int backend = BMP_IO_AUTO; // of the queue
+  int opt, error = 0;
+  size_t c, b;
+
+  while((opt = getopt(argc, argv, "s:r:w:f:d:o:t:l:b:pqk:a:h")) != -1){
+    switch(opt){
+      case 's':
+        sizes = optarg;
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        break;
+      case 'w':
+        warmups = atoi(optarg);
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'd':
+        dir = optarg;
+        break;
+      case 'o':
+        json_path = optarg;
+        break;
+      case 't':
+        bmp_set_threads(atoi(optarg));
+        break;
+      case 'l':
+        bmp_set_simd(atoi(optarg));
+        break;
+      case 'b':
+        bits = atoi(optarg);
+        break;
+      case 'p':
+        layout = BMP_LAYOUT_PLANAR;
+        break;
+      case 'q':
+        bmp_set_precision(BMP_PRECISION_FAST);
+        break;
+      case 'k':
+        keep = atol(optarg);
+        break;
+      case 'a':
+        if(!strcmp(optarg, "uring")){
+          backend = BMP_IO_URING;
+        }else if(!strcmp(optarg, "threads")){
+          backend = BMP_IO_THREADS;
+        }else if(strcmp(optarg, "auto")){
+          backend = -1;
+        }
+        break;
+      default:
+        usage();
+        return (opt == 'h') ? 0 : 2;
+    }
+  }
+  if((optind < argc)||(runs < 1)||(warmups < 0)
+      ||((bits != 8)&&(bits != 24)&&(bits != 32))
+      ||((layout == BMP_LAYOUT_PLANAR)&&(bits != 24))||(keep < -1)
+      ||(backend < 0)){
+    usage();
+    return 2;
+  }
+
+  BMPPOOL pool;
+  if((keep >= 0)&&create_pool(&pool, (size_t)keep << 20, &error)){
+    fprintf(stderr, "bmpbench: %s\n", get_error_msg_bmp(error));
+    return 1;
+  }
+
+  BMPQUEUE queue;
+  if(create_queue(&queue, PROBE_FILES, backend, &error)){
+    fprintf(stderr, "bmpbench: queue: %s\n", get_error_msg_bmp(error));
+    return 1;
+  }
+  const char *io = (queue.backend == BMP_IO_URING) ? "io_uring" : "threads";
+
+  FILE *json = NULL;
+  if(json_path != NULL){
+    if((json = fopen(json_path, "w")) == NULL){
+      perror(json_path);
+      return 1;
+    }
+    fprintf(json, "{\n  \"simd\": %d,\n  \"threads\": %d,\n  \"runs\": %d,\n"
+        "  \"warmups\": %d,\n  \"bits\": %d,\n  \"layout\": \"%s\",\n"
+        "  \"precision\": \"%s\",\n  \"pool_mb\": %ld,\n  \"queue\": \"%s\",\n"
+        "  \"results\": [", bmp_simd_level(), bmp_threads(), runs, warmups
+        , bits, layout ? "planar" : "packed"
+        , bmp_precision() ? "fast" : "exact", keep, io);
+  }
+
+  printf("simd level %d, %d threads, %d runs, %d bit pixels, %s, %s, %s\n"
+      , bmp_simd_level(), bmp_threads(), runs, bits
+      , layout ? "planar" : "packed", bmp_precision() ? "fast" : "exact", io);
+  printf("%-20s %13s %10s %10s %8s %10s\n", "operation", "size", "ns/pixel"
+      , "min", "stddev%", "GB/s");
+
+  int first = 1;
+  int failed = 0;
+  for(c=0; c<sizeof(classes)/sizeof(classes[0]); c++){
+    const struct size_class *size = &classes[c];
+    if(!selected(sizes, size->name)){
+      continue;
+    }
+
+    struct context ctx;
+    BMPFILE wrapped, master;
+    memset(&ctx, 0, sizeof(struct context));
+    if((ctx.pixels = generate(size->width, size->height)) == NULL
+        ||wrap_rows(&wrapped, ctx.pixels, size->width, size->height, &error)
+        ||bmpdup(&wrapped, &master, &error)
+        ||convert_image(&master, bits, &error)){
+      fprintf(stderr, "bmpbench: %dx%d: %s\n", size->width, size->height
+          , get_error_msg_bmp(error ? error : CANNOT_LOAD));
+      return 1;
+    }
+    clean_image(&wrapped);
+    if(keep >= 0){//The copies of bmpdup get the pool of the master
+      use_pool(&master, &pool);
+    }
+    ctx.master = &master;
+    ctx.queue = &queue;
+    ctx.layout = layout;
+    snprintf(ctx.path, PATH_MAX, "%s/bmpbench_%d.bmp", dir, (int)getpid());
+    snprintf(ctx.out_path, PATH_MAX, "%s/bmpbench_%d.out", dir, (int)getpid());
+    snprintf(ctx.mask_path, PATH_MAX, "%s/bmpbench_%d.rle", dir
+        , (int)getpid());
+    if(save_image(&master, ctx.path, &error)){
+      fprintf(stderr, "bmpbench: %s: %s\n", ctx.path
+          , get_error_msg_bmp(error));
+      return 1;
+    }
+    size_t capacity = 0;
+    if(save_image_to_memory(&master, &ctx.file, &capacity, &ctx.file_size
+        , BMP_MEMORY_GROW, &error)){
+      fprintf(stderr, "bmpbench: %dx%d: %s\n", size->width, size->height
+          , get_error_msg_bmp(error));
+      return 1;
+    }
+    for(b=0; b<sizeof(benches)/sizeof(benches[0]); b++){
+      if((benches[b].flags & BENCH_MASK)&&strstr(benches[b].name, filter)
+          &&!ctx.has_mask&&make_mask(&ctx, &error)){
+        fprintf(stderr, "bmpbench: %s: %s\n", ctx.mask_path
+            , get_error_msg_bmp(error));
+        return 1;
+      }
+    }
+
+    double pixels = (double)size->width*size->height;
+    for(b=0; b<sizeof(benches)/sizeof(benches[0]); b++){
+      const struct bench *bench = &benches[b];
+      struct result result;
+      if(!strstr(bench->name, filter)
+          ||((bench->flags & BENCH_24)&&(bits != 24))){
+        continue;
+      }
+      if(measure(bench, &ctx, runs, warmups, &result, &error)){
+        fprintf(stderr, "bmpbench: %s %dx%d: %s\n", bench->name, size->width
+            , size->height, get_error_msg_bmp(error));
+        failed = 1;
+        continue;
+      }
+
+      double ns_pixel = result.mean*1e9/pixels;
+      double gb_s = pixels*bits/8/result.mean/1e9;
+      double spread = 100*result.stddev/result.mean;
+      printf("%-20s %6dx%-6d %10.3f %10.3f %7.1f%% %10.3f\n", bench->name
+          , size->width, size->height, ns_pixel, result.min*1e9/pixels
+          , spread, gb_s);
+      fflush(stdout);
+
+      if(json != NULL){
+        fprintf(json, "%s\n    {\"operation\": \"%s\", \"class\": \"%s\", "
+            "\"width\": %d, \"height\": %d, \"padding\": %d, "
+            "\"mean_s\": %.9g, \"stddev_s\": %.9g, \"min_s\": %.9g, "
+            "\"max_s\": %.9g, \"ns_per_pixel\": %.6g, \"gb_per_s\": %.6g}"
+            , first ? "" : ",", bench->name, size->name, size->width
+            , size->height, (int)master.padding, result.mean, result.stddev
+            , result.min, result.max, ns_pixel, gb_s);
+        first = 0;
+      }
+    }
+
+    unlink(ctx.path);
+    unlink(ctx.out_path);
+    for(b=0; b<PROBE_FILES; b++){
+      char path[PATH_MAX + 16]; // out_path and the number
+      snprintf(path, sizeof(path), "%s.%d", ctx.out_path, (int)b);
+      unlink(path);
+    }
+    if(ctx.has_mask){
+      unlink(ctx.mask_path);
+      clean_image(&ctx.mask);
+    }
+    clean_image(&master);
+    free(ctx.pixels);
+    free(ctx.file);
+    free(ctx.buffer);
+  }
+
+  clean_queue(&queue);
+  if(keep >= 0){
+    printf("pool: %lu hits, %lu misses, %zu bytes kept\n", pool.hits
+        , pool.misses, pool.kept);
+    clean_pool(&pool);
+  }
+
+  if(json != NULL){
+    fprintf(json, "\n  ]\n}\n");
+    if(fclose(json)){
+      perror(json_path);
+      return 1;
+    }
+  }
+  return failed;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Static function definitions                                               */
+/*---------------------------------------------------------------------------*/
+
+static void usage(void){
+  fprintf(stderr, "Usage: bmpbench [-s sizes] [-r repetitions] [-w warmups]"
+      " [-f filter] [-d dir] [-o json] [-t threads] [-l simd] [-b bits]"
+      " [-p] [-q] [-k megabytes]\n");
+  fprintf(stderr, "  sizes: comma separated list of thumb, 12mp and 100mp\n");
+  fprintf(stderr, "  bits: 8, 24 or 32 bits per pixel\n");
+  fprintf(stderr, "  -p: planar images, only of 24 bits\n");
+  fprintf(stderr, "  -q: fast rounding of sepia, grayscale and luma\n");
+  fprintf(stderr, "  -k: recycle the bitmaps through a pool of megabytes\n");
+  fprintf(stderr, "  backend: uring, threads or auto, of queue_load and"
+      " queue_save\n");
+}
+
+static double now(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static int selected(const char *list, const char *name){
+  size_t len = strlen(name);
+  const char *p = list;
+
+  while((p = strstr(p, name)) != NULL){
+    if(((p == list)||(p[-1] == ','))&&((p[len] == ',')||(p[len] == '\0'))){
+      return 1;
+    }
+    p += len;
+  }
+  return 0;
+}
+
+static int make_mask(struct context *ctx, int *error){
+  RGBTRIPLE dark = {0x20, 0x10, 0x00};
+  RGBTRIPLE light = {0xE0, 0xF0, 0xFF};
+
+  if(bmpdup(ctx->master, &ctx->mask, error)){
+    return -1;
+  }
+  bitone(&ctx->mask, dark, light, 128);
+  if(save_image_rle(&ctx->mask, ctx->mask_path, BMP_RLE8, error)){
+    clean_image(&ctx->mask);
+    return -1;
+  }
+  ctx->has_mask = 1;
+  return 0;
+}
+
+static RGBTRIPLE *generate(int width, int height){
+  //Gradients with noise, so that neither the data nor the branches repeat
+  RGBTRIPLE *pixels = malloc((size_t)width*height*sizeof(RGBTRIPLE));
+  uint32_t seed = 0x9E3779B9;
+  int i, j;
+
+  if(pixels == NULL){
+    return NULL;
+  }
+  for(i=0; i<height; i++){
+    RGBTRIPLE *row = pixels + (size_t)i*width;
+    for(j=0; j<width; j++){
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      row[j].r = (j*255/width + (seed & 0x3F)) & 0xFF;
+      row[j].g = (i*255/height + ((seed >> 8) & 0x3F)) & 0xFF;
+      row[j].b = ((i + j)*127/(width + height) + ((seed >> 16) & 0x7F))
+          & 0xFF;
+    }
+  }
+  return pixels;
+}
+
+static int measure(const struct bench *bench, struct context *ctx, int runs
+        , int warmups, struct result *result, int *error){
+  double sum = 0, sum2 = 0;
+  int i;
+
+  result->min = INFINITY;
+  result->max = 0;
+  for(i=0; i<warmups+runs; i++){
+    //Some operations pack the master, bmpdup copies the layout
+    if(set_layout(ctx->master, ctx->layout, error)){
+      return -1;
+    }
+    if((bench->flags & BENCH_COPY)&&bmpdup(ctx->master, &ctx->work, error)){
+      return -1;
+    }
+    ctx->has_out = 0;
+
+    double start = now();
+    int ret = bench->run(ctx, error);
+    double t = now() - start;
+
+    if(bench->flags & BENCH_COPY){
+      clean_image(&ctx->work);
+    }
+    if(ctx->has_out){
+      clean_image(&ctx->out);
+    }
+    if(ret){
+      return -1;
+    }
+    if(i < warmups){
+      continue;
+    }
+    sum += t;
+    sum2 += t*t;
+    if(t < result->min){
+      result->min = t;
+    }
+    if(t > result->max){
+      result->max = t;
+    }
+  }
+
+  result->mean = sum/runs;
+  double variance = (runs > 1) ? (sum2 - sum*sum/runs)/(runs - 1) : 0;
+  result->stddev = (variance > 0) ? sqrt(variance) : 0;
+  return 0;
+}
+
+static int run_is_BMP(struct context *ctx, int *error){
+  return (is_BMP(ctx->path, error) == 1) ? 0 : -1;
+}
+
+static int run_probe_BMP(struct context *ctx, int *error){
+  BMPPROBE probe;
+  if(probe_BMP(ctx->path, &probe)){
+    *error = probe.error;
+    return -1;
+  }
+  return 0;
+}
+
+static int run_probe_BMP_batch(struct context *ctx, int *error){
+  char *paths[PROBE_FILES];
+  BMPPROBE probes[PROBE_FILES];
+  int i;
+
+  for(i=0; i<PROBE_FILES; i++){
+    paths[i] = ctx->path;
+  }
+  return (probe_BMP_batch(paths, PROBE_FILES, probes, 0, error) < 0) ? -1 : 0;
+}
+
+static int run_load_image(struct context *ctx, int *error){
+  if(load_image(&ctx->out, ctx->path, error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+static int run_load_image_mmap(struct context *ctx, int *error){
+  if(load_image_mmap(&ctx->out, ctx->path, BMP_MAP_READ, error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+static int run_save_image(struct context *ctx, int *error){
+  return save_image(ctx->master, ctx->out_path, error);
+}
+
+static int run_save_image_mmap(struct context *ctx, int *error){
+  return save_image_mmap(ctx->master, ctx->out_path, error);
+}
+
+static int run_load_image_memory(struct context *ctx, int *error){
+  if(load_image_from_memory(&ctx->out, ctx->file, ctx->file_size
+      , BMP_MEMORY_COPY, error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+static int run_load_image_borrow(struct context *ctx, int *error){
+  if(load_image_from_memory(&ctx->out, ctx->file, ctx->file_size
+      , BMP_MEMORY_BORROW, error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+//The buffer grows in the first run and is reused by the others
+static int run_save_image_memory(struct context *ctx, int *error){
+  size_t length;
+
+  return save_image_to_memory(ctx->master, &ctx->buffer, &ctx->buffer_size
+      , &length, BMP_MEMORY_GROW, error);
+}
+
+static int run_queue_load(struct context *ctx, int *error){
+  int i;
+
+  for(i=0; i<PROBE_FILES; i++){
+    if(queue_load(ctx->queue, ctx->path, NULL, error)){
+      return drain_queue(ctx->queue, -1, error);
+    }
+  }
+  return drain_queue(ctx->queue, 0, error);
+}
+
+static int run_queue_save(struct context *ctx, int *error){
+  char path[PATH_MAX + 16]; // out_path and the number
+  int i;
+
+  for(i=0; i<PROBE_FILES; i++){
+    snprintf(path, sizeof(path), "%s.%d", ctx->out_path, i);
+    if(queue_save(ctx->queue, ctx->master, path, NULL, error)){
+      return drain_queue(ctx->queue, -1, error);
+    }
+  }
+  return drain_queue(ctx->queue, 0, error);
+}
+
+//Waits for every request of queue, ret is -1 if one of them failed
+static int drain_queue(BMPQUEUE *queue, int ret, int *error){
+  BMPDONE done;
+  int got;
+
+  while((got = wait_queue(queue, &done, error)) == 1){
+    if(done.error){
+      *error = done.error;
+      ret = -1;
+    }else if(done.op == BMP_IO_LOAD){
+      clean_image(&done.image);
+    }
+  }
+  return (got < 0) ? -1 : ret;
+}
+
+static int run_load_image_rle(struct context *ctx, int *error){
+  if(load_image(&ctx->out, ctx->mask_path, error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+static int run_save_image_rle(struct context *ctx, int *error){
+  return save_image_rle(&ctx->mask, ctx->out_path, BMP_RLE8, error);
+}
+
+static int run_read_rows(struct context *ctx, int *error){
+  BMPSTREAM stream;
+  RGBTRIPLE *rows;
+  int n;
+
+  if(open_stream(&stream, ctx->path, error)){
+    return -1;
+  }
+  rows = malloc((size_t)STRIP_ROWS*stream.ih.biWidth*sizeof(RGBTRIPLE));
+  if(rows == NULL){
+    *error = CANNOT_LOAD;
+    close_stream(&stream, error);
+    return -1;
+  }
+  while((n = read_rows(&stream, rows, STRIP_ROWS, error)) > 0);
+  free(rows);
+  if(n < 0){
+    close_stream(&stream, error);
+    return -1;
+  }
+  return close_stream(&stream, error);
+}
+
+static int run_write_rows(struct context *ctx, int *error){
+  BMPSTREAM stream;
+  int width = ctx->master->ih.biWidth;
+  int height = ctx->master->ih.biHeight;
+  int i, n;
+
+  if(create_stream(&stream, ctx->out_path, width, height, error)){
+    return -1;
+  }
+  for(i=0; i<height; i+=n){
+    n = (height - i < STRIP_ROWS) ? height - i : STRIP_ROWS;
+    if(write_rows(&stream, ctx->pixels + (size_t)i*width, n, error)){
+      close_stream(&stream, error);
+      return -1;
+    }
+  }
+  return close_stream(&stream, error);
+}
+
+static int run_wrap_rows(struct context *ctx, int *error){
+  if(wrap_rows(&ctx->out, ctx->pixels, ctx->master->ih.biWidth
+      , ctx->master->ih.biHeight, error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+static int run_set_layout(struct context *ctx, int *error){
+  return set_layout(&ctx->work, (ctx->layout == BMP_LAYOUT_PACKED)
+      ? BMP_LAYOUT_PLANAR : BMP_LAYOUT_PACKED, error);
+}
+
+static int run_zero(struct context *ctx, int *error){
+  zero(&ctx->work, 0x5);
+  return 0;
+}
+
+static int run_sepia(struct context *ctx, int *error){
+  sepia(&ctx->work);
+  return 0;
+}
+
+static int run_saturation(struct context *ctx, int *error){
+  saturation(&ctx->work, 40);
+  return 0;
+}
+
+static int run_brightness(struct context *ctx, int *error){
+  brightness(&ctx->work, 30);
+  return 0;
+}
+
+static int run_chroma(struct context *ctx, int *error){
+  chroma(&ctx->work, 90);
+  return 0;
+}
+
+static int run_bitone(struct context *ctx, int *error){
+  RGBTRIPLE dark = {0x20, 0x10, 0x00};
+  RGBTRIPLE light = {0xE0, 0xF0, 0xFF};
+  bitone(&ctx->work, dark, light, 128);
+  return 0;
+}
+
+static int run_grayscale(struct context *ctx, int *error){
+  grayscale(&ctx->work, 'y');
+  return 0;
+}
+
+static int run_blackandwhite(struct context *ctx, int *error){
+  blackandwhite(&ctx->work);
+  return 0;
+}
+
+static int run_invert(struct context *ctx, int *error){
+  invert(&ctx->work);
+  return 0;
+}
+
+static int run_apply_chain(struct context *ctx, int *error){
+  BMPCHAIN chain;
+  chain_clear(&chain);
+  if(chain_add(&chain, BMP_OP_SEPIA, 0, error)
+      ||chain_add(&chain, BMP_OP_BRIGHTNESS, 20, error)
+      ||chain_add(&chain, BMP_OP_INVERT, 0, error)){
+    return -1;
+  }
+  return apply_chain(&ctx->work, &chain, error);
+}
+
+static int run_mirror_h(struct context *ctx, int *error){
+  *error = 0;
+  mirror(&ctx->work, 'h', error);
+  return *error ? -1 : 0;
+}
+
+static int run_mirror_v(struct context *ctx, int *error){
+  *error = 0;
+  mirror(&ctx->work, 'v', error);
+  return *error ? -1 : 0;
+}
+
+static int run_rotate_l(struct context *ctx, int *error){
+  return rotate(&ctx->work, 'l', error);
+}
+
+static int run_rotate_r(struct context *ctx, int *error){
+  return rotate(&ctx->work, 'r', error);
+}
+
+static int run_rotate_u(struct context *ctx, int *error){
+  return rotate(&ctx->work, 'u', error);
+}
+
+static int run_resolve_orientation(struct context *ctx, int *error){
+  //The flips are lazy, this times the pixels they end up moving
+  if(rotate(&ctx->work, 'u', error)){
+    return -1;
+  }
+  return resolve_orientation(&ctx->work, error);
+}
+
+static int run_histogram(struct context *ctx, int *error){
+  BMPHISTO histo;
+  histogram(ctx->master, &histo, BMP_HISTO_ALL);
+  return 0;
+}
+
+static int run_plot_histogram(struct context *ctx, int *error){
+  BMPHISTO histo;
+  histogram(ctx->master, &histo, BMP_HISTO_ALL);
+  return plot_histogram(&histo, BMP_HISTO_ALL, ctx->out_path, BMP_PLOT_PNG
+      , error);
+}
+
+static int run_generate_histogram(struct context *ctx, int *error){
+  int ret = generate_histogram(&ctx->work, ctx->out_path, error);
+  char png[PATH_MAX + 4];
+  snprintf(png, sizeof(png), "%s.png", ctx->out_path);
+  unlink(png);
+  return ret;
+}
+
+static int run_image_stats(struct context *ctx, int *error){
+  return (image_stats(&ctx->work, error) == NULL) ? -1 : 0;
+}
+
+static int run_bmpdup(struct context *ctx, int *error){
+  if(bmpdup(ctx->master, &ctx->out, error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+static int run_reduce(struct context *ctx, int *error){
+  return reduce(&ctx->work, 2, error);
+}
+
+static int run_enlarge(struct context *ctx, int *error){
+  return enlarge(&ctx->work, 2, error);
+}
+
+static int run_resize_area(struct context *ctx, int *error){
+  return resize(&ctx->work, ctx->work.ih.biWidth/2, ctx->work.ih.biHeight/2
+      , BMP_FILTER_AREA, error);
+}
+
+static int run_resize_bilinear(struct context *ctx, int *error){
+  return resize(&ctx->work, ctx->work.ih.biWidth*3/4
+      , ctx->work.ih.biHeight*3/4, BMP_FILTER_BILINEAR, error);
+}
+
+static int run_resize_bicubic(struct context *ctx, int *error){
+  return resize(&ctx->work, ctx->work.ih.biWidth*3/4
+      , ctx->work.ih.biHeight*3/4, BMP_FILTER_BICUBIC, error);
+}
+
+static int run_resize_lanczos3(struct context *ctx, int *error){
+  return resize(&ctx->work, ctx->work.ih.biWidth*3/4
+      , ctx->work.ih.biHeight*3/4, BMP_FILTER_LANCZOS3, error);
+}
+
+static int run_crop(struct context *ctx, int *error){
+  return crop(&ctx->work, 25, 25, 75, 75, error);
+}
+
+static int run_crop_rect(struct context *ctx, int *error){
+  return crop_rect(&ctx->work, ctx->work.ih.biWidth/4, ctx->work.ih.biHeight/4
+      , ctx->work.ih.biWidth/2, ctx->work.ih.biHeight/2, error);
+}
+
+static int run_view_image(struct context *ctx, int *error){
+  int width = ctx->master->ih.biWidth;
+  int height = ctx->master->ih.biHeight;
+
+  if(view_image(&ctx->out, ctx->master, width/4, height/4, width/2, height/2
+      , error)){
+    return -1;
+  }
+  ctx->has_out = 1;
+  return 0;
+}
+
+static int run_detach_view(struct context *ctx, int *error){
+  return run_view_image(ctx, error) ? -1 : detach_view(&ctx->out, error);
+}
+
+static int run_blur(struct context *ctx, int *error){
+  return blur(&ctx->work, 0, 3, error);
+}
+
+static int run_fast_blur(struct context *ctx, int *error){
+  return fast_blur(&ctx->work, 8, error);
+}
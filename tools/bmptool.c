@@ -0,0 +1,711 @@
+/**bmptool**********************************************************************
+
+  File        bmptool.c
+
+  Resume      Applies a pipeline of BMPlib operations to batches of images
+
+  Description Usage: bmptool -p spec -o dir [-j workers] [-m megabytes]
+            [-t threads] [-P] [-c rle8|rle4] input...
+
+            spec is a comma separated list of stages, each one a name and its
+            colon separated arguments, e.g. crop:0:0:640:480,sepia,blur:3.
+            Inputs are BMP files or directories, whose .bmp files are taken.
+            The results are saved in dir with the name of the input, the
+            inputs that are already in dir are replaced by them. Images
+            are processed by a pool of workers, and no more images are loaded
+            while the ones in flight would use more than megabytes. At the
+            end the throughput and the time spent in each stage are printed.
+            With -P the 24 bit images go through the stages in planar
+            layout (set_layout), converted when loaded and saved. With -c
+            the results are saved run length encoded (save_image_rle), the
+            ones with too many colours for it are saved uncompressed.
+            The workers share a BMPPOOL as large as the budget, the bitmaps
+            the stages replace are recycled by the next ones.
+
+            Stages:
+              crop:x:y:width:height   rectangle in pixels from the upper left
+              resize:width:height[:filter]  area, bilinear, bicubic, lanczos2
+                                      or lanczos3 (default)
+              reduce:factor  enlarge:factor
+              rotate:l|r|u  mirror:h|v
+              blur:radius             constant time blur (fast_blur)
+              gaussian:radius         separable Gaussian blur (blur)
+              sepia  invert  bw  zero:mask  saturation:percent
+              brightness:percent  chroma:degrees  grayscale:r|g|b|y
+              bitone:threshold        black and white around threshold
+
+            Consecutive point operations are fused in one BMPCHAIN.
+
+            Build: cc -O2 -Isrc tools/bmptool.c src/bmp.c -lm -lpthread
+
+  See also    bmp.h
+
+  Autor       Raúl San Martín Aniceto
+
+  Copyright (c) 2017 Raúl San Martín Aniceto
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "bmp.h"
+
+/*---------------------------------------------------------------------------*/
+/* Constant declarations                                                     */
+/*---------------------------------------------------------------------------*/
+
+#define MAX_STAGES 64
+#define STAGE_NAME 64 // characters kept of the spec of a stage
+
+#define DEFAULT_BUDGET 1024 // megabytes of images in flight
+
+#define STAGE_CROP 0
+#define STAGE_RESIZE 1
+#define STAGE_REDUCE 2
+#define STAGE_ENLARGE 3
+#define STAGE_ROTATE 4
+#define STAGE_MIRROR 5
+#define STAGE_BLUR 6
+#define STAGE_GAUSSIAN 7
+#define STAGE_BW 8
+#define STAGE_CHAIN 9 // fused point operations
+
+/*---------------------------------------------------------------------------*/
+/* Structure declarations                                                    */
+/*---------------------------------------------------------------------------*/
+
+struct stage{
+  char name[STAGE_NAME]; // as written in the spec, joined by '+' if fused
+  int kind; // STAGE_*
+  int args[4];
+  BMPCHAIN chain; // of a STAGE_CHAIN
+};
+
+struct worker{
+  pthread_t thread;
+  double seconds[MAX_STAGES + 2]; // load, stages and save
+  double megapixels; // of the images loaded
+  int done;
+  int failed;
+};
+
+/*---------------------------------------------------------------------------*/
+/* Variable declarations                                                     */
+/*---------------------------------------------------------------------------*/
+
+static struct stage stages[MAX_STAGES];
+static int n_stages = 0;
+
+static char **inputs = NULL;
+static size_t n_inputs = 0;
+static size_t next_input = 0; // shared by the workers
+
+static char *out_dir = NULL;
+static int layout = BMP_LAYOUT_PACKED; // of the 24 bit images
+static int compression = 0; // BMP_RLE* of the results, 0 for none
+
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t budget_free = PTHREAD_COND_INITIALIZER;
+static size_t budget = (size_t)DEFAULT_BUDGET << 20; // bytes
+static size_t in_flight = 0; // bytes of the images being processed
+
+static BMPPOOL bitmaps; // recycled by the stages of all the workers
+
+/*---------------------------------------------------------------------------*/
+/* Static function prototypes                                                */
+/*---------------------------------------------------------------------------*/
+
+static void usage(void);
+
+static double now(void);
+
+static int parse_spec(char *spec);
+
+static int parse_stage(char *text, struct stage *stage, int *point_op
+          , int *param);
+
+static int parse_filter(const char *name);
+
+static int add_input(char *path);
+
+static int add_file(const char *path);
+
+static int compare_paths(const void *a, const void *b);
+
+static size_t peak_bytes(int width, int height, int bits);
+
+static void acquire(size_t bytes);
+
+static void release(size_t bytes);
+
+static int run_stage(struct stage *stage, BMPFILE *image, int *error);
+
+static int process(char *path, struct worker *self);
+
+static void *worker_main(void *arg);
+
+/*---------------------------------------------------------------------------*/
+/* Function definitions                                                      */
+/*---------------------------------------------------------------------------*/
+
+int main(int argc, char **argv){
+  char *spec = NULL;
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt, i, j;
+
+  while((opt = getopt(argc, argv, "p:o:j:m:t:Pc:h")) != -1){
+    switch(opt){
+      case 'p':
+        spec = optarg;
+        break;
+      case 'o':
+        out_dir = optarg;
+        break;
+      case 'j':
+        workers = atol(optarg);
+        break;
+      case 'm':
+        budget = (size_t)atol(optarg) << 20;
+        break;
+      case 't':
+        bmp_set_threads(atoi(optarg));
+        break;
+      case 'P':
+        layout = BMP_LAYOUT_PLANAR;
+        break;
+      case 'c':
+        if(!strcasecmp(optarg, "rle8")){
+          compression = BMP_RLE8;
+        }else if(!strcasecmp(optarg, "rle4")){
+          compression = BMP_RLE4;
+        }else{
+          usage();
+          return 2;
+        }
+        break;
+      default:
+        usage();
+        return (opt == 'h') ? 0 : 2;
+    }
+  }
+  if((spec == NULL)||(out_dir == NULL)||(optind >= argc)||(workers < 1)
+      ||(budget == 0)){
+    usage();
+    return 2;
+  }
+  if(parse_spec(spec)){
+    return 2;
+  }
+  for(i=optind; i<argc; i++){
+    if(add_input(argv[i])){
+      return 2;
+    }
+  }
+  if(n_inputs == 0){
+    fprintf(stderr, "bmptool: no BMP files in the inputs\n");
+    return 2;
+  }
+  if((size_t)workers > n_inputs){
+    workers = n_inputs;
+  }
+
+  struct worker *pool = calloc(workers, sizeof(struct worker));
+  int error;
+  if(pool == NULL){
+    perror("bmptool");
+    return 1;
+  }
+  if(create_pool(&bitmaps, budget, &error)){
+    fprintf(stderr, "bmptool: %s\n", get_error_msg_bmp(error));
+    return 1;
+  }
+
+  double start = now();
+  for(i=0; i<workers; i++){
+    if(pthread_create(&pool[i].thread, NULL, worker_main, &pool[i])){
+      fprintf(stderr, "bmptool: cannot create the workers\n");
+      return 1;
+    }
+  }
+
+  struct worker total;
+  memset(&total, 0, sizeof(struct worker));
+  for(i=0; i<workers; i++){
+    pthread_join(pool[i].thread, NULL);
+    for(j=0; j<n_stages+2; j++){
+      total.seconds[j] += pool[i].seconds[j];
+    }
+    total.megapixels += pool[i].megapixels;
+    total.done += pool[i].done;
+    total.failed += pool[i].failed;
+  }
+  double elapsed = now() - start;
+
+  printf("%d images, %d failed, in %.3f s with %ld workers\n", total.done
+      , total.failed, elapsed, workers);
+  printf("%.2f images/s, %.2f MP/s\n", total.done/elapsed
+      , total.megapixels/elapsed);
+  printf("%-32s %12s %12s\n", "stage", "total s", "ms/image");
+  int images = (total.done > 0) ? total.done : 1;
+  for(j=0; j<n_stages+2; j++){
+    const char *name = (j == 0) ? "load" : (j == n_stages + 1) ? "save"
+        : stages[j-1].name;
+    printf("%-32s %12.3f %12.3f\n", name, total.seconds[j]
+        , 1000*total.seconds[j]/images);
+  }
+  printf("bitmaps: %lu recycled, %lu allocated\n", bitmaps.hits
+      , bitmaps.misses);
+
+  clean_pool(&bitmaps);
+  free(pool);
+  size_t k;
+  for(k=0; k<n_inputs; k++){
+    free(inputs[k]);
+  }
+  free(inputs);
+  return total.failed ? 1 : 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Static function definitions                                               */
+/*---------------------------------------------------------------------------*/
+
+static void usage(void){
+  fprintf(stderr, "Usage: bmptool -p spec -o dir [-j workers] [-m megabytes]"
+      " [-t threads] [-P] [-c rle8|rle4] input...\n");
+  fprintf(stderr, "  spec: stages separated by commas, e.g."
+      " crop:0:0:640:480,resize:320:240,sepia,blur:3\n");
+}
+
+static double now(void){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+static int parse_spec(char *spec){
+  char *copy = strdup(spec);
+  char *save = NULL;
+  char *text;
+  int point_op, param, error;
+
+  if(copy == NULL){
+    perror("bmptool");
+    return -1;
+  }
+
+  for(text=strtok_r(copy, ",", &save); text!=NULL
+      ; text=strtok_r(NULL, ",", &save)){
+    struct stage stage;
+    memset(&stage, 0, sizeof(struct stage));
+    snprintf(stage.name, STAGE_NAME, "%s", text);
+    if(parse_stage(text, &stage, &point_op, &param)){
+      fprintf(stderr, "bmptool: bad stage %s\n", stage.name);
+      free(copy);
+      return -1;
+    }
+
+    if(stage.kind == STAGE_CHAIN){//Fused with a previous point operation
+      struct stage *last = n_stages ? &stages[n_stages-1] : NULL;
+      if((last != NULL)&&(last->kind == STAGE_CHAIN)
+          &&(last->chain.n < BMP_CHAIN_MAX)){
+        size_t len = strlen(last->name);
+        snprintf(last->name + len, STAGE_NAME - len, "+%s", stage.name);
+      }else{
+        last = NULL;
+      }
+      if(last == NULL){
+        if(n_stages == MAX_STAGES){
+          fprintf(stderr, "bmptool: too many stages\n");
+          free(copy);
+          return -1;
+        }
+        chain_clear(&stage.chain);
+        stages[n_stages++] = stage;
+        last = &stages[n_stages-1];
+      }
+      int ret;
+      if(point_op == BMP_OP_BITONE){
+        RGBTRIPLE dark = {0x00, 0x00, 0x00};
+        RGBTRIPLE light = {0xFF, 0xFF, 0xFF};
+        ret = chain_add_bitone(&last->chain, dark, light, param, &error);
+      }else{
+        ret = chain_add(&last->chain, point_op, param, &error);
+      }
+      if(ret){
+        fprintf(stderr, "bmptool: %s: %s\n", stage.name
+            , get_error_msg_bmp(error));
+        free(copy);
+        return -1;
+      }
+      continue;
+    }
+
+    if(n_stages == MAX_STAGES){
+      fprintf(stderr, "bmptool: too many stages\n");
+      free(copy);
+      return -1;
+    }
+    stages[n_stages++] = stage;
+  }
+
+  free(copy);
+  if(n_stages == 0){
+    fprintf(stderr, "bmptool: empty pipeline\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_stage(char *text, struct stage *stage, int *point_op
+        , int *param){
+  char *save = NULL;
+  char *name = strtok_r(text, ":", &save);
+  char *arg[5] = {NULL};
+  int n = 0;
+  char *tok;
+
+  if(name == NULL){
+    return -1;
+  }
+  while((tok = strtok_r(NULL, ":", &save)) != NULL){
+    if(n == 5){
+      return -1;
+    }
+    arg[n++] = tok;
+  }
+
+  int i;
+  for(i=0; (i<n)&&(i<4); i++){
+    stage->args[i] = atoi(arg[i]);
+  }
+
+  *param = n ? stage->args[0] : 0;
+  stage->kind = STAGE_CHAIN;
+  if(!strcmp(name, "sepia")&&(n == 0)){
+    *point_op = BMP_OP_SEPIA;
+  }else if(!strcmp(name, "invert")&&(n == 0)){
+    *point_op = BMP_OP_INVERT;
+  }else if(!strcmp(name, "zero")&&(n == 1)){
+    *point_op = BMP_OP_ZERO;
+    *param = strtol(arg[0], NULL, 0);
+  }else if(!strcmp(name, "saturation")&&(n == 1)){
+    *point_op = BMP_OP_SATURATION;
+  }else if(!strcmp(name, "brightness")&&(n == 1)){
+    *point_op = BMP_OP_BRIGHTNESS;
+  }else if(!strcmp(name, "chroma")&&(n == 1)){
+    *point_op = BMP_OP_CHROMA;
+  }else if(!strcmp(name, "grayscale")&&(n <= 1)){
+    *point_op = BMP_OP_GRAYSCALE;
+    *param = n ? arg[0][0] : 'y';
+  }else if(!strcmp(name, "bitone")&&(n == 1)){
+    *point_op = BMP_OP_BITONE;
+  }else if(!strcmp(name, "crop")&&(n == 4)){
+    stage->kind = STAGE_CROP;
+  }else if(!strcmp(name, "resize")&&((n == 2)||(n == 3))){
+    stage->kind = STAGE_RESIZE;
+    stage->args[2] = (n == 3) ? parse_filter(arg[2]) : BMP_FILTER_LANCZOS3;
+    return (stage->args[2] < 0) ? -1 : 0;
+  }else if(!strcmp(name, "reduce")&&(n == 1)&&(*param > 0)){
+    stage->kind = STAGE_REDUCE;
+  }else if(!strcmp(name, "enlarge")&&(n == 1)&&(*param > 0)){
+    stage->kind = STAGE_ENLARGE;
+  }else if(!strcmp(name, "rotate")&&(n == 1)){
+    stage->kind = STAGE_ROTATE;
+    stage->args[0] = arg[0][0];
+  }else if(!strcmp(name, "mirror")&&(n == 1)){
+    stage->kind = STAGE_MIRROR;
+    stage->args[0] = arg[0][0];
+  }else if(!strcmp(name, "blur")&&(n == 1)){
+    stage->kind = STAGE_BLUR;
+  }else if(!strcmp(name, "gaussian")&&(n == 1)){
+    stage->kind = STAGE_GAUSSIAN;
+  }else if(!strcmp(name, "bw")&&(n == 0)){
+    stage->kind = STAGE_BW;
+  }else{
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_filter(const char *name){
+  static const char *names[] = {"area", "bilinear", "bicubic", "lanczos2"
+      , "lanczos3"};
+  static const int filters[] = {BMP_FILTER_AREA, BMP_FILTER_BILINEAR
+      , BMP_FILTER_BICUBIC, BMP_FILTER_LANCZOS2, BMP_FILTER_LANCZOS3};
+  int i;
+
+  for(i=0; i<5; i++){
+    if(!strcmp(name, names[i])){
+      return filters[i];
+    }
+  }
+  return -1;
+}
+
+static int add_input(char *path){
+  struct stat info;
+
+  if(stat(path, &info)){
+    fprintf(stderr, "bmptool: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if(!S_ISDIR(info.st_mode)){
+    return add_file(path);
+  }
+
+  DIR *dir = opendir(path);
+  if(dir == NULL){
+    fprintf(stderr, "bmptool: %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  size_t first = n_inputs;
+  struct dirent *entry;
+  char file[PATH_MAX];
+  while((entry = readdir(dir)) != NULL){
+    size_t len = strlen(entry->d_name);
+    if((len < 4)||strcasecmp(entry->d_name + len - 4, ".bmp")){
+      continue;
+    }
+    snprintf(file, PATH_MAX, "%s/%s", path, entry->d_name);
+    if((stat(file, &info) == 0)&&S_ISREG(info.st_mode)&&add_file(file)){
+      closedir(dir);
+      return -1;
+    }
+  }
+  closedir(dir);
+
+  //In name order, not in the one of the directory
+  qsort(inputs + first, n_inputs - first, sizeof(char *), compare_paths);
+  return 0;
+}
+
+static int add_file(const char *path){
+  char **grown = realloc(inputs, (n_inputs + 1)*sizeof(char *));
+  if(grown == NULL){
+    perror("bmptool");
+    return -1;
+  }
+  inputs = grown;
+  if((inputs[n_inputs] = strdup(path)) == NULL){
+    perror("bmptool");
+    return -1;
+  }
+  n_inputs++;
+  return 0;
+}
+
+static int compare_paths(const void *a, const void *b){
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static size_t peak_bytes(int width, int height, int bits){
+  //The biggest source and result bitmaps alive at once through the stages,
+  //8 bit images may be converted to 24 bit by the filters
+  size_t pixel = (bits > 24) ? (size_t)bits/8 : sizeof(RGBTRIPLE);
+  size_t size = (size_t)width*height*pixel;
+  size_t peak = size;
+  int i;
+
+  for(i=0; i<n_stages; i++){
+    const struct stage *stage = &stages[i];
+    switch(stage->kind){
+      case STAGE_CROP:
+        width = stage->args[2];
+        height = stage->args[3];
+        break;
+      case STAGE_RESIZE:
+        width = stage->args[0];
+        height = stage->args[1];
+        break;
+      case STAGE_REDUCE:
+        width /= stage->args[0];
+        height /= stage->args[0];
+        break;
+      case STAGE_ENLARGE:
+        width *= stage->args[0];
+        height *= stage->args[0];
+        break;
+      case STAGE_CHAIN:
+      case STAGE_BW:
+      case STAGE_MIRROR:
+        continue; // in place
+    }
+    size_t next = (size_t)width*height*pixel;
+    if(size + next > peak){
+      peak = size + next;
+    }
+    size = next;
+  }
+  //Planar images keep their bitmap besides the planes
+  return ((layout == BMP_LAYOUT_PLANAR)&&(bits == 24)) ? 2*peak : peak;
+}
+
+static void acquire(size_t bytes){
+  pthread_mutex_lock(&budget_lock);
+  //An image bigger than the budget goes alone
+  while((in_flight > 0)&&(in_flight + bytes > budget)){
+    pthread_cond_wait(&budget_free, &budget_lock);
+  }
+  in_flight += bytes;
+  pthread_mutex_unlock(&budget_lock);
+}
+
+static void release(size_t bytes){
+  pthread_mutex_lock(&budget_lock);
+  in_flight -= bytes;
+  pthread_cond_broadcast(&budget_free);
+  pthread_mutex_unlock(&budget_lock);
+}
+
+static int run_stage(struct stage *stage, BMPFILE *image, int *error){
+  int *a = stage->args;
+
+  switch(stage->kind){
+    case STAGE_CROP:
+      return crop_rect(image, a[0], a[1], a[2], a[3], error);
+    case STAGE_RESIZE:
+      return resize(image, a[0], a[1], a[2], error);
+    case STAGE_REDUCE:
+      return reduce(image, a[0], error);
+    case STAGE_ENLARGE:
+      return enlarge(image, a[0], error);
+    case STAGE_ROTATE:
+      return rotate(image, a[0], error);
+    case STAGE_MIRROR:
+      *error = 0;
+      mirror(image, a[0], error);
+      return *error ? -1 : 0;
+    case STAGE_BLUR:
+      return fast_blur(image, a[0], error);
+    case STAGE_GAUSSIAN:
+      return blur(image, 0, a[0], error);
+    case STAGE_BW:
+      blackandwhite(image);
+      return 0;
+    default:
+      return apply_chain(image, &stage->chain, error);
+  }
+}
+
+static int process(char *path, struct worker *self){
+  BMPPROBE probe;
+  BMPFILE image;
+  char out[PATH_MAX];
+  int error = 0;
+  int i;
+
+  if(probe_BMP(path, &probe)){
+    fprintf(stderr, "bmptool: %s: %s\n", path, get_error_msg_bmp(probe.error));
+    return -1;
+  }
+
+  const char *name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  if(snprintf(out, PATH_MAX, "%s/%s", out_dir, name) >= PATH_MAX){
+    fprintf(stderr, "bmptool: %s: %s\n", path, strerror(ENAMETOOLONG));
+    return -1;
+  }
+
+  //The height of a top-down file is negative in the header
+  size_t bytes = peak_bytes(probe.ih.biWidth, abs(probe.ih.biHeight)
+      , probe.ih.biBitCount);
+  acquire(bytes);
+
+  //Compressed images cannot be mapped, they are expanded by load_image. An
+  //output over its input would truncate the file the image is mapped from,
+  //so that one is read too
+  double t = now();
+  int compressed = (probe.ih.biCompression == BMP_RLE8)
+      ||(probe.ih.biCompression == BMP_RLE4);
+  char real_in[PATH_MAX], real_out[PATH_MAX];
+  int in_place = (realpath(path, real_in) != NULL)
+      &&(realpath(out, real_out) != NULL)&&(strcmp(real_in, real_out) == 0);
+  if((compressed||in_place) ? load_image(&image, path, &error)
+      : load_image_mmap(&image, path, BMP_MAP_PRIVATE, &error)){
+    fprintf(stderr, "bmptool: %s: %s\n", path, get_error_msg_bmp(error));
+    release(bytes);
+    return -1;
+  }
+  use_pool(&image, &bitmaps);
+  if((layout == BMP_LAYOUT_PLANAR)&&(image.ih.biBitCount == 24)
+      &&set_layout(&image, layout, &error)){
+    fprintf(stderr, "bmptool: %s: %s\n", path, get_error_msg_bmp(error));
+    clean_image(&image);
+    release(bytes);
+    return -1;
+  }
+  self->megapixels += (double)image.ih.biWidth*image.ih.biHeight/1e6;
+
+  double t1 = now();
+  self->seconds[0] += t1 - t;
+  for(i=0; i<n_stages; i++){
+    if(run_stage(&stages[i], &image, &error)){
+      fprintf(stderr, "bmptool: %s: %s: %s\n", path, stages[i].name
+          , get_error_msg_bmp(error));
+      clean_image(&image);
+      release(bytes);
+      return -1;
+    }
+    t = now();
+    self->seconds[i+1] += t - t1;
+    t1 = t;
+  }
+
+  int ret;
+  if((compression == 0)||((ret = save_image_rle(&image, out, compression
+      , &error))&&(error == NOT_SPT_FMT))){
+    ret = save_image(&image, out, &error);
+  }
+  if(ret){
+    fprintf(stderr, "bmptool: %s: %s\n", out, get_error_msg_bmp(error));
+  }
+  self->seconds[n_stages+1] += now() - t1;
+
+  clean_image(&image);
+  release(bytes);
+  return ret;
+}
+
+static void *worker_main(void *arg){
+  struct worker *self = arg;
+  size_t i;
+
+  while((i = __atomic_fetch_add(&next_input, 1, __ATOMIC_RELAXED)) < n_inputs){
+    if(process(inputs[i], self)){
+      self->failed++;
+    }else{
+      self->done++;
+    }
+  }
+  return NULL;
+}